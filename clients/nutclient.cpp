@@ -20,6 +20,8 @@
 #include "nutclient.h"
 
 #include <sstream>
+#include <memory>
+#include <chrono>
 
 #include <errno.h>
 #include <string.h>
@@ -37,6 +39,7 @@
 #  include <unistd.h> /* close */
 #  include <netdb.h> /* gethostbyname */
 #  include <fcntl.h>
+#  include <poll.h>
 #  define INVALID_SOCKET -1
 #  define SOCKET_ERROR -1
 #  define closesocket(s) close(s)
@@ -132,6 +135,18 @@ public:
 	~Socket();
 
 	void connect(const std::string& host, uint16_t port);
+	/**
+	 * Start connecting without waiting: the socket is then connecting
+	 * until finishConnect() says it is done.
+	 */
+	void startConnect(const std::string& host, uint16_t port);
+	/**
+	 * Go on connecting, without waiting.
+	 * \return true once connected, false while still connecting.
+	 * Throws if no address of the host could be connected to.
+	 */
+	bool finishConnect();
+	bool isConnecting()const{return _ai!=nullptr;}
 	void disconnect();
 	bool isConnected()const;
 
@@ -142,18 +157,35 @@ public:
 	size_t write(const void* buf, size_t sz);
 
 	std::string read();
+	void readLine(const char*& line, size_t& len);
 	void write(const std::string& str);
 
+	bool hasLine()const{return _buffer.find('\n', _begin)!=std::string::npos;}
+	bool waitReadable(time_t timeout);
+
+	SOCKET getFd()const{return _sock;}
+	void setNonBlocking();
+
 
 private:
+	static struct addrinfo* resolve(const std::string& host, uint16_t port);
+	/** Start connecting to _ai, or the next addresses if it fails right away. */
+	void tryConnect();
+
 	SOCKET _sock;
 	struct timeval	_tv;
 	std::string _buffer; /* Received buffer, string because data should be text only. */
+	size_t _begin; /* Start of the lines not yet taken from _buffer */
+	struct addrinfo* _res; /* Addresses of the host while connecting */
+	struct addrinfo* _ai; /* The one being connected to, in _res */
 };
 
 Socket::Socket():
 _sock(INVALID_SOCKET),
-_tv()
+_tv(),
+_begin(0),
+_res(nullptr),
+_ai(nullptr)
 {
 	_tv.tv_sec = -1;
 	_tv.tv_usec = 0;
@@ -169,18 +201,11 @@ void Socket::setTimeout(time_t timeout)
 	_tv.tv_sec = timeout;
 }
 
-void Socket::connect(const std::string& host, uint16_t port)
+struct addrinfo* Socket::resolve(const std::string& host, uint16_t port)
 {
-	int	sock_fd;
-	struct addrinfo	hints, *res, *ai;
+	struct addrinfo	hints, *res;
 	char			sport[NI_MAXSERV];
 	int			v;
-	fd_set 			wfds;
-	int			error;
-	socklen_t		error_size;
-	long			fd_flags;
-
-	_sock = -1;
 
 	if (host.empty()) {
 		throw nut::UnknownHostException();
@@ -209,6 +234,23 @@ void Socket::connect(const std::string& host, uint16_t port)
 		}
 	}
 
+	return res;
+}
+
+void Socket::connect(const std::string& host, uint16_t port)
+{
+	int	sock_fd;
+	struct addrinfo	*res, *ai;
+	int			v;
+	fd_set 			wfds;
+	int			error;
+	socklen_t		error_size;
+	long			fd_flags;
+
+	_sock = -1;
+
+	res = resolve(host, port);
+
 	for (ai = res; ai != nullptr; ai = ai->ai_next) {
 
 		sock_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
@@ -323,14 +365,92 @@ void Socket::connect(const std::string& host, uint16_t port)
 #endif // OLD
 }
 
+void Socket::startConnect(const std::string& host, uint16_t port)
+{
+	disconnect();
+
+	_res = _ai = resolve(host, port);
+	tryConnect();
+}
+
+void Socket::tryConnect()
+{
+	for (; _ai != nullptr; _ai = _ai->ai_next) {
+		SOCKET sock_fd = socket(_ai->ai_family, _ai->ai_socktype, _ai->ai_protocol);
+
+		if (sock_fd == INVALID_SOCKET) {
+			continue;
+		}
+
+		_sock = sock_fd;
+		setNonBlocking();
+
+		if (::connect(sock_fd, _ai->ai_addr, _ai->ai_addrlen) == 0) {
+			break;
+		}
+		if (errno == EINPROGRESS || errno == EINTR) {
+			/* finishConnect() tells how it went */
+			return;
+		}
+
+		::closesocket(_sock);
+		_sock = INVALID_SOCKET;
+	}
+
+	freeaddrinfo(_res);
+	_res = _ai = nullptr;
+
+	if (_sock == INVALID_SOCKET) {
+		throw nut::IOException("Cannot connect to host");
+	}
+}
+
+bool Socket::finishConnect()
+{
+	struct pollfd	pfd;
+	int			error = 0;
+	socklen_t		error_size = sizeof(error);
+
+	if (!isConnecting()) {
+		return isConnected();
+	}
+
+	pfd.fd = _sock;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0) {
+		return false;
+	}
+
+	if (getsockopt(_sock, SOL_SOCKET, SO_ERROR, &error, &error_size) == 0 && error == 0) {
+		freeaddrinfo(_res);
+		_res = _ai = nullptr;
+		return true;
+	}
+
+	/* refused or unreachable: on to the next address */
+	::closesocket(_sock);
+	_sock = INVALID_SOCKET;
+	_ai = _ai->ai_next;
+	tryConnect();
+
+	return !isConnecting();
+}
+
 void Socket::disconnect()
 {
+	if(_res)
+	{
+		freeaddrinfo(_res);
+		_res = _ai = nullptr;
+	}
 	if(_sock != INVALID_SOCKET)
 	{
 		::closesocket(_sock);
 		_sock = INVALID_SOCKET;
 	}
 	_buffer.clear();
+	_begin = 0;
 }
 
 bool Socket::isConnected()const
@@ -394,33 +514,77 @@ size_t Socket::write(const void* buf, size_t sz)
 
 std::string Socket::read()
 {
-	std::string res;
-	char buff[256];
+	const char* line;
+	size_t len;
+
+	readLine(line, len);
+	return std::string(line, len);
+}
+
+void Socket::readLine(const char*& line, size_t& len)
+{
+	char buff[4096];
+	size_t scan = _begin;
 
 	while(true)
 	{
-		// Look at already read data in _buffer
-		if(!_buffer.empty())
+		size_t idx = _buffer.find('\n', scan);
+		if(idx!=std::string::npos)
 		{
-			size_t idx = _buffer.find('\n');
-			if(idx!=std::string::npos)
-			{
-				res += _buffer.substr(0, idx);
-				_buffer.erase(0, idx+1);
-				return res;
-			}
-			res += _buffer;
+			line = _buffer.data() + _begin;
+			len = idx - _begin;
+			_begin = idx + 1;
+			return;
+		}
+
+		// Only move what is left of a partial line, once all
+		// complete ones were taken: a long LIST stays linear
+		if(_begin > 0)
+		{
+			_buffer.erase(0, _begin);
+			_begin = 0;
 		}
+		scan = _buffer.size();
 
 		// Read new buffer
-		size_t sz = read(&buff, 256);
+		size_t sz = read(&buff, sizeof(buff));
 		if(sz==0)
 		{
 			disconnect();
 			throw nut::IOException("Server closed connection unexpectedly");
 		}
-		_buffer.assign(buff, sz);
+		_buffer.append(buff, sz);
+	}
+}
+
+bool Socket::waitReadable(time_t timeout)
+{
+	if(!isConnected())
+	{
+		throw nut::NotConnectedException();
+	}
+
+	struct timeval tv;
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(_sock, &fds);
+	int ret = select(_sock+1, &fds, nullptr, nullptr, timeout<0 ? nullptr : &tv);
+	if (ret == -1 && errno != EINTR)
+	{
+		disconnect();
+		throw nut::IOException("Error while waiting on socket");
 	}
+	return ret > 0;
+}
+
+void Socket::setNonBlocking()
+{
+	long fd_flags = fcntl(_sock, F_GETFL);
+	fd_flags |= O_NONBLOCK;
+	fcntl(_sock, F_SETFL, fd_flags);
 }
 
 void Socket::write(const std::string& str)
@@ -525,6 +689,15 @@ std::map<std::string,std::map<std::string,std::vector<std::string> > > Client::g
 	return res;
 }
 
+void Client::forEachVariable(const std::string& dev, const VariableVisitor& fn)
+{
+	std::map<std::string,std::vector<std::string> > values = getDeviceVariableValues(dev);
+	for(std::map<std::string,std::vector<std::string> >::const_iterator it=values.cbegin(); it!=values.cend(); ++it)
+	{
+		fn(it->first, it->second);
+	}
+}
+
 bool Client::hasDeviceCommand(const std::string& dev, const std::string& name)
 {
 	std::set<std::string> names = getDeviceCommandNames(dev);
@@ -556,7 +729,8 @@ Client(),
 _host("localhost"),
 _port(3493),
 _timeout(0),
-_socket(new internal::Socket)
+_socket(new internal::Socket),
+_watching(false)
 {
 	// Do not connect now
 }
@@ -564,7 +738,8 @@ _socket(new internal::Socket)
 TcpClient::TcpClient(const std::string& host, uint16_t port):
 Client(),
 _timeout(0),
-_socket(new internal::Socket)
+_socket(new internal::Socket),
+_watching(false)
 {
 	connect(host, port);
 }
@@ -583,6 +758,8 @@ void TcpClient::connect(const std::string& host, uint16_t port)
 
 void TcpClient::connect()
 {
+	_pushes.clear();
+	_watching = false;
 	_socket->connect(_host, _port);
 }
 
@@ -646,18 +823,7 @@ Device TcpClient::getDevice(const std::string& name)
 
 std::set<std::string> TcpClient::getDeviceNames()
 {
-	std::set<std::string> res;
-
-	std::vector<std::vector<std::string> > devs = list("UPS");
-	for(std::vector<std::vector<std::string> >::iterator it=devs.begin();
-		it!=devs.end(); ++it)
-	{
-		std::string id = (*it)[0];
-		if(!id.empty())
-			res.insert(id);
-	}
-
-	return res;
+	return listNames("UPS");
 }
 
 std::string TcpClient::getDeviceDescription(const std::string& name)
@@ -667,28 +833,12 @@ std::string TcpClient::getDeviceDescription(const std::string& name)
 
 std::set<std::string> TcpClient::getDeviceVariableNames(const std::string& dev)
 {
-	std::set<std::string> set;
-
-	std::vector<std::vector<std::string> > res = list("VAR", dev);
-	for(size_t n=0; n<res.size(); ++n)
-	{
-		set.insert(res[n][0]);
-	}
-
-	return set;
+	return listNames("VAR", dev);
 }
 
 std::set<std::string> TcpClient::getDeviceRWVariableNames(const std::string& dev)
 {
-	std::set<std::string> set;
-
-	std::vector<std::vector<std::string> > res = list("RW", dev);
-	for(size_t n=0; n<res.size(); ++n)
-	{
-		set.insert(res[n][0]);
-	}
-
-	return set;
+	return listNames("RW", dev);
 }
 
 std::string TcpClient::getDeviceVariableDescription(const std::string& dev, const std::string& name)
@@ -703,17 +853,10 @@ std::vector<std::string> TcpClient::getDeviceVariableValue(const std::string& de
 
 std::map<std::string,std::vector<std::string> > TcpClient::getDeviceVariableValues(const std::string& dev)
 {
+	std::map<std::string,std::vector<std::string> > map;
 
-	std::map<std::string,std::vector<std::string> >  map;
-
-	std::vector<std::vector<std::string> > res = list("VAR", dev);
-	for(size_t n=0; n<res.size(); ++n)
-	{
-		std::vector<std::string>& vals = res[n];
-		std::string var = vals[0];
-		vals.erase(vals.begin());
-		map[var] = vals;
-	}
+	_socket->write("LIST VAR " + dev);
+	parseVariables("VAR " + dev, map);
 
 	return map;
 }
@@ -742,15 +885,8 @@ std::map<std::string,std::map<std::string,std::vector<std::string> > > TcpClient
 		try
 		{
 			std::map<std::string,std::vector<std::string> > map2;
-			std::vector<std::vector<std::string> > res = parseList("VAR " + *it);
-			for (std::vector<std::vector<std::string> >::iterator it2=res.begin(); it2!=res.end(); ++it2)
-			{
-				std::vector<std::string>& vals = *it2;
-				std::string var = vals[0];
-				vals.erase(vals.begin());
-				map2[var] = vals;
-			}
-			map[*it] = map2;
+			parseVariables("VAR " + *it, map2);
+			map[*it].swap(map2);
 		}
 		catch (NutException&)
 		{
@@ -767,6 +903,19 @@ std::map<std::string,std::map<std::string,std::vector<std::string> > > TcpClient
 	return map;
 }
 
+void TcpClient::forEachVariable(const std::string& dev, const VariableVisitor& fn)
+{
+	std::string name;
+	std::vector<std::string> values;
+
+	_socket->write("LIST VAR " + dev);
+	parseList("VAR " + dev, [&name, &values, &fn](const char* row, size_t len)
+	{
+		explode(row, len, values, &name);
+		fn(name, values);
+	});
+}
+
 TrackingID TcpClient::setDeviceVariable(const std::string& dev, const std::string& name, const std::string& value)
 {
 	std::string query = "SET VAR " + dev + " " + name + " " + escape(value);
@@ -785,15 +934,7 @@ TrackingID TcpClient::setDeviceVariable(const std::string& dev, const std::strin
 
 std::set<std::string> TcpClient::getDeviceCommandNames(const std::string& dev)
 {
-	std::set<std::string> cmds;
-
-	std::vector<std::vector<std::string> > res = list("CMD", dev);
-	for(size_t n=0; n<res.size(); ++n)
-	{
-		cmds.insert(res[n][0]);
-	}
-
-	return cmds;
+	return listNames("CMD", dev);
 }
 
 std::string TcpClient::getDeviceCommandDescription(const std::string& dev, const std::string& name)
@@ -942,28 +1083,79 @@ std::vector<std::vector<std::string> > TcpClient::list
 	return parseList(req);
 }
 
+std::set<std::string> TcpClient::listNames
+	(const std::string& subcmd, const std::string& params)
+{
+	std::string req = subcmd;
+	if(!params.empty())
+	{
+		req += " " + params;
+	}
+
+	std::set<std::string> names;
+	std::string name;
+	std::vector<std::string> rest;
+
+	_socket->write("LIST " + req);
+	parseList(req, [&names, &name, &rest](const char* row, size_t len)
+	{
+		explode(row, len, rest, &name);
+		if(!name.empty())
+			names.insert(names.end(), std::move(name));
+	});
+
+	return names;
+}
+
 std::vector<std::vector<std::string> > TcpClient::parseList
 	(const std::string& req)
 {
-	std::string res = _socket->read();
-	detectError(res);
-	if(res != ("BEGIN LIST " + req))
+	std::vector<std::vector<std::string> > arr;
+
+	parseList(req, [&arr](const char* row, size_t len)
+	{
+		arr.push_back(std::vector<std::string>());
+		explode(row, len, arr.back());
+	});
+
+	return arr;
+}
+
+namespace
+{
+
+bool lineIs(const char* line, size_t len, const std::string& str)
+{
+	return len == str.size() && memcmp(line, str.data(), len) == 0;
+}
+
+} /* namespace */
+
+void TcpClient::parseList
+	(const std::string& req, const std::function<void(const char* row, size_t len)>& row)
+{
+	const char* line;
+	size_t len;
+
+	readLine(line, len);
+	detectError(line, len);
+	if(!lineIs(line, len, "BEGIN LIST " + req))
 	{
 		throw NutException("Invalid response");
 	}
 
-	std::vector<std::vector<std::string> > arr;
+	std::string end = "END LIST " + req;
 	while(true)
 	{
-		res = _socket->read();
-		detectError(res);
-		if(res == ("END LIST " + req))
+		readLine(line, len);
+		detectError(line, len);
+		if(lineIs(line, len, end))
 		{
-			return arr;
+			return;
 		}
-		if(res.substr(0, req.size()) == req)
+		if(len >= req.size() && memcmp(line, req.data(), req.size()) == 0)
 		{
-			arr.push_back(explode(res, req.size()));
+			row(line + req.size(), len - req.size());
 		}
 		else
 		{
@@ -972,10 +1164,119 @@ std::vector<std::vector<std::string> > TcpClient::parseList
 	}
 }
 
+void TcpClient::parseVariables
+	(const std::string& req, std::map<std::string,std::vector<std::string> >& map)
+{
+	std::string name;
+	std::vector<std::string> values;
+
+	parseList(req, [&map, &name, &values](const char* row, size_t len)
+	{
+		explode(row, len, values, &name);
+		if(name.empty())
+			return;
+		// Rows come sorted, and the words move on into the map
+		std::map<std::string,std::vector<std::string> >::iterator it =
+			map.emplace_hint(map.end(), std::move(name), std::vector<std::string>());
+		it->second.swap(values);
+	});
+}
+
 std::string TcpClient::sendQuery(const std::string& req)
 {
 	_socket->write(req);
-	return _socket->read();
+	return readLine();
+}
+
+std::string TcpClient::readLine()
+{
+	const char* line;
+	size_t len;
+
+	readLine(line, len);
+	return std::string(line, len);
+}
+
+void TcpClient::readLine(const char*& line, size_t& len)
+{
+	while(true)
+	{
+		_socket->readLine(line, len);
+		// Set aside changes pushed in between answers
+		if(_watching && len >= 5 && memcmp(line, "PUSH ", 5) == 0)
+		{
+			_pushes.push_back(std::string(line, len));
+			continue;
+		}
+		return;
+	}
+}
+
+void TcpClient::watchDevice(const std::string& dev, const std::set<std::string>& patterns)
+{
+	std::string req = "WATCH " + dev;
+	for (std::set<std::string>::const_iterator it = patterns.cbegin(); it != patterns.cend(); ++it)
+	{
+		req += " " + escape(*it);
+	}
+	// Changes may follow right after the answer
+	_watching = true;
+	std::string res = sendQuery(req);
+	detectError(res);
+	if(res != "OK")
+	{
+		throw NutException("Invalid response");
+	}
+}
+
+void TcpClient::unwatchDevice(const std::string& dev)
+{
+	std::string res = sendQuery("UNWATCH " + dev);
+	detectError(res);
+	if(res != "OK")
+	{
+		throw NutException("Invalid response");
+	}
+}
+
+bool TcpClient::readChange(VariableChange& change, time_t timeout)
+{
+	std::string res;
+
+	if(!_pushes.empty())
+	{
+		res = _pushes.front();
+		_pushes.pop_front();
+	}
+	else
+	{
+		if(!_socket->hasLine() && !_socket->waitReadable(timeout))
+		{
+			return false;
+		}
+		res = _socket->read();
+	}
+
+	if(!parseChange(res, change))
+	{
+		throw NutException("Invalid response");
+	}
+	return true;
+}
+
+bool TcpClient::parseChange(const std::string& line, VariableChange& change)
+{
+	std::vector<std::string> args = explode(line);
+	if(args.size() < 4 || args[0] != "PUSH")
+	{
+		return false;
+	}
+
+	change.device = args[2];
+	change.variable = args[3];
+	change.values.assign(args.begin() + 4, args.end());
+	change.deleted = (args[1] == "DEL");
+	return true;
 }
 
 void TcpClient::sendAsyncQueries(const std::vector<std::string>& req)
@@ -994,10 +1295,65 @@ void TcpClient::detectError(const std::string& req)
 	}
 }
 
+void TcpClient::detectError(const char* line, size_t len)
+{
+	if(len >= 3 && memcmp(line, "ERR", 3) == 0)
+	{
+		throw NutException(len > 4 ? std::string(line + 4, len - 4) : std::string());
+	}
+}
+
 std::vector<std::string> TcpClient::explode(const std::string& str, size_t begin)
 {
 	std::vector<std::string> res;
-	std::string temp;
+
+	if(begin < str.size())
+	{
+		explode(str.data() + begin, str.size() - begin, res);
+	}
+
+	return res;
+}
+
+void TcpClient::explode(const char* str, size_t len, std::vector<std::string>& res, std::string* first)
+{
+	size_t count = 0;			// words done in res
+	bool head = (first != nullptr);	// the next word goes to first
+	std::string* temp = nullptr;	// word being read, if any
+
+	// The next slot is cleared, but keeps what it had allocated
+	auto word = [&]() -> std::string&
+	{
+		if(!temp)
+		{
+			if(head)
+			{
+				temp = first;
+			}
+			else
+			{
+				if(count == res.size())
+					res.push_back(std::string());
+				temp = &res[count];
+			}
+			temp->clear();
+		}
+		return *temp;
+	};
+	auto push = [&]()
+	{
+		word();
+		if(head)
+			head = false;
+		else
+			count++;
+		temp = nullptr;
+	};
+
+	if(first)
+	{
+		first->clear();
+	}
 
 	enum STATE {
 		INIT,
@@ -1007,7 +1363,7 @@ std::vector<std::string> TcpClient::explode(const std::string& str, size_t begin
 		QUOTED_ESCAPE
 	} state = INIT;
 
-	for(size_t idx=begin; idx<str.size(); ++idx)
+	for(size_t idx=0; idx<len; ++idx)
 	{
 		char c = str[idx];
 		switch(state)
@@ -1026,7 +1382,7 @@ std::vector<std::string> TcpClient::explode(const std::string& str, size_t begin
 			/* What about bad characters ? */
 			else
 			{
-				temp += c;
+				word() += c;
 				state = SIMPLE_STRING;
 			}
 			break;
@@ -1034,8 +1390,7 @@ std::vector<std::string> TcpClient::explode(const std::string& str, size_t begin
 			if(c==' ' /* || c=='\t' */)
 			{
 				/* if(!temp.empty()) : Must not occur */
-					res.push_back(temp);
-				temp.clear();
+					push();
 				state = INIT;
 			}
 			else if(c=='\\')
@@ -1045,14 +1400,13 @@ std::vector<std::string> TcpClient::explode(const std::string& str, size_t begin
 			else if(c=='"')
 			{
 				/* if(!temp.empty()) : Must not occur */
-					res.push_back(temp);
-				temp.clear();
+					push();
 				state = QUOTED_STRING;
 			}
 			/* What about bad characters ? */
 			else
 			{
-				temp += c;
+				word() += c;
 			}
 			break;
 		case QUOTED_STRING:
@@ -1062,47 +1416,46 @@ std::vector<std::string> TcpClient::explode(const std::string& str, size_t begin
 			}
 			else if(c=='"')
 			{
-				res.push_back(temp);
-				temp.clear();
+				push();
 				state = INIT;
 			}
 			/* What about bad characters ? */
 			else
 			{
-				temp += c;
+				word() += c;
 			}
 			break;
 		case SIMPLE_ESCAPE:
 			if(c=='\\' || c=='"' || c==' ' /* || c=='\t'*/)
 			{
-				temp += c;
+				word() += c;
 			}
 			else
 			{
-				temp += '\\' + c; // Really do this ?
+				word() += '\\' + c; // Really do this ?
 			}
 			state = SIMPLE_STRING;
 			break;
 		case QUOTED_ESCAPE:
 			if(c=='\\' || c=='"')
 			{
-				temp += c;
+				word() += c;
 			}
 			else
 			{
-				temp += '\\' + c; // Really do this ?
+				word() += '\\' + c; // Really do this ?
 			}
 			state = QUOTED_STRING;
 			break;
 		}
 	}
 
-	if(!temp.empty())
+	if(temp && !temp->empty())
 	{
-		res.push_back(temp);
+		push();
 	}
 
-	return res;
+	res.resize(count);
 }
 
 std::string TcpClient::escape(const std::string& str)
@@ -1146,23 +1499,1404 @@ TrackingID TcpClient::sendTrackingQuery(const std::string& req)
 
 /*
  *
- * Device implementation
+ * Asynchronous TCP Client implementation
  *
  */
 
-Device::Device(Client* client, const std::string& name):
-_client(client),
-_name(name)
+namespace
+{
+
+/* Promises of void are kept without a value */
+template<typename T> void settle(std::promise<T>& promise,
+	const std::function<T(const std::vector<std::string>&)>& convert,
+	const std::vector<std::string>& lines)
 {
+	promise.set_value(convert(lines));
 }
 
-Device::Device(const Device& dev):
-_client(dev._client),
-_name(dev._name)
+void settle(std::promise<void>& promise,
+	const std::function<void(const std::vector<std::string>&)>& convert,
+	const std::vector<std::string>& lines)
 {
+	convert(lines);
+	promise.set_value();
 }
 
-Device& Device::operator=(const Device& dev)
+} /* namespace */
+
+/* The single line of a GET answer, past what was asked for */
+std::vector<std::string> AsyncTcpClient::parseGet(const std::string& req, const std::vector<std::string>& lines)
+{
+	if(lines.size() != 1 || lines[0].compare(0, req.size(), req) != 0)
+	{
+		throw NutException("Invalid response");
+	}
+	return TcpClient::explode(lines[0], req.size());
+}
+
+/* The lines of a LIST answer, past what was asked for */
+std::vector<std::vector<std::string> > AsyncTcpClient::parseList(const std::string& req, const std::vector<std::string>& lines)
+{
+	std::vector<std::vector<std::string> > arr;
+	for(size_t n=0; n<lines.size(); ++n)
+	{
+		if(lines[n].compare(0, req.size(), req) != 0)
+		{
+			throw NutException("Invalid response");
+		}
+		arr.push_back(std::vector<std::string>());
+		TcpClient::explode(lines[n].data() + req.size(), lines[n].size() - req.size(), arr.back());
+	}
+	return arr;
+}
+
+std::set<std::string> AsyncTcpClient::parseNames(const std::string& req, const std::vector<std::string>& lines)
+{
+	std::set<std::string> names;
+	std::string name;
+	std::vector<std::string> rest;
+	for(size_t n=0; n<lines.size(); ++n)
+	{
+		if(lines[n].compare(0, req.size(), req) != 0)
+		{
+			throw NutException("Invalid response");
+		}
+		TcpClient::explode(lines[n].data() + req.size(), lines[n].size() - req.size(), rest, &name);
+		if(!name.empty())
+			names.insert(names.end(), std::move(name));
+	}
+	return names;
+}
+
+std::map<std::string,std::vector<std::string> > AsyncTcpClient::parseVariables(const std::string& req, const std::vector<std::string>& lines)
+{
+	std::map<std::string,std::vector<std::string> > map;
+	std::string name;
+	std::vector<std::string> values;
+	for(size_t n=0; n<lines.size(); ++n)
+	{
+		if(lines[n].compare(0, req.size(), req) != 0)
+		{
+			throw NutException("Invalid response");
+		}
+		TcpClient::explode(lines[n].data() + req.size(), lines[n].size() - req.size(), values, &name);
+		if(name.empty())
+			continue;
+		std::map<std::string,std::vector<std::string> >::iterator it =
+			map.emplace_hint(map.end(), std::move(name), std::vector<std::string>());
+		it->second.swap(values);
+	}
+	return map;
+}
+
+void AsyncTcpClient::parseOK(const std::vector<std::string>& lines)
+{
+	if(lines.size() != 1 || lines[0].substr(0, 2) != "OK")
+	{
+		throw NutException("Invalid response");
+	}
+}
+
+TrackingID AsyncTcpClient::parseTracking(const std::vector<std::string>& lines)
+{
+	std::vector<std::string> res;
+
+	if(lines.size() == 1)
+	{
+		res = TcpClient::explode(lines[0]);
+	}
+
+	if (res.size() == 1 && res[0] == "OK")
+	{
+		return TrackingID("");
+	}
+	else if (res.size() == 3 && res[0] == "OK" && res[1] == "TRACKING")
+	{
+		return TrackingID(res[2]);
+	}
+	else
+	{
+		throw NutException("Unknown query result");
+	}
+}
+
+AsyncTcpClient::AsyncTcpClient():
+_host("localhost"),
+_port(3493),
+_timeout(-1),
+_socket(new internal::Socket)
+{
+	// Do not connect now
+}
+
+AsyncTcpClient::AsyncTcpClient(const std::string& host, uint16_t port):
+_timeout(-1),
+_socket(new internal::Socket)
+{
+	connect(host, port);
+}
+
+AsyncTcpClient::~AsyncTcpClient()
+{
+	disconnect();
+	delete _socket;
+}
+
+void AsyncTcpClient::connect(const std::string& host, uint16_t port)
+{
+	_host = host;
+	_port = port;
+	connect();
+}
+
+void AsyncTcpClient::connect()
+{
+	disconnect();
+	_socket->setTimeout(_timeout);
+	_socket->connect(_host, _port);
+	_socket->setNonBlocking();
+}
+
+void AsyncTcpClient::connectAsync(const std::string& host, uint16_t port)
+{
+	_host = host;
+	_port = port;
+	disconnect();
+	_socket->startConnect(_host, _port);
+}
+
+bool AsyncTcpClient::isConnected()const
+{
+	return _socket->isConnected();
+}
+
+void AsyncTcpClient::disconnect()
+{
+	_socket->disconnect();
+	_out.clear();
+	_in.clear();
+	_watches.clear();
+	failAll(std::make_exception_ptr(NotConnectedException()));
+}
+
+void AsyncTcpClient::setTimeout(time_t timeout)
+{
+	_timeout = timeout;
+}
+
+time_t AsyncTcpClient::getTimeout()const
+{
+	return _timeout;
+}
+
+std::string AsyncTcpClient::getHost()const
+{
+	return _host;
+}
+
+uint16_t AsyncTcpClient::getPort()const
+{
+	return _port;
+}
+
+int AsyncTcpClient::getFd()const
+{
+	return isConnected() ? static_cast<int>(_socket->getFd()) : -1;
+}
+
+bool AsyncTcpClient::wantWrite()const
+{
+	// A connecting socket becomes writable once it is done
+	return isConnected() && (!_out.empty() || _socket->isConnecting());
+}
+
+size_t AsyncTcpClient::getPendingCount()const
+{
+	return _pending.size();
+}
+
+void AsyncTcpClient::failAll(std::exception_ptr error)
+{
+	// Callbacks may queue new queries, which are not failed here
+	std::deque<Pending> pending;
+	pending.swap(_pending);
+
+	while(!pending.empty())
+	{
+		Pending p = std::move(pending.front());
+		pending.pop_front();
+		p.done(p.lines, error);
+	}
+}
+
+void AsyncTcpClient::handleLine(std::string& line)
+{
+	// Pushed changes come in between answers, and belong to none of them
+	if(line.compare(0, 5, "PUSH ") == 0)
+	{
+		handleChange(line);
+		return;
+	}
+
+	if(_pending.empty())
+	{
+		// Nothing asked for it
+		return;
+	}
+
+	Pending& p = _pending.front();
+	std::exception_ptr error;
+
+	if(line.compare(0, 4, "ERR ") == 0 && !p.raw)
+	{
+		error = std::make_exception_ptr(NutException(line.substr(4)));
+	}
+	else if(!p.list.empty() && !p.begun)
+	{
+		if(line.compare(0, 11, "BEGIN LIST ") != 0 || line.compare(11, std::string::npos, p.list) != 0)
+		{
+			error = std::make_exception_ptr(NutException("Invalid response"));
+		}
+		else
+		{
+			p.begun = true;
+			return;
+		}
+	}
+	else if(!p.list.empty() && (line.compare(0, 9, "END LIST ") != 0 || line.compare(9, std::string::npos, p.list) != 0))
+	{
+		p.lines.push_back(std::move(line));
+		return;
+	}
+	else if(p.list.empty())
+	{
+		p.lines.push_back(std::move(line));
+	}
+
+	// Complete: off the queue first, as the callback may queue more
+	Pending done = std::move(p);
+	_pending.pop_front();
+	done.done(done.lines, error);
+}
+
+void AsyncTcpClient::handleChange(const std::string& line)
+{
+	VariableChange change;
+	if(!TcpClient::parseChange(line, change))
+	{
+		return;
+	}
+
+	std::map<std::string, ChangeHandler>::const_iterator it = _watches.find(change.device);
+	if(it == _watches.end() || !it->second)
+	{
+		// Not watched with watchDevice()
+		return;
+	}
+
+	// A copy, as the handler may unwatch the device
+	ChangeHandler handler = it->second;
+	handler(change);
+}
+
+bool AsyncTcpClient::flush()
+{
+	while(!_out.empty())
+	{
+		ssize_t res = ::write(_socket->getFd(), _out.data(), _out.size());
+		if(res < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			_socket->disconnect();
+			_out.clear();
+			_in.clear();
+			failAll(std::make_exception_ptr(IOException("Error while writing on socket")));
+			return false;
+		}
+		_out.erase(0, static_cast<size_t>(res));
+	}
+	return true;
+}
+
+void AsyncTcpClient::process()
+{
+	char buf[4096];
+	std::vector<std::string> lines;
+
+	if(!isConnected())
+	{
+		return;
+	}
+
+	if(_socket->isConnecting())
+	{
+		try
+		{
+			if(!_socket->finishConnect())
+			{
+				return;
+			}
+		}
+		catch(NutException&)
+		{
+			_out.clear();
+			_in.clear();
+			failAll(std::current_exception());
+			return;
+		}
+	}
+
+	if(!flush())
+	{
+		return;
+	}
+
+	std::exception_ptr lost;
+
+	while(isConnected())
+	{
+		ssize_t res = ::read(_socket->getFd(), buf, sizeof(buf));
+		if(res < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+		}
+		if(res <= 0)
+		{
+			// Once what came before is handled, e.g. "OK Goodbye"
+			lost = std::make_exception_ptr(IOException(res == 0
+				? "Server closed connection unexpectedly"
+				: "Error while reading on socket"));
+			break;
+		}
+
+		_in.append(buf, static_cast<size_t>(res));
+
+		size_t start = 0, idx;
+		while((idx = _in.find('\n', start)) != std::string::npos)
+		{
+			lines.emplace_back(_in, start, idx - start);
+			start = idx + 1;
+		}
+		_in.erase(0, start);
+	}
+
+	// Callbacks may disconnect, or queue more queries
+	for(size_t n=0; n<lines.size() && isConnected(); ++n)
+	{
+		handleLine(lines[n]);
+	}
+
+	if(lost)
+	{
+		// Whatever is still pending never gets an answer
+		_socket->disconnect();
+		_out.clear();
+		_in.clear();
+		_watches.clear();
+		failAll(lost);
+		return;
+	}
+
+	if(isConnected())
+	{
+		flush();
+	}
+}
+
+bool AsyncTcpClient::run(time_t timeout)
+{
+	if(!isConnected())
+	{
+		throw nut::NotConnectedException();
+	}
+
+	SOCKET sock = _socket->getFd();
+	struct timeval tv;
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+
+	fd_set rfds, wfds;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_SET(sock, &rfds);
+	if(wantWrite())
+	{
+		FD_SET(sock, &wfds);
+	}
+
+	int ret = select(sock+1, &rfds, &wfds, nullptr, timeout<0 ? nullptr : &tv);
+	if(ret == -1 && errno != EINTR)
+	{
+		disconnect();
+		throw nut::IOException("Error while waiting on socket");
+	}
+	if(ret <= 0)
+	{
+		return false;
+	}
+
+	process();
+	return true;
+}
+
+bool AsyncTcpClient::waitUntil(const std::function<bool()>& ready, time_t timeout)
+{
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::seconds(timeout < 0 ? 0 : timeout);
+
+	// Send what was queued right away
+	process();
+
+	while(!ready())
+	{
+		if(timeout >= 0 && std::chrono::steady_clock::now() >= deadline)
+		{
+			return false;
+		}
+		if(!isConnected())
+		{
+			// Whatever was pending failed on the way
+			return ready();
+		}
+		// Wake up at least every second to look at the deadline
+		run(timeout < 0 ? -1 : 1);
+	}
+	return true;
+}
+
+template<typename T> std::future<T> AsyncTcpClient::submit(const std::string& req, const std::string& list,
+	std::function<T(const std::vector<std::string>&)> convert, Callback<T> cb, bool raw)
+{
+	if(!isConnected())
+	{
+		throw nut::NotConnectedException();
+	}
+
+	std::shared_ptr<std::promise<T> > promise = std::make_shared<std::promise<T> >();
+	std::future<T> future = promise->get_future();
+
+	Pending p;
+	p.list = list;
+	p.begun = false;
+	p.raw = raw;
+	p.done = [promise, convert](const std::vector<std::string>& lines, std::exception_ptr error)
+	{
+		if(error)
+		{
+			promise->set_exception(error);
+			return;
+		}
+		try
+		{
+			settle(*promise, convert, lines);
+		}
+		catch(...)
+		{
+			promise->set_exception(std::current_exception());
+		}
+	};
+
+	if(cb)
+	{
+		// The future goes to the callback, once ready
+		std::shared_ptr<std::future<T> > shared = std::make_shared<std::future<T> >(std::move(future));
+		std::function<void(const std::vector<std::string>&, std::exception_ptr)> done = p.done;
+		p.done = [done, shared, cb](const std::vector<std::string>& lines, std::exception_ptr error)
+		{
+			done(lines, error);
+			cb(*shared);
+		};
+	}
+
+	_out += req + "\n";
+	_pending.push_back(p);
+
+	return cb ? std::future<T>() : std::move(future);
+}
+
+std::future<void> AsyncTcpClient::authenticate(const std::string& user, const std::string& passwd, Callback<void> cb)
+{
+	// Answered in order, so the first error is known by the second answer
+	std::shared_ptr<std::exception_ptr> first = std::make_shared<std::exception_ptr>();
+
+	submit<void>("USERNAME " + user, "",
+		[](const std::vector<std::string>& lines) { parseOK(lines); },
+		[first](std::future<void>& f) {
+			try { f.get(); } catch(...) { *first = std::current_exception(); }
+		});
+
+	return submit<void>("PASSWORD " + passwd, "",
+		[first](const std::vector<std::string>& lines) {
+			if(*first)
+				std::rethrow_exception(*first);
+			parseOK(lines);
+		}, cb);
+}
+
+std::future<void> AsyncTcpClient::logout(Callback<void> cb)
+{
+	return submit<void>("LOGOUT", "",
+		[](const std::vector<std::string>& lines) { NUT_UNUSED_VARIABLE(lines); }, cb);
+}
+
+std::future<std::set<std::string> > AsyncTcpClient::getDeviceNames(Callback<std::set<std::string> > cb)
+{
+	return submit<std::set<std::string> >("LIST UPS", "UPS",
+		[](const std::vector<std::string>& lines) { return parseNames("UPS", lines); }, cb);
+}
+
+std::future<std::string> AsyncTcpClient::getDeviceDescription(const std::string& dev, Callback<std::string> cb)
+{
+	std::string req = "UPSDESC " + dev;
+	return submit<std::string>("GET " + req, "",
+		[req](const std::vector<std::string>& lines) { return parseGet(req, lines)[0]; }, cb);
+}
+
+std::future<std::set<std::string> > AsyncTcpClient::getDeviceVariableNames(const std::string& dev, Callback<std::set<std::string> > cb)
+{
+	std::string req = "VAR " + dev;
+	return submit<std::set<std::string> >("LIST " + req, req,
+		[req](const std::vector<std::string>& lines) { return parseNames(req, lines); }, cb);
+}
+
+std::future<std::vector<std::string> > AsyncTcpClient::getDeviceVariableValue(const std::string& dev, const std::string& name, Callback<std::vector<std::string> > cb)
+{
+	std::string req = "VAR " + dev + " " + name;
+	return submit<std::vector<std::string> >("GET " + req, "",
+		[req](const std::vector<std::string>& lines) { return parseGet(req, lines); }, cb);
+}
+
+std::future<std::map<std::string,std::vector<std::string> > > AsyncTcpClient::getDeviceVariableValues(const std::string& dev, Callback<std::map<std::string,std::vector<std::string> > > cb)
+{
+	std::string req = "VAR " + dev;
+	return submit<std::map<std::string,std::vector<std::string> > >("LIST " + req, req,
+		[req](const std::vector<std::string>& lines)
+		{
+			return parseVariables(req, lines);
+		}, cb);
+}
+
+std::future<TrackingID> AsyncTcpClient::setDeviceVariable(const std::string& dev, const std::string& name, const std::string& value, Callback<TrackingID> cb)
+{
+	return submit<TrackingID>("SET VAR " + dev + " " + name + " " + TcpClient::escape(value), "",
+		parseTracking, cb);
+}
+
+std::future<std::set<std::string> > AsyncTcpClient::getDeviceCommandNames(const std::string& dev, Callback<std::set<std::string> > cb)
+{
+	std::string req = "CMD " + dev;
+	return submit<std::set<std::string> >("LIST " + req, req,
+		[req](const std::vector<std::string>& lines) { return parseNames(req, lines); }, cb);
+}
+
+std::future<TrackingID> AsyncTcpClient::executeDeviceCommand(const std::string& dev, const std::string& name, const std::string& param, Callback<TrackingID> cb)
+{
+	return submit<TrackingID>("INSTCMD " + dev + " " + name + " " + param, "",
+		parseTracking, cb);
+}
+
+std::future<void> AsyncTcpClient::deviceLogin(const std::string& dev, Callback<void> cb)
+{
+	return submit<void>("LOGIN " + dev, "",
+		[](const std::vector<std::string>& lines) { parseOK(lines); }, cb);
+}
+
+std::future<int> AsyncTcpClient::deviceGetNumLogins(const std::string& dev, Callback<int> cb)
+{
+	std::string req = "NUMLOGINS " + dev;
+	return submit<int>("GET " + req, "",
+		[req](const std::vector<std::string>& lines) { return atoi(parseGet(req, lines)[0].c_str()); }, cb);
+}
+
+std::future<TrackingResult> AsyncTcpClient::getTrackingResult(const TrackingID& id, Callback<TrackingResult> cb)
+{
+	if (id.empty())
+	{
+		// Not tracked: the query was done once answered, so no need to ask
+		std::promise<TrackingResult> promise;
+		std::future<TrackingResult> future = promise.get_future();
+		promise.set_value(TrackingResult::SUCCESS);
+		if (cb)
+		{
+			cb(future);
+			return std::future<TrackingResult>();
+		}
+		return future;
+	}
+
+	return submit<TrackingResult>("GET TRACKING " + id, "",
+		[](const std::vector<std::string>& lines)
+		{
+			const std::string& result = lines[0];
+
+			if (result == "PENDING")
+				return TrackingResult::PENDING;
+			else if (result == "SUCCESS")
+				return TrackingResult::SUCCESS;
+			else if (result == "ERR UNKNOWN")
+				return TrackingResult::UNKNOWN;
+			else if (result == "ERR INVALID-ARGUMENT")
+				return TrackingResult::INVALID_ARGUMENT;
+			else
+				return TrackingResult::FAILURE;
+		}, cb, true);
+}
+
+std::future<std::string> AsyncTcpClient::query(const std::string& req, Callback<std::string> cb)
+{
+	return submit<std::string>(req, "",
+		[](const std::vector<std::string>& lines) { return lines[0]; }, cb);
+}
+
+std::future<void> AsyncTcpClient::watchDevice(const std::string& dev, const std::set<std::string>& patterns,
+	ChangeHandler onChange, Callback<void> cb)
+{
+	std::string req = "WATCH " + dev;
+	for (std::set<std::string>::const_iterator it = patterns.cbegin(); it != patterns.cend(); ++it)
+	{
+		req += " " + TcpClient::escape(*it);
+	}
+	// Registered with the answer, which is handled before the changes following it
+	return submit<void>(req, "",
+		[this, dev, onChange](const std::vector<std::string>& lines) {
+			parseOK(lines);
+			_watches[dev] = onChange;
+		}, cb);
+}
+
+std::future<void> AsyncTcpClient::unwatchDevice(const std::string& dev, Callback<void> cb)
+{
+	return submit<void>("UNWATCH " + dev, "",
+		[this, dev](const std::vector<std::string>& lines) {
+			parseOK(lines);
+			_watches.erase(dev);
+		}, cb);
+}
+
+/*
+ *
+ * Client pool implementation
+ *
+ */
+
+ClientPool::ClientPool():
+_timeout(5),
+_retry(10)
+{
+}
+
+ClientPool::~ClientPool()
+{
+	for(std::map<std::string, Host>::iterator it = _hosts.begin(); it != _hosts.end(); ++it)
+	{
+		delete it->second.client;
+	}
+}
+
+std::string ClientPool::addHost(const std::string& host, uint16_t port, time_t timeout)
+{
+	std::ostringstream name;
+	if(host.find(':') != std::string::npos)
+		name << "[" << host << "]:" << port;
+	else
+		name << host << ":" << port;
+
+	std::pair<std::map<std::string, Host>::iterator, bool> res = _hosts.insert(std::make_pair(name.str(), Host()));
+	Host& h = res.first->second;
+	if(res.second)
+	{
+		h.host = host;
+		h.port = port;
+		h.client = nullptr;
+		h.timedOut = false;
+	}
+	h.timeout = timeout;
+
+	return res.first->first;
+}
+
+void ClientPool::removeHost(const std::string& name)
+{
+	std::map<std::string, Host>::iterator it = _hosts.find(name);
+	if(it != _hosts.end())
+	{
+		delete it->second.client;
+		_hosts.erase(it);
+	}
+}
+
+std::set<std::string> ClientPool::getHosts()const
+{
+	std::set<std::string> hosts;
+	for(std::map<std::string, Host>::const_iterator it = _hosts.begin(); it != _hosts.end(); ++it)
+	{
+		hosts.insert(it->first);
+	}
+	return hosts;
+}
+
+bool ClientPool::isConnected(const std::string& name)const
+{
+	std::map<std::string, Host>::const_iterator it = _hosts.find(name);
+	return it != _hosts.end() && it->second.client && it->second.client->isConnected();
+}
+
+void ClientPool::setTimeout(time_t timeout)
+{
+	_timeout = timeout;
+}
+
+time_t ClientPool::getTimeout()const
+{
+	return _timeout;
+}
+
+void ClientPool::setRetryInterval(time_t interval)
+{
+	_retry = interval;
+}
+
+time_t ClientPool::getRetryInterval()const
+{
+	return _retry;
+}
+
+bool ClientPool::prepare(Host& host, std::string& error)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	host.timedOut = false;
+
+	if(host.client && host.client->isConnected())
+	{
+		return true;
+	}
+
+	if(host.client && now < host.tried + std::chrono::seconds(_retry))
+	{
+		error = host.error.empty() ? NotConnectedException().str() : host.error;
+		return false;
+	}
+
+	if(!host.client)
+	{
+		host.client = new AsyncTcpClient;
+	}
+
+	host.tried = now;
+	host.error.clear();
+	host.client->setTimeout(host.timeout < 0 ? _timeout : host.timeout);
+
+	try
+	{
+		// Done by waitAll(), along with those of the other hosts
+		host.client->connectAsync(host.host, host.port);
+	}
+	catch(NutException& ex)
+	{
+		host.error = error = ex.what();
+		return false;
+	}
+
+	return true;
+}
+
+void ClientPool::waitAll()
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<struct pollfd> fds;
+	std::vector<Host*> polled;
+
+	for(;;)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::duration wait = std::chrono::steady_clock::duration::max();
+
+		fds.clear();
+		polled.clear();
+
+		for(std::map<std::string, Host>::iterator it = _hosts.begin(); it != _hosts.end(); ++it)
+		{
+			Host& h = it->second;
+			if(!h.client || !h.client->isConnected() || h.client->getPendingCount() == 0)
+				continue;
+
+			std::chrono::steady_clock::time_point deadline =
+				start + std::chrono::seconds(h.timeout < 0 ? _timeout : h.timeout);
+			if(now >= deadline)
+			{
+				// Its answers would come after those of the next queries
+				h.timedOut = true;
+				h.client->disconnect();
+				continue;
+			}
+			if(deadline - now < wait)
+				wait = deadline - now;
+
+			struct pollfd pfd;
+			pfd.fd = h.client->getFd();
+			pfd.events = POLLIN;
+			if(h.client->wantWrite())
+				pfd.events |= POLLOUT;
+			pfd.revents = 0;
+			fds.push_back(pfd);
+			polled.push_back(&h);
+		}
+
+		if(fds.empty())
+		{
+			return;
+		}
+
+		// Rounded up, not to spin the last millisecond
+		int ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count()) + 1;
+		int ret = poll(&fds[0], fds.size(), ms);
+		if(ret < 0 && errno != EINTR)
+		{
+			throw nut::IOException("Error while waiting on sockets");
+		}
+
+		for(size_t n = 0; ret > 0 && n < fds.size(); ++n)
+		{
+			// Errors and hang ups are found by reading
+			if(fds[n].revents)
+				polled[n]->client->process();
+		}
+	}
+}
+
+ClientPool::Results<std::string> ClientPool::check()
+{
+	return fanOut<std::string>([](AsyncTcpClient& client) {
+		return client.query("VER");
+	});
+}
+
+ClientPool::Results<std::set<std::string> > ClientPool::getDeviceNames()
+{
+	return fanOut<std::set<std::string> >([](AsyncTcpClient& client) {
+		return client.getDeviceNames();
+	});
+}
+
+ClientPool::Results<std::map<std::string,std::vector<std::string> > > ClientPool::getDeviceVariableValue(const std::string& name)
+{
+	typedef std::map<std::string,std::vector<std::string> > Values;
+
+	return fanOut<Values>([&name](AsyncTcpClient& client) {
+		std::shared_ptr<std::promise<Values> > promise = std::make_shared<std::promise<Values> >();
+		std::shared_ptr<Values> values = std::make_shared<Values>();
+
+		// Then one GET per device, all sent at once
+		client.getDeviceNames([&client, name, promise, values](std::future<std::set<std::string> >& f) {
+			std::set<std::string> devs;
+			try
+			{
+				devs = f.get();
+				if(devs.empty())
+				{
+					promise->set_value(Values());
+					return;
+				}
+			}
+			catch(...)
+			{
+				promise->set_exception(std::current_exception());
+				return;
+			}
+
+			std::shared_ptr<size_t> left = std::make_shared<size_t>(devs.size());
+			std::shared_ptr<bool> failed = std::make_shared<bool>(false);
+
+			for(std::set<std::string>::const_iterator it = devs.begin(); it != devs.end(); ++it)
+			{
+				std::string dev = *it;
+				client.getDeviceVariableValue(dev, name, [dev, promise, values, left, failed](std::future<std::vector<std::string> >& v) {
+					try
+					{
+						(*values)[dev] = v.get();
+					}
+					catch(IOException&)
+					{
+						if(!*failed)
+							promise->set_exception(std::current_exception());
+						*failed = true;
+					}
+					catch(NutException&)
+					{
+						// Not a variable of this one
+					}
+					if(--*left == 0 && !*failed)
+						promise->set_value(std::move(*values));
+				});
+			}
+		});
+
+		return promise->get_future();
+	});
+}
+
+/*
+ *
+ * Caching client implementation
+ *
+ */
+
+namespace {
+
+/* Set by the driver once, from what the device told it */
+const char* const static_variables[] = {
+	"device.mfr",
+	"device.model",
+	"device.serial",
+	"device.type",
+	"driver.name",
+	"driver.version",
+	"driver.version.internal",
+	"ups.firmware",
+	"ups.mfr",
+	"ups.model",
+	"ups.productid",
+	"ups.serial",
+	"ups.vendorid",
+};
+
+/* Errors of things which do not exist, which asking again won't change */
+bool is_missing(const std::string& error)
+{
+	return error == "UNKNOWN-UPS" || error == "VAR-NOT-SUPPORTED" || error == "CMD-NOT-SUPPORTED";
+}
+
+/* Entries keyed by device then name, which come one after the other */
+template<typename M> void erase_device(M& map, const std::string& dev)
+{
+	typename M::iterator it = map.lower_bound(std::make_pair(dev, std::string()));
+
+	while(it != map.end() && it->first.first == dev)
+	{
+		it = map.erase(it);
+	}
+}
+
+} /* namespace */
+
+CachingClient::CachingClient(Client* client, time_t ttl):
+_client(client),
+_ttl(ttl),
+_negativeTTL(-1),
+_staticTTL(300),
+_static(static_variables, static_variables + sizeof(static_variables) / sizeof(static_variables[0]))
+{
+}
+
+CachingClient::~CachingClient()
+{
+}
+
+Client* CachingClient::getClient()const
+{
+	return _client;
+}
+
+void CachingClient::setTTL(time_t ttl)
+{
+	_ttl = ttl;
+}
+
+time_t CachingClient::getTTL()const
+{
+	return _ttl;
+}
+
+void CachingClient::setNegativeTTL(time_t ttl)
+{
+	_negativeTTL = ttl;
+}
+
+time_t CachingClient::getNegativeTTL()const
+{
+	return _negativeTTL < 0 ? _ttl : _negativeTTL;
+}
+
+void CachingClient::setStaticTTL(time_t ttl)
+{
+	_staticTTL = ttl;
+}
+
+time_t CachingClient::getStaticTTL()const
+{
+	return _staticTTL;
+}
+
+void CachingClient::setStaticVariables(const std::set<std::string>& names)
+{
+	_static = names;
+}
+
+std::set<std::string> CachingClient::getStaticVariables()const
+{
+	return _static;
+}
+
+void CachingClient::invalidate()
+{
+	_devices = Cached<std::set<std::string> >();
+	_deviceDescriptions.clear();
+	_variableNames.clear();
+	_rwVariableNames.clear();
+	_commandNames.clear();
+	_values.clear();
+	_variableDescriptions.clear();
+	_commandDescriptions.clear();
+}
+
+void CachingClient::invalidate(const std::string& dev)
+{
+	_deviceDescriptions.erase(dev);
+	_variableNames.erase(dev);
+	_rwVariableNames.erase(dev);
+	_commandNames.erase(dev);
+
+	erase_device(_values, dev);
+	erase_device(_variableDescriptions, dev);
+	erase_device(_commandDescriptions, dev);
+}
+
+void CachingClient::invalidateValues(const std::string& dev)
+{
+	std::map<Key, Cached<std::vector<std::string> > >::iterator it = _values.lower_bound(Key(dev, ""));
+
+	while(it != _values.end() && it->first.first == dev)
+	{
+		if(_static.count(it->first.second))
+			++it;
+		else
+			it = _values.erase(it);
+	}
+
+	_variableNames.erase(dev);
+}
+
+time_t CachingClient::valueTTL(const std::string& name)const
+{
+	return _static.count(name) ? _staticTTL : _ttl;
+}
+
+template<typename T> const T& CachingClient::lookup(Cached<T>& entry, time_t ttl, const std::function<T()>& fetch)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	if(now < entry.expires)
+	{
+		if(!entry.error.empty())
+			throw NutException(entry.error);
+		return entry.value;
+	}
+
+	try
+	{
+		entry.value = fetch();
+		entry.error.clear();
+		entry.expires = now + std::chrono::seconds(ttl > 0 ? ttl : 0);
+	}
+	catch(IOException&)
+	{
+		entry.expires = now;
+		throw;
+	}
+	catch(NutException& ex)
+	{
+		time_t negative = getNegativeTTL();
+
+		entry.value = T();
+		entry.error = ex.str();
+		entry.expires = now + std::chrono::seconds(is_missing(entry.error) && negative > 0 ? negative : 0);
+		throw;
+	}
+
+	return entry.value;
+}
+
+bool CachingClient::cachedValues(const std::string& dev, std::map<std::string,std::vector<std::string> >& values)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::map<std::string, Cached<std::set<std::string> > >::const_iterator names = _variableNames.find(dev);
+
+	if(names == _variableNames.end() || now >= names->second.expires)
+	{
+		return false;
+	}
+	if(!names->second.error.empty())
+	{
+		throw NutException(names->second.error);
+	}
+
+	values.clear();
+	for(std::set<std::string>::const_iterator it = names->second.value.begin(); it != names->second.value.end(); ++it)
+	{
+		std::map<Key, Cached<std::vector<std::string> > >::const_iterator val = _values.find(Key(dev, *it));
+		if(val == _values.end() || now >= val->second.expires || !val->second.error.empty())
+		{
+			return false;
+		}
+		values.emplace_hint(values.end(), *it, val->second.value);
+	}
+
+	return true;
+}
+
+void CachingClient::storeValues(const std::string& dev, const std::map<std::string,std::vector<std::string> >& values)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	if(_ttl <= 0)
+	{
+		return;
+	}
+
+	Cached<std::set<std::string> >& names = _variableNames[dev];
+	names.value.clear();
+	names.error.clear();
+	names.expires = now + std::chrono::seconds(_ttl);
+
+	for(std::map<std::string,std::vector<std::string> >::const_iterator it = values.begin(); it != values.end(); ++it)
+	{
+		names.value.insert(names.value.end(), it->first);
+
+		Cached<std::vector<std::string> >& val = _values[Key(dev, it->first)];
+		val.value = it->second;
+		val.error.clear();
+		val.expires = now + std::chrono::seconds(valueTTL(it->first));
+	}
+}
+
+void CachingClient::authenticate(const std::string& user, const std::string& passwd)
+{
+	_client->authenticate(user, passwd);
+}
+
+void CachingClient::logout()
+{
+	invalidate();
+	_client->logout();
+}
+
+bool CachingClient::hasDevice(const std::string& dev)
+{
+	const std::set<std::string>& devs = lookup<std::set<std::string> >(_devices, _ttl,
+		[this]() { return _client->getDeviceNames(); });
+	return devs.find(dev) != devs.end();
+}
+
+std::set<std::string> CachingClient::getDeviceNames()
+{
+	return lookup<std::set<std::string> >(_devices, _ttl,
+		[this]() { return _client->getDeviceNames(); });
+}
+
+std::string CachingClient::getDeviceDescription(const std::string& name)
+{
+	return lookup<std::string>(_deviceDescriptions[name], _staticTTL,
+		[this, &name]() { return _client->getDeviceDescription(name); });
+}
+
+std::set<std::string> CachingClient::getDeviceVariableNames(const std::string& dev)
+{
+	return lookup<std::set<std::string> >(_variableNames[dev], _ttl,
+		[this, &dev]() { return _client->getDeviceVariableNames(dev); });
+}
+
+std::set<std::string> CachingClient::getDeviceRWVariableNames(const std::string& dev)
+{
+	return lookup<std::set<std::string> >(_rwVariableNames[dev], _staticTTL,
+		[this, &dev]() { return _client->getDeviceRWVariableNames(dev); });
+}
+
+bool CachingClient::hasDeviceVariable(const std::string& dev, const std::string& name)
+{
+	const std::set<std::string>& names = lookup<std::set<std::string> >(_variableNames[dev], _ttl,
+		[this, &dev]() { return _client->getDeviceVariableNames(dev); });
+	return names.find(name) != names.end();
+}
+
+std::string CachingClient::getDeviceVariableDescription(const std::string& dev, const std::string& name)
+{
+	return lookup<std::string>(_variableDescriptions[Key(dev, name)], _staticTTL,
+		[this, &dev, &name]() { return _client->getDeviceVariableDescription(dev, name); });
+}
+
+std::vector<std::string> CachingClient::getDeviceVariableValue(const std::string& dev, const std::string& name)
+{
+	return lookup<std::vector<std::string> >(_values[Key(dev, name)], valueTTL(name),
+		[this, &dev, &name]() { return _client->getDeviceVariableValue(dev, name); });
+}
+
+std::map<std::string,std::vector<std::string> > CachingClient::getDeviceVariableValues(const std::string& dev)
+{
+	std::map<std::string,std::vector<std::string> > values;
+
+	if(cachedValues(dev, values))
+	{
+		return values;
+	}
+
+	// All at once, however the client does it, rather than the missing ones
+	try
+	{
+		values = _client->getDeviceVariableValues(dev);
+	}
+	catch(IOException&)
+	{
+		throw;
+	}
+	catch(NutException& ex)
+	{
+		if(is_missing(ex.str()) && getNegativeTTL() > 0)
+		{
+			Cached<std::set<std::string> >& names = _variableNames[dev];
+			names.value.clear();
+			names.error = ex.str();
+			names.expires = std::chrono::steady_clock::now() + std::chrono::seconds(getNegativeTTL());
+		}
+		throw;
+	}
+
+	storeValues(dev, values);
+	return values;
+}
+
+std::map<std::string,std::map<std::string,std::vector<std::string> > > CachingClient::getDevicesVariableValues(const std::set<std::string>& devs)
+{
+	std::map<std::string,std::map<std::string,std::vector<std::string> > > res;
+	std::set<std::string> missing;
+
+	for(std::set<std::string>::const_iterator it = devs.begin(); it != devs.end(); ++it)
+	{
+		if(!cachedValues(*it, res[*it]))
+		{
+			res.erase(*it);
+			missing.insert(*it);
+		}
+	}
+
+	if(missing.empty())
+	{
+		return res;
+	}
+
+	std::map<std::string,std::map<std::string,std::vector<std::string> > > fetched = _client->getDevicesVariableValues(missing);
+	for(std::map<std::string,std::map<std::string,std::vector<std::string> > >::iterator it = fetched.begin(); it != fetched.end(); ++it)
+	{
+		storeValues(it->first, it->second);
+		res[it->first].swap(it->second);
+	}
+
+	return res;
+}
+
+TrackingID CachingClient::setDeviceVariable(const std::string& dev, const std::string& name, const std::string& value)
+{
+	_values.erase(Key(dev, name));
+	return _client->setDeviceVariable(dev, name, value);
+}
+
+TrackingID CachingClient::setDeviceVariable(const std::string& dev, const std::string& name, const std::vector<std::string>& values)
+{
+	_values.erase(Key(dev, name));
+	return _client->setDeviceVariable(dev, name, values);
+}
+
+std::set<std::string> CachingClient::getDeviceCommandNames(const std::string& dev)
+{
+	return lookup<std::set<std::string> >(_commandNames[dev], _staticTTL,
+		[this, &dev]() { return _client->getDeviceCommandNames(dev); });
+}
+
+bool CachingClient::hasDeviceCommand(const std::string& dev, const std::string& name)
+{
+	const std::set<std::string>& names = lookup<std::set<std::string> >(_commandNames[dev], _staticTTL,
+		[this, &dev]() { return _client->getDeviceCommandNames(dev); });
+	return names.find(name) != names.end();
+}
+
+std::string CachingClient::getDeviceCommandDescription(const std::string& dev, const std::string& name)
+{
+	return lookup<std::string>(_commandDescriptions[Key(dev, name)], _staticTTL,
+		[this, &dev, &name]() { return _client->getDeviceCommandDescription(dev, name); });
+}
+
+TrackingID CachingClient::executeDeviceCommand(const std::string& dev, const std::string& name, const std::string& param)
+{
+	invalidateValues(dev);
+	return _client->executeDeviceCommand(dev, name, param);
+}
+
+void CachingClient::deviceLogin(const std::string& dev)
+{
+	_client->deviceLogin(dev);
+}
+
+void CachingClient::deviceMaster(const std::string& dev)
+{
+	_client->deviceMaster(dev);
+}
+
+void CachingClient::devicePrimary(const std::string& dev)
+{
+	_client->devicePrimary(dev);
+}
+
+void CachingClient::deviceForcedShutdown(const std::string& dev)
+{
+	invalidateValues(dev);
+	_client->deviceForcedShutdown(dev);
+}
+
+int CachingClient::deviceGetNumLogins(const std::string& dev)
+{
+	return _client->deviceGetNumLogins(dev);
+}
+
+TrackingResult CachingClient::getTrackingResult(const TrackingID& id)
+{
+	return _client->getTrackingResult(id);
+}
+
+bool CachingClient::isFeatureEnabled(const Feature& feature)
+{
+	return _client->isFeatureEnabled(feature);
+}
+
+void CachingClient::setFeature(const Feature& feature, bool status)
+{
+	_client->setFeature(feature, status);
+}
+
+/*
+ *
+ * Device implementation
+ *
+ */
+
+Device::Device(Client* client, const std::string& name):
+_client(client),
+_name(name)
+{
+}
+
+Device::Device(const Device& dev):
+_client(dev._client),
+_name(dev._name)
+{
+}
+
+Device& Device::operator=(const Device& dev)
 {
 	// Self assignment?
 	if (this==&dev)
@@ -1235,6 +2969,12 @@ std::map<std::string,std::vector<std::string> > Device::getVariableValues()
 	return getClient()->getDeviceVariableValues(getName());
 }
 
+void Device::forEachVariable(const VariableVisitor& fn)
+{
+	if (!isOk()) throw NutException("Invalid device");
+	getClient()->forEachVariable(getName(), fn);
+}
+
 std::set<std::string> Device::getVariableNames()
 {
 	if (!isOk()) throw NutException("Invalid device");
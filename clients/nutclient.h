@@ -27,7 +27,11 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <future>
+#include <chrono>
 #include <cstdint>
 #include <ctime>
 
@@ -47,6 +51,9 @@ class Socket;
 
 class Client;
 class TcpClient;
+class AsyncTcpClient;
+class ClientPool;
+class CachingClient;
 class Device;
 class Variable;
 class Command;
@@ -149,6 +156,26 @@ typedef enum
 
 typedef std::string Feature;
 
+/**
+ * Change of a device variable pushed by the server.
+ * \see TcpClient::watchDevice(), AsyncTcpClient::watchDevice()
+ */
+struct VariableChange
+{
+	std::string device;
+	std::string variable;
+	/** New value(s), empty if the variable was removed. */
+	std::vector<std::string> values;
+	bool deleted;
+};
+
+/**
+ * Called for each variable of a device by Client::forEachVariable().
+ * The name and values are only valid during the call, copy or move
+ * what is to be kept.
+ */
+typedef std::function<void(const std::string& name, const std::vector<std::string>& values)> VariableVisitor;
+
 /**
  * A nut client is the starting point to dialog to NUTD.
  * It can connect to an NUTD then retrieve its device list.
@@ -264,6 +291,13 @@ public:
 	 * \return Variable values indexed by variable names, indexed by device names.
 	 */
 	virtual std::map<std::string,std::map<std::string,std::vector<std::string> > > getDevicesVariableValues(const std::set<std::string>& devs);
+	/**
+	 * Walk the values of all variables of a device without building a
+	 * map of them, e.g. to print or filter them.
+	 * \param dev Device name
+	 * \param fn Called for each variable, it must not use the client.
+	 */
+	virtual void forEachVariable(const std::string& dev, const VariableVisitor& fn);
 	/**
 	 * Intend to set the value of a variable.
 	 * \param dev Device name
@@ -364,6 +398,8 @@ class TcpClient : public Client
 	 * generally, but still want covered with integration tests
 	 */
 	friend class NutActiveClientTest;
+	/* Parses answers the same way */
+	friend class AsyncTcpClient;
 
 public:
 	/**
@@ -439,6 +475,7 @@ public:
 	virtual std::vector<std::string> getDeviceVariableValue(const std::string& dev, const std::string& name) override;
 	virtual std::map<std::string,std::vector<std::string> > getDeviceVariableValues(const std::string& dev) override;
 	virtual std::map<std::string,std::map<std::string,std::vector<std::string> > > getDevicesVariableValues(const std::set<std::string>& devs) override;
+	virtual void forEachVariable(const std::string& dev, const VariableVisitor& fn) override;
 	virtual TrackingID setDeviceVariable(const std::string& dev, const std::string& name, const std::string& value) override;
 	virtual TrackingID setDeviceVariable(const std::string& dev, const std::string& name, const std::vector<std::string>& values) override;
 
@@ -460,26 +497,580 @@ public:
 	virtual bool isFeatureEnabled(const Feature& feature) override;
 	virtual void setFeature(const Feature& feature, bool status) override;
 
+	/**
+	 * Subscribe to changes of variables of a device.
+	 * The server then pushes their current values, and every change as
+	 * it happens, to be read with readChange() instead of polling.
+	 * \param dev Device name.
+	 * \param patterns Glob patterns of the variables to watch, all if empty.
+	 */
+	void watchDevice(const std::string& dev, const std::set<std::string>& patterns = std::set<std::string>());
+	/**
+	 * Stop watching a device.
+	 * \param dev Device name.
+	 */
+	void unwatchDevice(const std::string& dev);
+	/**
+	 * Wait for the next pushed change of a watched device.
+	 * \param change Filled with the change, if any.
+	 * \param timeout Time to wait for it in seconds, negative to block.
+	 * \return true if a change was read, false on timeout.
+	 */
+	bool readChange(VariableChange& change, time_t timeout);
+
 protected:
 	std::string sendQuery(const std::string& req);
+	std::string readLine();
+	/** Next line in place in the receive buffer, valid until the next read. */
+	void readLine(const char*& line, size_t& len);
 	void sendAsyncQueries(const std::vector<std::string>& req);
 	static void detectError(const std::string& req);
+	static void detectError(const char* line, size_t len);
 	TrackingID sendTrackingQuery(const std::string& req);
 
 	std::vector<std::string> get(const std::string& subcmd, const std::string& params = "");
 
 	std::vector<std::vector<std::string> > list(const std::string& subcmd, const std::string& params = "");
+	/** First word of each row of a LIST answer, e.g. the names in LIST VAR. */
+	std::set<std::string> listNames(const std::string& subcmd, const std::string& params = "");
 
 	std::vector<std::vector<std::string> > parseList(const std::string& req);
+	/** Calls row with each row of the answer to LIST req, past req. */
+	void parseList(const std::string& req, const std::function<void(const char* row, size_t len)>& row);
+	/** Values of the rows of LIST VAR, moved into map. */
+	void parseVariables(const std::string& req, std::map<std::string,std::vector<std::string> >& map);
 
 	static std::vector<std::string> explode(const std::string& str, size_t begin=0);
+	/**
+	 * Split str into res, reusing the strings already there so that
+	 * parsing row after row into the same vector allocates next to nothing.
+	 * \param first If not null, gets the first word instead of res.
+	 */
+	static void explode(const char* str, size_t len, std::vector<std::string>& res, std::string* first = nullptr);
 	static std::string escape(const std::string& str);
+	/** Parse a "PUSH" line into change, false if it is not one. */
+	static bool parseChange(const std::string& line, VariableChange& change);
+
+private:
+	std::string _host;
+	uint16_t _port;
+	time_t _timeout;
+	internal::Socket* _socket;
+	/** Pushed changes read while waiting for answers. */
+	std::deque<std::string> _pushes;
+	bool _watching;
+};
+
+/**
+ * Non-blocking TCP NUTD client which pipelines its queries.
+ * Queries are queued without waiting for the answers to the previous
+ * ones, and as upsd answers them in order, each answer goes to whoever
+ * sent the query: through the returned std::future, or to a callback.
+ *
+ * Nothing is sent or read but from process(), which never blocks: call
+ * it when getFd() is readable, or writable while wantWrite() says so, from
+ * an external event loop, or have run() or wait() do the waiting.
+ * Callbacks are called from there. An AsyncTcpClient must only be used by
+ * one thread at a time.
+ */
+class AsyncTcpClient
+{
+public:
+	/**
+	 * Called once a query is answered, with a future which is ready:
+	 * get() then returns the result or throws what the query met.
+	 */
+	template<typename T> using Callback = std::function<void(std::future<T>&)>;
+	/** Called with each change pushed for a watched device. */
+	typedef std::function<void(const VariableChange& change)> ChangeHandler;
+
+	/**
+	 * Construct a nut AsyncTcpClient object.
+	 * You must call one of AsyncTcpClient::connect() after.
+	 */
+	AsyncTcpClient();
+
+	/**
+	 * Construct a nut AsyncTcpClient object then connect it to the specified server.
+	 * \param host Server host name.
+	 * \param port Server port.
+	 */
+	AsyncTcpClient(const std::string& host, uint16_t port = 3493);
+	~AsyncTcpClient();
+
+	AsyncTcpClient(const AsyncTcpClient&) = delete;
+	AsyncTcpClient& operator=(const AsyncTcpClient&) = delete;
+
+	/**
+	 * Connect it to the specified server.
+	 * Only the queries are asynchronous: this blocks until connected,
+	 * or for the timeout at most.
+	 * \param host Server host name.
+	 * \param port Server port.
+	 */
+	void connect(const std::string& host, uint16_t port = 3493);
+	void connect();
+	/**
+	 * Start connecting to the specified server, without waiting but to
+	 * resolve its name. Queries may be queued right away: process() sends
+	 * them once connected, or they fail with IOException if it could not
+	 * connect. Meanwhile it counts as connected, and wantWrite() is true.
+	 * \param host Server host name.
+	 * \param port Server port.
+	 */
+	void connectAsync(const std::string& host, uint16_t port = 3493);
+	bool isConnected()const;
+	/**
+	 * Force the deconnection. Queries not answered yet fail with
+	 * NotConnectedException.
+	 */
+	void disconnect();
+
+	/**
+	 * Set the timeout of connect() in seconds, negative to block.
+	 */
+	void setTimeout(time_t timeout);
+	time_t getTimeout()const;
+
+	std::string getHost()const;
+	uint16_t getPort()const;
+
+	/**
+	 * Event loop integration.
+	 * \{
+	 */
+	/** Socket to wait on, -1 if not connected. */
+	int getFd()const;
+	/** Whether queries are waiting for the socket to be writable. */
+	bool wantWrite()const;
+	/** Number of queries sent or queued but not answered yet. */
+	size_t getPendingCount()const;
+	/**
+	 * Send what can be sent and handle what was received, without
+	 * blocking. Answered queries are completed from here.
+	 */
+	void process();
+	/**
+	 * Wait for the socket and process() once.
+	 * \param timeout Time to wait in seconds, negative to block.
+	 * \return false if nothing happened in time.
+	 */
+	bool run(time_t timeout);
+	/**
+	 * Run until a future returned by this client is ready.
+	 * \param timeout Time to wait in seconds, negative to block.
+	 * \return false if it is still not ready after timeout.
+	 */
+	template<typename T> bool wait(const std::future<T>& f, time_t timeout = -1)
+	{
+		return waitUntil([&f]() {
+			return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		}, timeout);
+	}
+	/** \} */
+
+	/**
+	 * Queries, as those of TcpClient. Each returns a future for its
+	 * result, or if given a callback, an invalid future and the callback
+	 * gets the future once the answer came.
+	 * \{
+	 */
+	std::future<void> authenticate(const std::string& user, const std::string& passwd, Callback<void> cb = nullptr);
+	std::future<void> logout(Callback<void> cb = nullptr);
+
+	std::future<std::set<std::string> > getDeviceNames(Callback<std::set<std::string> > cb = nullptr);
+	std::future<std::string> getDeviceDescription(const std::string& dev, Callback<std::string> cb = nullptr);
+
+	std::future<std::set<std::string> > getDeviceVariableNames(const std::string& dev, Callback<std::set<std::string> > cb = nullptr);
+	std::future<std::vector<std::string> > getDeviceVariableValue(const std::string& dev, const std::string& name, Callback<std::vector<std::string> > cb = nullptr);
+	std::future<std::map<std::string,std::vector<std::string> > > getDeviceVariableValues(const std::string& dev, Callback<std::map<std::string,std::vector<std::string> > > cb = nullptr);
+	std::future<TrackingID> setDeviceVariable(const std::string& dev, const std::string& name, const std::string& value, Callback<TrackingID> cb = nullptr);
+
+	std::future<std::set<std::string> > getDeviceCommandNames(const std::string& dev, Callback<std::set<std::string> > cb = nullptr);
+	std::future<TrackingID> executeDeviceCommand(const std::string& dev, const std::string& name, const std::string& param = "", Callback<TrackingID> cb = nullptr);
+
+	std::future<void> deviceLogin(const std::string& dev, Callback<void> cb = nullptr);
+	std::future<int> deviceGetNumLogins(const std::string& dev, Callback<int> cb = nullptr);
+	std::future<TrackingResult> getTrackingResult(const TrackingID& id, Callback<TrackingResult> cb = nullptr);
+
+	/**
+	 * Any query answered with a single line, such as "VER".
+	 * An "ERR" answer throws NutException as the others. Changes pushed
+	 * after a "WATCH" sent this way are dropped: use watchDevice().
+	 */
+	std::future<std::string> query(const std::string& req, Callback<std::string> cb = nullptr);
+
+	/**
+	 * Subscribe to changes of variables of a device, as
+	 * TcpClient::watchDevice() does. Once it is answered, the current
+	 * values then every change go to onChange, from process(), and never
+	 * to the answers of other queries.
+	 * \param dev Device name.
+	 * \param patterns Glob patterns of the variables to watch, all if empty.
+	 * \param onChange Called with each change of the device.
+	 */
+	std::future<void> watchDevice(const std::string& dev, const std::set<std::string>& patterns,
+		ChangeHandler onChange, Callback<void> cb = nullptr);
+	/**
+	 * Stop watching a device. Changes pushed until it is answered still
+	 * go to the handler given to watchDevice().
+	 */
+	std::future<void> unwatchDevice(const std::string& dev, Callback<void> cb = nullptr);
+	/** \} */
+
+protected:
+	/** A query sent or queued, with what to do with its answer. */
+	struct Pending
+	{
+		/** For LIST queries, what follows "BEGIN LIST ", empty otherwise. */
+		std::string list;
+		bool begun;
+		/** "ERR" answers are handed over as they are. */
+		bool raw;
+		std::vector<std::string> lines;
+		/** Given the answer lines, or an exception. */
+		std::function<void(const std::vector<std::string>&, std::exception_ptr)> done;
+	};
+
+	template<typename T> std::future<T> submit(const std::string& req, const std::string& list,
+		std::function<T(const std::vector<std::string>&)> convert, Callback<T> cb, bool raw = false);
+
+	static std::vector<std::string> parseGet(const std::string& req, const std::vector<std::string>& lines);
+	static std::vector<std::vector<std::string> > parseList(const std::string& req, const std::vector<std::string>& lines);
+	static std::map<std::string,std::vector<std::string> > parseVariables(const std::string& req, const std::vector<std::string>& lines);
+	static std::set<std::string> parseNames(const std::string& req, const std::vector<std::string>& lines);
+	static void parseOK(const std::vector<std::string>& lines);
+	static TrackingID parseTracking(const std::vector<std::string>& lines);
+
+	bool flush();
+	void handleLine(std::string& line);
+	void handleChange(const std::string& line);
+	void failAll(std::exception_ptr error);
+	bool waitUntil(const std::function<bool()>& ready, time_t timeout);
 
 private:
 	std::string _host;
 	uint16_t _port;
 	time_t _timeout;
 	internal::Socket* _socket;
+	/** Queries not written yet. */
+	std::string _out;
+	/** Partial line read. */
+	std::string _in;
+	std::deque<Pending> _pending;
+	/** Handlers of the watched devices, by name. */
+	std::map<std::string, ChangeHandler> _watches;
+};
+
+/**
+ * Persistent connections to several NUTDs, queried all at once.
+ * Each host has an AsyncTcpClient: a query is pipelined to all of them,
+ * then their answers are waited for together, without threads, each
+ * host for its own timeout. Results are merged by host, and a host which
+ * failed or did not answer in time has its error instead of a value.
+ *
+ * A host whose connection was lost or timed out is reconnected, as by
+ * nutclient_tcp_reconnect(), by the next query which comes after the
+ * retry interval; until then its results say it is not connected.
+ * Hosts are connected to all at once as well, within their timeout,
+ * and only resolving their names blocks.
+ * A ClientPool must only be used by one thread at a time.
+ */
+class ClientPool
+{
+public:
+	/** What one host answered. */
+	template<typename T> struct Result
+	{
+		Result(): ok(false), value() {}
+
+		bool ok;
+		/** Only meaningful if ok. */
+		T value;
+		/** Why not ok. */
+		std::string error;
+	};
+
+	/** Results by host, as named by getHosts(). */
+	template<typename T> using Results = std::map<std::string, Result<T> >;
+
+	ClientPool();
+	~ClientPool();
+
+	ClientPool(const ClientPool&) = delete;
+	ClientPool& operator=(const ClientPool&) = delete;
+
+	/**
+	 * Add a server to query; it is connected to by the first query.
+	 * \param host Server host name.
+	 * \param port Server port.
+	 * \param timeout Time in seconds to connect and answer a query,
+	 * negative for that of the pool.
+	 * \return Name of the host in results, "host:port".
+	 */
+	std::string addHost(const std::string& host, uint16_t port = 3493, time_t timeout = -1);
+	/** Disconnect and forget a host, by the name addHost() returned. */
+	void removeHost(const std::string& name);
+	std::set<std::string> getHosts()const;
+	bool isConnected(const std::string& name)const;
+
+	/**
+	 * Set the timeout in seconds of the hosts which have none of their
+	 * own, 5 by default.
+	 */
+	void setTimeout(time_t timeout);
+	time_t getTimeout()const;
+	/**
+	 * Set the time in seconds between attempts to reconnect to a host,
+	 * 10 by default.
+	 */
+	void setRetryInterval(time_t interval);
+	time_t getRetryInterval()const;
+
+	/**
+	 * Health check: ask every host for its version, which keeps idle
+	 * connections alive and reconnects the lost ones.
+	 */
+	Results<std::string> check();
+	Results<std::set<std::string> > getDeviceNames();
+	/**
+	 * Value of a variable for every device of every host, by device;
+	 * devices which do not have it are left out.
+	 */
+	Results<std::map<std::string,std::vector<std::string> > > getDeviceVariableValue(const std::string& name);
+
+	/**
+	 * Run a query on every host at once and wait for the answers.
+	 * \param query Given the connection to each host, sends what is to be
+	 * asked and returns the future of the answer. It may chain further
+	 * queries through callbacks.
+	 */
+	template<typename T> Results<T> fanOut(const std::function<std::future<T>(AsyncTcpClient&)>& query)
+	{
+		Results<T> results;
+		std::map<std::string, std::future<T> > futures;
+
+		for(std::map<std::string, Host>::iterator it = _hosts.begin(); it != _hosts.end(); ++it)
+		{
+			Result<T>& res = results[it->first];
+			if(!prepare(it->second, res.error))
+				continue;
+			try
+			{
+				std::future<T> f = query(*it->second.client);
+				if(f.valid())
+					futures[it->first] = std::move(f);
+				else
+					res.error = "No future to wait for";
+			}
+			catch(std::exception& ex)
+			{
+				res.error = ex.what();
+			}
+			catch(...)
+			{
+				res.error = "Unknown error";
+			}
+		}
+
+		waitAll();
+
+		for(typename std::map<std::string, std::future<T> >::iterator it = futures.begin(); it != futures.end(); ++it)
+		{
+			Result<T>& res = results[it->first];
+			Host& host = _hosts.find(it->first)->second;
+			if(host.timedOut)
+			{
+				res.error = "Timeout";
+			}
+			else if(it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			{
+				// Not to block on a query which chained nothing more
+				res.error = "No answer";
+			}
+			else
+			{
+				try
+				{
+					res.value = it->second.get();
+					res.ok = true;
+				}
+				catch(std::exception& ex)
+				{
+					res.error = ex.what();
+				}
+				catch(...)
+				{
+					res.error = "Unknown error";
+				}
+			}
+			// Told again until it is time to reconnect
+			if(!res.ok && !host.client->isConnected())
+				host.error = res.error;
+		}
+
+		return results;
+	}
+
+protected:
+	struct Host
+	{
+		std::string host;
+		uint16_t port;
+		/** Negative for that of the pool. */
+		time_t timeout;
+		AsyncTcpClient* client;
+		/** Last attempt to connect, and why it failed. */
+		std::chrono::steady_clock::time_point tried;
+		std::string error;
+		/** Whether the last query was given up. */
+		bool timedOut;
+	};
+
+	/**
+	 * Get a host ready to be queried, reconnecting it if it is time to.
+	 * \return false with the error if it is not connected.
+	 */
+	bool prepare(Host& host, std::string& error);
+	/**
+	 * Run the connections until no query is pending, disconnecting
+	 * those which took longer than their timeout.
+	 */
+	void waitAll();
+
+private:
+	std::map<std::string, Host> _hosts;
+	time_t _timeout;
+	time_t _retry;
+};
+
+/**
+ * Client which keeps what another client answered, for a while.
+ * Give it to Device, Variable and Command objects, or to code which asks
+ * for the same variables again and again, not to ask the server each time.
+ * Values are kept for the TTL, and those of static variables (such as
+ * device.model, which do not change while the driver runs) along with
+ * descriptions and names of commands for the static TTL. That a device,
+ * variable or command does not exist is kept for the negative TTL.
+ *
+ * Setting a variable forgets its value, and a command or a forced
+ * shutdown all but the static values of the device. The number of logins
+ * and tracking results are never kept.
+ */
+class CachingClient : public Client
+{
+public:
+	/**
+	 * Construct a nut CachingClient object.
+	 * \param client Client to ask, which must outlive this one.
+	 * \param ttl Time in seconds values are kept, 0 not to keep them.
+	 */
+	CachingClient(Client* client, time_t ttl = 5);
+	~CachingClient() override;
+
+	CachingClient(const CachingClient&) = delete;
+	CachingClient& operator=(const CachingClient&) = delete;
+
+	Client* getClient()const;
+
+	void setTTL(time_t ttl);
+	time_t getTTL()const;
+	/**
+	 * Set the time in seconds that a device, variable or command does not
+	 * exist is kept, negative for the TTL (the default).
+	 */
+	void setNegativeTTL(time_t ttl);
+	time_t getNegativeTTL()const;
+	/**
+	 * Set the time in seconds static variables, descriptions and names of
+	 * commands are kept, 300 by default.
+	 */
+	void setStaticTTL(time_t ttl);
+	time_t getStaticTTL()const;
+	/**
+	 * Set the names of the variables kept for the static TTL.
+	 * By default those of the make, model, serial number and firmware of
+	 * the device, and of the name and version of its driver.
+	 */
+	void setStaticVariables(const std::set<std::string>& names);
+	std::set<std::string> getStaticVariables()const;
+
+	/** Forget everything. */
+	void invalidate();
+	/** Forget all about a device. */
+	void invalidate(const std::string& dev);
+
+	virtual void authenticate(const std::string& user, const std::string& passwd) override;
+	virtual void logout() override;
+
+	virtual bool hasDevice(const std::string& dev) override;
+	virtual std::set<std::string> getDeviceNames() override;
+	virtual std::string getDeviceDescription(const std::string& name) override;
+
+	virtual std::set<std::string> getDeviceVariableNames(const std::string& dev) override;
+	virtual std::set<std::string> getDeviceRWVariableNames(const std::string& dev) override;
+	virtual bool hasDeviceVariable(const std::string& dev, const std::string& name) override;
+	virtual std::string getDeviceVariableDescription(const std::string& dev, const std::string& name) override;
+	virtual std::vector<std::string> getDeviceVariableValue(const std::string& dev, const std::string& name) override;
+	virtual std::map<std::string,std::vector<std::string> > getDeviceVariableValues(const std::string& dev) override;
+	virtual std::map<std::string,std::map<std::string,std::vector<std::string> > > getDevicesVariableValues(const std::set<std::string>& devs) override;
+	virtual TrackingID setDeviceVariable(const std::string& dev, const std::string& name, const std::string& value) override;
+	virtual TrackingID setDeviceVariable(const std::string& dev, const std::string& name, const std::vector<std::string>& values) override;
+
+	virtual std::set<std::string> getDeviceCommandNames(const std::string& dev) override;
+	virtual bool hasDeviceCommand(const std::string& dev, const std::string& name) override;
+	virtual std::string getDeviceCommandDescription(const std::string& dev, const std::string& name) override;
+	virtual TrackingID executeDeviceCommand(const std::string& dev, const std::string& name, const std::string& param="") override;
+
+	virtual void deviceLogin(const std::string& dev) override;
+	virtual void deviceMaster(const std::string& dev) override;
+	virtual void devicePrimary(const std::string& dev) override;
+	virtual void deviceForcedShutdown(const std::string& dev) override;
+	virtual int deviceGetNumLogins(const std::string& dev) override;
+
+	virtual TrackingResult getTrackingResult(const TrackingID& id) override;
+
+	virtual bool isFeatureEnabled(const Feature& feature) override;
+	virtual void setFeature(const Feature& feature, bool status) override;
+
+protected:
+	/** An answer, or the error saying what was asked for does not exist. */
+	template<typename T> struct Cached
+	{
+		T value;
+		std::string error;
+		std::chrono::steady_clock::time_point expires;
+	};
+
+	typedef std::pair<std::string, std::string> Key;
+
+	/**
+	 * Get what entry keeps if it did not expire, else fetch it again.
+	 * Only errors saying something does not exist are kept.
+	 */
+	template<typename T> const T& lookup(Cached<T>& entry, time_t ttl, const std::function<T()>& fetch);
+	/** Values of all variables of a device, if all are kept. */
+	bool cachedValues(const std::string& dev, std::map<std::string,std::vector<std::string> >& values);
+	void storeValues(const std::string& dev, const std::map<std::string,std::vector<std::string> >& values);
+	/** Forget the values of a device which may change, and its variables. */
+	void invalidateValues(const std::string& dev);
+	time_t valueTTL(const std::string& name)const;
+
+private:
+	Client* _client;
+	time_t _ttl;
+	time_t _negativeTTL;
+	time_t _staticTTL;
+	std::set<std::string> _static;
+
+	Cached<std::set<std::string> > _devices;
+	std::map<std::string, Cached<std::string> > _deviceDescriptions;
+	std::map<std::string, Cached<std::set<std::string> > > _variableNames;
+	std::map<std::string, Cached<std::set<std::string> > > _rwVariableNames;
+	std::map<std::string, Cached<std::set<std::string> > > _commandNames;
+	std::map<Key, Cached<std::vector<std::string> > > _values;
+	std::map<Key, Cached<std::string> > _variableDescriptions;
+	std::map<Key, Cached<std::string> > _commandDescriptions;
 };
 
 /**
@@ -552,6 +1143,11 @@ public:
 	 * \return Map of all variables values indexed by their names.
 	 */
 	std::map<std::string,std::vector<std::string> > getVariableValues();
+	/**
+	 * Walk the values of all variables of the device.
+	 * \see Client::forEachVariable()
+	 */
+	void forEachVariable(const VariableVisitor& fn);
 	/**
 	 * Retrieve all variables names supported by the device.
 	 * \return Set of available variable names.
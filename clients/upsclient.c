@@ -37,6 +37,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "common.h"
 #include "nut_stdint.h"
@@ -70,6 +71,12 @@
 
 #define SMALLBUF	512
 
+/* most pushed changes kept aside while reading answers */
+#define UPSCLI_PUSHBUF_MAX	65536
+
+/* most answers received and not collected yet, per connection */
+#define UPSCLI_READBUF_MAX	65536
+
 #ifdef SHUT_RDWR
 #define shutdown_how SHUT_RDWR
 #else
@@ -142,6 +149,24 @@ static int upscli_initialized = 0;
 
 #ifdef WITH_OPENSSL
 static SSL_CTX	*ssl_ctx;
+
+/* The last TLS session with each server, for the next connection to
+ * resume it instead of doing a full handshake. Sessions established
+ * without checking the server certificate are not offered when it is
+ * to be checked. */
+typedef struct ssl_session_s {
+	char	*host;
+	uint16_t	port;
+	int	verifycert;
+	SSL_SESSION	*session;
+
+	struct ssl_session_s	*next;
+}	ssl_session_t;
+
+static ssl_session_t	*ssl_sessions = NULL;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t	ssl_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 #elif defined(WITH_NSS) /* WITH_OPENSLL */
 static int verify_certificate = 1;
 static HOST_CERT_t *first_host_cert = NULL;
@@ -199,6 +224,133 @@ static int ssl_error(SSL *ssl, ssize_t ret)
 	return -1;
 }
 
+static void ssl_sessions_lock_take(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ssl_sessions_lock);
+#endif
+}
+
+static void ssl_sessions_lock_drop(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ssl_sessions_lock);
+#endif
+}
+
+/* must be called with ssl_sessions_lock held */
+static ssl_session_t *ssl_session_find(const char *host, uint16_t port, int verifycert)
+{
+	ssl_session_t	*sess;
+
+	for (sess = ssl_sessions; sess; sess = sess->next) {
+		if ((sess->port == port) && (sess->verifycert == verifycert)
+			&& (!strcmp(sess->host, host))) {
+			return sess;
+		}
+	}
+
+	return NULL;
+}
+
+/* OpenSSL hands over a new session: during SSL_connect() up to TLSv1.2,
+ * and from a ticket sent after the handshake with TLSv1.3 */
+static int ssl_session_new_cb(SSL *ssl, SSL_SESSION *session)
+{
+	UPSCONN_t	*ups = (UPSCONN_t *)SSL_get_app_data(ssl);
+	ssl_session_t	*sess;
+	int	verifycert = (SSL_get_verify_mode(ssl) != SSL_VERIFY_NONE);
+
+	if ((!ups) || (!ups->host)) {
+		return 0;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (!SSL_SESSION_is_resumable(session)) {
+		return 0;
+	}
+#endif
+
+	ssl_sessions_lock_take();
+
+	sess = ssl_session_find(ups->host, ups->port, verifycert);
+
+	if (!sess) {
+		sess = xcalloc(1, sizeof(*sess));
+		sess->host = xstrdup(ups->host);
+		sess->port = ups->port;
+		sess->verifycert = verifycert;
+		sess->next = ssl_sessions;
+		ssl_sessions = sess;
+	}
+
+	if (sess->session) {
+		SSL_SESSION_free(sess->session);
+	}
+
+	/* we keep the reference we were given */
+	sess->session = session;
+
+	ssl_sessions_lock_drop();
+
+	return 1;
+}
+
+/* offer the last session with this server, if any */
+static void ssl_session_resume(UPSCONN_t *ups, int verifycert)
+{
+	ssl_session_t	*sess;
+
+	ssl_sessions_lock_take();
+
+	sess = ssl_session_find(ups->host, ups->port, verifycert);
+
+	if ((sess) && (sess->session) && (SSL_set_session(ups->ssl, sess->session) != 1)) {
+		ssl_debug();
+	}
+
+	ssl_sessions_lock_drop();
+}
+
+/* do not offer the session again after a failed handshake */
+static void ssl_session_forget(UPSCONN_t *ups, int verifycert)
+{
+	ssl_session_t	*sess;
+
+	ssl_sessions_lock_take();
+
+	sess = ssl_session_find(ups->host, ups->port, verifycert);
+
+	if ((sess) && (sess->session)) {
+		SSL_SESSION_free(sess->session);
+		sess->session = NULL;
+	}
+
+	ssl_sessions_lock_drop();
+}
+
+static void ssl_sessions_free(void)
+{
+	ssl_session_t	*sess, *next;
+
+	ssl_sessions_lock_take();
+
+	for (sess = ssl_sessions; sess; sess = next) {
+		next = sess->next;
+
+		if (sess->session) {
+			SSL_SESSION_free(sess->session);
+		}
+
+		free(sess->host);
+		free(sess);
+	}
+
+	ssl_sessions = NULL;
+
+	ssl_sessions_lock_drop();
+}
+
 #elif defined(WITH_NSS) /* WITH_OPENSSL */
 
 static char *nss_password_callback(PK11SlotInfo *slot, PRBool retry,
@@ -302,7 +454,16 @@ static SECStatus GetClientAuthData(UPSCONN_t *arg, PRFileDesc *fd,
 
 static void HandshakeCallback(PRFileDesc *fd, UPSCONN_t *client_data)
 {
+#if defined(NSS_VMAJOR) && (NSS_VMAJOR > 3 || (NSS_VMAJOR == 3 && defined(NSS_VMINOR) && NSS_VMINOR >= 34))
+	SSLChannelInfo	info;
+
+	/* "resumed" was added to SSLChannelInfo in NSS 3.34 */
+	if ((SSL_GetChannelInfo(fd, &info, sizeof(info)) == SECSuccess) && (info.resumed)) {
+		upsdebugx(3, "SSL session resumed with server %s", client_data->host);
+	}
+#else
 	NUT_UNUSED_VARIABLE(fd);
+#endif
 
 	upslogx(LOG_INFO, "SSL handshake done successfully with server %s",
 		client_data->host);
@@ -383,6 +544,11 @@ int upscli_init(int certverify, const char *certpath,
 
 		SSL_CTX_set_verify(ssl_ctx, ssl_mode, NULL);
 	}
+
+	/* keep sessions ourselves, by server, see ssl_session_new_cb() */
+	SSL_CTX_set_session_cache_mode(ssl_ctx,
+		SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, ssl_session_new_cb);
 #elif defined(WITH_NSS) /* WITH_OPENSSL */
 	PR_Init(PR_USER_THREAD, PR_PRIORITY_NORMAL, 0);
 
@@ -428,6 +594,14 @@ int upscli_init(int certverify, const char *certpath,
 		nss_error("upscli_init / SSL_OptionSetDefault(SSL_V2_COMPATIBLE_HELLO)");
 		return -1;
 	}
+	/* NSS caches client sessions by itself, let it resume them from
+	 * tickets too */
+	status = SSL_OptionSetDefault(SSL_ENABLE_SESSION_TICKETS, PR_TRUE);
+	if (status != SECSuccess) {
+		upslogx(LOG_ERR, "Can not enable SSL session tickets");
+		nss_error("upscli_init / SSL_OptionSetDefault(SSL_ENABLE_SESSION_TICKETS)");
+		return -1;
+	}
 	if (certname) {
 		nsscertname = xstrdup(certname);
 	}
@@ -485,6 +659,8 @@ static HOST_CERT_t* upscli_find_host_cert(const char* hostname)
 int upscli_cleanup(void)
 {
 #ifdef WITH_OPENSSL
+	ssl_sessions_free();
+
 	if (ssl_ctx) {
 		SSL_CTX_free(ssl_ctx);
 		ssl_ctx = NULL;
@@ -833,19 +1009,26 @@ static int upscli_sslinit(UPSCONN_t *ups, int verifycert)
 		SSL_set_verify(ups->ssl, SSL_VERIFY_NONE, NULL);
 	}
 
+	/* for ssl_session_new_cb() */
+	SSL_set_app_data(ups->ssl, ups);
+	ssl_session_resume(ups, (verifycert != 0));
+
 	res = SSL_connect(ups->ssl);
 	switch(res)
 	{
 	case 1:
-		upsdebugx(3, "SSL connected (%s)", SSL_get_version(ups->ssl));
+		upsdebugx(3, "SSL connected (%s, %s)", SSL_get_version(ups->ssl),
+			SSL_session_reused(ups->ssl) ? "session resumed" : "full handshake");
 		break;
 	case 0:
 		upslog_with_errno(1, "SSL_connect do not accept handshake.");
 		ssl_error(ups->ssl, res);
+		ssl_session_forget(ups, (verifycert != 0));
 		return -1;
 	default:
 		upslog_with_errno(1, "Unknown return value from SSL_connect %d", res);
 		ssl_error(ups->ssl, res);
+		ssl_session_forget(ups, (verifycert != 0));
 		return -1;
 	}
 
@@ -1479,7 +1662,18 @@ ssize_t upscli_sendline(UPSCONN_t *ups, const char *buf, size_t buflen)
 	return upscli_sendline_timeout(ups, buf, buflen, 0);
 }
 
-ssize_t upscli_readline_timeout(UPSCONN_t *ups, char *buf, size_t buflen, const time_t timeout)
+/* the buffer lines are read into, which the non-blocking queries grow */
+static void read_alloc(UPSCONN_t *ups)
+{
+	if (!ups->readbuf) {
+		ups->readsize = UPSCLI_NETBUF_LEN;
+		ups->readbuf = xmalloc(ups->readsize);
+		ups->readlen = 0;
+		ups->readidx = 0;
+	}
+}
+
+static ssize_t readline_raw(UPSCONN_t *ups, char *buf, size_t buflen, const time_t timeout)
 {
 	ssize_t	ret;
 	size_t	recv;
@@ -1503,11 +1697,15 @@ ssize_t upscli_readline_timeout(UPSCONN_t *ups, char *buf, size_t buflen, const
 		return -1;
 	}
 
-	for (recv = 0; recv < (buflen-1); recv++) {
+	read_alloc(ups);
+
+	for (recv = 0; recv < (buflen-1); ) {
+		char	*start, *eol;
+		size_t	len;
 
 		if (ups->readidx == ups->readlen) {
 
-			ret = net_read(ups, ups->readbuf, sizeof(ups->readbuf), timeout);
+			ret = net_read(ups, ups->readbuf, ups->readsize, timeout);
 
 			if (ret < 1) {
 				upscli_disconnect(ups);
@@ -1521,9 +1719,26 @@ ssize_t upscli_readline_timeout(UPSCONN_t *ups, char *buf, size_t buflen, const
 			ups->readidx = 0;
 		}
 
-		buf[recv] = ups->readbuf[ups->readidx++];
+		/* up to the end of the line, or as much as fits */
+		start = ups->readbuf + ups->readidx;
+		len = ups->readlen - ups->readidx;
+
+		if (len > buflen - 1 - recv) {
+			len = buflen - 1 - recv;
+		}
+
+		eol = memchr(start, '\n', len);
+
+		if (eol) {
+			len = (size_t)(eol - start);
+		}
+
+		memcpy(buf + recv, start, len);
+		recv += len;
+		ups->readidx += len;
 
-		if (buf[recv] == '\n') {
+		if (eol) {
+			ups->readidx++;
 			break;
 		}
 	}
@@ -1532,11 +1747,562 @@ ssize_t upscli_readline_timeout(UPSCONN_t *ups, char *buf, size_t buflen, const
 	return 0;
 }
 
+/* keep a pushed change for upscli_readpush() */
+static void push_queue(UPSCONN_t *ups, const char *line)
+{
+	size_t	len = strlen(line);
+
+	/* the application does not read them, don't grow forever */
+	if (ups->pushlen + len + 1 > UPSCLI_PUSHBUF_MAX) {
+		return;
+	}
+
+	if (ups->pushlen + len + 1 > ups->pushsize) {
+		ups->pushsize = ups->pushlen + len + 1 + UPSCLI_NETBUF_LEN;
+		ups->pushbuf = xrealloc(ups->pushbuf, ups->pushsize);
+	}
+
+	memcpy(ups->pushbuf + ups->pushlen, line, len);
+	ups->pushbuf[ups->pushlen + len] = '\n';
+	ups->pushlen += len + 1;
+}
+
+ssize_t upscli_readline_timeout(UPSCONN_t *ups, char *buf, size_t buflen, const time_t timeout)
+{
+	ssize_t	ret;
+
+	while ((ret = readline_raw(ups, buf, buflen, timeout)) == 0) {
+
+		/* set aside changes pushed in between answers */
+		if ((ups->watching) && (!strncmp(buf, "PUSH ", 5))) {
+			push_queue(ups, buf);
+			continue;
+		}
+
+		break;
+	}
+
+	return ret;
+}
+
 ssize_t upscli_readline(UPSCONN_t *ups, char *buf, size_t buflen)
 {
 	return upscli_readline_timeout(ups, buf, buflen, DEFAULT_NETWORK_TIMEOUT);
 }
 
+/* a query submitted without waiting for its answer */
+struct upscli_query_s {
+	int	list;		/* LIST rather than GET */
+	int	begun;		/* BEGIN LIST was received */
+	size_t	numq;
+	char	*args;		/* the numq words of the query, one after the other */
+};
+
+/* the other functions wait for the connection as they always did */
+static void set_nonblock(UPSCONN_t *ups, int nonblock)
+{
+	int	fd_flags;
+
+	if (ups->nonblock == nonblock) {
+		return;
+	}
+
+	fd_flags = fcntl(ups->fd, F_GETFL);
+
+	if (fd_flags < 0) {
+		return;
+	}
+
+	if (nonblock) {
+		fd_flags |= O_NONBLOCK;
+	} else {
+		fd_flags &= ~O_NONBLOCK;
+	}
+
+	if (fcntl(ups->fd, F_SETFL, fd_flags) == 0) {
+		ups->nonblock = nonblock;
+	}
+}
+
+static int submit_query(UPSCONN_t *ups, const char *cmdname, int list, size_t numq, const char **query)
+{
+	char	cmd[UPSCLI_NETBUF_LEN], *arg;
+	struct upscli_query_s	*q;
+	size_t	i, len, argslen = 0;
+
+	if (!ups) {
+		return -1;
+	}
+
+	if (ups->upsclient_magic != UPSCLIENT_MAGIC) {
+		ups->upserror = UPSCLI_ERR_INVALIDARG;
+		return -1;
+	}
+
+	if (ups->fd < 0) {
+		ups->upserror = UPSCLI_ERR_DRVNOTCONN;
+		return -1;
+	}
+
+	if ((numq < 1) || (!query)) {
+		ups->upserror = UPSCLI_ERR_INVALIDARG;
+		return -1;
+	}
+
+	/* plain connections are then only written as far as they take it,
+	 * SSL ones have their records written whole */
+	if (!upscli_ssl(ups)) {
+		set_nonblock(ups, 1);
+	}
+
+	build_cmd(cmd, sizeof(cmd), cmdname, numq, query);
+	len = strlen(cmd);
+
+	if (ups->sendlen + len > ups->sendsize) {
+		ups->sendsize = ups->sendlen + len + UPSCLI_NETBUF_LEN;
+		ups->sendbuf = xrealloc(ups->sendbuf, ups->sendsize);
+	}
+
+	memcpy(ups->sendbuf + ups->sendlen, cmd, len);
+	ups->sendlen += len;
+
+	if (ups->numqueries == ups->sizequeries) {
+		/* reuse the room of those answered, else grow */
+		if (ups->queryidx > 0) {
+			memmove(ups->queries, ups->queries + ups->queryidx,
+				(ups->numqueries - ups->queryidx) * sizeof(*ups->queries));
+			ups->numqueries -= ups->queryidx;
+			ups->queryidx = 0;
+		} else {
+			ups->sizequeries = ups->sizequeries ? ups->sizequeries * 2 : 8;
+			ups->queries = xrealloc(ups->queries, ups->sizequeries * sizeof(*ups->queries));
+		}
+	}
+
+	for (i = 0; i < numq; i++) {
+		argslen += strlen(query[i]) + 1;
+	}
+
+	q = &ups->queries[ups->numqueries++];
+	q->list = list;
+	q->begun = 0;
+	q->numq = numq;
+	q->args = arg = xmalloc(argslen);
+
+	for (i = 0; i < numq; i++) {
+		len = strlen(query[i]) + 1;
+		memcpy(arg, query[i], len);
+		arg += len;
+	}
+
+	return 0;
+}
+
+int upscli_submit_get(UPSCONN_t *ups, size_t numq, const char **query)
+{
+	return submit_query(ups, "GET", 0, numq, query);
+}
+
+int upscli_submit_list(UPSCONN_t *ups, size_t numq, const char **query)
+{
+	return submit_query(ups, "LIST", 1, numq, query);
+}
+
+size_t upscli_pending(UPSCONN_t *ups)
+{
+	if ((!ups) || (ups->upsclient_magic != UPSCLIENT_MAGIC)) {
+		return 0;
+	}
+
+	return ups->numqueries - ups->queryidx;
+}
+
+/* the oldest query is answered */
+static void query_done(UPSCONN_t *ups)
+{
+	free(ups->queries[ups->queryidx].args);
+
+	if (++ups->queryidx == ups->numqueries) {
+		ups->queryidx = 0;
+		ups->numqueries = 0;
+		set_nonblock(ups, 0);
+	}
+}
+
+/* as verify_resp(), for the words kept by submit_query() */
+static int query_match(const struct upscli_query_s *q, size_t numa, char **a)
+{
+	const char	*arg = q->args;
+	size_t	i;
+
+	if (numa < q->numq) {
+		return 0;
+	}
+
+	for (i = 0; i < q->numq; i++) {
+		if (strcasecmp(arg, a[i]) != 0) {
+			return 0;
+		}
+
+		arg += strlen(arg) + 1;
+	}
+
+	return 1;
+}
+
+/* whether a whole line was received and not collected yet */
+static int line_ready(const UPSCONN_t *ups)
+{
+	return (ups->readidx < ups->readlen)
+		&& (memchr(ups->readbuf + ups->readidx, '\n', ups->readlen - ups->readidx) != NULL);
+}
+
+/* send what was submitted, as much as the connection takes */
+static int async_write(UPSCONN_t *ups)
+{
+	ssize_t	ret;
+
+	if (ups->sendlen == 0) {
+		return 0;
+	}
+
+	if (upscli_ssl(ups)) {
+		/* SSL records are written whole */
+		ret = net_write(ups, ups->sendbuf, ups->sendlen, 0);
+	} else {
+		ret = write(ups->fd, ups->sendbuf, ups->sendlen);
+
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+				return 0;
+			}
+
+			ups->upserror = UPSCLI_ERR_WRITE;
+			ups->syserrno = errno;
+		}
+	}
+
+	if (ret < 1) {
+		return -1;
+	}
+
+	ups->sendlen -= (size_t)ret;
+	memmove(ups->sendbuf, ups->sendbuf + ret, ups->sendlen);
+
+	return 0;
+}
+
+/* read what arrived after what was not collected yet */
+static int async_read(UPSCONN_t *ups)
+{
+	ssize_t	ret;
+
+	read_alloc(ups);
+
+	if (ups->readidx > 0) {
+		ups->readlen -= ups->readidx;
+		memmove(ups->readbuf, ups->readbuf + ups->readidx, ups->readlen);
+		ups->readidx = 0;
+	}
+
+	if (ups->readlen == ups->readsize) {
+		if (ups->readsize >= UPSCLI_READBUF_MAX) {
+			/* collect some first */
+			if (line_ready(ups)) {
+				return 0;
+			}
+
+			/* a line that long is no answer */
+			ups->upserror = UPSCLI_ERR_PROTOCOL;
+			return -1;
+		}
+
+		ups->readsize *= 2;
+		ups->readbuf = xrealloc(ups->readbuf, ups->readsize);
+	}
+
+	if (upscli_ssl(ups)) {
+		ret = net_read(ups, ups->readbuf + ups->readlen, ups->readsize - ups->readlen, 0);
+	} else {
+		ret = read(ups->fd, ups->readbuf + ups->readlen, ups->readsize - ups->readlen);
+
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+				return 0;
+			}
+
+			ups->upserror = UPSCLI_ERR_READ;
+			ups->syserrno = errno;
+		}
+
+		if (ret == 0) {
+			ups->upserror = UPSCLI_ERR_SRVDISC;
+		}
+	}
+
+	if (ret < 1) {
+		return -1;
+	}
+
+	ups->readlen += (size_t)ret;
+
+	return 0;
+}
+
+/* one poll() of the connections, which sends and reads what it can */
+static int poll_once(UPSCONN_t **ups, size_t numups, struct pollfd *fds, int timeout, size_t *polled)
+{
+	size_t	i;
+	int	ret, ready = 0;
+
+	*polled = 0;
+
+	for (i = 0; i < numups; i++) {
+		UPSCONN_t	*u = ups[i];
+
+		/* ignored by poll() */
+		fds[i].fd = -1;
+		fds[i].events = 0;
+
+		if ((!u) || (u->upsclient_magic != UPSCLIENT_MAGIC) || (u->fd < 0)) {
+			continue;
+		}
+
+		if ((u->sendlen == 0) && (upscli_pending(u) == 0)) {
+			continue;
+		}
+
+		fds[i].fd = u->fd;
+		fds[i].revents = 0;
+		(*polled)++;
+
+		if (u->sendlen > 0) {
+			fds[i].events |= POLLOUT;
+		}
+
+		/* no more until collected */
+		if ((u->readbuf) && (u->readlen - u->readidx >= UPSCLI_READBUF_MAX)) {
+			ready++;
+			continue;
+		}
+
+		fds[i].events |= POLLIN;
+
+		if ((u->readbuf) && (line_ready(u))) {
+			ready++;
+		}
+
+#ifdef WITH_OPENSSL
+		/* already decrypted, poll() can't tell */
+		if ((u->ssl) && (SSL_pending(u->ssl) > 0)) {
+			ready++;
+		}
+#elif defined(WITH_NSS) /* WITH_OPENSSL */
+		if ((u->ssl) && (SSL_DataPending(u->ssl) > 0)) {
+			ready++;
+		}
+#endif	/* WITH_OPENSSL | WITH_NSS */
+	}
+
+	/* nothing to wait for */
+	if (*polled == 0) {
+		return 0;
+	}
+
+	/* don't wait if something is there already */
+	ret = poll(fds, (nfds_t)numups, ready ? 0 : timeout);
+
+	if ((ret < 0) && (errno != EINTR)) {
+		return -1;
+	}
+
+	ready = 0;
+
+	for (i = 0; i < numups; i++) {
+		UPSCONN_t	*u = ups[i];
+		int	failed = 0;
+
+		if (fds[i].fd < 0) {
+			continue;
+		}
+
+		if ((ret > 0) && (fds[i].revents & POLLOUT)) {
+			failed = (async_write(u) != 0);
+		}
+
+		/* errors and hang ups show up as reads */
+		if ((!failed) && (ret > 0) && (fds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+			failed = (async_read(u) != 0);
+		}
+
+#ifdef WITH_OPENSSL
+		if ((!failed) && (u->ssl) && (SSL_pending(u->ssl) > 0)) {
+			failed = (async_read(u) != 0);
+		}
+#elif defined(WITH_NSS) /* WITH_OPENSSL */
+		if ((!failed) && (u->ssl) && (SSL_DataPending(u->ssl) > 0)) {
+			failed = (async_read(u) != 0);
+		}
+#endif	/* WITH_OPENSSL | WITH_NSS */
+
+		/* what came before is collected first, the failure shows
+		 * again with the next poll */
+		if ((failed) && (!line_ready(u))) {
+			/* keep why, for upscli_collect() to tell */
+			int	upserror = u->upserror, syserrno = u->syserrno;
+
+			upscli_disconnect(u);
+			u->upserror = upserror;
+			u->syserrno = syserrno;
+			ready++;
+			continue;
+		}
+
+		if ((u->readbuf) && (line_ready(u))) {
+			ready++;
+		}
+	}
+
+	return ready;
+}
+
+int upscli_poll(UPSCONN_t **ups, size_t numups, int timeout)
+{
+	struct pollfd	*fds;
+	struct timeval	start, now;
+	size_t	polled;
+	int	ret, left = timeout;
+
+	if ((!ups) && (numups > 0)) {
+		return -1;
+	}
+
+	fds = xcalloc(numups ? numups : 1, sizeof(*fds));
+	nut_monotime(&start);
+
+	/* sending, or a part of a line, is no answer yet */
+	while ((ret = poll_once(ups, numups, fds, left, &polled)) == 0) {
+		if (polled == 0) {
+			break;
+		}
+
+		if (timeout < 0) {
+			continue;
+		}
+
+		nut_monotime(&now);
+		left = timeout - (int)(nut_monotime_diff(&now, &start) * 1000);
+
+		if (left <= 0) {
+			break;
+		}
+	}
+
+	free(fds);
+	return ret;
+}
+
+int upscli_collect(UPSCONN_t *ups, size_t *numa, char ***answer)
+{
+	struct upscli_query_s	*q;
+	char	*line, *eol;
+
+	if (!ups) {
+		return -1;
+	}
+
+	if ((ups->upsclient_magic != UPSCLIENT_MAGIC) || (!numa) || (!answer)) {
+		ups->upserror = UPSCLI_ERR_INVALIDARG;
+		return -1;
+	}
+
+	/* disconnected by upscli_poll(), which set why */
+	if (ups->fd < 0) {
+		return -1;
+	}
+
+	while (ups->queryidx < ups->numqueries) {
+
+		if ((!ups->readbuf) || (!line_ready(ups))) {
+			return UPSCLI_ANSWER_NONE;
+		}
+
+		/* the line is parsed where it is */
+		line = ups->readbuf + ups->readidx;
+		eol = memchr(line, '\n', ups->readlen - ups->readidx);
+		*eol = '\0';
+		ups->readidx = (size_t)(eol - ups->readbuf) + 1;
+
+		/* set aside changes pushed in between answers */
+		if ((ups->watching) && (!strncmp(line, "PUSH ", 5))) {
+			push_queue(ups, line);
+			continue;
+		}
+
+		q = &ups->queries[ups->queryidx];
+
+		if (upscli_errcheck(ups, line) != 0) {
+			query_done(ups);
+			return -1;
+		}
+
+		if (!pconf_line(&ups->pc_ctx, line)) {
+			ups->upserror = UPSCLI_ERR_PARSE;
+			query_done(ups);
+			return -1;
+		}
+
+		*numa = ups->pc_ctx.numargs;
+		*answer = ups->pc_ctx.arglist;
+
+		/* q: [GET] VAR <ups> <var>   *
+		 * a: VAR <ups> <var> <val> */
+		if (!q->list) {
+			if (!query_match(q, ups->pc_ctx.numargs, ups->pc_ctx.arglist)) {
+				ups->upserror = UPSCLI_ERR_PROTOCOL;
+				query_done(ups);
+				return -1;
+			}
+
+			query_done(ups);
+			return UPSCLI_ANSWER_GET;
+		}
+
+		/* q: [LIST] VAR <ups>       *
+		 * a: [BEGIN LIST] VAR <ups> */
+		if (!q->begun) {
+			if ((ups->pc_ctx.numargs < 2)
+			 || (strcasecmp(ups->pc_ctx.arglist[0], "BEGIN") != 0)
+			 || (strcasecmp(ups->pc_ctx.arglist[1], "LIST") != 0)
+			 || (!query_match(q, ups->pc_ctx.numargs - 2, &ups->pc_ctx.arglist[2]))) {
+				ups->upserror = UPSCLI_ERR_PROTOCOL;
+				query_done(ups);
+				return -1;
+			}
+
+			q->begun = 1;
+			continue;
+		}
+
+		if ((ups->pc_ctx.numargs >= 2)
+		 && (!strcmp(ups->pc_ctx.arglist[0], "END"))
+		 && (!strcmp(ups->pc_ctx.arglist[1], "LIST"))) {
+			query_done(ups);
+			return UPSCLI_ANSWER_END;
+		}
+
+		/* a: VAR <ups> <var> <val>, the list goes on */
+		if (!query_match(q, ups->pc_ctx.numargs, ups->pc_ctx.arglist)) {
+			ups->upserror = UPSCLI_ERR_PROTOCOL;
+			return -1;
+		}
+
+		return UPSCLI_ANSWER_ROW;
+	}
+
+	return UPSCLI_ANSWER_NONE;
+}
+
 /* split upsname[@hostname[:port]] into separate components */
 int upscli_splitname(const char *buf, char **upsname, char **hostname, uint16_t *port)
 {
@@ -1646,6 +2412,35 @@ int upscli_disconnect(UPSCONN_t *ups)
 	free(ups->host);
 	ups->host = NULL;
 
+	free(ups->pushbuf);
+	ups->pushbuf = NULL;
+	ups->pushlen = 0;
+	ups->pushsize = 0;
+	ups->watching = 0;
+
+	free(ups->readbuf);
+	ups->readbuf = NULL;
+	ups->readsize = 0;
+	ups->readlen = 0;
+	ups->readidx = 0;
+
+	/* what was submitted is answered no more */
+	free(ups->sendbuf);
+	ups->sendbuf = NULL;
+	ups->sendlen = 0;
+	ups->sendsize = 0;
+
+	while (ups->queryidx < ups->numqueries) {
+		free(ups->queries[ups->queryidx++].args);
+	}
+
+	free(ups->queries);
+	ups->queries = NULL;
+	ups->queryidx = 0;
+	ups->numqueries = 0;
+	ups->sizequeries = 0;
+	ups->nonblock = 0;
+
 	if (ups->fd < 0) {
 		return 0;
 	}
@@ -1700,6 +2495,165 @@ int upscli_upserror(UPSCONN_t *ups)
 	return ups->upserror;
 }
 
+int upscli_watch(UPSCONN_t *ups, const char *upsname, size_t numglob, const char **glob)
+{
+	char	cmd[UPSCLI_NETBUF_LEN], tmp[UPSCLI_NETBUF_LEN];
+	const char	**arg;
+	size_t	i;
+	int	watching;
+
+	if (!ups) {
+		return -1;
+	}
+
+	if (!upsname) {
+		ups->upserror = UPSCLI_ERR_INVALIDARG;
+		return -1;
+	}
+
+	arg = xcalloc(numglob + 1, sizeof(*arg));
+	arg[0] = upsname;
+
+	for (i = 0; i < numglob; i++) {
+		arg[i + 1] = glob[i];
+	}
+
+	build_cmd(cmd, sizeof(cmd), "WATCH", numglob + 1, arg);
+	free(arg);
+
+	/* changes may follow right after the answer */
+	watching = ups->watching;
+	ups->watching = 1;
+
+	if (upscli_sendline(ups, cmd, strlen(cmd)) != 0) {
+		return -1;
+	}
+
+	if (upscli_readline(ups, tmp, sizeof(tmp)) != 0) {
+		return -1;
+	}
+
+	/* older servers don't know WATCH, and push nothing */
+	if (upscli_errcheck(ups, tmp) != 0) {
+		ups->watching = watching;
+		return -1;
+	}
+
+	if (strncmp(tmp, "OK", 2) != 0) {
+		ups->watching = watching;
+		ups->upserror = UPSCLI_ERR_PROTOCOL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int upscli_push_pending(UPSCONN_t *ups)
+{
+	if ((!ups) || (ups->upsclient_magic != UPSCLIENT_MAGIC)) {
+		return 0;
+	}
+
+	if ((ups->pushlen > 0) || (ups->readidx < ups->readlen)) {
+		return 1;
+	}
+
+#ifdef WITH_OPENSSL
+	if ((ups->ssl) && (SSL_pending(ups->ssl) > 0)) {
+		return 1;
+	}
+#elif defined(WITH_NSS) /* WITH_OPENSSL */
+	if ((ups->ssl) && (SSL_DataPending(ups->ssl) > 0)) {
+		return 1;
+	}
+#endif	/* WITH_OPENSSL | WITH_NSS */
+
+	return 0;
+}
+
+int upscli_readpush(UPSCONN_t *ups, size_t *numa, char ***answer, const time_t timeout)
+{
+	char	tmp[UPSCLI_NETBUF_LEN];
+
+	if (!ups) {
+		return -1;
+	}
+
+	if (ups->upsclient_magic != UPSCLIENT_MAGIC) {
+		ups->upserror = UPSCLI_ERR_INVALIDARG;
+		return -1;
+	}
+
+	if (ups->pushlen > 0) {
+		char	*eol = memchr(ups->pushbuf, '\n', ups->pushlen);
+		size_t	len = (size_t)(eol - ups->pushbuf);
+
+		if (len >= sizeof(tmp)) {
+			len = sizeof(tmp) - 1;
+		}
+
+		memcpy(tmp, ups->pushbuf, len);
+		tmp[len] = '\0';
+
+		ups->pushlen -= (size_t)(eol - ups->pushbuf) + 1;
+		memmove(ups->pushbuf, eol + 1, ups->pushlen);
+
+	} else {
+		if (ups->fd < 0) {
+			ups->upserror = UPSCLI_ERR_DRVNOTCONN;
+			return -1;
+		}
+
+		if (!upscli_push_pending(ups)) {
+			fd_set	fds;
+			struct timeval	tv;
+			int	ret;
+
+			FD_ZERO(&fds);
+			FD_SET(ups->fd, &fds);
+
+			tv.tv_sec = timeout;
+			tv.tv_usec = 0;
+
+			ret = select(ups->fd + 1, &fds, NULL, NULL, &tv);
+
+			if ((ret == 0) || ((ret < 0) && (errno == EINTR))) {
+				return 0;
+			}
+
+			if (ret < 0) {
+				ups->upserror = UPSCLI_ERR_READ;
+				ups->syserrno = errno;
+				return -1;
+			}
+		}
+
+		if (readline_raw(ups, tmp, sizeof(tmp), DEFAULT_NETWORK_TIMEOUT) != 0) {
+			return -1;
+		}
+
+		if (strncmp(tmp, "PUSH ", 5) != 0) {
+			ups->upserror = UPSCLI_ERR_PROTOCOL;
+			return -1;
+		}
+	}
+
+	if (!pconf_line(&ups->pc_ctx, tmp)) {
+		ups->upserror = UPSCLI_ERR_PARSE;
+		return -1;
+	}
+
+	if (ups->pc_ctx.numargs < 4) {
+		ups->upserror = UPSCLI_ERR_PROTOCOL;
+		return -1;
+	}
+
+	*numa = ups->pc_ctx.numargs;
+	*answer = ups->pc_ctx.arglist;
+
+	return 1;
+}
+
 int upscli_ssl(UPSCONN_t *ups)
 {
 	if (!ups) {
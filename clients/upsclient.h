@@ -73,10 +73,28 @@ typedef struct {
 	void *ssl;
 #endif /* WITH_OPENSSL | WITH_NSS */
 
-	char	readbuf[64];
+	/* what was read and not handed out yet, readidx up to readlen */
+	char	*readbuf;
+	size_t	readsize;
 	size_t	readlen;
 	size_t	readidx;
 
+	/* PUSH lines (see upscli_watch) that arrived while reading answers */
+	int	watching;
+	char	*pushbuf;
+	size_t	pushlen;
+	size_t	pushsize;
+
+	/* queries submitted without waiting (see upscli_submit_get) */
+	char	*sendbuf;
+	size_t	sendlen;
+	size_t	sendsize;
+	struct upscli_query_s	*queries;
+	size_t	queryidx;	/* the first one not fully answered */
+	size_t	numqueries;
+	size_t	sizequeries;
+	int	nonblock;
+
 }	UPSCONN_t;
 
 const char *upscli_strerror(UPSCONN_t *ups);
@@ -112,6 +130,45 @@ int upscli_splitaddr(const char *buf, char **hostname, uint16_t *port);
 
 int upscli_disconnect(UPSCONN_t *ups);
 
+/* subscribe to changes of the variables of upsname matching any of the
+ * glob patterns (all variables if there are none), which the server then
+ * pushes as they happen, starting with their current values */
+int upscli_watch(UPSCONN_t *ups, const char *upsname, size_t numglob, const char **glob);
+
+/* returns 1 if a pushed change can be read without waiting */
+int upscli_push_pending(UPSCONN_t *ups);
+
+/* get the next pushed change (PUSH VAR <ups> <var> <value> or
+ * PUSH DEL <ups> <var>), waiting up to timeout seconds for one;
+ * returns 1 if one was read, 0 if none arrived, -1 on error */
+int upscli_readpush(UPSCONN_t *ups, size_t *numa, char ***answer, const time_t timeout);
+
+/* non-blocking queries, for many connections at once: queue them with
+ * upscli_submit_get() or upscli_submit_list(), have upscli_poll() send
+ * them and read the answers of all connections as they come, and take
+ * these with upscli_collect(), in the order of the queries */
+
+/* queue GET <query>; 0 if queued, -1 on error */
+int upscli_submit_get(UPSCONN_t *ups, size_t numq, const char **query);
+
+/* queue LIST <query>; 0 if queued, -1 on error */
+int upscli_submit_list(UPSCONN_t *ups, size_t numq, const char **query);
+
+/* number of queries submitted and not fully collected yet */
+size_t upscli_pending(UPSCONN_t *ups);
+
+/* send and receive for the connections with pending queries, waiting up
+ * to timeout milliseconds (forever if negative) for any of them to be
+ * ready; returns the number of connections with an answer to collect,
+ * 0 on timeout, -1 on error. Connections which failed are disconnected,
+ * and upscli_collect() then tells why. */
+int upscli_poll(UPSCONN_t **ups, size_t numups, int timeout);
+
+/* take the next answer which was received, in numa and answer as with
+ * upscli_get() and upscli_list_next(); returns one of UPSCLI_ANSWER_*,
+ * or -1 if the query failed (see upscli_upserror()) */
+int upscli_collect(UPSCONN_t *ups, size_t *numa, char ***answer);
+
 /* these functions return elements from UPSCONN_t to avoid direct references */
 
 int upscli_fd(UPSCONN_t *ups);
@@ -174,6 +231,13 @@ int upscli_ssl(UPSCONN_t *ups);
 #define UPSCLI_LIST_RW		2	/* just read/write variables */
 #define UPSCLI_LIST_CMDS	3	/* instant commands */
 
+/* what upscli_collect got */
+
+#define UPSCLI_ANSWER_NONE	0	/* nothing yet */
+#define UPSCLI_ANSWER_GET	1	/* the answer to a GET */
+#define UPSCLI_ANSWER_ROW	2	/* a row of a LIST, more follow */
+#define UPSCLI_ANSWER_END	3	/* the end of a LIST */
+
 /* flags for use with upscli_connect */
 
 #define UPSCLI_CONN_TRYSSL		0x0001	/* try SSL, OK if not supported   */
@@ -1587,6 +1587,9 @@ static void update_crittimer(utype_t *ups)
 }
 
 /* handle connecting to upsd, plus get SSL going too if possible */
+/* what upsd should push to us as it changes */
+static const char	*watchvar = "ups.status";
+
 static int try_connect(utype_t *ups)
 {
 	int	flags = 0, ret;
@@ -1644,8 +1647,15 @@ static int try_connect(utype_t *ups)
 
 	ret = do_upsd_auth(ups);
 
-	if (ret == 1)
+	if (ret == 1) {
+		/* have status changes pushed to us between polls */
+		if (upscli_watch(&ups->conn, ups->upsname, 1, &watchvar) < 0) {
+			upsdebugx(1, "UPS [%s]: can't watch status changes (%s), polling only",
+				ups->sys, upscli_strerror(&ups->conn));
+		}
+
 		return 1;		/* everything is happy */
+	}
 
 	/* something failed in the auth so we may not be completely logged in */
 
@@ -1708,6 +1718,126 @@ static void parse_status(utype_t *ups, char *status)
 	}
 }
 
+/* handle a status change pushed by upsd, returns -1 if the link is gone */
+static int readpush(utype_t *ups)
+{
+	char	status[SMALLBUF];
+	size_t	numa;
+	char	**answer;
+	int	ret;
+
+	ret = upscli_readpush(&ups->conn, &numa, &answer, 0);
+
+	if (ret < 0) {
+		upslogx(LOG_ERR, "UPS [%s]: reading status changes failed - %s",
+			ups->sys, upscli_strerror(&ups->conn));
+
+		/* the next poll will reconnect */
+		if (upscli_fd(&ups->conn) == -1)
+			drop_connection(ups);
+
+		return -1;
+	}
+
+	if ((ret == 0) || (numa < 5) || (strcasecmp(answer[1], "VAR") != 0)
+		|| (strcmp(answer[2], ups->upsname) != 0)
+		|| (strcasecmp(answer[3], "ups.status") != 0))
+		return 0;
+
+	upsdebugx(2, "%s: %s", __func__, ups->sys);
+
+	snprintf(status, sizeof(status), "%s", answer[4]);
+	parse_status(ups, status);
+
+	return 1;
+}
+
+/* sleep until the next poll, handling status changes as they come */
+static void wait_for_changes(unsigned int interval)
+{
+	time_t	start, now;
+	int	changed = 0;
+
+	time(&start);
+
+	for (;;) {
+		utype_t	*ups;
+		fd_set	rfds;
+		struct timeval	tv;
+		int	maxfd = -1, ret;
+
+		/* deal with changes that came along with our poll answers */
+		for (ups = firstups; ups != NULL; ups = ups->next) {
+			while (flag_isset(ups->status, ST_CONNECTED)
+				&& upscli_push_pending(&ups->conn)) {
+				ret = readpush(ups);
+
+				if (ret < 0)
+					break;
+
+				changed |= ret;
+			}
+		}
+
+		if (changed) {
+			recalc();
+			changed = 0;
+		}
+
+		time(&now);
+
+		if ((exit_flag) || (userfsd) || (reload_flag)
+			|| (difftime(now, start) >= interval))
+			return;
+
+		FD_ZERO(&rfds);
+
+		for (ups = firstups; ups != NULL; ups = ups->next) {
+			int	fd;
+
+			if ((!flag_isset(ups->status, ST_CONNECTED)) || (!ups->conn.watching))
+				continue;
+
+			fd = upscli_fd(&ups->conn);
+
+			if (fd < 0)
+				continue;
+
+			FD_SET(fd, &rfds);
+
+			if (fd > maxfd)
+				maxfd = fd;
+		}
+
+		/* nothing to watch, plain polling */
+		if (maxfd < 0) {
+			sleep(interval - (unsigned int)difftime(now, start));
+			return;
+		}
+
+		tv.tv_sec = interval - (time_t)difftime(now, start);
+		tv.tv_usec = 0;
+
+		ret = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+
+		/* timeout, or a signal to look at */
+		if (ret <= 0)
+			return;
+
+		for (ups = firstups; ups != NULL; ups = ups->next) {
+			int	fd = upscli_fd(&ups->conn);
+
+			if ((fd < 0) || (!FD_ISSET(fd, &rfds)))
+				continue;
+
+			ret = readpush(ups);
+
+			if (ret > 0)
+				changed = 1;
+		}
+	}
+}
+
 /* see what the status of the UPS is and handle any changes */
 static void pollups(utype_t *ups)
 {
@@ -2309,7 +2439,7 @@ int main(int argc, char *argv[])
 		/* reap children that have exited */
 		waitpid(-1, NULL, WNOHANG);
 
-		sleep(sleepval);
+		wait_for_changes(sleepval);
 	}
 
 	upslogx(LOG_INFO, "Signal %d: exiting", exit_flag);
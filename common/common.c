@@ -975,6 +975,56 @@ ssize_t select_write(const int fd, const void *buf, const size_t buflen, const t
 	return write(fd, buf, buflen);
 }
 
+/* Read a clock which only ever goes forward, whatever NTP or the admin
+   do to the time of day, for measuring how long things take or how old
+   they are; its values mean nothing across processes or reboots. Falls
+   back to gettimeofday() where there is no such clock. */
+void nut_monotime(struct timeval *tv)
+{
+#if (defined HAVE_CLOCK_GETTIME) && (defined CLOCK_MONOTONIC)
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = (suseconds_t)(ts.tv_nsec / 1000);
+		return;
+	}
+#endif
+
+	gettimeofday(tv, NULL);
+}
+
+/* Seconds from start to end, both from nut_monotime() */
+double nut_monotime_diff(const struct timeval *end, const struct timeval *start)
+{
+	return (double)(end->tv_sec - start->tv_sec)
+		+ (double)(end->tv_usec - start->tv_usec) / 1e6;
+}
+
+/* FNV-1a hash of a name, ignoring the case of ASCII letters if nocase;
+   tables use its low bits, hence their power of two buckets */
+size_t nut_strhash(const char *str, int nocase)
+{
+	size_t	hash = 2166136261U;
+
+	for (; *str; str++) {
+		hash ^= nocase ? (unsigned char)tolower((unsigned char)*str) : (unsigned char)*str;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Buckets for a hash table of count entries, a power of two from min
+   (itself one) up, with room for as many more to keep the chains short */
+size_t nut_hashbuckets(size_t count, size_t min)
+{
+	size_t	buckets;
+
+	for (buckets = min; buckets < count * 2; buckets *= 2);
+
+	return buckets;
+}
 
 /* FIXME: would be good to get more from /etc/ld.so.conf[.d] and/or
  * LD_LIBRARY_PATH and a smarter dependency on build bitness; also
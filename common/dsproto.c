@@ -0,0 +1,88 @@
+/* dsproto.c - compact records for the driver/server socket protocol
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Once negotiated with PROTVER, a driver sends variable values as
+ * length prefixed records instead of quoted and escaped text lines.
+ * Each variable gets a small integer id, announced once per connection
+ * with its name, so that upsd can keep a pointer to the tree node per
+ * id and store new values without parsing them one byte at a time nor
+ * looking the name up again. Everything else is still sent as text,
+ * wrapped in records, see docs/sock-protocol.txt.
+ */
+
+#include "config.h"	/* must be the first header */
+
+#include "common.h"
+#include "dsproto.h"
+
+size_t dsp_encode(char *buf, size_t bufsize, int type, unsigned int id,
+	const char *data, size_t len)
+{
+	if ((id > DSP_MAX_ID) || (len > DSP_MAX_PAYLOAD) || (bufsize < DSP_HDR_LEN + len)) {
+		return 0;
+	}
+
+	buf[0] = (char)type;
+	buf[1] = (char)((id >> 8) & 0xff);
+	buf[2] = (char)(id & 0xff);
+	dsp_setlen(buf, len);
+
+	if (len > 0) {
+		memcpy(buf + DSP_HDR_LEN, data, len);
+	}
+
+	return DSP_HDR_LEN + len;
+}
+
+void dsp_setlen(char *rec, size_t len)
+{
+	rec[3] = (char)((len >> 8) & 0xff);
+	rec[4] = (char)(len & 0xff);
+}
+
+ssize_t dsp_decode(const char *buf, size_t buflen, dsp_rec_t *rec)
+{
+	const unsigned char	*hdr = (const unsigned char *)buf;
+
+	if (buflen < DSP_HDR_LEN) {
+		return 0;
+	}
+
+	switch (hdr[0])
+	{
+	case DSP_REC_NAME:
+	case DSP_REC_SET:
+	case DSP_REC_TEXT:
+		break;
+
+	default:
+		return -1;
+	}
+
+	rec->type = hdr[0];
+	rec->id = ((unsigned int)hdr[1] << 8) | hdr[2];
+	rec->len = ((size_t)hdr[3] << 8) | hdr[4];
+
+	if (buflen < DSP_HDR_LEN + rec->len) {
+		return 0;
+	}
+
+	rec->data = buf + DSP_HDR_LEN;
+
+	return (ssize_t)(DSP_HDR_LEN + rec->len);
+}
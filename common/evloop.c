@@ -0,0 +1,480 @@
+/* evloop.c - event notification backends for upsd and drivers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Descriptors are registered once (when a driver, client or listening
+ * socket appears) and unregistered once (before it is closed), rather
+ * than rebuilding a pollfd array on every pass of the main loop.
+ *
+ * Ready descriptors are first collected into a private list and only
+ * then dispatched, since a handler may well close other descriptors
+ * (e.g. kick_login_clients) or accept new ones which then reuse a
+ * just closed fd number. Each registration gets a generation number
+ * so that such stale events are dropped instead of being delivered
+ * to the wrong (or a freed) object.
+ *
+ * All of this lives in an evloop_t, so that several threads can each
+ * run their own loop. The evloop_*() calls without a loop argument
+ * work on a default one, which is all a driver (or a single-threaded
+ * upsd) ever needs.
+ */
+
+#include "config.h"	/* must be the first header */
+
+#include "common.h"
+#include "nut_stdint.h"
+#include "evloop.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+typedef struct {
+	handler_type_t	type;
+	void		*data;
+	int		events;
+	int		used;
+	uint32_t	gen;	/* bumped on every (un)registration */
+	size_t		pidx;	/* index in pfds[] (poll backend) */
+} evslot_t;
+
+typedef struct {
+	int		fd;
+	uint32_t	gen;
+	int		revents;
+} evready_t;
+
+struct evloop_s {
+	evloop_backend_t	backend;
+
+		/* indexed by file descriptor */
+	evslot_t	*slots;
+	size_t		numslots;
+	size_t		numused;
+
+		/* descriptors found ready in the last evloop_wait() */
+	evready_t	*ready;
+	size_t		readyalloc;
+
+		/* poll() backend: dense array of registered descriptors */
+	struct pollfd	*pfds;
+	size_t		pfdsalloc;
+
+#ifdef HAVE_SYS_EPOLL_H
+		/* epoll() backend */
+	int		epfd;
+	struct epoll_event	*epevents;
+	size_t		epeventsalloc;
+#endif	/* HAVE_SYS_EPOLL_H */
+};
+
+	/* the loop behind evloop_init() and friends */
+static evloop_t	*evdefault = NULL;
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t ev_to_epoll(int events)
+{
+	uint32_t	ret = 0;
+
+	if (events & POLLIN)
+		ret |= EPOLLIN;
+	if (events & POLLOUT)
+		ret |= EPOLLOUT;
+
+	return ret;
+}
+
+static int epoll_to_ev(uint32_t events)
+{
+	int	ret = 0;
+
+	if (events & EPOLLIN)
+		ret |= POLLIN;
+	if (events & EPOLLOUT)
+		ret |= POLLOUT;
+	if (events & EPOLLHUP)
+		ret |= POLLHUP;
+	if (events & EPOLLERR)
+		ret |= POLLERR;
+
+	return ret;
+}
+
+static int epoll_ctl_fd(evloop_t *loop, int op, int fd, int events, uint32_t gen)
+{
+	struct epoll_event	ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ev_to_epoll(events);
+	ev.data.u64 = ((uint64_t)gen << 32) | (uint32_t)fd;
+
+	return epoll_ctl(loop->epfd, op, fd, &ev);
+}
+#endif	/* HAVE_SYS_EPOLL_H */
+
+static void slots_grow(evloop_t *loop, size_t fd)
+{
+	size_t	newsize;
+
+	if (fd < loop->numslots)
+		return;
+
+	newsize = loop->numslots ? loop->numslots : 64;
+
+	while (newsize <= fd)
+		newsize *= 2;
+
+	loop->slots = xrealloc(loop->slots, newsize * sizeof(*loop->slots));
+	memset(&loop->slots[loop->numslots], 0, (newsize - loop->numslots) * sizeof(*loop->slots));
+	loop->numslots = newsize;
+}
+
+static void ready_grow(evloop_t *loop, size_t wanted)
+{
+	if (wanted < 1)
+		wanted = 1;
+
+	if (loop->readyalloc >= wanted)
+		return;
+
+	loop->readyalloc = wanted;
+	loop->ready = xrealloc(loop->ready, loop->readyalloc * sizeof(*loop->ready));
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_EPOLL) {
+		loop->epeventsalloc = loop->readyalloc;
+		loop->epevents = xrealloc(loop->epevents, loop->epeventsalloc * sizeof(*loop->epevents));
+	}
+#endif
+}
+
+const char *evloop_backend_name(evloop_backend_t backend)
+{
+	switch (backend)
+	{
+	case EVLOOP_AUTO:
+		return "auto";
+	case EVLOOP_POLL:
+		return "poll";
+	case EVLOOP_EPOLL:
+		return "epoll";
+	}
+
+	return "unknown";
+}
+
+int evloop_backend_parse(const char *name, evloop_backend_t *backend)
+{
+	if (!strcasecmp(name, "auto")) {
+		*backend = EVLOOP_AUTO;
+		return 0;
+	}
+
+	if (!strcasecmp(name, "poll")) {
+		*backend = EVLOOP_POLL;
+		return 0;
+	}
+
+	if (!strcasecmp(name, "epoll")) {
+		*backend = EVLOOP_EPOLL;
+		return 0;
+	}
+
+	return -1;
+}
+
+evloop_t *evloop_new(evloop_backend_t backend)
+{
+	evloop_t	*loop = xcalloc(1, sizeof(*loop));
+
+	loop->backend = EVLOOP_POLL;
+
+#ifdef HAVE_SYS_EPOLL_H
+	loop->epfd = -1;
+
+	if ((backend == EVLOOP_AUTO) || (backend == EVLOOP_EPOLL)) {
+		loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (loop->epfd < 0) {
+			upslog_with_errno(LOG_WARNING,
+				"%s: epoll not available, falling back to poll", __func__);
+		} else {
+			loop->backend = EVLOOP_EPOLL;
+		}
+	}
+#else
+	if (backend == EVLOOP_EPOLL) {
+		upslogx(LOG_WARNING,
+			"%s: epoll support not compiled in, falling back to poll", __func__);
+	}
+#endif	/* HAVE_SYS_EPOLL_H */
+
+	upsdebugx(1, "%s: using %s backend", __func__, evloop_backend_name(loop->backend));
+
+	return loop;
+}
+
+void evloop_delete(evloop_t *loop)
+{
+	if (!loop)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->epfd != -1) {
+		close(loop->epfd);
+	}
+
+	free(loop->epevents);
+#endif	/* HAVE_SYS_EPOLL_H */
+
+	free(loop->slots);
+	free(loop->ready);
+	free(loop->pfds);
+	free(loop);
+}
+
+evloop_backend_t evloop_loop_backend(const evloop_t *loop)
+{
+	return loop->backend;
+}
+
+int evloop_loop_add(evloop_t *loop, int fd, int events, handler_type_t type, void *data)
+{
+	evslot_t	*slot;
+
+	if ((!loop) || (fd < 0)) {
+		return -1;
+	}
+
+	slots_grow(loop, (size_t)fd);
+	slot = &loop->slots[fd];
+
+	if (slot->used) {
+		upsdebugx(1, "%s: FD %d is already registered", __func__, fd);
+		return -1;
+	}
+
+	slot->gen++;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_EPOLL) {
+		if (epoll_ctl_fd(loop, EPOLL_CTL_ADD, fd, events, slot->gen) < 0) {
+			upslog_with_errno(LOG_ERR, "%s: epoll_ctl(ADD, %d)", __func__, fd);
+			return -1;
+		}
+	} else
+#endif	/* HAVE_SYS_EPOLL_H */
+	{
+		if (loop->numused >= loop->pfdsalloc) {
+			loop->pfdsalloc = loop->pfdsalloc ? loop->pfdsalloc * 2 : 64;
+			loop->pfds = xrealloc(loop->pfds, loop->pfdsalloc * sizeof(*loop->pfds));
+		}
+
+		loop->pfds[loop->numused].fd = fd;
+		loop->pfds[loop->numused].events = (short)events;
+		loop->pfds[loop->numused].revents = 0;
+		slot->pidx = loop->numused;
+	}
+
+	slot->type = type;
+	slot->data = data;
+	slot->events = events;
+	slot->used = 1;
+	loop->numused++;
+
+	upsdebugx(5, "%s: FD %d (type %d), %zu registered", __func__, fd, type, loop->numused);
+
+	return 0;
+}
+
+int evloop_loop_mod(evloop_t *loop, int fd, int events)
+{
+	evslot_t	*slot;
+
+	if ((!loop) || (fd < 0) || ((size_t)fd >= loop->numslots) || (!loop->slots[fd].used)) {
+		return -1;
+	}
+
+	slot = &loop->slots[fd];
+
+	if (slot->events == events) {
+		return 0;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_EPOLL) {
+		if (epoll_ctl_fd(loop, EPOLL_CTL_MOD, fd, events, slot->gen) < 0) {
+			upslog_with_errno(LOG_ERR, "%s: epoll_ctl(MOD, %d)", __func__, fd);
+			return -1;
+		}
+	} else
+#endif	/* HAVE_SYS_EPOLL_H */
+	{
+		loop->pfds[slot->pidx].events = (short)events;
+	}
+
+	slot->events = events;
+
+	return 0;
+}
+
+void evloop_loop_del(evloop_t *loop, int fd)
+{
+	evslot_t	*slot;
+
+	if ((!loop) || (fd < 0) || ((size_t)fd >= loop->numslots) || (!loop->slots[fd].used)) {
+		return;
+	}
+
+	slot = &loop->slots[fd];
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_EPOLL) {
+		/* nothing to worry about if this fails, close() cleans up too */
+		epoll_ctl_fd(loop, EPOLL_CTL_DEL, fd, 0, 0);
+	} else
+#endif	/* HAVE_SYS_EPOLL_H */
+	{
+		/* move the last entry into the hole */
+		size_t	last = loop->numused - 1;
+
+		if (slot->pidx != last) {
+			loop->pfds[slot->pidx] = loop->pfds[last];
+			loop->slots[loop->pfds[last].fd].pidx = slot->pidx;
+		}
+	}
+
+	slot->used = 0;
+	slot->data = NULL;
+	slot->gen++;
+	loop->numused--;
+
+	upsdebugx(5, "%s: FD %d, %zu registered", __func__, fd, loop->numused);
+}
+
+size_t evloop_loop_count(const evloop_t *loop)
+{
+	return loop ? loop->numused : 0;
+}
+
+int evloop_loop_wait(evloop_t *loop, int timeout, evloop_handler_fn dispatch)
+{
+	size_t	i, numready = 0;
+	int	ret;
+
+	if (!loop) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ready_grow(loop, loop->numused);
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (loop->backend == EVLOOP_EPOLL) {
+		int	maxevents = (loop->epeventsalloc > INT_MAX) ? INT_MAX : (int)loop->epeventsalloc;
+
+		ret = epoll_wait(loop->epfd, loop->epevents, maxevents, timeout);
+
+		if (ret < 0) {
+			return -1;
+		}
+
+		for (i = 0; i < (size_t)ret; i++) {
+			loop->ready[numready].fd = (int)(loop->epevents[i].data.u64 & 0xFFFFFFFF);
+			loop->ready[numready].gen = (uint32_t)(loop->epevents[i].data.u64 >> 32);
+			loop->ready[numready].revents = epoll_to_ev(loop->epevents[i].events);
+			numready++;
+		}
+	} else
+#endif	/* HAVE_SYS_EPOLL_H */
+	{
+		ret = poll(loop->pfds, (nfds_t)loop->numused, timeout);
+
+		if (ret < 0) {
+			return -1;
+		}
+
+		for (i = 0; (i < loop->numused) && (numready < (size_t)ret); i++) {
+			if (!loop->pfds[i].revents) {
+				continue;
+			}
+
+			loop->ready[numready].fd = loop->pfds[i].fd;
+			loop->ready[numready].gen = loop->slots[loop->pfds[i].fd].gen;
+			loop->ready[numready].revents = loop->pfds[i].revents;
+			numready++;
+		}
+	}
+
+	for (i = 0; i < numready; i++) {
+		evslot_t	*slot = &loop->slots[loop->ready[i].fd];
+
+		/* unregistered (or replaced) by an earlier handler */
+		if ((!slot->used) || (slot->gen != loop->ready[i].gen)) {
+			upsdebugx(5, "%s: dropping stale event for FD %d", __func__, loop->ready[i].fd);
+			continue;
+		}
+
+		dispatch(slot->type, slot->data, loop->ready[i].revents);
+	}
+
+	return (int)numready;
+}
+
+evloop_backend_t evloop_init(evloop_backend_t backend)
+{
+	evloop_delete(evdefault);
+	evdefault = evloop_new(backend);
+
+	return evdefault->backend;
+}
+
+void evloop_free(void)
+{
+	evloop_delete(evdefault);
+	evdefault = NULL;
+}
+
+evloop_t *evloop_default(void)
+{
+	return evdefault;
+}
+
+int evloop_add(int fd, int events, handler_type_t type, void *data)
+{
+	return evloop_loop_add(evdefault, fd, events, type, data);
+}
+
+int evloop_mod(int fd, int events)
+{
+	return evloop_loop_mod(evdefault, fd, events);
+}
+
+void evloop_del(int fd)
+{
+	evloop_loop_del(evdefault, fd);
+}
+
+size_t evloop_count(void)
+{
+	return evloop_loop_count(evdefault);
+}
+
+int evloop_wait(int timeout, evloop_handler_fn dispatch)
+{
+	return evloop_loop_wait(evdefault, timeout, dispatch);
+}
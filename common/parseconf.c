@@ -27,7 +27,8 @@
  * All subsequent calls must have it as the first argument.  There are
  * two entry points for parsing lines.  You can have it read a file
  * (pconf_file_begin and pconf_file_next), take lines directly from
- * the caller (pconf_line), or go along a character at a time (pconf_char).
+ * the caller (pconf_line), go along a character at a time (pconf_char),
+ * or hand it whatever a read() returned (pconf_line_buf).
  * The parsing is identical no matter how you feed it.
  *
  * Since there are no more callbacks, you take the successful return
@@ -74,6 +75,11 @@
  * Finally, there is argsize, which remembers how long each of the
  * arglist elements are.  This is how we know when to expand them.
  *
+ * pconf_line_buf skips the state machine for the plain characters in
+ * the middle of a word or comment: it looks for the next one which
+ * matters in that state and copies everything before it at once.  Only
+ * that character is then fed to the state machine.
+ *
  */
 
 #include "common.h"
@@ -147,7 +153,7 @@ static void add_arg_word(PCONF_CTX_t *ctx)
 		ctx->argsize[argpos] = 0;
 	}
 
-	wbuflen = strlen(ctx->wordbuf);
+	wbuflen = (size_t)(ctx->wordptr - ctx->wordbuf);
 
 	/* now see if the string itself grew compared to last time */
 	if (wbuflen >= ctx->argsize[argpos]) {
@@ -166,18 +172,37 @@ static void add_arg_word(PCONF_CTX_t *ctx)
 		ctx->argsize[argpos] = newlen;
 	}
 
-	/* strncpy doesn't give us a trailing NULL, so prep the space */
-	memset(ctx->arglist[argpos], '\0', ctx->argsize[argpos]);
-
 	/* finally copy the new value into the provided space */
-	strncpy(ctx->arglist[argpos], ctx->wordbuf, wbuflen);
+	memcpy(ctx->arglist[argpos], ctx->wordbuf, wbuflen + 1);
+}
+
+/* make room for len more characters (and the null) in wordbuf */
+static void wordbuf_grow(PCONF_CTX_t *ctx, size_t len)
+{
+	size_t	wbuflen = (size_t)(ctx->wordptr - ctx->wordbuf);
+
+	if (wbuflen + len < ctx->wordbufsize)
+		return;
+
+	ctx->wordbufsize *= 2;
+
+	if (ctx->wordbufsize <= wbuflen + len)
+		ctx->wordbufsize = wbuflen + len + 1;
+
+	ctx->wordbuf = realloc(ctx->wordbuf, ctx->wordbufsize);
+
+	if (!ctx->wordbuf)
+		pconf_fatal(ctx, "realloc wordbuf failed");
+
+	/* repoint as wordbuf may have moved */
+	ctx->wordptr = &ctx->wordbuf[wbuflen];
 }
 
 static void addchar(PCONF_CTX_t *ctx)
 {
 	size_t	wbuflen;
 
-	wbuflen = strlen(ctx->wordbuf);
+	wbuflen = (size_t)(ctx->wordptr - ctx->wordbuf);
 
 	/* CVE-2012-2944: only allow the subset of ASCII charset from Space to ~ */
 	if ((ctx->ch < 0x20) || (ctx->ch > 0x7f)) {
@@ -195,19 +220,31 @@ static void addchar(PCONF_CTX_t *ctx)
 	}
 
 	/* allow for the null */
-	if (wbuflen >= (ctx->wordbufsize - 1)) {
-		ctx->wordbufsize += 8;
+	wordbuf_grow(ctx, 1);
+
+	*ctx->wordptr++ = (char)ctx->ch;
+	*ctx->wordptr = '\0';
+}
+
+/* addchar for a run of characters which are all valid */
+static void addchars(PCONF_CTX_t *ctx, const char *buf, size_t len)
+{
+	size_t	wbuflen;
 
-		ctx->wordbuf = realloc(ctx->wordbuf, ctx->wordbufsize);
+	wbuflen = (size_t)(ctx->wordptr - ctx->wordbuf);
 
-		if (!ctx->wordbuf)
-			pconf_fatal(ctx, "realloc wordbuf failed");
+	if (ctx->wordlen_limit != 0) {
+		if (wbuflen >= ctx->wordlen_limit)
+			return;
 
-		/* repoint as wordbuf may have moved */
-		ctx->wordptr = &ctx->wordbuf[wbuflen];
+		if (len > ctx->wordlen_limit - wbuflen)
+			len = ctx->wordlen_limit - wbuflen;
 	}
 
-	*ctx->wordptr++ = (char)ctx->ch;
+	wordbuf_grow(ctx, len);
+
+	memcpy(ctx->wordptr, buf, len);
+	ctx->wordptr += len;
 	*ctx->wordptr = '\0';
 }
 
@@ -624,6 +661,86 @@ char *pconf_encode(const char *src, char *dest, size_t destsize)
 	return dest;
 }
 
+/* characters that collect() and quotecollect() respectively just add
+ * to the word: valid for addchar(), and no space, #, \, = nor " */
+#define PCONF_WORDCHAR(c)	(((c) > 0x20) && ((c) <= 0x7f) \
+	&& ((c) != '#') && ((c) != '\\') && ((c) != '='))
+#define PCONF_QUOTECHAR(c)	(((c) >= 0x20) && ((c) <= 0x7f) \
+	&& ((c) != '#') && ((c) != '\\') && ((c) != '"'))
+
+/* parse input a buffer at a time, stopping after the first complete line:
+ * returns 1 when the arguments of a line are ready, 0 when all of buf was
+ * used without finishing one, and -1 on a parse error, like pconf_char
+ * would for the last character used.  *used is set to how much of buf
+ * was used, so call it again with the rest until it returns 0 */
+int pconf_line_buf(PCONF_CTX_t *ctx, const char *buf, size_t buflen, size_t *used)
+{
+	const unsigned char	*ubuf = (const unsigned char *)buf;
+	const char	*eol;
+	size_t	i = 0, run;
+
+	*used = 0;
+
+	if (!check_magic(ctx))
+		return -1;
+
+	/* if the last call finished a line, clean stuff up for another */
+	if ((ctx->state == STATE_ENDOFLINE) || (ctx->state == STATE_PARSEERR)) {
+		ctx->numargs = 0;
+		ctx->state = STATE_FINDWORDSTART;
+	}
+
+	while (i < buflen) {
+		run = i;
+
+		switch (ctx->state)
+		{
+		case STATE_COLLECT:
+			while ((run < buflen) && PCONF_WORDCHAR(ubuf[run]))
+				run++;
+
+			addchars(ctx, buf + i, run - i);
+			break;
+
+		case STATE_QUOTECOLLECT:
+			while ((run < buflen) && PCONF_QUOTECHAR(ubuf[run]))
+				run++;
+
+			addchars(ctx, buf + i, run - i);
+			break;
+
+		case STATE_FINDEOL:
+			eol = memchr(buf + i, '\n', buflen - i);
+			run = eol ? (size_t)(eol - buf) : buflen;
+			break;
+		}
+
+		i = run;
+
+		if (i == buflen)
+			break;
+
+		ctx->ch = buf[i++];
+		parse_char(ctx);
+
+		if (ctx->state == STATE_ENDOFLINE) {
+			*used = i;
+			return 1;
+		}
+
+		if (ctx->state == STATE_PARSEERR) {
+			*used = i;
+			return -1;
+		}
+	}
+
+	if (buflen > 0)
+		ctx->ch = buf[buflen - 1];
+
+	*used = buflen;
+	return 0;
+}
+
 /* parse input a character at a time */
 int pconf_char(PCONF_CTX_t *ctx, char ch)
 {
@@ -22,6 +22,7 @@
 
 #include "config.h"	/* must be first */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <sys/stat.h>
@@ -33,6 +34,106 @@
 #include "state.h"
 #include "parseconf.h"
 
+typedef struct st_name_s {
+	struct st_name_s	*next;	/* in the same hash bucket */
+	size_t	hash;
+	size_t	refs;		/* number of tree nodes using it */
+	char	str[1];		/* allocated to fit */
+} st_name_t;
+
+	/* process-wide table of variable names */
+static st_name_t	**names = NULL;
+static size_t	numnames = 0;
+static size_t	namebuckets = 0;
+
+static st_name_t *st_name_find(const char *str, size_t hash)
+{
+	st_name_t	*name;
+
+	if (!names) {
+		return NULL;
+	}
+
+	for (name = names[hash & (namebuckets - 1)]; name; name = name->next) {
+		if ((name->hash == hash) && (!strcasecmp(name->str, str))) {
+			return name;
+		}
+	}
+
+	return NULL;
+}
+
+static void st_name_grow(void)
+{
+	st_name_t	**newnames;
+	size_t	newbuckets = nut_hashbuckets(numnames, 256);
+	size_t	i;
+
+	newnames = xcalloc(newbuckets, sizeof(*newnames));
+
+	for (i = 0; i < namebuckets; i++) {
+		while (names[i]) {
+			st_name_t	*name = names[i];
+
+			names[i] = name->next;
+			name->next = newnames[name->hash & (newbuckets - 1)];
+			newnames[name->hash & (newbuckets - 1)] = name;
+		}
+	}
+
+	free(names);
+	names = newnames;
+	namebuckets = newbuckets;
+}
+
+/* get a reference to the interned copy of a name, adding it if needed;
+ * the first spelling seen is the one kept for names differing in case */
+static st_name_t *st_name_get(const char *str)
+{
+	size_t	hash = nut_strhash(str, 1);
+	size_t	len;
+	st_name_t	*name = st_name_find(str, hash);
+
+	if (name) {
+		name->refs++;
+		return name;
+	}
+
+	if (numnames >= namebuckets) {
+		st_name_grow();
+	}
+
+	len = strlen(str);
+	name = xmalloc(sizeof(*name) + len);
+	memcpy(name->str, str, len + 1);
+	name->hash = hash;
+	name->refs = 1;
+	name->next = names[hash & (namebuckets - 1)];
+	names[hash & (namebuckets - 1)] = name;
+	numnames++;
+
+	return name;
+}
+
+static void st_name_put(st_name_t *name)
+{
+	st_name_t	**nptr;
+
+	if ((!name) || (--name->refs > 0)) {
+		return;
+	}
+
+	for (nptr = &names[name->hash & (namebuckets - 1)]; *nptr; nptr = &(*nptr)->next) {
+		if (*nptr == name) {
+			*nptr = name->next;
+			numnames--;
+			break;
+		}
+	}
+
+	free(name);
+}
+
 static void val_escape(st_tree_t *node)
 {
 	char	etmp[ST_MAX_VALUE_LEN];
@@ -82,7 +183,7 @@ static void st_tree_range_free(range_t *list)
 /* free all memory associated with a node */
 static void st_tree_node_free(st_tree_t *node)
 {
-	free(node->var);
+	st_name_put(node->name);
 	free(node->raw);
 	free(node->safe);
 
@@ -98,32 +199,90 @@ static void st_tree_node_free(st_tree_t *node)
 	free(node);
 }
 
-/* add a subtree to another subtree */
-static void st_tree_node_add(st_tree_t **nptr, st_tree_t *sptr)
+/* the tree is kept AVL balanced: drivers tend to add their variables
+ * in (nearly) sorted order, which would otherwise degenerate it into
+ * a linked list; in-order walks through left/right are unaffected */
+static int st_tree_height(const st_tree_t *node)
 {
-	if (!sptr) {
-		return;
-	}
+	return node ? node->height : 0;
+}
 
-	while (*nptr) {
+static void st_tree_update_height(st_tree_t *node)
+{
+	int	lh = st_tree_height(node->left);
+	int	rh = st_tree_height(node->right);
 
-		st_tree_t	*node = *nptr;
+	node->height = 1 + ((lh > rh) ? lh : rh);
+}
 
-		if (strcasecmp(node->var, sptr->var) > 0) {
-			nptr = &node->left;
-			continue;
+static st_tree_t *st_tree_rotate_left(st_tree_t *node)
+{
+	st_tree_t	*pivot = node->right;
+
+	node->right = pivot->left;
+	pivot->left = node;
+
+	st_tree_update_height(node);
+	st_tree_update_height(pivot);
+
+	return pivot;
+}
+
+static st_tree_t *st_tree_rotate_right(st_tree_t *node)
+{
+	st_tree_t	*pivot = node->left;
+
+	node->left = pivot->right;
+	pivot->right = node;
+
+	st_tree_update_height(node);
+	st_tree_update_height(pivot);
+
+	return pivot;
+}
+
+/* restore the balance of *nptr after one of its subtrees was changed */
+static void st_tree_rebalance(st_tree_t **nptr)
+{
+	st_tree_t	*node = *nptr;
+	int	balance = st_tree_height(node->left) - st_tree_height(node->right);
+
+	if (balance > 1) {
+		if (st_tree_height(node->left->left) < st_tree_height(node->left->right)) {
+			node->left = st_tree_rotate_left(node->left);
 		}
 
-		if (strcasecmp(node->var, sptr->var) < 0) {
-			nptr = &node->right;
-			continue;
+		*nptr = st_tree_rotate_right(node);
+		return;
+	}
+
+	if (balance < -1) {
+		if (st_tree_height(node->right->right) < st_tree_height(node->right->left)) {
+			node->right = st_tree_rotate_right(node->right);
 		}
 
-		upsdebugx(1, "%s: duplicate value (shouldn't happen)", __func__);
+		*nptr = st_tree_rotate_left(node);
 		return;
 	}
 
-	*nptr = sptr;
+	st_tree_update_height(node);
+}
+
+/* detach the leftmost node of a subtree and return it */
+static st_tree_t *st_tree_unlink_min(st_tree_t **nptr)
+{
+	st_tree_t	*node = *nptr;
+	st_tree_t	*min;
+
+	if (!node->left) {
+		*nptr = node->right;
+		return node;
+	}
+
+	min = st_tree_unlink_min(&node->left);
+	st_tree_rebalance(nptr);
+
+	return min;
 }
 
 /* remove a variable from a tree
@@ -132,90 +291,99 @@ static void st_tree_node_add(st_tree_t **nptr, st_tree_t *sptr)
  */
 int state_delinfo(st_tree_t **nptr, const char *var)
 {
-	while (*nptr) {
-
-		st_tree_t	*node = *nptr;
+	st_tree_t	*node = *nptr;
+	int	cmp, ret;
 
-		if (strcasecmp(node->var, var) > 0) {
-			nptr = &node->left;
-			continue;
-		}
+	if (!node) {
+		return 0;	/* not found */
+	}
 
-		if (strcasecmp(node->var, var) < 0) {
-			nptr = &node->right;
-			continue;
-		}
+	cmp = strcasecmp(node->var, var);
 
+	if (cmp > 0) {
+		ret = state_delinfo(&node->left, var);
+	} else if (cmp < 0) {
+		ret = state_delinfo(&node->right, var);
+	} else {
 		if (node->flags & ST_FLAG_IMMUTABLE) {
 			upsdebugx(6, "%s: not deleting immutable variable [%s]", __func__, var);
 			return 0;
 		}
 
-		/* whatever is on the left, hang it off current right */
-		st_tree_node_add(&node->right, node->left);
-
-		/* now point the parent at the old right child */
-		*nptr = node->right;
+		if ((!node->left) || (!node->right)) {
+			/* point the parent at the only child (if any) */
+			*nptr = node->left ? node->left : node->right;
+		} else {
+			/* put the in-order successor in place of the node */
+			st_tree_t	*next = st_tree_unlink_min(&node->right);
+
+			next->left = node->left;
+			next->right = node->right;
+			*nptr = next;
+			st_tree_rebalance(nptr);
+		}
 
 		st_tree_node_free(node);
 
 		return 1;
 	}
 
-	return 0;	/* not found */
+	if (ret) {
+		st_tree_rebalance(nptr);
+	}
+
+	return ret;
 }
 
 /* interface */
 
 int state_setinfo(st_tree_t **nptr, const char *var, const char *val)
 {
-	while (*nptr) {
-
-		st_tree_t	*node = *nptr;
-
-		if (strcasecmp(node->var, var) > 0) {
-			nptr = &node->left;
-			continue;
-		}
-
-		if (strcasecmp(node->var, var) < 0) {
-			nptr = &node->right;
-			continue;
-		}
-
-		/* updating an existing entry */
-		if (!strcasecmp(node->raw, val)) {
-			return 0;	/* no change */
-		}
+	return state_setinfo_seq(nptr, var, val, 0);
+}
 
-		/* changes should be ignored */
-		if (node->flags & ST_FLAG_IMMUTABLE) {
-			return 0;	/* no change */
-		}
+/* like state_setinfo(), and tag the node with a caller supplied change
+ * sequence number if it was added or its value changed */
+int state_setinfo_seq(st_tree_t **nptr, const char *var, const char *val, uint64_t seq)
+{
+	st_tree_t	*node = *nptr;
+	int	cmp, ret;
 
-		/* expand the buffer if the value grows */
-		if (node->rawsize < (strlen(val) + 1)) {
-			node->rawsize = strlen(val) + 1;
-			node->raw = xrealloc(node->raw, node->rawsize);
-		}
+	if (!node) {
+		node = xcalloc(1, sizeof(*node));
 
-		/* store the literal value for later comparisons */
-		snprintf(node->raw, node->rawsize, "%s", val);
+		node->name = st_name_get(var);
+		node->var = node->name->str;
+		node->raw = xstrdup(val);
+		node->rawsize = strlen(val) + 1;
+		node->height = 1;
+		node->seq = seq;
+		nut_monotime(&node->updated);
 
 		val_escape(node);
 
-		return 1;	/* changed */
+		*nptr = node;
+
+		return 1;	/* added */
 	}
 
-	*nptr = xcalloc(1, sizeof(**nptr));
+	cmp = strcasecmp(node->var, var);
 
-	(*nptr)->var = xstrdup(var);
-	(*nptr)->raw = xstrdup(val);
-	(*nptr)->rawsize = strlen(val) + 1;
+	if (cmp > 0) {
+		ret = state_setinfo_seq(&node->left, var, val, seq);
+	} else if (cmp < 0) {
+		ret = state_setinfo_seq(&node->right, var, val, seq);
+	} else {
+		/* updating an existing entry */
+		return state_setnode_seq(node, val, seq);
+	}
 
-	val_escape(*nptr);
+	/* something was added or changed below, a no-op in the latter case */
+	if (ret) {
+		st_tree_rebalance(nptr);
+	}
 
-	return 1;	/* added */
+	return ret;
 }
 
 static int st_tree_enum_add(enum_t **list, const char *enc)
@@ -242,6 +410,41 @@ static int st_tree_enum_add(enum_t **list, const char *enc)
 	return 1;	/* added */
 }
 
+/* change the value of a node found earlier, for callers which keep
+ * pointers to nodes (these stay valid until the node is deleted) */
+int state_setnode_seq(st_tree_t *node, const char *val, uint64_t seq)
+{
+	size_t	len;
+
+	/* changes should be ignored */
+	if (node->flags & ST_FLAG_IMMUTABLE) {
+		return 0;	/* no change */
+	}
+
+	/* the same value again is still news: it is current as of now */
+	nut_monotime(&node->updated);
+
+	if (!strcasecmp(node->raw, val)) {
+		return 0;	/* no change */
+	}
+
+	len = strlen(val) + 1;
+
+	/* expand the buffer if the value grows */
+	if (node->rawsize < len) {
+		node->rawsize = len;
+		node->raw = xrealloc(node->raw, node->rawsize);
+	}
+
+	/* store the literal value for later comparisons */
+	memcpy(node->raw, val, len);
+
+	val_escape(node);
+	node->seq = seq;
+
+	return 1;	/* changed */
+}
+
 int state_addenum(st_tree_t *root, const char *var, const char *val)
 {
 	st_tree_t	*sttmp;
@@ -602,14 +805,29 @@ int state_delrange(st_tree_t *root, const char *var, const int min, const int ma
 
 st_tree_t *state_tree_find(st_tree_t *node, const char *var)
 {
+	/* a name which is not interned is in no tree at all, and one
+	 * which is is the very same st_name_t in every tree using it */
+	const st_name_t	*name = st_name_find(var, nut_strhash(var, 1));
+
+	if (!name) {
+		return NULL;
+	}
+
 	while (node) {
+		int	cmp;
 
-		if (strcasecmp(node->var, var) > 0) {
+		if (node->name == name) {
+			break;	/* found */
+		}
+
+		cmp = strcasecmp(node->var, var);
+
+		if (cmp > 0) {
 			node = node->left;
 			continue;
 		}
 
-		if (strcasecmp(node->var, var) < 0) {
+		if (cmp < 0) {
 			node = node->right;
 			continue;
 		}
@@ -619,3 +837,29 @@ st_tree_t *state_tree_find(st_tree_t *node, const char *var)
 
 	return node;
 }
+
+/* count the names in a tree which are shared with other trees, and add
+ * to *saved the memory this saves compared to every tree having its own
+ * copy of each name: each node saves its copy, less its share of the
+ * interned name (header included) and of the hash buckets, which makes
+ * names used by this tree alone cost a little */
+size_t state_sharednames(const st_tree_t *node, ssize_t *saved)
+{
+	size_t	count = 0, len, interned;
+
+	for (; node; node = node->right) {
+		count += state_sharednames(node->left, saved);
+
+		len = strlen(node->var);
+		interned = sizeof(st_name_t) + len
+			+ (namebuckets * sizeof(*names)) / numnames;
+
+		*saved += (ssize_t)(len + 1) - (ssize_t)(interned / node->name->refs);
+
+		if (node->name->refs > 1) {
+			count++;
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,273 @@
+/* twheel.c - hierarchical timer wheel for upsd
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Level 0 has a slot for each of the next 64 seconds. A slot of level L
+ * covers 64^L seconds; its timers are moved down (cascaded) once the
+ * wheel reaches the start of that range, and end up in level 0 or on
+ * the due list by the second they expire. Setting, deleting and running
+ * a timer is O(1), and a pass of the loop only looks at the slots which
+ * hold timers: idle connections and quiet drivers cost nothing until
+ * their time comes.
+ *
+ * Timers which need to check on something (a client being idle, a
+ * driver having gone quiet) are best made lazy: rather than moving the
+ * timer each time the client or the driver is heard from, let it expire
+ * and set it again for whatever time is then left.
+ */
+
+#include "config.h"	/* must be the first header */
+
+#include "common.h"
+#include "twheel.h"
+
+#define TWHEEL_MASK	((uint64_t)TWHEEL_SLOTS - 1)
+#define TWHEEL_SPAN	((time_t)1 << (TWHEEL_BITS * TWHEEL_LEVELS))
+
+static void twheel_link(twheel_t *wheel, twtimer_t *timer)
+{
+	twtimer_t	**head;
+	time_t	diff;
+	int	level;
+	uint64_t	idx;
+
+	diff = timer->expires - wheel->now;
+
+	if (diff <= 0) {
+		head = &wheel->due;
+		timer->slot = -1;
+	} else {
+		if (diff >= TWHEEL_SPAN) {
+			diff = TWHEEL_SPAN - 1;
+			timer->expires = wheel->now + diff;
+		}
+
+		for (level = 0; level < TWHEEL_LEVELS - 1; level++) {
+			if (diff < ((time_t)1 << (TWHEEL_BITS * (level + 1)))) {
+				break;
+			}
+		}
+
+		idx = ((uint64_t)timer->expires >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+		head = &wheel->slots[level][idx];
+		wheel->used[level] |= (uint64_t)1 << idx;
+		timer->slot = level * TWHEEL_SLOTS + (int)idx;
+	}
+
+	timer->next = *head;
+	if (*head) {
+		(*head)->pprev = &timer->next;
+	}
+	*head = timer;
+	timer->pprev = head;
+
+	timer->wheel = wheel;
+	wheel->count++;
+}
+
+static void twheel_unlink(twtimer_t *timer)
+{
+	twheel_t	*wheel = timer->wheel;
+
+	*timer->pprev = timer->next;
+	if (timer->next) {
+		timer->next->pprev = timer->pprev;
+	}
+
+	if (timer->slot >= 0) {
+		int	level = timer->slot / TWHEEL_SLOTS;
+		int	idx = timer->slot % TWHEEL_SLOTS;
+
+		if (!wheel->slots[level][idx]) {
+			wheel->used[level] &= ~((uint64_t)1 << idx);
+		}
+	}
+
+	timer->wheel = NULL;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	wheel->count--;
+}
+
+/* move all timers of a slot to where they belong now */
+static void twheel_cascade(twheel_t *wheel, int level, uint64_t idx)
+{
+	twtimer_t	*timer;
+
+	while ((timer = wheel->slots[level][idx]) != NULL) {
+		twheel_unlink(timer);
+		twheel_link(wheel, timer);
+	}
+}
+
+/* the clock went back, or so far forward that the slots don't tell
+ * anything any more: file everything pending again */
+static void twheel_rebase(twheel_t *wheel, time_t now)
+{
+	twtimer_t	*timer, *list = NULL;
+	int	level, idx;
+
+	for (level = 0; level < TWHEEL_LEVELS; level++) {
+		for (idx = 0; idx < TWHEEL_SLOTS; idx++) {
+			while ((timer = wheel->slots[level][idx]) != NULL) {
+				twheel_unlink(timer);
+
+				/* keep the delays across a step back */
+				if (now < wheel->now) {
+					timer->expires -= wheel->now - now;
+				}
+
+				timer->next = list;
+				list = timer;
+			}
+		}
+	}
+
+	wheel->now = now;
+
+	while ((timer = list) != NULL) {
+		list = timer->next;
+		twheel_link(wheel, timer);
+	}
+}
+
+void twheel_init(twheel_t *wheel, time_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+}
+
+/* seconds until the next slot with timers comes, -1 if they are empty:
+ * level 0 holds the next 63 seconds, higher levels are looked at once
+ * the start of their slot comes */
+static time_t twheel_next(const twheel_t *wheel)
+{
+	time_t	best = -1;
+	int	level;
+
+	for (level = 0; level < TWHEEL_LEVELS; level++) {
+		int	shift = TWHEEL_BITS * level;
+		uint64_t	base = (uint64_t)wheel->now >> shift, j;
+
+		if (!wheel->used[level]) {
+			continue;
+		}
+
+		for (j = 1; j <= TWHEEL_SLOTS; j++) {
+			if (wheel->used[level] & ((uint64_t)1 << ((base + j) & TWHEEL_MASK))) {
+				time_t	delay = (time_t)((base + j) << shift) - wheel->now;
+
+				if ((best < 0) || (delay < best)) {
+					best = delay;
+				}
+				break;
+			}
+		}
+	}
+
+	return best;
+}
+
+void twheel_run(twheel_t *wheel, time_t now)
+{
+	twtimer_t	*timer, *expired;
+	int	level;
+
+	if ((now < wheel->now) || (now - wheel->now >= TWHEEL_SPAN)) {
+		twheel_rebase(wheel, now);
+	}
+
+	while (wheel->now < now) {
+		time_t	next = twheel_next(wheel);
+
+		/* skip the seconds with nothing to do */
+		if ((next < 0) || (next > now - wheel->now)) {
+			wheel->now = now;
+			break;
+		}
+
+		wheel->now += next;
+
+		for (level = 1; level < TWHEEL_LEVELS; level++) {
+			uint64_t	t = (uint64_t)wheel->now >> (TWHEEL_BITS * level);
+
+			/* not at the start of a slot of this level */
+			if (((uint64_t)wheel->now & (((uint64_t)1 << (TWHEEL_BITS * level)) - 1)) != 0) {
+				break;
+			}
+
+			twheel_cascade(wheel, level, t & TWHEEL_MASK);
+		}
+
+		twheel_cascade(wheel, 0, (uint64_t)wheel->now & TWHEEL_MASK);
+	}
+
+	/* the ones set again with no delay are for the next run */
+	expired = wheel->due;
+	wheel->due = NULL;
+
+	if (expired) {
+		expired->pprev = &expired;
+	}
+
+	while ((timer = expired) != NULL) {
+		twheel_unlink(timer);
+		timer->fn(timer);
+	}
+}
+
+time_t twheel_timeout(const twheel_t *wheel)
+{
+	if (wheel->due) {
+		return 0;
+	}
+
+	return twheel_next(wheel);
+}
+
+void twtimer_init(twtimer_t *timer, twtimer_fn fn, void *arg)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->fn = fn;
+	timer->arg = arg;
+}
+
+void twtimer_set(twheel_t *wheel, twtimer_t *timer, time_t delay)
+{
+	if (timer->wheel) {
+		twheel_unlink(timer);
+	}
+
+	if (delay >= TWHEEL_SPAN) {
+		delay = TWHEEL_SPAN - 1;
+	}
+
+	timer->expires = wheel->now + ((delay > 0) ? delay : 0);
+	twheel_link(wheel, timer);
+}
+
+void twtimer_del(twtimer_t *timer)
+{
+	if (timer->wheel) {
+		twheel_unlink(timer);
+	}
+}
+
+int twtimer_pending(const twtimer_t *timer)
+{
+	return (timer->wheel != NULL);
+}
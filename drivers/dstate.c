@@ -36,14 +36,32 @@
 #include "parseconf.h"
 #include "attribute.h"
 #include "nut_stdint.h"
+#include "evloop.h"
+#include "dsproto.h"
 
-	static int	sockfd = -1, stale = 1, alarm_active = 0, ignorelb = 0;
+	static int	sockfd = -1, stale = 1, alarm_active = 0, ignorelb = 0, extraready = 0;
 	static char	*sockfn = NULL;
 	static char	status_buf[ST_MAX_VALUE_LEN], alarm_buf[ST_MAX_VALUE_LEN];
 	static st_tree_t	*dtree_root = NULL;
 	static conn_t	*connhead = NULL;
 	static cmdlist_t *cmdhead = NULL;
 
+	/* updates held back until dstate_commit_batch(), as text and as
+	 * compact records (with the ids these use) */
+	static int	batch_depth = 0;
+	static char	*batch_buf = NULL, *batch_cbuf = NULL;
+	static size_t	batch_len = 0, batch_size = 0;
+	static size_t	batch_clen = 0, batch_csize = 0;
+	static size_t	batch_ctext = 0, batch_ctextlen = 0;	/* open text record */
+	static unsigned int	*batch_ids = NULL;
+	static size_t	batch_numids = 0, batch_idsize = 0;
+	static st_tree_t	*batch_root = NULL;	/* variables to SETINFO */
+
+	/* compact record ids (in aux) and names by id, never reused */
+	static st_tree_t	*ids_root = NULL;
+	static const char	**ids_name = NULL;
+	static unsigned int	ids_last = 0;
+
 	struct ups_handler	upsh;
 
 /* this may be a frequent stumbling point for new users, so be verbose here */
@@ -151,9 +169,12 @@ static int sock_open(const char *fn)
 
 static void sock_disconnect(conn_t *conn)
 {
+	evloop_del(conn->fd);
 	close(conn->fd);
 
 	pconf_finish(&conn->ctx);
+	free(conn->outbuf);
+	free(conn->known);
 
 	if (conn->prev) {
 		conn->prev->next = conn->next;
@@ -170,13 +191,352 @@ static void sock_disconnect(conn_t *conn)
 	free(conn);
 }
 
-static void send_to_all(const char *fmt, ...)
+/* send as much of the queued data as the socket takes without blocking
+ * (unless in synchronous mode), returns 0 if the connection was dropped */
+static int sock_flush(conn_t *conn)
 {
 	ssize_t	ret;
+	size_t	sent = 0;
+
+	while (sent < conn->outlen) {
+		ret = write(conn->fd, conn->outbuf + sent, conn->outlen - sent);
+
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+		}
+
+		if (ret < 1) {
+			upsdebugx(0, "WARNING: %s: write %zu bytes to "
+				"socket %d failed (ret=%zd), disconnecting: %s",
+				__func__, conn->outlen - sent, conn->fd, ret, strerror(errno));
+			sock_disconnect(conn);
+			return 0;
+		}
+
+		upsdebugx(6, "%s: write %zd bytes to socket %d succeeded",
+			__func__, ret, conn->fd);
+
+		sent += (size_t)ret;
+	}
+
+	if (sent > 0) {
+		conn->outlen -= sent;
+		memmove(conn->outbuf, conn->outbuf + sent, conn->outlen);
+	}
+
+	/* get told when the rest can go out */
+	evloop_mod(conn->fd, conn->outlen ? (POLLIN | POLLOUT) : POLLIN);
+
+	return 1;
+}
+
+/* add a formatted message to the output of a connection, and send it
+ * if enough piled up, returns 0 if the connection was dropped */
+static int sock_queue(conn_t *conn, const char *buf, size_t buflen)
+{
+	if (conn->outlen + buflen > DS_OUTBUF_MAX) {
+		upsdebugx(0, "WARNING: %s: socket %d is not read "
+			"(%zu bytes pending), disconnecting",
+			__func__, conn->fd, conn->outlen);
+		upsdebugx(6, "failed write: %.*s", (int)strcspn(buf, "\n"), buf);
+		sock_disconnect(conn);
+
+		/* TOTHINK: Maybe fallback elsewhere in other cases? */
+		if (do_synchronous == -1) {
+			upsdebugx(0, "%s: synchronous mode was 'auto', "
+				"will try 'on' for next connections",
+				__func__);
+			do_synchronous = 1;
+		}
+
+		return 0;
+	}
+
+	if (conn->outlen + buflen > conn->outsize) {
+		conn->outsize = conn->outlen + buflen + ST_SOCK_BUF_LEN;
+		conn->outbuf = xrealloc(conn->outbuf, conn->outsize);
+	}
+
+	memcpy(conn->outbuf + conn->outlen, buf, buflen);
+	conn->outlen += buflen;
+
+	/* a burst of updates goes out in few writes, the rest is sent
+	 * when the driver gets back to dstate_poll_fds() */
+	if ((do_synchronous == 1) || (conn->outlen >= DS_FLUSH_LEN)) {
+		return sock_flush(conn);
+	}
+
+	return 1;
+}
+
+/* which kinds of connections there are */
+#define CONN_TEXT	1
+#define CONN_COMPACT	2
+
+static int conn_kinds(void)
+{
+	conn_t	*conn;
+	int	kinds = 0;
+
+	for (conn = connhead; conn; conn = conn->next) {
+		kinds |= conn->compact ? CONN_COMPACT : CONN_TEXT;
+	}
+
+	return kinds;
+}
+
+/* the compact record id of a variable, or 0 if we ran out of them */
+static unsigned int var_id(const char *var)
+{
+	st_tree_t	*node = state_tree_find(ids_root, var);
+
+	if (node) {
+		return (unsigned int)node->aux;
+	}
+
+	if (ids_last >= DSP_MAX_ID) {
+		return 0;
+	}
+
+	state_setinfo(&ids_root, var, "");
+	node = state_tree_find(ids_root, var);
+	node->aux = ++ids_last;
+
+	ids_name = xrealloc(ids_name, (ids_last + 1) * sizeof(*ids_name));
+	ids_name[ids_last] = node->var;
+
+	return ids_last;
+}
+
+/* returns 0 if the connection was dropped */
+static int sock_queue_rec(conn_t *conn, int type, unsigned int id, const char *data, size_t len)
+{
+	char	buf[DSP_HDR_LEN + ST_SOCK_BUF_LEN];
+	size_t	buflen = dsp_encode(buf, sizeof(buf), type, id, data, len);
+
+	if (!buflen) {
+		upslogx(LOG_ERR, "%s: record for id %u too large (%zu bytes)", __func__, id, len);
+		return 1;
+	}
+
+	return sock_queue(conn, buf, buflen);
+}
+
+/* tell a compact connection which variable an id stands for, unless
+ * it already knows, returns 0 if the connection was dropped */
+static int sock_announce(conn_t *conn, unsigned int id)
+{
+	size_t	byte = id / 8;
+
+	if ((byte < conn->knownsize) && (conn->known[byte] & (1 << (id % 8)))) {
+		return 1;
+	}
+
+	if (byte >= conn->knownsize) {
+		size_t	size = byte + 64;
+
+		conn->known = xrealloc(conn->known, size);
+		memset(conn->known + conn->knownsize, 0, size - conn->knownsize);
+		conn->knownsize = size;
+	}
+
+	conn->known[byte] |= (unsigned char)(1 << (id % 8));
+
+	return sock_queue_rec(conn, DSP_REC_NAME, id, ids_name[id], strlen(ids_name[id]));
+}
+
+static void send_buf_to_all(const char *buf, size_t buflen)
+{
+	conn_t	*conn, *cnext;
+	int	dropped = 0;
+
+	for (conn = connhead; conn; conn = cnext) {
+		cnext = conn->next;
+
+		if (conn->compact) {
+			if (!sock_queue_rec(conn, DSP_REC_TEXT, 0, buf, buflen)) {
+				dropped = 1;
+			}
+			continue;
+		}
+
+		if (!sock_queue(conn, buf, buflen)) {
+			dropped = 1;
+		}
+	}
+
+	/* only now, this sends to all again */
+	if (dropped) {
+		dstate_setinfo("driver.parameter.synchronous", "%s",
+			(do_synchronous==1)?"yes":((do_synchronous==0)?"no":"auto"));
+	}
+}
+
+static void batch_add_text(const char *buf, size_t buflen)
+{
+	static const char	head[] = "BATCH BEGIN\n";
+
+	if (batch_len + buflen + sizeof(head) > batch_size) {
+		batch_size = batch_len + buflen + sizeof(head) + ST_SOCK_BUF_LEN;
+		batch_buf = xrealloc(batch_buf, batch_size);
+	}
+
+	if (batch_len == 0) {
+		memcpy(batch_buf, head, sizeof(head) - 1);
+		batch_len = sizeof(head) - 1;
+	}
+
+	memcpy(batch_buf + batch_len, buf, buflen);
+	batch_len += buflen;
+}
+
+static void batch_add_rec(int type, unsigned int id, const char *data, size_t len)
+{
+	static const char	head[] = "BATCH BEGIN\n";
+	size_t	need = 2 * DSP_HDR_LEN + sizeof(head) + len;
+
+	if (batch_clen + need > batch_csize) {
+		batch_csize = batch_clen + need + ST_SOCK_BUF_LEN;
+		batch_cbuf = xrealloc(batch_cbuf, batch_csize);
+	}
+
+	if (batch_clen == 0) {
+		batch_clen = dsp_encode(batch_cbuf, batch_csize, DSP_REC_TEXT, 0, head, sizeof(head) - 1);
+		batch_ctext = 0;
+		batch_ctextlen = sizeof(head) - 1;
+	}
+
+	/* text lines in a row go in one record, just make it longer */
+	if ((type == DSP_REC_TEXT) && (batch_ctextlen > 0)
+	 && (batch_ctextlen + len <= DSP_MAX_PAYLOAD)) {
+		memcpy(batch_cbuf + batch_clen, data, len);
+		batch_clen += len;
+		batch_ctextlen += len;
+		dsp_setlen(batch_cbuf + batch_ctext, batch_ctextlen);
+		return;
+	}
+
+	batch_ctext = batch_clen;
+	batch_ctextlen = (type == DSP_REC_TEXT) ? len : 0;
+	batch_clen += dsp_encode(batch_cbuf + batch_clen, batch_csize - batch_clen, type, id, data, len);
+}
+
+static void batch_add(const char *buf, size_t buflen)
+{
+	int	kinds = conn_kinds();
+
+	if (kinds & CONN_TEXT) {
+		batch_add_text(buf, buflen);
+	}
+
+	if (kinds & CONN_COMPACT) {
+		batch_add_rec(DSP_REC_TEXT, 0, buf, buflen);
+	}
+}
+
+static void batch_add_value(const char *var)
+{
+	char	buf[ST_SOCK_BUF_LEN];
+	const st_tree_t	*node = state_tree_find(dtree_root, var);
+	int	kinds = conn_kinds();
+	unsigned int	id = 0;
+
+	/* deleted again since */
+	if (!node) {
+		return;
+	}
+
+	if (kinds & CONN_COMPACT) {
+		id = var_id(node->var);
+	}
+
+	if ((kinds & CONN_TEXT) || ((kinds & CONN_COMPACT) && !id)) {
+		if (snprintf(buf, sizeof(buf), "SETINFO %s \"%s\"\n", node->var, node->val) < 1) {
+			return;
+		}
+	}
+
+	if (kinds & CONN_TEXT) {
+		batch_add_text(buf, strlen(buf));
+	}
+
+	if (!(kinds & CONN_COMPACT)) {
+		return;
+	}
+
+	if (!id) {
+		batch_add_rec(DSP_REC_TEXT, 0, buf, strlen(buf));
+		return;
+	}
+
+	if (batch_numids == batch_idsize) {
+		batch_idsize = batch_idsize ? batch_idsize * 2 : 64;
+		batch_ids = xrealloc(batch_ids, batch_idsize * sizeof(*batch_ids));
+	}
+
+	batch_ids[batch_numids++] = id;
+	batch_add_rec(DSP_REC_SET, id, node->raw, strlen(node->raw));
+}
+
+/* add the SETINFO lines for the variables changed in the batch so far */
+static void batch_add_values(const st_tree_t *node)
+{
+	if (!node) {
+		return;
+	}
+
+	batch_add_values(node->left);
+	batch_add_value(node->var);
+	batch_add_values(node->right);
+}
+
+/* something else than its value is about to be sent for a variable,
+ * so upsd must learn about the variable itself first */
+static void batch_settle(const char *var)
+{
+	if ((batch_depth < 1) || (!state_tree_find(batch_root, var))) {
+		return;
+	}
+
+	/* only this one, the rest can wait for the commit */
+	batch_add_value(var);
+	state_delinfo(&batch_root, var);
+}
+
+/* returns 0 if the connection was dropped */
+static int batch_send(conn_t *conn)
+{
+	size_t	i;
+
+	if (!conn->compact) {
+		return batch_len ? sock_queue(conn, batch_buf, batch_len) : 1;
+	}
+
+	if (!batch_clen) {
+		return 1;
+	}
+
+	for (i = 0; i < batch_numids; i++) {
+		if (!sock_announce(conn, batch_ids[i])) {
+			return 0;
+		}
+	}
+
+	return sock_queue(conn, batch_cbuf, batch_clen);
+}
+
+static void send_to_all(const char *fmt, ...)
+{
+	int	ret;
 	char	buf[ST_SOCK_BUF_LEN];
 	size_t	buflen;
 	va_list	ap;
-	conn_t	*conn, *cnext;
 
 	va_start(ap, fmt);
 #ifdef HAVE_PRAGMAS_FOR_GCC_DIAGNOSTIC_IGNORED_FORMAT_NONLITERAL
@@ -199,52 +559,23 @@ static void send_to_all(const char *fmt, ...)
 		return;
 	}
 
-	if (ret <= INT_MAX)
-		upsdebugx(5, "%s: %.*s", __func__, (int)(ret-1), buf);
+	upsdebugx(5, "%s: %.*s", __func__, ret - 1, buf);
 
 	buflen = strlen(buf);
-	if (buflen >= SSIZE_MAX) {
-		/* Can't compare buflen to ret... though should not happen with ST_SOCK_BUF_LEN */
-		upslog_with_errno(LOG_NOTICE, "%s failed: buffered message too large", __func__);
+
+	if (batch_depth > 0) {
+		batch_add(buf, buflen);
 		return;
 	}
 
-	for (conn = connhead; conn; conn = cnext) {
-		cnext = conn->next;
-
-		ret = write(conn->fd, buf, buflen);
-
-		if ((ret < 1) || (ret != (ssize_t)buflen)) {
-			upsdebugx(0, "WARNING: %s: write %zd bytes to "
-				"socket %d failed (ret=%zd), disconnecting: %s",
-				__func__, buflen, conn->fd, ret, strerror(errno));
-			upsdebugx(6, "failed write: %s", buf);
-			sock_disconnect(conn);
-
-			/* TOTHINK: Maybe fallback elsewhere in other cases? */
-			if (ret < 0 && errno == EAGAIN && do_synchronous == -1) {
-				upsdebugx(0, "%s: synchronous mode was 'auto', "
-					"will try 'on' for next connections",
-					__func__);
-				do_synchronous = 1;
-			}
-
-			dstate_setinfo("driver.parameter.synchronous", "%s",
-				(do_synchronous==1)?"yes":((do_synchronous==0)?"no":"auto"));
-		} else {
-			upsdebugx(6, "%s: write %zd bytes to socket %d succeeded "
-				"(ret=%zd): %s",
-				__func__, buflen, conn->fd, ret, buf);
-		}
-	}
+	send_buf_to_all(buf, buflen);
 }
 
 static int send_to_one(conn_t *conn, const char *fmt, ...)
 {
-	ssize_t	ret;
+	int	ret;
 	va_list	ap;
 	char	buf[ST_SOCK_BUF_LEN];
-	size_t	buflen;
 
 	va_start(ap, fmt);
 #ifdef HAVE_PRAGMAS_FOR_GCC_DIAGNOSTIC_IGNORED_FORMAT_NONLITERAL
@@ -268,61 +599,19 @@ static int send_to_one(conn_t *conn, const char *fmt, ...)
 		return 1;
 	}
 
-	buflen = strlen(buf);
-	if (buflen >= SSIZE_MAX) {
-		/* Can't compare buflen to ret... though should not happen with ST_SOCK_BUF_LEN */
-		upslog_with_errno(LOG_NOTICE, "%s failed: buffered message too large", __func__);
-		return 0;	/* failed */
-	}
-
-	if (ret <= INT_MAX)
-		upsdebugx(5, "%s: %.*s", __func__, (int)(ret-1), buf);
-
-/*
-	upsdebugx(0, "%s: writing %zd bytes to socket %d: %s",
-		__func__, buflen, conn->fd, buf);
-*/
-
-	ret = write(conn->fd, buf, buflen);
+	upsdebugx(5, "%s: %.*s", __func__, ret - 1, buf);
 
-	if (ret < 0) {
-		/* Hacky bugfix: throttle down for upsd to read that */
-		upsdebugx(1, "%s: had to throttle down to retry "
-			"writing %zd bytes to socket %d "
-			"(ret=%zd, errno=%d, strerror=%s): %s",
-			__func__, buflen, conn->fd,
-			ret, errno, strerror(errno),
-			buf);
-		usleep(200);
-		ret = write(conn->fd, buf, buflen);
-		if (ret == (ssize_t)buflen) {
-			upsdebugx(1, "%s: throttling down helped", __func__);
-		}
+	if (conn->compact) {
+		ret = sock_queue_rec(conn, DSP_REC_TEXT, 0, buf, strlen(buf));
+	} else {
+		ret = sock_queue(conn, buf, strlen(buf));
 	}
 
-	if ((ret < 1) || (ret != (ssize_t)buflen)) {
-		upsdebugx(0, "WARNING: %s: write %zd bytes to "
-			"socket %d failed (ret=%zd), disconnecting: %s",
-			__func__, buflen, conn->fd, ret, strerror(errno));
-		upsdebugx(6, "failed write: %s", buf);
-		sock_disconnect(conn);
-
-		/* TOTHINK: Maybe fallback elsewhere in other cases? */
-		if (ret < 0 && errno == EAGAIN && do_synchronous == -1) {
-			upsdebugx(0, "%s: synchronous mode was 'auto', "
-				"will try 'on' for next connections",
-				__func__);
-			do_synchronous = 1;
-		}
-
+	if (!ret) {
 		dstate_setinfo("driver.parameter.synchronous", "%s",
 			(do_synchronous==1)?"yes":((do_synchronous==0)?"no":"auto"));
 
 		return 0;	/* failed */
-	} else {
-		upsdebugx(6, "%s: write %zd bytes to socket %d succeeded "
-			"(ret=%zd): %s",
-			__func__, buflen, conn->fd, ret, buf);
 	}
 
 	return 1;	/* OK */
@@ -378,6 +667,13 @@ static void sock_connect(int sock)
 	conn = xcalloc(1, sizeof(*conn));
 	conn->fd = fd;
 
+	if (evloop_add(fd, POLLIN, EVLOOP_CLIENT, conn) < 0) {
+		upslogx(LOG_ERR, "Can't watch unix fd %d", fd);
+		close(fd);
+		free(conn);
+		return;
+	}
+
 	pconf_init(&conn->ctx, NULL);
 
 	if (connhead) {
@@ -390,6 +686,22 @@ static void sock_connect(int sock)
 	upsdebugx(3, "new connection on fd %d", fd);
 }
 
+/* returns 0 if the connection was dropped */
+static int send_setinfo_one(conn_t *conn, const st_tree_t *node)
+{
+	unsigned int	id = conn->compact ? var_id(node->var) : 0;
+
+	if (!id) {
+		return send_to_one(conn, "SETINFO %s \"%s\"\n", node->var, node->val);
+	}
+
+	if (!sock_announce(conn, id)) {
+		return 0;
+	}
+
+	return sock_queue_rec(conn, DSP_REC_SET, id, node->raw, strlen(node->raw));
+}
+
 static int st_tree_dump_conn(st_tree_t *node, conn_t *conn)
 {
 	int	ret;
@@ -408,7 +720,7 @@ static int st_tree_dump_conn(st_tree_t *node, conn_t *conn)
 		}
 	}
 
-	if (!send_to_one(conn, "SETINFO %s \"%s\"\n", node->var, node->val)) {
+	if (!send_setinfo_one(conn, node)) {
 		return 0;	/* write failed, bail out */
 	}
 
@@ -522,6 +834,25 @@ static int sock_arg(conn_t *conn, size_t numarg, char **arg)
 		return 0;
 	}
 
+	/* PROTVER <version>, answered with the one we use from now on */
+	if (!strcasecmp(arg[0], "PROTVER")) {
+		int	ver = atoi(arg[1]);
+
+		if (ver > DSP_PROTVER_COMPACT) {
+			ver = DSP_PROTVER_COMPACT;
+		} else if (ver < DSP_PROTVER_TEXT) {
+			ver = DSP_PROTVER_TEXT;
+		}
+
+		if (!send_to_one(conn, "PROTVER %d\n", ver)) {
+			return 1;
+		}
+
+		conn->compact = (ver >= DSP_PROTVER_COMPACT);
+		upsdebugx(2, "%s: socket %d uses protocol version %d", __func__, conn->fd, ver);
+		return 1;
+	}
+
 	/* INSTCMD <cmdname> [<cmdparam>] [TRACKING <id>] */
 	if (!strcasecmp(arg[0], "INSTCMD")) {
 		int ret;
@@ -604,7 +935,8 @@ static int sock_arg(conn_t *conn, size_t numarg, char **arg)
 
 static void sock_read(conn_t *conn)
 {
-	ssize_t	ret, i;
+	ssize_t	ret;
+	size_t	i, used;
 	char	buf[SMALLBUF];
 
 	ret = read(conn->fd, buf, sizeof(buf));
@@ -622,9 +954,16 @@ static void sock_read(conn_t *conn)
 		}
 	}
 
-	for (i = 0; i < ret; i++) {
+	/* upsd went away, don't keep waking up for it */
+	if (ret == 0) {
+		upsdebugx(2, "%s: socket %d closed by peer", __func__, conn->fd);
+		sock_disconnect(conn);
+		return;
+	}
+
+	for (i = 0; i < (size_t)ret; i += used) {
 
-		switch(pconf_char(&conn->ctx, buf[i]))
+		switch(pconf_line_buf(&conn->ctx, buf + i, (size_t)ret - i, &used))
 		{
 		case 0: /* nothing to parse yet */
 			continue;
@@ -653,6 +992,7 @@ static void sock_close(void)
 	conn_t	*conn, *cnext;
 
 	if (sockfd != -1) {
+		evloop_del(sockfd);
 		close(sockfd);
 		sockfd = -1;
 
@@ -670,6 +1010,8 @@ static void sock_close(void)
 
 	connhead = NULL;
 	/* conntail = NULL; */
+
+	evloop_free();
 }
 
 /* interface */
@@ -698,40 +1040,65 @@ char * dstate_init(const char *prog, const char *devname)
 
 	upsdebugx(2, "dstate_init: sock %s open on fd %d", sockname, sockfd);
 
+	evloop_init(EVLOOP_AUTO);
+
+	if (evloop_add(sockfd, POLLIN, EVLOOP_SERVER, NULL) < 0) {
+		fatalx(EXIT_FAILURE, "Can't watch listener socket %s", sockname);
+	}
+
 	/* NOTE: Caller must free this string */
 	return xstrdup(sockname);
 }
 
-/* returns 1 if timeout expired or data is available on UPS fd, 0 otherwise */
-int dstate_poll_fds(struct timeval timeout, int extrafd)
+static void sock_dispatch(handler_type_t type, void *data, int revents)
 {
-	int	ret, maxfd, overrun = 0;
-	fd_set	rfds;
-	struct timeval	now;
-	conn_t	*conn, *cnext;
-
-	FD_ZERO(&rfds);
-	FD_SET(sockfd, &rfds);
+	conn_t	*conn = (conn_t *)data;
 
-	maxfd = sockfd;
+	switch (type)
+	{
+	case EVLOOP_SERVER:
+		sock_connect(sockfd);
+		break;
 
-	if (extrafd != -1) {
-		FD_SET(extrafd, &rfds);
+	case EVLOOP_CLIENT:
+		if ((revents & POLLOUT) && (!sock_flush(conn))) {
+			break;
+		}
 
-		if (extrafd > maxfd) {
-			maxfd = extrafd;
+		if (revents & (POLLIN | POLLHUP | POLLERR)) {
+			sock_read(conn);
 		}
+		break;
+
+	case EVLOOP_DRIVER:
+		extraready = 1;
+		break;
+
+	default:
+		upsdebugx(2, "%s: unexpected handler type %d", __func__, type);
 	}
+}
 
-	for (conn = connhead; conn; conn = conn->next) {
-		FD_SET(conn->fd, &rfds);
+/* returns 1 if timeout expired or data is available on UPS fd, 0 otherwise */
+int dstate_poll_fds(struct timeval timeout, int extrafd)
+{
+	int	ret, overrun = 0;
+	long	msec;
+	struct timeval	now;
+	conn_t	*conn, *cnext;
+
+	/* send what piled up since the last call */
+	for (conn = connhead; conn; conn = cnext) {
+		cnext = conn->next;
 
-		if (conn->fd > maxfd) {
-			maxfd = conn->fd;
+		if (conn->outlen) {
+			sock_flush(conn);
 		}
 	}
 
-	gettimeofday(&now, NULL);
+	/* setting the time of day must not cut the wait short or drag it
+	 * out, so timeout is on the clock of nut_monotime() */
+	nut_monotime(&now);
 
 	/* number of microseconds should always be positive */
 	if (timeout.tv_usec < now.tv_usec) {
@@ -748,7 +1115,25 @@ int dstate_poll_fds(struct timeval timeout, int extrafd)
 		timeout.tv_usec -= now.tv_usec;
 	}
 
-	ret = select(maxfd + 1, &rfds, NULL, NULL, &timeout);
+	msec = (long)timeout.tv_sec * 1000 + ((long)timeout.tv_usec + 999) / 1000;
+
+	if (msec > INT_MAX) {
+		msec = INT_MAX;
+	}
+
+	/* the UPS fd may be reopened by the driver at any time, so it is
+	 * only watched for the duration of this call */
+	extraready = 0;
+
+	if ((extrafd != -1) && (evloop_add(extrafd, POLLIN, EVLOOP_DRIVER, NULL) < 0)) {
+		return 1;	/* can't tell, let the driver look at it */
+	}
+
+	ret = evloop_wait((int)msec, sock_dispatch);
+
+	if (extrafd != -1) {
+		evloop_del(extrafd);
+	}
 
 	if (ret == 0) {
 		return 1;	/* timer expired */
@@ -763,26 +1148,14 @@ int dstate_poll_fds(struct timeval timeout, int extrafd)
 			break;
 
 		default:
-			upslog_with_errno(LOG_ERR, "select unix sockets failed");
+			upslog_with_errno(LOG_ERR, "polling unix sockets failed");
 		}
 
 		return overrun;
 	}
 
-	if (FD_ISSET(sockfd, &rfds)) {
-		sock_connect(sockfd);
-	}
-
-	for (conn = connhead; conn; conn = cnext) {
-		cnext = conn->next;
-
-		if (FD_ISSET(conn->fd, &rfds)) {
-			sock_read(conn);
-		}
-	}
-
 	/* tell the caller if that fd woke up */
-	if ((extrafd != -1) && (FD_ISSET(extrafd, &rfds))) {
+	if (extraready) {
 		return 1;
 	}
 
@@ -813,10 +1186,20 @@ int dstate_setinfo(const char *var, const char *fmt, ...)
 
 	ret = state_setinfo(&dtree_root, var, value);
 
-	if (ret == 1) {
-		send_to_all("SETINFO %s \"%s\"\n", var, value);
+	if (ret != 1) {
+		return ret;
 	}
 
+	/* only the last value matters, it is looked up on commit */
+	if (batch_depth > 0) {
+		if (connhead) {
+			state_setinfo(&batch_root, var, "");
+		}
+		return ret;
+	}
+
+	send_to_all("SETINFO %s \"%s\"\n", var, value);
+
 	return ret;
 }
 
@@ -845,6 +1228,7 @@ int dstate_addenum(const char *var, const char *fmt, ...)
 	ret = state_addenum(dtree_root, var, value);
 
 	if (ret == 1) {
+		batch_settle(var);
 		send_to_all("ADDENUM %s \"%s\"\n", var, value);
 	}
 
@@ -858,6 +1242,7 @@ int dstate_addrange(const char *var, const int min, const int max)
 	ret = state_addrange(dtree_root, var, min, max);
 
 	if (ret == 1) {
+		batch_settle(var);
 		send_to_all("ADDRANGE %s %i %i\n", var, min, max);
 		/* Also add the "NUMBER" flag for ranges */
 		dstate_addflags(var, ST_FLAG_NUMBER);
@@ -906,6 +1291,7 @@ void dstate_setflags(const char *var, int flags)
 	}
 
 	/* update listeners */
+	batch_settle(var);
 	send_to_all("SETFLAGS %s\n", flist);
 }
 
@@ -964,9 +1350,68 @@ void dstate_setaux(const char *var, long aux)
 	sttmp->aux = aux;
 
 	/* update listeners */
+	batch_settle(var);
 	send_to_all("SETAUX %s %ld\n", var, aux);
 }
 
+/* hold back updates to upsd until the matching dstate_commit_batch(),
+ * batches may nest */
+void dstate_begin_batch(void)
+{
+	batch_depth++;
+}
+
+/* send everything changed since dstate_begin_batch() as one BATCH,
+ * which upsd applies at once; variables changed several times in
+ * the meantime are only sent with their last value */
+void dstate_commit_batch(void)
+{
+	static const char	tail[] = "BATCH END\n";
+	conn_t	*conn, *cnext;
+	int	dropped = 0;
+
+	if (batch_depth < 1) {
+		upsdebugx(1, "%s: no batch in progress", __func__);
+		return;
+	}
+
+	if (--batch_depth > 0) {
+		return;
+	}
+
+	batch_add_values(batch_root);
+	state_infofree(batch_root);
+	batch_root = NULL;
+
+	/* nothing changed (or nobody connected) */
+	if ((batch_len == 0) && (batch_clen == 0)) {
+		return;
+	}
+
+	batch_add(tail, sizeof(tail) - 1);
+
+	upsdebugx(5, "%s: %zu bytes of text, %zu bytes of records",
+		__func__, batch_len, batch_clen);
+
+	for (conn = connhead; conn; conn = cnext) {
+		cnext = conn->next;
+
+		if (!batch_send(conn)) {
+			dropped = 1;
+		}
+	}
+
+	batch_len = 0;
+	batch_clen = 0;
+	batch_ctextlen = 0;
+	batch_numids = 0;
+
+	if (dropped) {
+		dstate_setinfo("driver.parameter.synchronous", "%s",
+			(do_synchronous==1)?"yes":((do_synchronous==0)?"no":"auto"));
+	}
+}
+
 const char *dstate_getinfo(const char *var)
 {
 	return state_getinfo(dtree_root, var);
@@ -992,6 +1437,9 @@ int dstate_delinfo(const char *var)
 
 	/* update listeners */
 	if (ret == 1) {
+		if (batch_root) {
+			state_delinfo(&batch_root, var);
+		}
 		send_to_all("DELINFO %s\n", var);
 	}
 
@@ -1006,6 +1454,7 @@ int dstate_delenum(const char *var, const char *val)
 
 	/* update listeners */
 	if (ret == 1) {
+		batch_settle(var);
 		send_to_all("DELENUM %s \"%s\"\n", var, val);
 	}
 
@@ -1020,6 +1469,7 @@ int dstate_delrange(const char *var, const int min, const int max)
 
 	/* update listeners */
 	if (ret == 1) {
+		batch_settle(var);
 		send_to_all("DELRANGE %s %i %i\n", var, min, max);
 	}
 
@@ -1048,6 +1498,24 @@ void dstate_free(void)
 	state_cmdfree(cmdhead);
 	cmdhead = NULL;
 
+	state_infofree(batch_root);
+	batch_root = NULL;
+	free(batch_buf);
+	batch_buf = NULL;
+	batch_len = batch_size = 0;
+	free(batch_cbuf);
+	batch_cbuf = NULL;
+	batch_clen = batch_csize = batch_ctextlen = 0;
+	free(batch_ids);
+	batch_ids = NULL;
+	batch_numids = batch_idsize = 0;
+
+	state_infofree(ids_root);
+	ids_root = NULL;
+	free(ids_name);
+	ids_name = NULL;
+	ids_last = 0;
+
 	sock_close();
 }
 
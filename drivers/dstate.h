@@ -31,6 +31,8 @@
 
 #define DS_LISTEN_BACKLOG 16
 #define DS_MAX_READ 256		/* don't read forever from upsd */
+#define DS_FLUSH_LEN 4096	/* send queued updates once this much piles up */
+#define DS_OUTBUF_MAX (1024 * 1024)	/* give up on readers lagging this much */
 
 #ifndef MAX_STRING_SIZE
 #define MAX_STRING_SIZE	128
@@ -40,6 +42,12 @@
 typedef struct conn_s {
 	int     fd;
 	PCONF_CTX_t	ctx;
+	char	*outbuf;	/* queued updates not sent yet */
+	size_t	outlen;
+	size_t	outsize;
+	int	compact;	/* upsd asked for compact records */
+	unsigned char	*known;	/* bitmap of record ids announced */
+	size_t	knownsize;
 	struct conn_s	*prev;
 	struct conn_s	*next;
 } conn_t;
@@ -61,6 +69,8 @@ void dstate_setflags(const char *var, int flags);
 void dstate_addflags(const char *var, const int addflags);
 void dstate_delflags(const char *var, const int delflags);
 void dstate_setaux(const char *var, long aux);
+void dstate_begin_batch(void);
+void dstate_commit_batch(void);
 const char *dstate_getinfo(const char *var);
 void dstate_addcmd(const char *cmdname);
 int dstate_delinfo(const char *var);
@@ -1056,10 +1056,14 @@ int main(int argc, char **argv)
 
 		struct timeval	timeout;
 
-		gettimeofday(&timeout, NULL);
+		/* a deadline on the clock of dstate_poll_fds() */
+		nut_monotime(&timeout);
 		timeout.tv_sec += poll_interval;
 
+		/* let upsd see the outcome of a whole update at once */
+		dstate_begin_batch();
 		upsdrv_updateinfo();
+		dstate_commit_batch();
 
 		/* Dump the data tree (in upsc-like format) to stdout and exit */
 		if (dump_data) {
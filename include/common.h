@@ -208,6 +208,14 @@ char *xstrdup(const char *string);
 ssize_t select_read(const int fd, void *buf, const size_t buflen, const time_t d_sec, const suseconds_t d_usec);
 ssize_t select_write(const int fd, const void *buf, const size_t buflen, const time_t d_sec, const suseconds_t d_usec);
 
+/* monotonic time, for timeouts and ages (see common.c) */
+void nut_monotime(struct timeval *tv);
+double nut_monotime_diff(const struct timeval *end, const struct timeval *start);
+
+/* chained hash tables of names, with a power of two buckets (see common.c) */
+size_t nut_strhash(const char *str, int nocase);
+size_t nut_hashbuckets(size_t count, size_t min);
+
 char * get_libname(const char* base_libname);
 
 /* Buffer sizes used for various functions */
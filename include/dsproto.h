@@ -0,0 +1,69 @@
+/* dsproto.h - compact records for the driver/server socket protocol
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef NUT_DSPROTO_H_SEEN
+#define NUT_DSPROTO_H_SEEN 1
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/* "PROTVER <n>" on the driver socket: 1 is the plain text protocol,
+ * from 2 on the driver sends compact records after its answer */
+#define DSP_PROTVER_TEXT	1
+#define DSP_PROTVER_COMPACT	2
+
+/* type, 16 bit variable id and 16 bit payload length, network order */
+#define DSP_HDR_LEN	5
+#define DSP_MAX_ID	65535
+#define DSP_MAX_PAYLOAD	65535
+
+/* record types */
+#define DSP_REC_NAME	'N'	/* payload is the name of variable id */
+#define DSP_REC_SET	'S'	/* payload is the new (raw) value of id */
+#define DSP_REC_TEXT	'T'	/* payload is text protocol line(s) */
+
+typedef struct {
+	int	type;
+	unsigned int	id;
+	const char	*data;	/* not NUL terminated */
+	size_t	len;
+} dsp_rec_t;
+
+/* put one record in buf, returns its length, or 0 if it does not fit */
+size_t dsp_encode(char *buf, size_t bufsize, int type, unsigned int id,
+	const char *data, size_t len);
+
+/* change the payload length of an encoded record, e.g. after adding
+ * more text to it */
+void dsp_setlen(char *rec, size_t len);
+
+/* find the first record in buf, returns its length, 0 if more data is
+ * needed or -1 if this is not a valid record */
+ssize_t dsp_decode(const char *buf, size_t buflen, dsp_rec_t *rec);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+
+#endif	/* NUT_DSPROTO_H_SEEN */
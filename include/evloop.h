@@ -0,0 +1,92 @@
+/* evloop.h - event notification backends for upsd and drivers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef NUT_EVLOOP_H_SEEN
+#define NUT_EVLOOP_H_SEEN 1
+
+#include <poll.h>
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/* what kind of object is behind a registered file descriptor */
+typedef enum {
+	EVLOOP_DRIVER = 1,
+	EVLOOP_CLIENT,
+	EVLOOP_SERVER
+} handler_type_t;
+
+/* available notification mechanisms */
+typedef enum {
+	EVLOOP_AUTO = 0,	/* best one available on this system */
+	EVLOOP_POLL,		/* portable poll(), always available */
+	EVLOOP_EPOLL		/* Linux epoll(7) */
+} evloop_backend_t;
+
+/* one set of registered descriptors, with its own backend instance;
+ * a loop must only be used by one thread at a time */
+typedef struct evloop_s evloop_t;
+
+/* called once per ready descriptor, with POLLIN/POLLOUT/POLLHUP/...
+ * style flags in revents (epoll results are mapped onto these) */
+typedef void (*evloop_handler_fn)(handler_type_t type, void *data, int revents);
+
+/* set up the requested backend (falling back to poll() if it is not
+ * usable), returns the backend actually in use */
+evloop_backend_t evloop_init(evloop_backend_t backend);
+void evloop_free(void);
+
+/* parse a backend name from upsd.conf, returns -1 if unknown */
+int evloop_backend_parse(const char *name, evloop_backend_t *backend);
+const char *evloop_backend_name(evloop_backend_t backend);
+
+/* (un)register a descriptor; events is a mask of POLLIN and POLLOUT.
+ * evloop_del() must be called before the descriptor is closed. */
+int evloop_add(int fd, int events, handler_type_t type, void *data);
+int evloop_mod(int fd, int events);
+void evloop_del(int fd);
+
+/* number of currently registered descriptors */
+size_t evloop_count(void);
+
+/* wait up to timeout milliseconds and dispatch ready descriptors,
+ * returns the number of descriptors dispatched or -1 on error */
+int evloop_wait(int timeout, evloop_handler_fn dispatch);
+
+/* the loop used by the calls above (NULL before evloop_init) */
+evloop_t *evloop_default(void);
+
+/* same as above, on separately created loops */
+evloop_t *evloop_new(evloop_backend_t backend);
+void evloop_delete(evloop_t *loop);
+evloop_backend_t evloop_loop_backend(const evloop_t *loop);
+int evloop_loop_add(evloop_t *loop, int fd, int events, handler_type_t type, void *data);
+int evloop_loop_mod(evloop_t *loop, int fd, int events);
+void evloop_loop_del(evloop_t *loop, int fd);
+size_t evloop_loop_count(const evloop_t *loop);
+int evloop_loop_wait(evloop_t *loop, int timeout, evloop_handler_fn dispatch);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+
+#endif	/* NUT_EVLOOP_H_SEEN */
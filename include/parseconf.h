@@ -71,6 +71,7 @@ int pconf_line(PCONF_CTX_t *ctx, const char *line);
 void pconf_finish(PCONF_CTX_t *ctx);
 char *pconf_encode(const char *src, char *dest, size_t destsize);
 int pconf_char(PCONF_CTX_t *ctx, char ch);
+int pconf_line_buf(PCONF_CTX_t *ctx, const char *buf, size_t buflen, size_t *used);
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
@@ -23,6 +23,8 @@
 #define NUT_STATE_H_SEEN 1
 
 #include "extstate.h"
+#include "nut_stdint.h"
+#include "timehead.h"
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
@@ -32,8 +34,13 @@ extern "C" {
 
 #define ST_SOCK_BUF_LEN 512
 
+/* variable names are interned, i.e. stored once per process however
+ * many trees (devices) use them */
+struct st_name_s;
+
 typedef struct st_tree_s {
-	char	*var;
+	char	*var;			/* points into name */
+	struct st_name_s	*name;
 	char	*val;			/* points to raw or safe */
 
 	char	*raw;			/* raw data from caller */
@@ -50,9 +57,15 @@ typedef struct st_tree_s {
 
 	struct st_tree_s	*left;
 	struct st_tree_s	*right;
+	int	height;		/* of this subtree, keeps it AVL balanced */
+
+	uint64_t	seq;		/* last change, see state_setinfo_seq() */
+	struct timeval	updated;	/* last set, changed or not (nut_monotime) */
 } st_tree_t;
 
 int state_setinfo(st_tree_t **nptr, const char *var, const char *val);
+int state_setinfo_seq(st_tree_t **nptr, const char *var, const char *val, uint64_t seq);
+int state_setnode_seq(st_tree_t *node, const char *val, uint64_t seq);
 int state_addenum(st_tree_t *root, const char *var, const char *val);
 int state_addrange(st_tree_t *root, const char *var, const int min, const int max);
 int state_setaux(st_tree_t *root, const char *var, const char *auxs);
@@ -70,6 +83,7 @@ int state_delinfo(st_tree_t **root, const char *var);
 int state_delenum(st_tree_t *root, const char *var, const char *val);
 int state_delrange(st_tree_t *root, const char *var, const int min, const int max);
 st_tree_t *state_tree_find(st_tree_t *node, const char *var);
+size_t state_sharednames(const st_tree_t *node, ssize_t *saved);
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
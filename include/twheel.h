@@ -0,0 +1,89 @@
+/* twheel.h - hierarchical timer wheel for upsd
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef NUT_TWHEEL_H_SEEN
+#define NUT_TWHEEL_H_SEEN 1
+
+#include <time.h>
+#include "nut_stdint.h"
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/* 4 levels of 64 slots of one second each: delays up to 2^24 seconds
+ * (about 194 days), longer ones are cut down to that */
+#define TWHEEL_BITS	6
+#define TWHEEL_SLOTS	(1 << TWHEEL_BITS)
+#define TWHEEL_LEVELS	4
+
+typedef struct twtimer_s	twtimer_t;
+typedef struct twheel_s		twheel_t;
+
+/* called once the timer expired; it is no longer pending then, so it
+ * may set itself again */
+typedef void (*twtimer_fn)(twtimer_t *timer);
+
+/* usually embedded in what it is the timer of */
+struct twtimer_s {
+	twtimer_fn	fn;
+	void		*arg;
+
+	/* private */
+	twheel_t	*wheel;		/* NULL unless pending */
+	twtimer_t	*next;
+	twtimer_t	**pprev;
+	time_t		expires;
+	int		slot;		/* level * TWHEEL_SLOTS + index, -1 if due */
+};
+
+/* a wheel must only be used by one thread at a time */
+struct twheel_s {
+	time_t		now;		/* as of the last twheel_run() */
+	twtimer_t	*due;		/* expired, to be run */
+	twtimer_t	*slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+	uint64_t	used[TWHEEL_LEVELS];	/* which slots are not empty */
+	size_t		count;		/* pending timers */
+};
+
+void twheel_init(twheel_t *wheel, time_t now);
+
+/* run the timers expired by now, in no particular order; if the clock
+ * went back, pending timers keep what was left of their delays */
+void twheel_run(twheel_t *wheel, time_t now);
+
+/* seconds from the last twheel_run() until the next one has anything
+ * to do: 0 if some timer is due already, -1 if none is pending */
+time_t twheel_timeout(const twheel_t *wheel);
+
+void twtimer_init(twtimer_t *timer, twtimer_fn fn, void *arg);
+
+/* (re)arm a timer to expire delay seconds after the last twheel_run(),
+ * or right with the next one for a delay of 0 */
+void twtimer_set(twheel_t *wheel, twtimer_t *timer, time_t delay);
+void twtimer_del(twtimer_t *timer);
+int twtimer_pending(const twtimer_t *timer);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+
+#endif	/* NUT_TWHEEL_H_SEEN */
@@ -23,6 +23,7 @@
 #include "sstate.h"
 #include "user.h"
 #include "netssl.h"
+#include "netwatch.h"
 #include "nut_stdint.h"
 #include <ctype.h>
 
@@ -42,11 +43,9 @@ static void ups_create(const char *fn, const char *name, const char *desc)
 {
 	upstype_t	*temp;
 
-	for (temp = firstups; temp != NULL; temp = temp->next) {
-		if (!strcasecmp(temp->name, name)) {
-			upslogx(LOG_ERR, "UPS name [%s] is already in use!", name);
-			return;
-		}
+	if (get_ups_ptr(name)) {
+		upslogx(LOG_ERR, "UPS name [%s] is already in use!", name);
+		return;
 	}
 
 	/* grab some memory and add the info */
@@ -60,13 +59,22 @@ static void ups_create(const char *fn, const char *name, const char *desc)
 
 	temp->stale = 1;
 	temp->retain = 1;
+
+	ups_check_start(temp);
+
+	/* start change sequences from the clock, so that LIST DELTA
+	 * clients also notice when upsd itself was restarted */
+	temp->seq = (uint64_t)time(NULL) << 24;
+	temp->seqbase = temp->seq;
+
 	temp->sock_fd = sstate_connect(temp);
 
 	/* preload this to the current time to avoid false staleness */
-	time(&temp->last_heard);
+	nut_monotime(&temp->last_heard);
 
 	temp->next = firstups;
 	firstups = temp;
+	ups_index_add(temp);
 	num_ups++;
 }
 
@@ -95,15 +103,14 @@ static void ups_update(const char *fn, const char *name, const char *desc)
 
 		upslogx(LOG_NOTICE, "Redefined UPS [%s]", name);
 
-		/* release all data */
-		sstate_infofree(temp);
-		sstate_cmdfree(temp);
-		pconf_finish(&temp->sock_ctx);
-
-		close(temp->sock_fd);
-		temp->sock_fd = -1;
+		/* release all data, along with the state of the protocol
+		 * the old driver talked, and reconnect soon */
+		sstate_disconnect(temp);
 		temp->dumpdone = 0;
 
+		/* even if it was not connected */
+		ups_check_soon(temp);
+
 		/* now redefine the filename and wrap up */
 		free(temp->fn);
 		temp->fn = xstrdup(fn);
@@ -169,6 +176,18 @@ static int parse_upsd_conf_args(size_t numargs, char **arg)
 		}
 	}
 
+	/* CLIENT_INACTIVITY_DELAY <seconds> */
+	if (!strcmp(arg[0], "CLIENT_INACTIVITY_DELAY")) {
+		if (isdigit((size_t)arg[1][0])) {
+			client_inactivity_delay = atoi(arg[1]);
+			return 1;
+		}
+		else {
+			upslogx(LOG_ERR, "CLIENT_INACTIVITY_DELAY has non numeric value (%s)!", arg[1]);
+			return 0;
+		}
+	}
+
 	/* TRACKINGDELAY <seconds> */
 	if (!strcmp(arg[0], "TRACKINGDELAY")) {
 		if (isdigit((size_t)arg[1][0])) {
@@ -207,6 +226,29 @@ static int parse_upsd_conf_args(size_t numargs, char **arg)
 		}
 	}
 
+	/* EVENT_BACKEND <auto|epoll|poll> */
+	if (!strcmp(arg[0], "EVENT_BACKEND")) {
+		if (evloop_backend_parse(arg[1], &event_backend) == 0) {
+			return 1;
+		}
+		else {
+			upslogx(LOG_ERR, "EVENT_BACKEND has unknown value (%s)!", arg[1]);
+			return 0;
+		}
+	}
+
+	/* WORKERS <threads> */
+	if (!strcmp(arg[0], "WORKERS")) {
+		if (isdigit((size_t)arg[1][0])) {
+			num_workers = atoi(arg[1]);
+			return 1;
+		}
+		else {
+			upslogx(LOG_ERR, "WORKERS has non numeric value (%s)!", arg[1]);
+			return 0;
+		}
+	}
+
 	/* STATEPATH <dir> */
 	if (!strcmp(arg[0], "STATEPATH")) {
 		free(statepath);
@@ -286,6 +328,12 @@ static int parse_upsd_conf_args(size_t numargs, char **arg)
 	if (numargs < 3)
 		return 0;
 
+	/* METRICS_LISTEN <address> <port> */
+	if (!strcmp(arg[0], "METRICS_LISTEN")) {
+		metrics_listen_add(arg[1], arg[2]);
+		return 1;
+	}
+
 	/* ACL <aclname> <ip block> */
 	if (!strcmp(arg[0], "ACL")) {
 		upslogx(LOG_WARNING, "ACL in upsd.conf is no longer supported - switch to LISTEN");
@@ -313,7 +361,7 @@ static void upsd_conf_err(const char *errmsg)
 	upslogx(LOG_ERR, "Fatal error in parseconf (upsd.conf): %s", errmsg);
 }
 
-void load_upsdconf(int reloading)
+int load_upsdconf(int reloading)
 {
 	char	fn[SMALLBUF];
 	PCONF_CTX_t	ctx;
@@ -331,7 +379,7 @@ void load_upsdconf(int reloading)
 			fatalx(EXIT_FAILURE, "%s", ctx.errmsg);
 
 		upslogx(LOG_ERR, "Reload failed: %s", ctx.errmsg);
-		return;
+		return 0;
 	}
 
 	if (reloading) {
@@ -377,6 +425,8 @@ void load_upsdconf(int reloading)
 	}
 
 	pconf_finish(&ctx);
+
+	return 1;
 }
 
 /* callback during parsing of ups.conf */
@@ -485,18 +535,25 @@ static void delete_ups(upstype_t *target)
 			/* make sure nobody stays logged into this thing */
 			kick_login_clients(target->name);
 
+			ups_index_del(ptr);
+
 			/* about to delete the first ups? */
 			if (ptr == last)
 				firstups = ptr->next;
 			else
 				last->next = ptr->next;
 
-			if (ptr->sock_fd != -1)
+			if (ptr->sock_fd != -1) {
+				evloop_del(ptr->sock_fd);
 				close(ptr->sock_fd);
+			}
+
+			twtimer_del(&ptr->check);
 
 			/* release memory */
 			sstate_infofree(ptr);
 			sstate_cmdfree(ptr);
+			watch_ups_free(ptr);
 			pconf_finish(&ptr->sock_ctx);
 
 			free(ptr->fn);
@@ -556,8 +613,10 @@ void conf_reload(void)
 	read_upsconf();
 	upsconf_add(1);			/* 1 = reloading */
 
-	/* now reread upsd.conf */
-	load_upsdconf(1);		/* 1 = reloading */
+	/* now reread upsd.conf, keeping the listening sockets (and their
+	 * clients) of the addresses it still has */
+	server_reload_start();
+	server_reload_finish(load_upsdconf(1));		/* 1 = reloading */
 
 	/* now delete all UPS entries that didn't get reloaded */
 
@@ -573,6 +632,9 @@ void conf_reload(void)
 		upstmp = upsnext;
 	}
 
+	/* size the name index for what is left */
+	ups_index_rebuild();
+
 	/* did they actually delete the last UPS? */
 	if (firstups == NULL)
 		upslogx(LOG_WARNING, "Warning: no UPSes currently defined!");
@@ -581,6 +643,13 @@ void conf_reload(void)
 	if (!check_file("upsd.users"))
 		return;
 
+	/* the sessions only hold on to names and passwords, but this keeps
+	 * what was worked out for them, crypt(3) results included */
+	if (!user_changed()) {
+		upsdebugx(1, "upsd.users did not change");
+		return;
+	}
+
 	/* delete all users */
 	user_flush();
 
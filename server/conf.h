@@ -29,8 +29,8 @@ extern "C" {
 /* *INDENT-ON* */
 #endif
 
-/* read upsd.conf */
-void load_upsdconf(int reloading);
+/* read upsd.conf, 0 if it could not be */
+int load_upsdconf(int reloading);
 
 /* add valid UPSes from ups.conf to the internal structures */
 void upsconf_add(int reloading);
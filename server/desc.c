@@ -19,6 +19,7 @@
 
 #include "config.h"  /* must be the first header */
 
+#include <ctype.h>
 #include <string.h>
 
 #include "common.h"
@@ -28,58 +29,181 @@
 
 extern const char *datapath;
 
+/*
+ * Descriptions are hashed by name (case-insensitive FNV-1a) as cmdvartab
+ * is loaded. Names of indexed collections (outlet.3.desc) which have no
+ * entry of their own are looked up as a template, with each index as
+ * "n" (outlet.n.desc), then without their indexes (outlet.desc), the way
+ * cmdvartab describes the main outlet and the others at once.
+ */
+
 typedef struct dlist_s {
 	char	*name;
 	char	*desc;
-	struct dlist_s	*next;
+	struct dlist_s	*next;	/* in the same hash bucket */
+	size_t	hash;
 } dlist_t;
 
-static dlist_t	*cmd_list = NULL, *var_list = NULL;
+typedef struct {
+	dlist_t	**hash;
+	size_t	buckets;
+	size_t	count;
+} dtable_t;
 
-static void list_free(dlist_t *ptr)
-{
-	dlist_t	*next;
+static dtable_t	cmd_table = { NULL, 0, 0 }, var_table = { NULL, 0, 0 };
 
-	while (ptr) {
-		next = ptr->next;
+static void table_free(dtable_t *table)
+{
+	dlist_t	*ptr, *next;
+	size_t	i;
 
-		free(ptr->name);
-		free(ptr->desc);
-		free(ptr);
+	for (i = 0; i < table->buckets; i++) {
+		for (ptr = table->hash[i]; ptr; ptr = next) {
+			next = ptr->next;
 
-		ptr = next;
+			free(ptr->name);
+			free(ptr->desc);
+			free(ptr);
+		}
 	}
+
+	free(table->hash);
+
+	table->hash = NULL;
+	table->buckets = 0;
+	table->count = 0;
 }
 
-static const char *list_get(const dlist_t *list, const char *name)
+static dlist_t *table_find(const dtable_t *table, const char *name)
 {
-	const dlist_t	*temp;
+	dlist_t	*temp;
+	size_t	hash;
+
+	if (!table->hash) {
+		return NULL;
+	}
+
+	hash = nut_strhash(name, 1);
 
-	for (temp = list; temp != NULL; temp = temp->next) {
+	for (temp = table->hash[hash & (table->buckets - 1)]; temp != NULL; temp = temp->next) {
 
-		if (!strcasecmp(temp->name, name)) {
-			return temp->desc;
+		if ((temp->hash == hash) && (!strcasecmp(temp->name, name))) {
+			return temp;
 		}
 	}
 
 	return NULL;
 }
 
-static void desc_add(dlist_t **list, const char *name, const char *desc)
+/* keep the chains short */
+static void table_grow(dtable_t *table)
 {
-	dlist_t	*temp;
+	dlist_t	**oldhash = table->hash, *temp, *next;
+	size_t	oldbuckets = table->buckets, i;
+
+	table->buckets = nut_hashbuckets(table->count, 64);
+	table->hash = xcalloc(table->buckets, sizeof(*table->hash));
 
-	for (temp = *list; temp != NULL; temp = temp->next) {
-		if (!strcasecmp(temp->name, name)) {
-			break;
+	for (i = 0; i < oldbuckets; i++) {
+		for (temp = oldhash[i]; temp; temp = next) {
+			next = temp->next;
+			temp->next = table->hash[temp->hash & (table->buckets - 1)];
+			table->hash[temp->hash & (table->buckets - 1)] = temp;
 		}
 	}
 
+	free(oldhash);
+}
+
+/* the name with each all-digit component replaced by "n", or dropped
+ * if tmpl is NULL; returns 0 if it has no such component */
+static int desc_template(const char *name, char *buf, size_t buflen, const char *tmpl)
+{
+	const char	*comp, *end, *c;
+	size_t	len = 0, clen;
+	int	found = 0;
+
+	for (comp = name; *comp; comp = (*end) ? end + 1 : end) {
+		int	digits = 1;
+
+		end = strchr(comp, '.');
+		if (!end) {
+			end = comp + strlen(comp);
+		}
+
+		clen = (size_t)(end - comp);
+
+		for (c = comp; c < end; c++) {
+			if (!isdigit((unsigned char)*c)) {
+				digits = 0;
+				break;
+			}
+		}
+
+		/* not the first one, that's never an index */
+		if ((clen) && (digits) && (comp != name)) {
+			found = 1;
+
+			if (!tmpl) {
+				continue;
+			}
+
+			comp = tmpl;
+			clen = strlen(tmpl);
+		}
+
+		if (len + clen + 2 > buflen) {
+			return 0;
+		}
+
+		if (len) {
+			buf[len++] = '.';
+		}
+
+		memcpy(buf + len, comp, clen);
+		len += clen;
+	}
+
+	buf[len] = '\0';
+
+	return found;
+}
+
+static const char *table_get(const dtable_t *table, const char *name)
+{
+	const dlist_t	*temp;
+	char	tmpl[SMALLBUF];
+
+	temp = table_find(table, name);
+
+	if ((!temp) && (desc_template(name, tmpl, sizeof(tmpl), "n"))) {
+		temp = table_find(table, tmpl);
+
+		if ((!temp) && (desc_template(name, tmpl, sizeof(tmpl), NULL))) {
+			temp = table_find(table, tmpl);
+		}
+	}
+
+	return (temp) ? temp->desc : NULL;
+}
+
+static void desc_add(dtable_t *table, const char *name, const char *desc)
+{
+	dlist_t	*temp;
+
+	temp = table_find(table, name);
+
 	if (temp == NULL) {
+		if (table->count >= table->buckets) {
+			table_grow(table);
+		}
+
 		temp = xcalloc(1, sizeof(*temp));
 		temp->name = xstrdup(name);
-		temp->next = *list;
-		*list = temp;
+		temp->hash = nut_strhash(name, 1);
+		temp->next = table->hash[temp->hash & (table->buckets - 1)];
+		table->hash[temp->hash & (table->buckets - 1)] = temp;
+		table->count++;
 	}
 
 	free(temp->desc);
@@ -120,12 +244,12 @@ void desc_load(void)
 		}
 
 		if (!strcmp(ctx.arglist[0], "CMDDESC")) {
-			desc_add(&cmd_list, ctx.arglist[1], ctx.arglist[2]);
+			desc_add(&cmd_table, ctx.arglist[1], ctx.arglist[2]);
 			continue;
 		}
 
 		if (!strcmp(ctx.arglist[0], "VARDESC")) {
-			desc_add(&var_list, ctx.arglist[1], ctx.arglist[2]);
+			desc_add(&var_table, ctx.arglist[1], ctx.arglist[2]);
 			continue;
 		}
 
@@ -137,18 +261,16 @@ void desc_load(void)
 
 void desc_free(void)
 {
-	list_free(cmd_list);
-	list_free(var_list);
-
-	cmd_list = var_list = NULL;
+	table_free(&cmd_table);
+	table_free(&var_table);
 }
 
 const char *desc_get_cmd(const char *name)
 {
-	return list_get(cmd_list, name);
+	return table_get(&cmd_table, name);
 }
 
 const char *desc_get_var(const char *name)
 {
-	return list_get(var_list, name);
+	return table_get(&var_table, name);
 }
@@ -34,8 +34,16 @@
 #include "netmisc.h"
 #include "netuser.h"
 #include "netinstcmd.h"
+#include "netwatch.h"
 
 #define FLAG_USER	0x0001		/* username and password must be set */
+#define FLAG_SHARED	0x0002		/* only reads the shared state */
+#define FLAG_LOCAL	0x0004		/* only uses the client itself */
+
+/* the TLS handshake reads the certificate settings, which a reload may
+ * change, so it runs in parallel with other requests rather than without
+ * locking; OpenSSL before 1.1 gets its locking callbacks in ssl_init() */
+#define FLAG_STARTTLS	FLAG_SHARED
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
@@ -48,14 +56,17 @@ static struct {
 	void	(*func)(nut_ctype_t *client, size_t numargs, const char **arg);
 	int	flags;
 } netcmds[] = {
-	{ "VER",	net_ver,	0		},
-	{ "NETVER",	net_netver,	0		},
-	{ "PROTVER",	net_netver,	0		},	/* aliased since NUT 2.8.0 */
-	{ "HELP",	net_help,	0		},
-	{ "STARTTLS",	net_starttls,	0		},
-
-	{ "GET",	net_get,	0		},
-	{ "LIST",	net_list,	0		},
+	{ "VER",	net_ver,	FLAG_LOCAL	},
+	{ "NETVER",	net_netver,	FLAG_LOCAL	},
+	{ "PROTVER",	net_netver,	FLAG_LOCAL	},	/* aliased since NUT 2.8.0 */
+	{ "HELP",	net_help,	FLAG_LOCAL	},
+	{ "STARTTLS",	net_starttls,	FLAG_STARTTLS	},
+
+	{ "GET",	net_get,	FLAG_SHARED	},
+	{ "LIST",	net_list,	FLAG_SHARED	},
+
+	{ "WATCH",	net_watch,	0		},
+	{ "UNWATCH",	net_unwatch,	0		},
 
 	{ "USERNAME",	net_username,	0		},
 	{ "PASSWORD",	net_password,	0		},
@@ -24,6 +24,7 @@
 #include "state.h"
 #include "desc.h"
 #include "neterr.h"
+#include "stats.h"
 
 #include "netget.h"
 
@@ -160,6 +161,36 @@ static void get_type(nut_ctype_t *client, const char *upsname, const char *var)
 	sendback(client, "%s NUMBER\n", buf);
 }
 
+/* seconds since the driver last set a variable, changed or not */
+static void get_varage(nut_ctype_t *client, const char *upsname, const char *var)
+{
+	const	upstype_t	*ups;
+	const	st_tree_t	*node;
+	struct timeval	now;
+
+	ups = get_ups_ptr(upsname);
+
+	if (!ups) {
+		send_err(client, NUT_ERR_UNKNOWN_UPS);
+		return;
+	}
+
+	if (!ups_available(ups, client))
+		return;
+
+	node = sstate_getnode(ups, var);
+
+	if (!node) {
+		send_err(client, NUT_ERR_VAR_NOT_SUPPORTED);
+		return;
+	}
+
+	nut_monotime(&now);
+
+	sendback(client, "VARAGE %s %s %.3f\n", upsname, var,
+		nut_monotime_diff(&now, &node->updated));
+}
+
 static void get_var_server(nut_ctype_t *client, const char *upsname, const char *var)
 {
 	if (!strcasecmp(var, "server.info")) {
@@ -240,6 +271,12 @@ void net_get(nut_ctype_t *client, size_t numarg, const char **arg)
 		return;
 	}
 
+	/* GET STATS NAME */
+	if (!strcasecmp(arg[0], "STATS")) {
+		stats_get(client, arg[1]);
+		return;
+	}
+
 	/* GET NUMLOGINS UPS */
 	if (!strcasecmp(arg[0], "NUMLOGINS")) {
 		get_numlogins(client, arg[1]);
@@ -263,6 +300,12 @@ void net_get(nut_ctype_t *client, size_t numarg, const char **arg)
 		return;
 	}
 
+	/* GET VARAGE UPS VARNAME */
+	if (!strcasecmp(arg[0], "VARAGE")) {
+		get_varage(client, arg[1], arg[2]);
+		return;
+	}
+
 	/* GET TYPE UPS VARNAME */
 	if (!strcasecmp(arg[0], "TYPE")) {
 		get_type(client, arg[1], arg[2]);
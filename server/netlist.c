@@ -25,6 +25,8 @@
 #include "sstate.h"
 #include "state.h"
 #include "neterr.h"
+#include "nut_stdint.h"
+#include "stats.h"
 
 #include "netlist.h"
 
@@ -127,6 +129,99 @@ static void list_var(nut_ctype_t *client, const char *upsname)
 	sendback(client, "END LIST VAR %s\n", upsname);
 }
 
+/* variables changed after a given sequence number */
+static int delta_dump(st_tree_t *node, nut_ctype_t *client, const char *ups,
+	uint64_t since, int fsd)
+{
+	int	ret = 1;
+
+	if (!node)
+		return 1;
+
+	if (!delta_dump(node->left, client, ups, since, fsd))
+		return 0;
+
+	if (node->seq > since) {
+		if ((fsd == 1) && (!strcasecmp(node->var, "ups.status"))) {
+			ret = sendback(client, "VAR %s %s \"FSD %s\"\n",
+				ups, node->var, node->val);
+
+		} else {
+			ret = sendback(client, "VAR %s %s \"%s\"\n",
+				ups, node->var, node->val);
+		}
+	}
+
+	if (ret != 1)
+		return 0;
+
+	return delta_dump(node->right, client, ups, since, fsd);
+}
+
+/* variables deleted after a given sequence number */
+static int deleted_dump(st_tree_t *node, nut_ctype_t *client, const char *ups,
+	uint64_t since)
+{
+	if (!node)
+		return 1;
+
+	if (!deleted_dump(node->left, client, ups, since))
+		return 0;
+
+	if ((node->seq > since) && (!sendback(client, "DEL %s %s\n", ups, node->var)))
+		return 0;
+
+	return deleted_dump(node->right, client, ups, since);
+}
+
+static void list_delta(nut_ctype_t *client, const char *upsname, const char *seqstr)
+{
+	const   upstype_t *ups;
+	uint64_t	since;
+	char	*end;
+
+	ups = get_ups_ptr(upsname);
+
+	if (!ups) {
+		send_err(client, NUT_ERR_UNKNOWN_UPS);
+		return;
+	}
+
+	errno = 0;
+	since = (uint64_t)strtoull(seqstr, &end, 10);
+
+	if ((errno) || (end == seqstr) || (*end)) {
+		send_err(client, NUT_ERR_INVALID_ARGUMENT);
+		return;
+	}
+
+	if (!ups_available(ups, client))
+		return;
+
+	if (!sendback(client, "BEGIN LIST DELTA %s %s\n", upsname, seqstr))
+		return;
+
+	if (!sendback(client, "SEQ %s %" PRIu64 "\n", upsname, ups->seq))
+		return;
+
+	/* the data was reset (driver reconnected, upsd restarted...) since
+	 * the client last looked, or it is just starting: send everything */
+	if ((since < ups->seqbase) || (since > ups->seq)) {
+		if (!sendback(client, "RESET %s\n", upsname))
+			return;
+
+		since = 0;
+	}
+
+	if (!delta_dump(ups->inforoot, client, upsname, since, ups->fsd))
+		return;
+
+	if ((since > 0) && (!deleted_dump(ups->delroot, client, upsname, since)))
+		return;
+
+	sendback(client, "END LIST DELTA %s %s\n", upsname, seqstr);
+}
+
 static void list_cmd(nut_ctype_t *client, const char *upsname)
 {
 	const   upstype_t *ups;
@@ -298,14 +393,33 @@ void net_list(nut_ctype_t *client, size_t numarg, const char **arg)
 		return;
 	}
 
+	/* LIST STATS */
+	if (!strcasecmp(arg[0], "STATS")) {
+		stats_list(client);
+		return;
+	}
+
 	if (numarg < 2) {
 		send_err(client, NUT_ERR_INVALID_ARGUMENT);
 		return;
 	}
 
-	/* LIST VAR UPS */
+	/* LIST VAR UPS [UPS ...] */
 	if (!strcasecmp(arg[0], "VAR")) {
-		list_var(client, arg[1]);
+		size_t	i;
+
+		/* all of it is queued at once, keep that within bounds */
+		if (numarg - 1 > NUT_NET_LIST_UPS_MAX) {
+			send_err(client, NUT_ERR_INVALID_ARGUMENT);
+			return;
+		}
+
+		/* one block (or ERR line) per device, in the order asked for;
+		 * the answers are queued and go out together */
+		for (i = 1; i < numarg; i++) {
+			list_var(client, arg[i]);
+		}
+
 		return;
 	}
 
@@ -332,6 +446,12 @@ void net_list(nut_ctype_t *client, size_t numarg, const char **arg)
 		return;
 	}
 
+	/* LIST DELTA UPS SEQUENCE */
+	if (!strcasecmp(arg[0], "DELTA")) {
+		list_delta(client, arg[1], arg[2]);
+		return;
+	}
+
 	/* LIST ENUM UPS VARNAME */
 	if (!strcasecmp(arg[0], "ENUM")) {
 		list_enum(client, arg[1], arg[2]);
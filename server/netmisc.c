@@ -90,6 +90,7 @@ void net_fsd(nut_ctype_t *client, size_t numarg, const char **arg)
 		client->username, client->addr, ups->name);
 
 	ups->fsd = 1;
+	sstate_setchanged(ups, "ups.status");
 	sendback(client, "OK FSD-SET\n");
 }
 
@@ -65,6 +65,25 @@ int certrequest = 0;
 
 static int	ssl_initialized = 0;
 
+	/* handshakes done by net_starttls(), see ssl_stats() */
+static unsigned long	ssl_full = 0, ssl_resumed = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t	ssl_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* how many TLS handshakes were full ones, and how many resumed a session */
+void ssl_stats(unsigned long *full, unsigned long *resumed)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ssl_stats_lock);
+#endif
+	*full = ssl_full;
+	*resumed = ssl_resumed;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ssl_stats_lock);
+#endif
+}
+
 #ifndef WITH_SSL
 
 /* stubs for non-ssl compiles */
@@ -98,6 +117,13 @@ ssize_t ssl_read(nut_ctype_t *client, char *buf, size_t buflen)
 	return -1;
 }
 
+int ssl_pending(nut_ctype_t *client)
+{
+	NUT_UNUSED_VARIABLE(client);
+
+	return 0;
+}
+
 void ssl_init(void)
 {
 	ssl_initialized = 0;	/* keep gcc quiet */
@@ -116,10 +142,110 @@ void ssl_cleanup(void)
 
 #else
 
+/* STARTTLS runs on the worker threads, see FLAG_STARTTLS */
+static void ssl_count_handshake(nut_ctype_t *client, const char *version, int resumed)
+{
+	unsigned long	full, res;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&ssl_stats_lock);
+#endif
+	if (resumed) {
+		ssl_resumed++;
+	} else {
+		ssl_full++;
+	}
+
+	full = ssl_full;
+	res = ssl_resumed;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&ssl_stats_lock);
+#endif
+
+	upsdebugx(3, "SSL connected with %s (%s, %s; %lu full and %lu resumed handshakes so far)",
+		client->addr, version, resumed ? "session resumed" : "full handshake",
+		full, res);
+}
+
 #ifdef WITH_OPENSSL
 
 static SSL_CTX	*ssl_ctx = NULL;
 
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) && defined(HAVE_PTHREAD)
+/* OpenSSL before 1.1 leaves the locking of its shared data (session
+ * cache, error queues, ...) to the application, which the worker threads
+ * need as they read, write and handshake in parallel */
+static pthread_mutex_t	*ssl_locks = NULL;
+static int	ssl_numlocks = 0;
+
+static void ssl_locking_cb(int mode, int n, const char *file, int line)
+{
+	NUT_UNUSED_VARIABLE(file);
+	NUT_UNUSED_VARIABLE(line);
+
+	if ((n < 0) || (n >= ssl_numlocks)) {
+		return;
+	}
+
+	if (mode & CRYPTO_LOCK) {
+		pthread_mutex_lock(&ssl_locks[n]);
+	} else {
+		pthread_mutex_unlock(&ssl_locks[n]);
+	}
+}
+
+# if OPENSSL_VERSION_NUMBER < 0x10000000L
+/* 1.0 tells the threads apart by the address of errno, but not 0.9.8 */
+static unsigned long ssl_id_cb(void)
+{
+	return (unsigned long)pthread_self();
+}
+# endif
+
+static void ssl_locks_init(void)
+{
+	int	i;
+
+	if (ssl_locks) {
+		return;
+	}
+
+	ssl_numlocks = CRYPTO_num_locks();
+	ssl_locks = xcalloc((size_t)ssl_numlocks, sizeof(*ssl_locks));
+
+	for (i = 0; i < ssl_numlocks; i++) {
+		pthread_mutex_init(&ssl_locks[i], NULL);
+	}
+
+# if OPENSSL_VERSION_NUMBER < 0x10000000L
+	CRYPTO_set_id_callback(ssl_id_cb);
+# endif
+	CRYPTO_set_locking_callback(ssl_locking_cb);
+}
+
+static void ssl_locks_free(void)
+{
+	int	i;
+
+	if (!ssl_locks) {
+		return;
+	}
+
+	CRYPTO_set_locking_callback(NULL);
+# if OPENSSL_VERSION_NUMBER < 0x10000000L
+	CRYPTO_set_id_callback(NULL);
+# endif
+
+	for (i = 0; i < ssl_numlocks; i++) {
+		pthread_mutex_destroy(&ssl_locks[i]);
+	}
+
+	free(ssl_locks);
+	ssl_locks = NULL;
+	ssl_numlocks = 0;
+}
+#endif	/* OpenSSL < 1.1 && HAVE_PTHREAD */
+
 static void ssl_debug(void)
 {
 	unsigned long	e;
@@ -167,6 +293,30 @@ static int ssl_error(SSL *ssl, ssize_t ret)
 	return -1;
 }
 
+/* see whether a TLS call failed only because the socket would block,
+ * and note which events it waits for then */
+static int ssl_blocked(nut_ctype_t *client, int ret, int events)
+{
+	NUT_UNUSED_VARIABLE(events);
+
+	switch (SSL_get_error(client->ssl, ret))
+	{
+	case SSL_ERROR_WANT_READ:
+		client->ssl_want = POLLIN;
+		break;
+
+	case SSL_ERROR_WANT_WRITE:
+		client->ssl_want = POLLOUT;
+		break;
+
+	default:
+		return 0;
+	}
+
+	errno = EAGAIN;
+	return 1;
+}
+
 #elif defined(WITH_NSS) /* WITH_OPENSSL */
 
 static CERTCertificate *cert;
@@ -216,6 +366,19 @@ static int ssl_error(PRFileDesc *ssl, ssize_t ret)
 	return -1;
 }
 
+/* see whether a TLS call failed only because the socket would block;
+ * NSS does not tell which way, so assume the one of the call */
+static int ssl_blocked(nut_ctype_t *client, int ret, int events)
+{
+	if ((ret >= 0) || (PR_GetError() != PR_WOULD_BLOCK_ERROR)) {
+		return 0;
+	}
+
+	client->ssl_want = events;
+	errno = EAGAIN;
+	return 1;
+}
+
 static SECStatus AuthCertificate(CERTCertDBHandle *arg, PRFileDesc *fd,
 	PRBool checksig, PRBool isServer)
 {
@@ -247,22 +410,93 @@ static SECStatus BadCertHandler(nut_ctype_t *arg, PRFileDesc *fd)
 
 static void HandshakeCallback(PRFileDesc *fd, nut_ctype_t *client_data)
 {
+	int	resumed = 0;
+#if defined(NSS_VMAJOR) && (NSS_VMAJOR > 3 || (NSS_VMAJOR == 3 && defined(NSS_VMINOR) && NSS_VMINOR >= 34))
+	SSLChannelInfo	info;
+
+	/* "resumed" was added to SSLChannelInfo in NSS 3.34 */
+	if (SSL_GetChannelInfo(fd, &info, sizeof(info)) == SECSuccess) {
+		resumed = info.resumed;
+	}
+#else
 	NUT_UNUSED_VARIABLE(fd);
+#endif
 
 	upslogx(LOG_INFO, "SSL handshake done successfully with client %s",
 		client_data->addr);
+
+	ssl_count_handshake(client_data, "NSS", resumed);
 }
 
 
 #endif /* WITH_OPENSSL | WITH_NSS */
 
+/* go on with the handshake as far as the socket allows without blocking
+ * returns 1 once it is done, 0 while it waits for client->ssl_want,
+ * -1 if it failed
+ */
+static int ssl_handshake(nut_ctype_t *client)
+{
+#ifdef WITH_OPENSSL
+	int	ret;
+
+	client->ssl_want = 0;
+
+	ERR_clear_error();
+	ret = SSL_accept(client->ssl);
+
+	if (ret == 1) {
+		client->ssl_connected = 1;
+		ssl_count_handshake(client, SSL_get_version(client->ssl),
+			SSL_session_reused(client->ssl));
+		return 1;
+	}
+
+	if (ssl_blocked(client, ret, POLLIN)) {
+		return 0;
+	}
+
+	upslogx(LOG_ERR, "SSL handshake with %s failed", client->addr);
+	ssl_error(client->ssl, ret);
+	return -1;
+
+#elif defined(WITH_NSS) /* WITH_OPENSSL */
+	client->ssl_want = 0;
+
+	/* Note: this call can generate memory leaks not resolvable
+	 * by any release function.
+	 * Probably SSL session key object allocation. */
+	if (SSL_ForceHandshake(client->ssl) != SECSuccess) {
+		PRErrorCode code = PR_GetError();
+
+		/* the first flight of the server fits in the socket buffer
+		 * of a new connection, so it mostly waits for the client */
+		if (ssl_blocked(client, -1, POLLIN)) {
+			return 0;
+		}
+
+		if (code==SSL_ERROR_NO_CERTIFICATE) {
+			upslogx(LOG_WARNING, "Client %s do not provide certificate.",
+				client->addr);
+		} else {
+			nss_error("net_starttls / SSL_ForceHandshake");
+			return -1;
+		}
+	}
+
+	client->ssl_connected = 1;
+	return 1;
+#endif /* WITH_OPENSSL | WITH_NSS */
+}
+
 void net_starttls(nut_ctype_t *client, size_t numarg, const char **arg)
 {
 #ifdef WITH_OPENSSL
-	int ret;
+	int	flags;
 #elif defined(WITH_NSS) /* WITH_OPENSSL */
 	SECStatus	status;
 	PRFileDesc	*socket;
+	PRSocketOptionData	opt;
 #endif /* WITH_OPENSSL | WITH_NSS */
 
 	NUT_UNUSED_VARIABLE(numarg);
@@ -287,7 +521,6 @@ void net_starttls(nut_ctype_t *client, size_t numarg, const char **arg)
 #endif /* WITH_OPENSSL | WITH_NSS */
 	{
 		send_err(client, NUT_ERR_FEATURE_NOT_CONFIGURED);
-		ssl_initialized = 0;
 		return;
 	}
 
@@ -295,6 +528,12 @@ void net_starttls(nut_ctype_t *client, size_t numarg, const char **arg)
 		return;
 	}
 
+	/* the answer must go out in plain text before the handshake */
+	if ((client_flush(client) < 0) || (client->outlen > 0)) {
+		upslogx(LOG_ERR, "Can not send STARTTLS answer to %s", client->addr);
+		return;
+	}
+
 #ifdef WITH_OPENSSL
 
 	client->ssl = SSL_new(ssl_ctx);
@@ -311,24 +550,18 @@ void net_starttls(nut_ctype_t *client, size_t numarg, const char **arg)
 		return;
 	}
 
-	ret = SSL_accept(client->ssl);
-	switch (ret)
-	{
-	case 1:
-		client->ssl_connected = 1;
-		upsdebugx(3, "SSL connected (%s)", SSL_get_version(client->ssl));
-		break;
-
-	case 0:
-		upslog_with_errno(LOG_ERR, "SSL_accept do not accept handshake.");
-		ssl_error(client->ssl, ret);
-		break;
-	case -1:
-		upslog_with_errno(LOG_ERR, "Unknown return value from SSL_accept");
-		ssl_error(client->ssl, ret);
-		break;
+	/* a client which stops reading must not hold up the thread
+	 * serving it: records which do not fit stay queued until POLLOUT,
+	 * see client_write(), and they may be moved around meanwhile */
+	flags = fcntl(client->sock_fd, F_GETFL);
+	if ((flags < 0) || (fcntl(client->sock_fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		upslog_with_errno(LOG_ERR, "Can not make the connection of %s non-blocking", client->addr);
+		client_drop(client);
+		return;
 	}
 
+	SSL_set_mode(client->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 #elif defined(WITH_NSS) /* WITH_OPENSSL */
 
 	socket = PR_ImportTCPSocket(client->sock_fd);
@@ -389,23 +622,22 @@ void net_starttls(nut_ctype_t *client, size_t numarg, const char **arg)
 		return;
 	}
 
-	/* Note: this call can generate memory leaks not resolvable
-	 * by any release function.
-	 * Probably SSL session key object allocation. */
-	status = SSL_ForceHandshake(client->ssl);
-	if (status != SECSuccess) {
-		PRErrorCode code = PR_GetError();
-		if (code==SSL_ERROR_NO_CERTIFICATE) {
-			upslogx(LOG_WARNING, "Client %s do not provide certificate.",
-				client->addr);
-		} else {
-			nss_error("net_starttls / SSL_ForceHandshake");
-			/* TODO : Close the connection. */
-			return;
-		}
+	/* a client which stops reading must not hold up the thread
+	 * serving it, see client_write() */
+	opt.option = PR_SockOpt_Nonblocking;
+	opt.value.non_blocking = PR_TRUE;
+	if (PR_SetSocketOption(client->ssl, &opt) != PR_SUCCESS) {
+		upslogx(LOG_ERR, "Can not make the connection of %s non-blocking", client->addr);
+		nss_error("net_starttls / PR_SetSocketOption");
+		client_drop(client);
+		return;
 	}
-	client->ssl_connected = 1;
 #endif /* WITH_OPENSSL | WITH_NSS */
+
+	/* the rest of the handshake goes on as the client sends it */
+	if (ssl_handshake(client) < 0) {
+		client_drop(client);
+	}
 }
 
 void ssl_init(void)
@@ -428,6 +660,10 @@ void ssl_init(void)
 #ifdef WITH_OPENSSL
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
+# ifdef HAVE_PTHREAD
+	/* before any worker thread may get to use the library */
+	ssl_locks_init();
+# endif
 	SSL_load_error_strings();
 	SSL_library_init();
 
@@ -481,6 +717,19 @@ void ssl_init(void)
 
 	SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
 
+	/* Let returning clients (e.g. upsmon after a network hiccup) resume
+	 * their session, be it from our cache or from a session ticket, and
+	 * skip the public key operations of a full handshake. Such sessions
+	 * must not outlive whatever a reconnect period may be, but older
+	 * OpenSSL releases default to forgetting them after 5 minutes. */
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_timeout(ssl_ctx, NETSSL_SESSION_TIMEOUT);
+
+	if (SSL_CTX_set_session_id_context(ssl_ctx, (const unsigned char *)"upsd", 4) != 1) {
+		ssl_debug();
+		fatalx(EXIT_FAILURE, "SSL_CTX_set_session_id_context failed");
+	}
+
 	ssl_initialized = 1;
 
 #elif defined(WITH_NSS) /* WITH_OPENSSL */
@@ -515,14 +764,23 @@ void ssl_init(void)
 		return;
 	}
 
-	/* Default server cache config */
-	status = SSL_ConfigServerSessionIDCache(0, 0, 0, NULL);
+	/* Default server cache config, with the lifetime of sessions
+	 * for TLS as for the OpenSSL backend */
+	status = SSL_ConfigServerSessionIDCache(0, 0, NETSSL_SESSION_TIMEOUT, NULL);
 	if (status != SECSuccess) {
 		upslogx(LOG_ERR, "Can not initialize SSL server cache");
 		nss_error("upscli_init / SSL_ConfigServerSessionIDCache");
 		return;
 	}
 
+	/* Resume sessions from tickets too, keeping nothing on our side */
+	status = SSL_OptionSetDefault(SSL_ENABLE_SESSION_TICKETS, PR_TRUE);
+	if (status != SECSuccess) {
+		upslogx(LOG_ERR, "Can not enable SSL session tickets");
+		nss_error("upscli_init / SSL_OptionSetDefault(SSL_ENABLE_SESSION_TICKETS)");
+		return;
+	}
+
 	if (!disable_weak_ssl) {
 		status = SSL_OptionSetDefault(SSL_ENABLE_SSL3, PR_TRUE);
 		if (status != SECSuccess) {
@@ -631,14 +889,43 @@ void ssl_init(void)
 #ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_TAUTOLOGICAL_CONSTANT_OUT_OF_RANGE_COMPARE_BESIDEFUNC
 # pragma GCC diagnostic ignored "-Wtautological-constant-out-of-range-compare"
 #endif
+/* finish the handshake before anything else goes through, returns 0
+ * once it is done, -1 otherwise (with errno EAGAIN while it goes on) */
+static int ssl_connect_step(nut_ctype_t *client)
+{
+	int	ret;
+
+	if (client->ssl_connected) {
+		return 0;
+	}
+
+	ret = ssl_handshake(client);
+
+	if (ret > 0) {
+		return 0;
+	}
+
+	if (ret == 0) {
+		errno = EAGAIN;
+	} else {
+		errno = EIO;
+	}
+
+	return -1;
+}
+
+/* returns -1 with errno EAGAIN when the TLS layer has to wait for
+ * client->ssl_want first */
 ssize_t ssl_read(nut_ctype_t *client, char *buf, size_t buflen)
 {
 	ssize_t	ret = -1;
 
-	if (!client->ssl_connected) {
+	if (ssl_connect_step(client) < 0) {
 		return -1;
 	}
 
+	client->ssl_want = 0;
+
 #ifdef WITH_OPENSSL
 	/* SSL_* routines deal with int type for return and buflen
 	 * We might need to window our I/O if we exceed 2GB (in
@@ -646,6 +933,7 @@ ssize_t ssl_read(nut_ctype_t *client, char *buf, size_t buflen)
 	 * but smaller systems with 16-bits might be endangered :)
 	 */
 	assert(buflen <= INT_MAX);
+	ERR_clear_error();
 	int iret = SSL_read(client->ssl, buf, (int)buflen);
 	assert(iret <= SSIZE_MAX);
 	ret = (ssize_t)iret;
@@ -657,21 +945,32 @@ ssize_t ssl_read(nut_ctype_t *client, char *buf, size_t buflen)
 #endif /* WITH_OPENSSL | WITH_NSS */
 
 	if (ret < 1) {
+		if (ssl_blocked(client, (int)ret, POLLIN)) {
+			return -1;
+		}
+
 		ssl_error(client->ssl, ret);
+		/* not to be taken for having to wait */
+		errno = EIO;
 		return -1;
 	}
 
 	return ret;
 }
 
+/* returns -1 with errno EAGAIN when the TLS layer has to wait for
+ * client->ssl_want first, the caller then calls again with the same
+ * data once it may go on (which it may have moved meanwhile) */
 ssize_t ssl_write(nut_ctype_t *client, const char *buf, size_t buflen)
 {
 	ssize_t	ret = -1;
 
-	if (!client->ssl_connected) {
+	if (ssl_connect_step(client) < 0) {
 		return -1;
 	}
 
+	client->ssl_want = 0;
+
 #ifdef WITH_OPENSSL
 	/* SSL_* routines deal with int type for return and buflen
 	 * We might need to window our I/O if we exceed 2GB (in
@@ -679,6 +978,7 @@ ssize_t ssl_write(nut_ctype_t *client, const char *buf, size_t buflen)
 	 * but smaller systems with 16-bits might be endangered :)
 	 */
 	assert(buflen <= INT_MAX);
+	ERR_clear_error();
 	int iret = SSL_write(client->ssl, buf, (int)buflen);
 	assert(iret <= SSIZE_MAX);
 	ret = (ssize_t)iret;
@@ -691,16 +991,59 @@ ssize_t ssl_write(nut_ctype_t *client, const char *buf, size_t buflen)
 
 	upsdebugx(5, "ssl_write ret=%zd", ret);
 
+	if (ret < 1) {
+		if (ssl_blocked(client, (int)ret, POLLOUT)) {
+			return -1;
+		}
+
+		ssl_error(client->ssl, ret);
+		errno = EIO;
+		return -1;
+	}
+
 	return ret;
 }
 #if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP_BESIDEFUNC) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_TYPE_LIMITS_BESIDEFUNC) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_TAUTOLOGICAL_CONSTANT_OUT_OF_RANGE_COMPARE_BESIDEFUNC) )
 # pragma GCC diagnostic pop
 #endif
 
+/* whether the TLS layer holds data it read from the socket already, which
+ * the loop would not hear about as the socket has nothing left to read */
+int ssl_pending(nut_ctype_t *client)
+{
+	if ((!client->ssl) || (!client->ssl_connected)) {
+		return 0;
+	}
+
+#ifdef WITH_OPENSSL
+# if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	/* also whole records not decrypted yet */
+	if (SSL_has_pending(client->ssl)) {
+		return 1;
+	}
+# endif
+	return SSL_pending(client->ssl) > 0;
+#elif defined(WITH_NSS) /* WITH_OPENSSL */
+	return SSL_DataPending(client->ssl) > 0;
+#endif /* WITH_OPENSSL | WITH_NSS */
+}
+
 void ssl_finish(nut_ctype_t *client)
 {
 	if (client->ssl) {
 #ifdef WITH_OPENSSL
+		/* SSL_free() alone would drop the session from the cache as
+		 * if the connection had failed; keep it for the client to
+		 * resume, but do not wait on one that may be gone by now to
+		 * read our close_notify. Failed connections were dropped from
+		 * the cache by OpenSSL already. */
+		if (client->ssl_connected) {
+			SSL_set_quiet_shutdown(client->ssl, 1);
+			if (SSL_shutdown(client->ssl) < 0) {
+				ERR_clear_error();
+			}
+		}
+
 		SSL_free(client->ssl);
 #elif defined(WITH_NSS)
 		PR_Shutdown(client->ssl, PR_SHUTDOWN_BOTH);
@@ -713,11 +1056,16 @@ void ssl_finish(nut_ctype_t *client)
 
 void ssl_cleanup(void)
 {
+	upsdebugx(1, "TLS handshakes: %lu full, %lu resumed", ssl_full, ssl_resumed);
+
 #ifdef WITH_OPENSSL
 	if (ssl_ctx) {
 		SSL_CTX_free(ssl_ctx);
 		ssl_ctx = NULL;
 	}
+# if (OPENSSL_VERSION_NUMBER < 0x10100000L) && defined(HAVE_PTHREAD)
+	ssl_locks_free();
+# endif
 #elif defined(WITH_NSS) /* WITH_OPENSSL */
 	CERT_DestroyCertificate(cert);
     SECKEY_DestroyPrivateKey(privKey);
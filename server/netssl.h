@@ -44,13 +44,18 @@ extern int certrequest;
 /* Required (cnx failed if no certificate or invalid CA chain) */
 #define NETSSL_CERTREQ_REQUIRE	2
 
+/* Seconds a TLS session can be resumed for after its full handshake */
+#define NETSSL_SESSION_TIMEOUT	3600
+
 
 void ssl_init(void);
 void ssl_finish(nut_ctype_t *client);
 void ssl_cleanup(void);
+void ssl_stats(unsigned long *full, unsigned long *resumed);
 
 ssize_t ssl_read(nut_ctype_t *client, char *buf, size_t buflen);
 ssize_t ssl_write(nut_ctype_t *client, const char *buf, size_t buflen);
+int ssl_pending(nut_ctype_t *client);
 
 void net_starttls(nut_ctype_t *client, size_t numarg, const char **arg);
 
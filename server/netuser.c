@@ -82,7 +82,7 @@ void net_logout(nut_ctype_t *client, size_t numarg, const char **arg)
 
 	sendback(client, "OK Goodbye\n");
 
-	client->last_heard = 0;
+	timerclear(&client->last_heard);
 }
 
 /* NOTE: Protocol updated since NUT 2.8.0 to handle master/primary
@@ -0,0 +1,264 @@
+/* netwatch.c - WATCH handlers for upsd
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Clients may subscribe to the variables of a UPS, and then get every
+ * change parsed from the driver pushed to them as it happens, instead
+ * of polling for it. The pushed lines are queued like any answer, so
+ * they never end up in the middle of the answer to a request.
+ */
+
+#include "common.h"
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <sys/socket.h>
+
+#include "upsd.h"
+#include "sstate.h"
+#include "state.h"
+#include "neterr.h"
+
+#include "netwatch.h"
+
+/* variable names are case-insensitive, so are the patterns; without
+ * FNM_CASEFOLD, both are matched in lower case */
+#ifdef FNM_CASEFOLD
+#define WATCH_FNM_FLAGS	FNM_CASEFOLD
+#else
+#define WATCH_FNM_FLAGS	0
+
+static void watch_lower(char *dst, size_t dstlen, const char *src)
+{
+	size_t	i;
+
+	for (i = 0; (src[i]) && (i < dstlen - 1); i++) {
+		dst[i] = (char)tolower((unsigned char)src[i]);
+	}
+
+	dst[i] = '\0';
+}
+#endif
+
+static int watch_match(const watch_t *watch, const char *var)
+{
+	size_t	i;
+#ifndef FNM_CASEFOLD
+	char	lower[SMALLBUF];
+#endif
+
+	if (!watch->numglobs) {
+		return 1;
+	}
+
+#ifndef FNM_CASEFOLD
+	watch_lower(lower, sizeof(lower), var);
+	var = lower;
+#endif
+
+	for (i = 0; i < watch->numglobs; i++) {
+		if (!fnmatch(watch->globs[i], var, WATCH_FNM_FLAGS)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void watch_free(watch_t *watch)
+{
+	size_t	i;
+
+	for (i = 0; i < watch->numglobs; i++) {
+		free(watch->globs[i]);
+	}
+
+	free(watch->globs);
+	free(watch);
+}
+
+/* remove the subscription of a client to a UPS, if any */
+static int watch_del(upstype_t *ups, nut_ctype_t *client)
+{
+	watch_t	**wptr;
+
+	for (wptr = &ups->watchers; *wptr; wptr = &(*wptr)->next) {
+		watch_t	*watch = *wptr;
+
+		if (watch->client != client) {
+			continue;
+		}
+
+		*wptr = watch->next;
+		client->numwatch--;
+		watch_free(watch);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* queue a change for one watcher, node is NULL if var was deleted */
+static void watch_send(const watch_t *watch, const upstype_t *ups,
+	const st_tree_t *node, const char *var)
+{
+	nut_ctype_t	*client = watch->client;
+
+	if (!node) {
+		sendpush(client, "PUSH DEL %s %s\n", ups->name, var);
+
+	} else if ((ups->fsd == 1) && (!strcasecmp(node->var, "ups.status"))) {
+		sendpush(client, "PUSH VAR %s %s \"FSD %s\"\n",
+			ups->name, node->var, node->val);
+
+	} else {
+		sendpush(client, "PUSH VAR %s %s \"%s\"\n",
+			ups->name, node->var, node->val);
+	}
+}
+
+/* send the current values to a new watcher */
+static void watch_dump(const watch_t *watch, const upstype_t *ups, const st_tree_t *node)
+{
+	for (; node; node = node->right) {
+		watch_dump(watch, ups, node->left);
+
+		if (watch_match(watch, node->var)) {
+			watch_send(watch, ups, node, node->var);
+		}
+	}
+}
+
+void net_watch(nut_ctype_t *client, size_t numarg, const char **arg)
+{
+	upstype_t	*ups;
+	watch_t	*watch;
+	size_t	i;
+	int	on = 1;
+
+	if (numarg < 1) {
+		send_err(client, NUT_ERR_INVALID_ARGUMENT);
+		return;
+	}
+
+	ups = get_ups_ptr(arg[0]);
+
+	if (!ups) {
+		send_err(client, NUT_ERR_UNKNOWN_UPS);
+		return;
+	}
+
+	/* a new WATCH replaces the previous one for the same UPS */
+	watch_del(ups, client);
+
+	watch = xcalloc(1, sizeof(*watch));
+	watch->client = client;
+	watch->numglobs = numarg - 1;
+
+	if (watch->numglobs) {
+		watch->globs = xcalloc(watch->numglobs, sizeof(*watch->globs));
+
+		for (i = 0; i < watch->numglobs; i++) {
+			watch->globs[i] = xstrdup(arg[i + 1]);
+#ifndef FNM_CASEFOLD
+			watch_lower(watch->globs[i], strlen(arg[i + 1]) + 1, arg[i + 1]);
+#endif
+		}
+	}
+
+	watch->next = ups->watchers;
+	ups->watchers = watch;
+	client->numwatch++;
+
+	/* watchers may stay silent for long, notice if they vanish */
+	if (setsockopt(client->sock_fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0) {
+		upsdebug_with_errno(2, "%s: can't enable keepalive for %s", __func__, client->addr);
+	}
+
+	upsdebugx(2, "%s: %s watches UPS [%s] (%zu patterns)",
+		__func__, client->addr, ups->name, watch->numglobs);
+
+	if (!sendback(client, "OK\n")) {
+		return;
+	}
+
+	if ((ups->sock_fd < 0) || (ups->stale)) {
+		return;
+	}
+
+	watch_dump(watch, ups, ups->inforoot);
+}
+
+void net_unwatch(nut_ctype_t *client, size_t numarg, const char **arg)
+{
+	upstype_t	*ups;
+
+	if (numarg != 1) {
+		send_err(client, NUT_ERR_INVALID_ARGUMENT);
+		return;
+	}
+
+	ups = get_ups_ptr(arg[0]);
+
+	if (!ups) {
+		send_err(client, NUT_ERR_UNKNOWN_UPS);
+		return;
+	}
+
+	watch_del(ups, client);
+
+	sendback(client, "OK\n");
+}
+
+void watch_notify(upstype_t *ups, const char *var)
+{
+	const st_tree_t	*node;
+	const watch_t	*watch;
+
+	if (!ups->watchers) {
+		return;
+	}
+
+	node = state_tree_find(ups->inforoot, var);
+
+	for (watch = ups->watchers; watch; watch = watch->next) {
+		if (watch_match(watch, var)) {
+			watch_send(watch, ups, node, var);
+		}
+	}
+}
+
+void watch_client_free(nut_ctype_t *client)
+{
+	upstype_t	*ups;
+
+	for (ups = firstups; ups && client->numwatch; ups = ups->next) {
+		watch_del(ups, client);
+	}
+}
+
+void watch_ups_free(upstype_t *ups)
+{
+	while (ups->watchers) {
+		watch_t	*watch = ups->watchers;
+
+		ups->watchers = watch->next;
+		watch->client->numwatch--;
+		watch_free(watch);
+	}
+}
@@ -38,6 +38,11 @@
 #endif
 
 #include "parseconf.h"
+#include "twheel.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
@@ -49,7 +54,7 @@ extern "C" {
 typedef struct nut_ctype_s {
 	char	*addr;
 	int	sock_fd;
-	time_t	last_heard;
+	struct timeval	last_heard;	/* nut_monotime(), cleared once dropped */
 	char	*loginups;
 	char	*password;
 	char	*username;
@@ -65,9 +70,47 @@ typedef struct nut_ctype_s {
 	void *ssl;
 #endif
 	int	ssl_connected;
+	int	ssl_want;	/* POLLIN or POLLOUT the TLS layer waits for
+				 * to go on, 0 if it does not */
 
 	PCONF_CTX_t	ctx;
 
+	/* pending output queued by sendback(), flushed by client_flush() */
+	char	*outbuf;	/* ring buffer */
+	size_t	outsize;	/* allocated size of outbuf */
+	size_t	outhead;	/* offset of the first pending byte */
+	size_t	outlen;		/* number of pending bytes */
+
+	/* requests read but kept for later by client_parse() */
+	char	*inbuf;
+	size_t	inlen;
+
+	size_t	numwatch;	/* UPSes this client WATCHes */
+
+	twtimer_t	idle;	/* on the loop serving it, see client_idle() */
+
+	/* a scraper from METRICS_LISTEN: 1 + the line ends in a row it sent,
+	 * 4 once it is answered */
+	int	metrics;
+
+	/* worker thread serving this client (see WORKERS in upsd.conf),
+	 * NULL if it is served by the main loop */
+	struct upsd_worker_s	*worker;
+	int	poked;		/* waiting in the poke list of the worker */
+	int	inloop;		/* registered with the loop of the worker */
+#ifdef HAVE_PTHREAD
+	/* taken around the output queue and last_heard, which the main
+	 * loop also uses to push WATCHed changes to worker clients */
+	pthread_mutex_t	outlock;
+
+	/* changes pushed by the main loop while outlock was taken, which
+	 * the worker queues in turn, covered by the lock of the worker */
+	char	*deferbuf;
+	size_t	deferlen;
+	size_t	defersize;
+	int	deferdrop;	/* too many piled up, have it dropped */
+#endif
+
 	/* doubly linked list */
 	struct nut_ctype_s	*prev;
 	struct nut_ctype_s	*next;
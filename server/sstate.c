@@ -28,6 +28,10 @@
 #include "upsd.h"
 #include "upstype.h"
 #include "nut_stdint.h"
+#include "evloop.h"
+#include "netwatch.h"
+#include "dsproto.h"
+#include "stats.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -37,6 +41,86 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+/* a variable announced by a driver speaking compact records */
+typedef struct svar_s {
+	char	*name;
+	st_tree_t	*node;	/* in inforoot, looked up on first use */
+} svar_t;
+
+/* a line held back until the end of a BATCH */
+typedef struct sbatch_s {
+	unsigned int	id;	/* compact record for this variable, or 0 */
+	char	**arg;	/* NULL terminated, just the value if id is set */
+} sbatch_t;
+
+/* bookkeeping for a variable added or changed by the driver */
+static void setinfo_done(upstype_t *ups, const char *var)
+{
+	ups->seq++;
+
+	if (ups->delroot) {
+		state_delinfo(&ups->delroot, var);
+	}
+
+	watch_notify(ups, var);
+}
+
+/* drop any pointer to the node of a variable about to be deleted */
+static void svar_forget(upstype_t *ups, const char *var)
+{
+	st_tree_t	*node;
+	size_t	i;
+
+	if (!ups->vars) {
+		return;
+	}
+
+	node = state_tree_find(ups->inforoot, var);
+
+	for (i = 0; node && (i < ups->numvars); i++) {
+		if (ups->vars[i].node == node) {
+			ups->vars[i].node = NULL;
+		}
+	}
+}
+
+static void svar_free(upstype_t *ups)
+{
+	size_t	i;
+
+	for (i = 0; i < ups->numvars; i++) {
+		free(ups->vars[i].name);
+	}
+
+	free(ups->vars);
+
+	ups->vars = NULL;
+	ups->numvars = 0;
+}
+
+/* SETINFO through a compact record: no parsing, and no lookup either
+ * once the node of this variable is known */
+static void svar_setinfo(upstype_t *ups, unsigned int id, const char *val)
+{
+	svar_t	*var = &ups->vars[id];
+	int	ret;
+
+	if (!var->node) {
+		var->node = state_tree_find(ups->inforoot, var->name);
+	}
+
+	if (var->node) {
+		ret = state_setnode_seq(var->node, val, ups->seq + 1);
+	} else {
+		ret = state_setinfo_seq(&ups->inforoot, var->name, val, ups->seq + 1);
+		var->node = state_tree_find(ups->inforoot, var->name);
+	}
+
+	if (ret) {
+		setinfo_done(ups, var->name);
+	}
+}
+
 static int parse_args(upstype_t *ups, size_t numargs, char **arg)
 {
 	if (numargs < 1)
@@ -49,17 +133,31 @@ static int parse_args(upstype_t *ups, size_t numargs, char **arg)
 
 	if (!strcasecmp(arg[0], "DUMPDONE")) {
 		upsdebugx(3, "UPS [%s]: dump is done", ups->name);
+
+		if (!ups->dumpdone) {
+			ssize_t	saved = 0;
+			size_t	shared = state_sharednames(ups->inforoot, &saved);
+
+			/* sharing only pays off once a few devices do */
+			upslogx(LOG_INFO, "UPS [%s]: %zu variable names shared with other devices (%zd bytes %s)",
+				ups->name, shared, (saved < 0) ? -saved : saved,
+				(saved < 0) ? "more than unshared copies" : "saved");
+		}
+
 		ups->dumpdone = 1;
+		ups_check_soon(ups);
 		return 1;
 	}
 
 	if (!strcasecmp(arg[0], "DATASTALE")) {
 		ups->data_ok = 0;
+		ups_check_soon(ups);
 		return 1;
 	}
 
 	if (!strcasecmp(arg[0], "DATAOK")) {
 		ups->data_ok = 1;
+		ups_check_soon(ups);
 		return 1;
 	}
 
@@ -79,9 +177,27 @@ static int parse_args(upstype_t *ups, size_t numargs, char **arg)
 		return 1;
 	}
 
+	/* PROTVER <version>, compact records follow from 2 on */
+	if (!strcasecmp(arg[0], "PROTVER")) {
+		if (atoi(arg[1]) >= DSP_PROTVER_COMPACT) {
+			upsdebugx(2, "UPS [%s]: driver sends compact records", ups->name);
+			ups->compact = 1;
+		}
+		return 1;
+	}
+
 	/* DELINFO <var> */
 	if (!strcasecmp(arg[0], "DELINFO")) {
-		state_delinfo(&ups->inforoot, arg[1]);
+		svar_forget(ups, arg[1]);
+
+		if (state_delinfo(&ups->inforoot, arg[1])) {
+			/* remember it for LIST DELTA */
+			ups->seq++;
+			state_delinfo(&ups->delroot, arg[1]);
+			state_setinfo_seq(&ups->delroot, arg[1], "", ups->seq);
+
+			watch_notify(ups, arg[1]);
+		}
 		return 1;
 	}
 
@@ -96,7 +212,9 @@ static int parse_args(upstype_t *ups, size_t numargs, char **arg)
 
 	/* SETINFO <varname> <value> */
 	if (!strcasecmp(arg[0], "SETINFO")) {
-		state_setinfo(&ups->inforoot, arg[1], arg[2]);
+		if (state_setinfo_seq(&ups->inforoot, arg[1], arg[2], ups->seq + 1)) {
+			setinfo_done(ups, arg[1]);
+		}
 		return 1;
 	}
 
@@ -148,6 +266,100 @@ static int parse_args(upstype_t *ups, size_t numargs, char **arg)
 	return 0;
 }
 
+static void batch_free(upstype_t *ups)
+{
+	size_t	i, j;
+
+	for (i = 0; i < ups->batchlen; i++) {
+		for (j = 0; ups->batch[i].arg[j]; j++) {
+			free(ups->batch[i].arg[j]);
+		}
+
+		free(ups->batch[i].arg);
+	}
+
+	free(ups->batch);
+
+	ups->batch = NULL;
+	ups->batchlen = 0;
+	ups->batchsize = 0;
+	ups->inbatch = 0;
+}
+
+static void batch_apply(upstype_t *ups)
+{
+	size_t	i, numargs;
+
+	if (ups->batchlen > 0) {
+		upsdebugx(3, "UPS [%s]: applying batch of %zu updates", ups->name, ups->batchlen);
+	}
+
+	for (i = 0; i < ups->batchlen; i++) {
+		if (ups->batch[i].id) {
+			svar_setinfo(ups, ups->batch[i].id, ups->batch[i].arg[0]);
+			continue;
+		}
+
+		for (numargs = 0; ups->batch[i].arg[numargs]; numargs++);
+
+		parse_args(ups, numargs, ups->batch[i].arg);
+	}
+
+	batch_free(ups);
+}
+
+/* hold back what the driver sends between BATCH BEGIN and BATCH END,
+ * so clients never see a half applied update (e.g. ups.status changed
+ * but not ups.alarm yet), returns 1 if the line was taken care of;
+ * a non zero id stands for a compact SETINFO of that variable to arg[0] */
+static int batch_handle(upstype_t *ups, unsigned int id, size_t numargs, char **arg)
+{
+	char	**line;
+	size_t	i;
+
+	if ((!id) && (numargs == 2) && (!strcasecmp(arg[0], "BATCH"))) {
+		if (!strcasecmp(arg[1], "BEGIN")) {
+			/* don't lose an unfinished one */
+			batch_apply(ups);
+			ups->inbatch = 1;
+			return 1;
+		}
+
+		if (!strcasecmp(arg[1], "END")) {
+			batch_apply(ups);
+			return 1;
+		}
+	}
+
+	if (!ups->inbatch) {
+		return 0;
+	}
+
+	if (ups->batchlen >= SS_BATCH_MAX) {
+		upslogx(LOG_NOTICE, "UPS [%s]: batch exceeds %d updates, applying it now",
+			ups->name, SS_BATCH_MAX);
+		batch_apply(ups);
+		return 0;
+	}
+
+	if (ups->batchlen == ups->batchsize) {
+		ups->batchsize = ups->batchsize ? ups->batchsize * 2 : 64;
+		ups->batch = xrealloc(ups->batch, ups->batchsize * sizeof(*ups->batch));
+	}
+
+	line = xcalloc(numargs + 1, sizeof(*line));
+
+	for (i = 0; i < numargs; i++) {
+		line[i] = xstrdup(arg[i]);
+	}
+
+	ups->batch[ups->batchlen].id = id;
+	ups->batch[ups->batchlen].arg = line;
+	ups->batchlen++;
+
+	return 1;
+}
+
 /* nothing fancy - just make the driver say something back to us */
 static void sendping(upstype_t *ups)
 {
@@ -168,7 +380,7 @@ static void sendping(upstype_t *ups)
 		return;
 	}
 
-	time(&ups->last_ping);
+	nut_monotime(&ups->last_ping);
 }
 
 /* interface */
@@ -176,7 +388,8 @@ static void sendping(upstype_t *ups)
 int sstate_connect(upstype_t *ups)
 {
 	int	fd;
-	const char	*dumpcmd = "DUMPALL\n";
+	/* ask for compact records (older drivers just ignore that) */
+	const char	*dumpcmd = "PROTVER 2\nDUMPALL\n";
 	size_t	dumpcmdlen = strlen(dumpcmd);
 	ssize_t	ret;
 	struct sockaddr_un	sa;
@@ -197,13 +410,14 @@ int sstate_connect(upstype_t *ups)
 	ret = connect(fd, (struct sockaddr *) &sa, sizeof(sa));
 
 	if (ret < 0) {
-		time_t	now;
+		struct timeval	now;
 
 		close(fd);
 
 		/* rate-limit complaints - don't spam the syslog */
-		time(&now);
-		if (difftime(now, ups->last_connfail) < SS_CONNFAIL_INT)
+		nut_monotime(&now);
+		if ((timerisset(&ups->last_connfail))
+			&& (nut_monotime_diff(&now, &ups->last_connfail) < SS_CONNFAIL_INT))
 			return -1;
 
 		ups->last_connfail = now;
@@ -238,16 +452,23 @@ int sstate_connect(upstype_t *ups)
 		return -1;
 	}
 
+	if (evloop_add(fd, POLLIN, EVLOOP_DRIVER, ups) < 0) {
+		upslogx(LOG_ERR, "Can't watch socket for UPS [%s]", ups->name);
+		close(fd);
+		return -1;
+	}
+
 	pconf_init(&ups->sock_ctx, NULL);
 
 	ups->dumpdone = 0;
 	ups->stale = 0;
 
 	/* now is the last time we heard something from the driver */
-	time(&ups->last_heard);
+	nut_monotime(&ups->last_heard);
 
 	/* set ups.status to "WAIT" while waiting for the driver response to dumpcmd */
-	state_setinfo(&ups->inforoot, "ups.status", "WAIT");
+	state_setinfo_seq(&ups->inforoot, "ups.status", "WAIT", ++ups->seq);
+	watch_notify(ups, "ups.status");
 
 	upslogx(LOG_INFO, "Connected to UPS [%s]: %s", ups->name, ups->fn);
 
@@ -264,15 +485,176 @@ void sstate_disconnect(upstype_t *ups)
 	sstate_cmdfree(ups);
 
 	pconf_finish(&ups->sock_ctx);
+	batch_free(ups);
+	svar_free(ups);
 
+	free(ups->rbuf);
+	ups->rbuf = NULL;
+	ups->rlen = 0;
+	ups->rsize = 0;
+	ups->compact = 0;
+
+	evloop_del(ups->sock_fd);
 	close(ups->sock_fd);
 	ups->sock_fd = -1;
+
+	/* reconnect right away */
+	ups_check_soon(ups);
+}
+
+/* set the 'last heard' time to now for later staleness checks */
+static void sstate_heard(upstype_t *ups)
+{
+	nut_monotime(&ups->last_heard);
+
+	/* don't wait for the next check to tell that it is back, unless
+	 * it is the driver which says the data is stale */
+	if ((ups->stale) && ((!ups->dumpdone) || (ups->data_ok))) {
+		ups_check_soon(ups);
+	}
+}
+
+/* feed text protocol to the parser, returns how much of it was used:
+ * all of it, unless the driver switched to compact records meanwhile */
+static size_t sock_text(upstype_t *ups, const char *buf, size_t buflen)
+{
+	size_t	i, used;
+	int	compact = ups->compact;
+
+	for (i = 0; i < buflen; i += used) {
+
+		switch (pconf_line_buf(&ups->sock_ctx, buf + i, buflen - i, &used))
+		{
+		case 1:
+			if (batch_handle(ups, 0, ups->sock_ctx.numargs, ups->sock_ctx.arglist)
+			 || parse_args(ups, ups->sock_ctx.numargs, ups->sock_ctx.arglist)) {
+				sstate_heard(ups);
+			}
+
+			if (ups->compact && !compact) {
+				return i + used;	/* the rest is records */
+			}
+			continue;
+
+		case 0:
+			continue;	/* haven't gotten a line yet */
+
+		default:
+			/* parse error */
+			upslogx(LOG_NOTICE, "Parse error on sock: %s", ups->sock_ctx.errmsg);
+			STATS_ADD(driver_parse_errors, 1);
+			return buflen;
+		}
+	}
+
+	return buflen;
+}
+
+/* handle one compact record, returns 0 if it makes no sense */
+static int sock_record(upstype_t *ups, const dsp_rec_t *rec)
+{
+	char	val[ST_MAX_VALUE_LEN];
+
+	switch (rec->type)
+	{
+	case DSP_REC_TEXT:
+		sock_text(ups, rec->data, rec->len);
+		return 1;
+
+	case DSP_REC_NAME:
+		if ((rec->id < 1) || (rec->len < 1)) {
+			return 0;
+		}
+
+		if (rec->id >= ups->numvars) {
+			size_t	num = rec->id + 64;
+
+			ups->vars = xrealloc(ups->vars, num * sizeof(*ups->vars));
+			memset(ups->vars + ups->numvars, 0, (num - ups->numvars) * sizeof(*ups->vars));
+			ups->numvars = num;
+		}
+
+		free(ups->vars[rec->id].name);
+		ups->vars[rec->id].name = xcalloc(1, rec->len + 1);
+		memcpy(ups->vars[rec->id].name, rec->data, rec->len);
+		ups->vars[rec->id].node = NULL;
+		return 1;
+
+	case DSP_REC_SET:
+		if ((rec->id >= ups->numvars) || (!ups->vars[rec->id].name)
+		 || (rec->len >= sizeof(val))) {
+			return 0;
+		}
+
+		memcpy(val, rec->data, rec->len);
+		val[rec->len] = '\0';
+
+		sstate_heard(ups);
+
+		if (ups->inbatch) {
+			char	*arg = val;
+
+			if (batch_handle(ups, rec->id, 1, &arg)) {
+				return 1;
+			}
+		}
+
+		svar_setinfo(ups, rec->id, val);
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/* add data to the compact record buffer and handle what is complete */
+static void sock_records(upstype_t *ups, const char *buf, size_t buflen)
+{
+	dsp_rec_t	rec;
+	ssize_t	ret;
+	size_t	pos = 0;
+
+	if (ups->rlen + buflen > ups->rsize) {
+		ups->rsize = ups->rlen + buflen + SS_RBUF_LEN;
+		ups->rbuf = xrealloc(ups->rbuf, ups->rsize);
+	}
+
+	memcpy(ups->rbuf + ups->rlen, buf, buflen);
+	ups->rlen += buflen;
+
+	while ((ret = dsp_decode(ups->rbuf + pos, ups->rlen - pos, &rec)) > 0) {
+		if (!sock_record(ups, &rec)) {
+			upslogx(LOG_NOTICE, "UPS [%s]: bad record (type %d, id %u, %zu bytes)",
+				ups->name, rec.type, rec.id, rec.len);
+			STATS_ADD(driver_parse_errors, 1);
+			ret = -1;
+			break;
+		}
+
+		pos += (size_t)ret;
+
+		/* a text line may have made us drop the driver */
+		if (ups->sock_fd < 0) {
+			return;
+		}
+	}
+
+	if (ret < 0) {
+		/* no way to tell where the next record starts */
+		upslogx(LOG_WARNING, "UPS [%s]: lost track of the driver socket protocol", ups->name);
+		sstate_disconnect(ups);
+		return;
+	}
+
+	ups->rlen -= pos;
+	memmove(ups->rbuf, ups->rbuf + pos, ups->rlen);
 }
 
 void sstate_readline(upstype_t *ups)
 {
-	ssize_t	i, ret;
-	char	buf[SMALLBUF];
+	ssize_t	ret;
+	size_t	used;
+	char	buf[LARGEBUF];
 
 	if ((!ups) || (ups->sock_fd < 0)) {
 		return;
@@ -294,25 +676,18 @@ void sstate_readline(upstype_t *ups)
 		}
 	}
 
-	for (i = 0; i < ret; i++) {
+	STATS_ADD(driver_bytes_in, ret);
 
-		switch (pconf_char(&ups->sock_ctx, buf[i]))
-		{
-		case 1:
-			/* set the 'last heard' time to now for later staleness checks */
-			if (parse_args(ups, ups->sock_ctx.numargs, ups->sock_ctx.arglist)) {
-				time(&ups->last_heard);
-			}
-			continue;
+	if (ups->compact) {
+		sock_records(ups, buf, (size_t)ret);
+		return;
+	}
 
-		case 0:
-			continue;	/* haven't gotten a line yet */
+	used = sock_text(ups, buf, (size_t)ret);
 
-		default:
-			/* parse error */
-			upslogx(LOG_NOTICE, "Parse error on sock: %s", ups->sock_ctx.errmsg);
-			return;
-		}
+	/* switched to compact records in the middle of this */
+	if (ups->compact && (ups->sock_fd >= 0)) {
+		sock_records(ups, buf + used, (size_t)ret - used);
 	}
 }
 
@@ -348,7 +723,7 @@ const cmdlist_t *sstate_getcmdlist(const upstype_t *ups)
 
 int sstate_dead(upstype_t *ups, int arg_maxage)
 {
-	time_t	now;
+	struct timeval	now;
 	double	elapsed;
 
 	/* an unconnected ups is always dead */
@@ -357,7 +732,7 @@ int sstate_dead(upstype_t *ups, int arg_maxage)
 		return 1;	/* dead */
 	}
 
-	time(&now);
+	nut_monotime(&now);
 
 	/* ignore DATAOK/DATASTALE unless the dump is done */
 	if ((ups->dumpdone) && (!ups->data_ok)) {
@@ -365,10 +740,10 @@ int sstate_dead(upstype_t *ups, int arg_maxage)
 		return 1;	/* dead */
 	}
 
-	elapsed = difftime(now, ups->last_heard);
+	elapsed = nut_monotime_diff(&now, &ups->last_heard);
 
 	/* somewhere beyond a third of the maximum time - prod it to make it talk */
-	if ((elapsed > (arg_maxage / 3)) && (difftime(now, ups->last_ping) > (arg_maxage / 3)))
+	if ((elapsed > (arg_maxage / 3)) && (nut_monotime_diff(&now, &ups->last_ping) > (arg_maxage / 3)))
 		sendping(ups);
 
 	if (elapsed > arg_maxage) {
@@ -380,12 +755,60 @@ int sstate_dead(upstype_t *ups, int arg_maxage)
 	return 0;
 }
 
+/* seconds until sstate_dead() may tell something new just because time
+ * went by: the driver is due for a ping, or its data for going stale;
+ * anything the driver says meanwhile calls for ups_check_soon() */
+time_t sstate_check_delay(const upstype_t *ups, int arg_maxage)
+{
+	struct timeval	now;
+	const struct timeval	*last;
+	double	delay, stale;
+
+	nut_monotime(&now);
+
+	last = timercmp(&ups->last_ping, &ups->last_heard, >) ? &ups->last_ping : &ups->last_heard;
+	delay = nut_monotime_diff(last, &now) + (arg_maxage / 3) + 1;
+
+	if (!ups->stale) {
+		stale = nut_monotime_diff(&ups->last_heard, &now) + arg_maxage + 1;
+
+		if (stale < delay) {
+			delay = stale;
+		}
+	}
+
+	return (delay < 1) ? 1 : (time_t)delay;
+}
+
 /* release all info(tree) data used by <ups> */
 void sstate_infofree(upstype_t *ups)
 {
+	size_t	i;
+
 	state_infofree(ups->inforoot);
+	state_infofree(ups->delroot);
 
 	ups->inforoot = NULL;
+	ups->delroot = NULL;
+
+	for (i = 0; i < ups->numvars; i++) {
+		ups->vars[i].node = NULL;
+	}
+
+	/* whoever saw older data must start over */
+	ups->seqbase = ++ups->seq;
+}
+
+/* flag a variable as changed, when its value as seen by clients
+ * changed through something else than the driver (e.g. FSD) */
+void sstate_setchanged(upstype_t *ups, const char *var)
+{
+	st_tree_t	*node = state_tree_find(ups->inforoot, var);
+
+	if (node) {
+		node->seq = ++ups->seq;
+		watch_notify(ups, var);
+	}
 }
 
 void sstate_cmdfree(upstype_t *ups)
@@ -418,7 +841,13 @@ int sstate_sendline(upstype_t *ups, const char *buf)
 	}
 
 	upslog_with_errno(LOG_NOTICE, "Send to UPS [%s] failed", ups->name);
-	sstate_disconnect(ups);
+
+	/* a worker leaves it to the main loop, which sees the hangup */
+	if (upsd_is_main_thread()) {
+		sstate_disconnect(ups);
+	} else {
+		shutdown(ups->sock_fd, shutdown_how);
+	}
 
 	return 0;	/* failed */
 }
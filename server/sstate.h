@@ -27,7 +27,10 @@
 #include "upstype.h"
 
 #define SS_CONNFAIL_INT 300	/* complain about a dead driver every 5 mins */
+#define SS_CONNECT_INT 2	/* but try to reconnect to it every 2 secs   */
 #define SS_MAX_READ 256		/* don't let drivers tie us up in read()     */
+#define SS_BATCH_MAX 65536	/* apply a BATCH early past this many lines  */
+#define SS_RBUF_LEN 4096	/* room for compact records from the driver  */
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
@@ -48,7 +51,9 @@ void sstate_makeinfolist(const upstype_t *ups, char *buf, size_t bufsize);
 void sstate_makerwlist(const upstype_t *ups, char *buf, size_t bufsize);
 void sstate_makeinstcmdlist_t(const upstype_t *ups, char *buf, size_t bufsize);
 int sstate_dead(upstype_t *ups, int maxage);
+time_t sstate_check_delay(const upstype_t *ups, int maxage);
 void sstate_infofree(upstype_t *ups);
+void sstate_setchanged(upstype_t *ups, const char *var);
 void sstate_cmdfree(upstype_t *ups);
 int sstate_sendline(upstype_t *ups, const char *buf);
 const st_tree_t *sstate_getnode(const upstype_t *ups, const char *varname);
@@ -0,0 +1,307 @@
+/* stats.c - counters of what upsd is doing, for GET STATS, LIST STATS
+   and METRICS_LISTEN
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * The hot paths only bump counters (see STATS_ADD), and only once per
+ * read() or write() rather than per line; everything else is gathered
+ * when asked for. The same walk over the numbers serves the network
+ * protocol (dotted names, as for variables) and the Prometheus text
+ * format of METRICS_LISTEN.
+ */
+
+#include "common.h"
+
+#include "upsd.h"
+#include "neterr.h"
+#include "netssl.h"
+
+#include "stats.h"
+
+upsd_stats_t	upsd_stats;
+
+typedef struct {
+	const char	*name;		/* for GET STATS and LIST STATS */
+	const char	*metric;	/* for METRICS_LISTEN */
+	const char	*type;		/* NULL for the sum and count of a histogram */
+	const char	*help;
+	double	scale;			/* from the unit of name to that of metric */
+} stats_def_t;
+
+enum {
+	ST_CLIENTS = 0,
+	ST_NET_REQUESTS,
+	ST_NET_PARSE_ERRORS,
+	ST_NET_BYTES_IN,
+	ST_NET_BYTES_OUT,
+	ST_DRIVER_BYTES_IN,
+	ST_DRIVER_PARSE_ERRORS,
+	ST_STALE,
+	ST_TRACKING,
+	ST_TLS_FULL,
+	ST_TLS_RESUMED,
+	ST_RELOADS,
+	ST_RELOAD_USEC,
+	ST_LOOP,
+	ST_LOOP_SUM,
+	ST_LOOP_COUNT,
+	ST_UPS_LOGINS,
+	ST_UPS_STALE,
+	ST_UPS_AGE
+};
+
+static const stats_def_t	stats_defs[] = {
+	{ "clients", "upsd_clients", "gauge",
+		"Client connections", 1 },
+	{ "net.requests", "upsd_net_requests_total", "counter",
+		"Requests parsed from clients", 1 },
+	{ "net.parse.errors", "upsd_net_parse_errors_total", "counter",
+		"Unparsable requests from clients", 1 },
+	{ "net.bytes.in", "upsd_net_bytes_in_total", "counter",
+		"Bytes read from clients", 1 },
+	{ "net.bytes.out", "upsd_net_bytes_out_total", "counter",
+		"Bytes written to clients", 1 },
+	{ "driver.bytes.in", "upsd_driver_bytes_in_total", "counter",
+		"Bytes read from drivers", 1 },
+	{ "driver.parse.errors", "upsd_driver_parse_errors_total", "counter",
+		"Unparsable lines and records from drivers", 1 },
+	{ "stale.transitions", "upsd_stale_transitions_total", "counter",
+		"Times the data of a UPS went stale", 1 },
+	{ "tracking.entries", "upsd_tracking_entries", "gauge",
+		"INSTCMD and SET VAR results kept for GET TRACKING", 1 },
+	{ "tls.handshakes.full", "upsd_tls_handshakes_full_total", "counter",
+		"Full TLS handshakes", 1 },
+	{ "tls.handshakes.resumed", "upsd_tls_handshakes_resumed_total", "counter",
+		"TLS handshakes which resumed a session", 1 },
+	{ "reload.count", "upsd_reloads_total", "counter",
+		"Configuration reloads", 1 },
+	{ "reload.usec", "upsd_reload_seconds", "gauge",
+		"Time the last configuration reload took", 1e-6 },
+	{ "loop.usec", "upsd_loop_seconds", "histogram",
+		"Time the main loop took to handle an event", 1e-6 },
+	{ "loop.usec.sum", "upsd_loop_seconds_sum", NULL, NULL, 1e-6 },
+	{ "loop.count", "upsd_loop_seconds_count", NULL, NULL, 1 },
+	{ "logins", "upsd_ups_logins", "gauge",
+		"Clients logged into a UPS", 1 },
+	{ "stale", "upsd_ups_stale", "gauge",
+		"Whether the data of a UPS is stale", 1 },
+	{ "age", "upsd_ups_age_seconds", "gauge",
+		"Time since upsd last heard from the driver of a UPS", 1 }
+};
+
+	/* upper bounds of the loop_bucket, in microseconds */
+static const char	*stats_le[STATS_LOOP_BUCKETS] = {
+	"10", "100", "1000", "10000", "100000", "1000000", "inf"
+};
+
+/* one number, of a UPS or with the upper bound of a histogram bucket */
+typedef void (*stats_emit_t)(void *arg, const stats_def_t *def, const char *ups, const char *le, double value);
+
+/* called with state_lock held (at least) for reading */
+static void stats_walk(stats_emit_t emit, void *arg)
+{
+	upstype_t	*ups;
+	unsigned long	full = 0, resumed = 0, count = 0;
+	struct timeval	now;
+	size_t	i;
+
+	emit(arg, &stats_defs[ST_CLIENTS], NULL, NULL, (double)client_count());
+	emit(arg, &stats_defs[ST_NET_REQUESTS], NULL, NULL, (double)STATS_GET(net_requests));
+	emit(arg, &stats_defs[ST_NET_PARSE_ERRORS], NULL, NULL, (double)STATS_GET(net_parse_errors));
+	emit(arg, &stats_defs[ST_NET_BYTES_IN], NULL, NULL, (double)STATS_GET(net_bytes_in));
+	emit(arg, &stats_defs[ST_NET_BYTES_OUT], NULL, NULL, (double)STATS_GET(net_bytes_out));
+	emit(arg, &stats_defs[ST_DRIVER_BYTES_IN], NULL, NULL, (double)STATS_GET(driver_bytes_in));
+	emit(arg, &stats_defs[ST_DRIVER_PARSE_ERRORS], NULL, NULL, (double)STATS_GET(driver_parse_errors));
+	emit(arg, &stats_defs[ST_STALE], NULL, NULL, (double)STATS_GET(stale));
+	emit(arg, &stats_defs[ST_TRACKING], NULL, NULL, (double)tracking_size());
+
+	ssl_stats(&full, &resumed);
+	emit(arg, &stats_defs[ST_TLS_FULL], NULL, NULL, (double)full);
+	emit(arg, &stats_defs[ST_TLS_RESUMED], NULL, NULL, (double)resumed);
+
+	emit(arg, &stats_defs[ST_RELOADS], NULL, NULL, (double)STATS_GET(reloads));
+	emit(arg, &stats_defs[ST_RELOAD_USEC], NULL, NULL, (double)STATS_GET(reload_usec));
+
+	/* buckets are cumulative, up to the total count */
+	for (i = 0; i < STATS_LOOP_BUCKETS; i++) {
+		count += STATS_GET(loop_bucket[i]);
+		emit(arg, &stats_defs[ST_LOOP], NULL, stats_le[i], (double)count);
+	}
+
+	emit(arg, &stats_defs[ST_LOOP_SUM], NULL, NULL, (double)STATS_GET(loop_usec));
+	emit(arg, &stats_defs[ST_LOOP_COUNT], NULL, NULL, (double)count);
+
+	/* one metric after the other, for all UPSes */
+	for (ups = firstups; ups; ups = ups->next) {
+		emit(arg, &stats_defs[ST_UPS_LOGINS], ups->name, NULL, (double)ups->numlogins);
+	}
+
+	for (ups = firstups; ups; ups = ups->next) {
+		emit(arg, &stats_defs[ST_UPS_STALE], ups->name, NULL, (double)ups->stale);
+	}
+
+	nut_monotime(&now);
+
+	for (ups = firstups; ups; ups = ups->next) {
+		/* never heard from */
+		if (!timerisset(&ups->last_heard)) {
+			continue;
+		}
+
+		emit(arg, &stats_defs[ST_UPS_AGE], ups->name, NULL, nut_monotime_diff(&now, &ups->last_heard));
+	}
+}
+
+/* the name of a number in GET STATS and LIST STATS */
+static void stats_name(char *buf, size_t buflen, const stats_def_t *def, const char *ups, const char *le)
+{
+	if (ups) {
+		snprintf(buf, buflen, "ups.%s.%s", ups, def->name);
+	} else if (le) {
+		snprintf(buf, buflen, "%s.le.%s", def->name, le);
+	} else {
+		snprintf(buf, buflen, "%s", def->name);
+	}
+}
+
+typedef struct {
+	nut_ctype_t	*client;
+	const char	*name;		/* the one to answer with, NULL for all */
+	int	found;
+} stats_net_t;
+
+static void stats_emit_net(void *arg, const stats_def_t *def, const char *ups, const char *le, double value)
+{
+	stats_net_t	*net = (stats_net_t *)arg;
+	char	name[SMALLBUF];
+
+	stats_name(name, sizeof(name), def, ups, le);
+
+	if ((net->name) && (strcasecmp(name, net->name))) {
+		return;
+	}
+
+	sendback(net->client, "STATS %s %.0f\n", name, value);
+	net->found = 1;
+}
+
+/* GET STATS <name> */
+void stats_get(nut_ctype_t *client, const char *name)
+{
+	stats_net_t	net;
+
+	net.client = client;
+	net.name = name;
+	net.found = 0;
+
+	stats_walk(stats_emit_net, &net);
+
+	if (!net.found) {
+		send_err(client, NUT_ERR_VAR_NOT_SUPPORTED);
+	}
+}
+
+/* LIST STATS */
+void stats_list(nut_ctype_t *client)
+{
+	stats_net_t	net;
+
+	net.client = client;
+	net.name = NULL;
+	net.found = 0;
+
+	if (!sendback(client, "BEGIN LIST STATS\n")) {
+		return;
+	}
+
+	stats_walk(stats_emit_net, &net);
+
+	sendback(client, "END LIST STATS\n");
+}
+
+typedef struct {
+	nut_ctype_t	*client;
+	const stats_def_t	*last;	/* the family last given HELP and TYPE */
+} stats_metric_t;
+
+static void stats_emit_metric(void *arg, const stats_def_t *def, const char *ups, const char *le, double value)
+{
+	stats_metric_t	*m = (stats_metric_t *)arg;
+	char	labels[SMALLBUF] = "", val[SMALLBUF];
+
+	if ((def->type) && (def != m->last)) {
+		sendback(m->client, "# HELP %s %s\n# TYPE %s %s\n",
+			def->metric, def->help, def->metric, def->type);
+	}
+
+	m->last = def;
+
+	if (ups) {
+		snprintf(labels, sizeof(labels), "{ups=\"%s\"}", ups);
+	} else if ((le) && (!strcmp(le, "inf"))) {
+		snprintf(labels, sizeof(labels), "{le=\"+Inf\"}");
+	} else if (le) {
+		snprintf(labels, sizeof(labels), "{le=\"%g\"}", strtod(le, NULL) * def->scale);
+	}
+
+	/* bucket counts are counts, whatever the unit of their bounds */
+	if ((def->scale != 1) && (!le)) {
+		snprintf(val, sizeof(val), "%g", value * def->scale);
+	} else {
+		snprintf(val, sizeof(val), "%.0f", value);
+	}
+
+	sendback(m->client, "%s%s%s %s\n", def->metric, le ? "_bucket" : "", labels, val);
+}
+
+/* answer an HTTP request on METRICS_LISTEN, whatever it was */
+void stats_metrics(nut_ctype_t *client)
+{
+	stats_metric_t	m;
+
+	m.client = client;
+	m.last = NULL;
+
+	if (!sendback(client, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Connection: close\r\n\r\n")) {
+		return;
+	}
+
+	stats_walk(stats_emit_metric, &m);
+}
+
+/* how long the main loop took for an event since start */
+void stats_loop_time(const struct timeval *start)
+{
+	struct timeval	now;
+	double	elapsed;
+	unsigned long	usec, bound = 10;
+	size_t	i;
+
+	nut_monotime(&now);
+
+	elapsed = nut_monotime_diff(&now, start) * 1e6;
+	usec = (elapsed > 0) ? (unsigned long)elapsed : 0;
+
+	for (i = 0; (i < STATS_LOOP_BUCKETS - 1) && (usec > bound); i++) {
+		bound *= 10;
+	}
+
+	STATS_ADD(loop_usec, usec);
+	STATS_ADD(loop_bucket[i], 1);
+}
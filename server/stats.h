@@ -0,0 +1,79 @@
+/* stats.h - counters of what upsd is doing
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef NUT_STATS_H_SEEN
+#define NUT_STATS_H_SEEN 1
+
+#include "nut_ctype.h"
+#include "timehead.h"
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+extern "C" {
+/* *INDENT-ON* */
+#endif
+
+/* buckets of the histogram of how long the main loop takes to handle an
+ * event: up to 10us, 100us, ... 1s, and the rest */
+#define STATS_LOOP_BUCKETS	7
+
+typedef struct {
+	unsigned long	net_requests;		/* parsed from clients */
+	unsigned long	net_parse_errors;
+	unsigned long	net_bytes_in;
+	unsigned long	net_bytes_out;
+
+	unsigned long	driver_bytes_in;
+	unsigned long	driver_parse_errors;
+
+	unsigned long	stale;			/* UPSes going stale */
+
+	unsigned long	reloads;		/* of the configuration */
+	unsigned long	reload_usec;		/* the last one took */
+
+	unsigned long	loop_usec;
+	unsigned long	loop_bucket[STATS_LOOP_BUCKETS];
+} upsd_stats_t;
+
+extern upsd_stats_t	upsd_stats;
+
+/* The main loop and the workers bump these without taking any lock:
+ * relaxed atomics where the compiler has them, and the odd lost update
+ * with WORKERS otherwise, which statistics can live with. */
+#ifdef __ATOMIC_RELAXED
+# define STATS_ADD(counter, n)	((void)__atomic_fetch_add(&upsd_stats.counter, (unsigned long)(n), __ATOMIC_RELAXED))
+# define STATS_SET(counter, n)	__atomic_store_n(&upsd_stats.counter, (unsigned long)(n), __ATOMIC_RELAXED)
+# define STATS_GET(counter)	__atomic_load_n(&upsd_stats.counter, __ATOMIC_RELAXED)
+#else
+# define STATS_ADD(counter, n)	((void)(upsd_stats.counter += (unsigned long)(n)))
+# define STATS_SET(counter, n)	((void)(upsd_stats.counter = (unsigned long)(n)))
+# define STATS_GET(counter)	(upsd_stats.counter)
+#endif
+
+void stats_loop_time(const struct timeval *start);
+
+void stats_get(nut_ctype_t *client, const char *name);
+void stats_list(nut_ctype_t *client);
+void stats_metrics(nut_ctype_t *client);
+
+#ifdef __cplusplus
+/* *INDENT-OFF* */
+}
+/* *INDENT-ON* */
+#endif
+
+#endif	/* NUT_STATS_H_SEEN */
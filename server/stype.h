@@ -41,6 +41,8 @@ typedef struct stype_s {
 	char	*addr;
 	char	*port;
 	int	sock_fd;
+	int	metrics;	/* METRICS_LISTEN rather than LISTEN */
+	int	retain;		/* still listed after a reload */
 	struct stype_s	*next;
 } stype_t;
 
@@ -30,8 +30,13 @@
 #include "netcmds.h"
 #include "upsconf.h"
 
+#include <ctype.h>
+#include <limits.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #ifdef HAVE_SYS_SIGNAL_H
@@ -49,6 +54,9 @@
 #include "sstate.h"
 #include "desc.h"
 #include "neterr.h"
+#include "evloop.h"
+#include "twheel.h"
+#include "stats.h"
 
 #ifdef HAVE_WRAP
 #include <tcpd.h>
@@ -66,6 +74,9 @@ int	maxage = 15;
 /* default to 1h before cleaning up status tracking entries */
 int	tracking_delay = 3600;
 
+/* default 60 seconds before an idle client is disconnected */
+int	client_inactivity_delay = 60;
+
 /*
  * Preloaded to ALLOW_NO_DEVICE from upsd.conf or environment variable
  * (with higher prio for envvar); defaults to disabled for legacy compat.
@@ -75,6 +86,13 @@ int allow_no_device = 0;
 /* preloaded to {OPEN_MAX} in main, can be overridden via upsd.conf */
 nfds_t	maxconn = 0;
 
+/* best available by default, can be overridden via upsd.conf */
+evloop_backend_t	event_backend = EVLOOP_AUTO;
+
+/* everything is served from the main loop by default, can be
+ * overridden via upsd.conf */
+int	num_workers = 0;
+
 /* preloaded to STATEPATH in main, can be overridden via upsd.conf */
 char	*statepath = NULL;
 
@@ -90,18 +108,14 @@ nut_ctype_t	*firstclient = NULL;
 /* default is to listen on all local interfaces */
 static stype_t	*firstaddr = NULL;
 
-static int 	opt_af = AF_UNSPEC;
+	/* METRICS_LISTEN, none by default */
+static stype_t	*firstmetrics = NULL;
 
-typedef enum {
-	DRIVER = 1,
-	CLIENT,
-	SERVER
-} handler_type_t;
+	/* timers of the main loop: its clients, the drivers and tracking */
+static twheel_t	timers;
+static twtimer_t	tracking_timer;
 
-typedef struct {
-	handler_type_t	type;
-	void		*data;
-} handler_t;
+static int 	opt_af = AF_UNSPEC;
 
 
 /* Commands and settings status tracking */
@@ -116,18 +130,25 @@ static int	tracking_enabled = 0;
 typedef struct tracking_s {
 	char	*id;
 	int	status;
-	time_t	request_time; /* for cleanup */
-	/* doubly linked list */
+	struct timeval	request_time; /* for cleanup, nut_monotime() */
+	/* doubly linked list, newest first */
 	struct tracking_s	*prev;
 	struct tracking_s	*next;
+	struct tracking_s	*hnext;	/* in the same hash bucket */
+	size_t	hash;
 } tracking_t;
 
 static tracking_t	*tracking_list = NULL;
+static tracking_t	*tracking_last = NULL;	/* oldest */
+static tracking_t	**tracking_hash = NULL;
+static size_t	tracking_count = 0;
+static size_t	tracking_buckets = 0;
 
+	/* UPS by name, see get_ups_ptr() */
+static upstype_t	**ups_hash = NULL;
+static size_t	ups_count = 0;
+static size_t	ups_buckets = 0;
 
-	/* pollfd  */
-static struct pollfd	*fds = NULL;
-static handler_t	*handler = NULL;
 
 	/* pid file */
 static char	pidfn[SMALLBUF];
@@ -135,6 +156,64 @@ static char	pidfn[SMALLBUF];
 	/* set by signal handlers */
 static int	reload_flag = 0, exit_flag = 0;
 
+/*
+ * With WORKERS set, the main loop keeps the drivers, the LISTEN sockets
+ * and the housekeeping, and hands each new client over to one of the
+ * worker threads, which then reads, parses and answers its requests
+ * from its own event loop.
+ *
+ * Everything shared (UPSes and their state trees, users, tracking, the
+ * client list) is covered by state_lock: the main loop holds it for
+ * writing while handling an event or doing its periodic work, but not
+ * while it waits. Workers take it for reading around FLAG_SHARED
+ * requests (GET and LIST), which thus run in parallel, for writing
+ * around any other request except FLAG_LOCAL ones, and not at all for
+ * reading from and writing to their sockets.
+ *
+ * The main loop reaches worker clients only through sendpush() and
+ * client_drop(), which queue them up on the poke list of the worker
+ * and wake it up. sendpush() never waits for the output queue of a
+ * worker client: when the worker holds it, the line is left for the
+ * worker to queue. Workers never touch the main loop, and only they
+ * disconnect their clients.
+ */
+typedef struct upsd_worker_s	upsd_worker_t;
+
+#ifdef HAVE_PTHREAD
+struct upsd_worker_s {
+	pthread_t	thread;
+	evloop_t	*loop;
+	int	wakefd[2];	/* the main loop pokes through this pipe */
+
+	pthread_mutex_t	lock;	/* covers pokes and stop */
+	nut_ctype_t	**pokes;	/* new, dropped or with output to send */
+	size_t	numpokes;
+	size_t	pokesalloc;
+	int	stop;
+
+	/* private to the thread */
+	nut_ctype_t	**work;		/* the pokes being worked on */
+	size_t	workalloc;
+	int	done;		/* saw stop */
+	twheel_t	wheel;		/* idle timers of its clients */
+};
+
+static pthread_rwlock_t	state_lock;
+static pthread_t	main_thread;
+
+static upsd_worker_t	*workers = NULL;
+static size_t	workers_running = 0;
+static size_t	worker_next = 0;	/* round robin for client_connect() */
+static size_t	worker_clients = 0;	/* connections served by workers */
+#endif	/* HAVE_PTHREAD */
+
+/* how requests need state_lock, see above */
+typedef enum {
+	LOCK_NONE = 0,
+	LOCK_SHARED,
+	LOCK_EXCL
+} state_lock_t;
+
 /* Minimalistic support for UUID v4 */
 /* Ref: RFC 4122 https://tools.ietf.org/html/rfc4122#section-4.1.2 */
 #define UUID4_BYTESIZE 16
@@ -160,13 +239,17 @@ static const char *inet_ntopW (struct sockaddr_storage *s)
 upstype_t *get_ups_ptr(const char *name)
 {
 	upstype_t	*tmp;
+	size_t	hash;
 
-	if (!name) {
+	if ((!name) || (!ups_hash)) {
 		return NULL;
 	}
 
-	for (tmp = firstups; tmp; tmp = tmp->next) {
-		if (!strcasecmp(tmp->name, name)) {
+	/* UPS names are matched case-insensitively */
+	hash = nut_strhash(name, 1);
+
+	for (tmp = ups_hash[hash & (ups_buckets - 1)]; tmp; tmp = tmp->hnext) {
+		if ((tmp->hash == hash) && (!strcasecmp(tmp->name, name))) {
 			return tmp;
 		}
 	}
@@ -174,6 +257,64 @@ upstype_t *get_ups_ptr(const char *name)
 	return NULL;
 }
 
+/* (re)build the index of get_ups_ptr() from firstups, with room for
+ * at least as many more */
+void ups_index_rebuild(void)
+{
+	upstype_t	*ups;
+
+	ups_count = 0;
+
+	for (ups = firstups; ups; ups = ups->next) {
+		ups_count++;
+	}
+
+	free(ups_hash);
+
+	ups_buckets = nut_hashbuckets(ups_count, 16);
+
+	ups_hash = xcalloc(ups_buckets, sizeof(*ups_hash));
+
+	for (ups = firstups; ups; ups = ups->next) {
+		ups->hash = nut_strhash(ups->name, 1);
+		ups->hnext = ups_hash[ups->hash & (ups_buckets - 1)];
+		ups_hash[ups->hash & (ups_buckets - 1)] = ups;
+	}
+}
+
+/* index a UPS that was just added to firstups */
+void ups_index_add(upstype_t *ups)
+{
+	/* keep the chains short */
+	if ((!ups_hash) || (ups_count >= ups_buckets)) {
+		ups_index_rebuild();
+		return;
+	}
+
+	ups_count++;
+	ups->hash = nut_strhash(ups->name, 1);
+	ups->hnext = ups_hash[ups->hash & (ups_buckets - 1)];
+	ups_hash[ups->hash & (ups_buckets - 1)] = ups;
+}
+
+/* drop a UPS which is about to be deleted from the index */
+void ups_index_del(upstype_t *ups)
+{
+	upstype_t	**uptr;
+
+	if (!ups_hash) {
+		return;
+	}
+
+	for (uptr = &ups_hash[ups->hash & (ups_buckets - 1)]; *uptr; uptr = &(*uptr)->hnext) {
+		if (*uptr == ups) {
+			*uptr = ups->hnext;
+			ups_count--;
+			return;
+		}
+	}
+}
+
 /* mark the data stale if this is new, otherwise cleanup any remaining junk */
 static void ups_data_stale(upstype_t *ups)
 {
@@ -183,6 +324,7 @@ static void ups_data_stale(upstype_t *ups)
 	}
 
 	ups->stale = 1;
+	STATS_ADD(stale, 1);
 
 	upslogx(LOG_NOTICE, "Data for UPS [%s] is stale - check driver", ups->name);
 }
@@ -199,14 +341,62 @@ static void ups_data_ok(upstype_t *ups)
 	upslogx(LOG_NOTICE, "UPS [%s] data is no longer stale", ups->name);
 }
 
-/* add another listening address */
-void listen_add(const char *addr, const char *port)
+/* (re)connect to the driver of a UPS, or see whether it still feeds us
+ * data; then wait for whichever of these can change next */
+static void ups_check(twtimer_t *timer)
 {
-	stype_t	*server;
+	upstype_t	*ups = (upstype_t *)timer->arg;
 
-	/* don't change listening addresses on reload */
-	if (reload_flag) {
-		return;
+	/* see if we need to (re)connect to the socket */
+	if (ups->sock_fd < 0) {
+		upsdebugx(1, "%s: UPS [%s] is not currently connected",
+			__func__, ups->name);
+		ups->sock_fd = sstate_connect(ups);
+		upsdebugx(1, "%s: UPS [%s] is now connected as FD %d",
+			__func__, ups->name, ups->sock_fd);
+
+		if (ups->sock_fd < 0) {
+			twtimer_set(&timers, timer, SS_CONNECT_INT);
+			return;
+		}
+
+	/* throw some warnings if it's not feeding us data any more */
+	} else if (sstate_dead(ups, maxage)) {
+		ups_data_stale(ups);
+	} else {
+		ups_data_ok(ups);
+	}
+
+	twtimer_set(&timers, timer, sstate_check_delay(ups, maxage));
+}
+
+/* set up the checks of a new UPS, starting right away */
+void ups_check_start(upstype_t *ups)
+{
+	twtimer_init(&ups->check, ups_check, ups);
+	ups_check_soon(ups);
+}
+
+/* have ups_check() run with the next pass of the main loop, since the
+ * driver connection or what the driver says about its data changed */
+void ups_check_soon(upstype_t *ups)
+{
+	twtimer_set(&timers, &ups->check, 0);
+}
+
+/* add a listening address to a list; on reload, one which is there
+ * already is only marked to be kept, socket and all */
+static stype_t *server_add(stype_t **first, const char *addr, const char *port, int metrics)
+{
+	stype_t	*server, **last;
+
+	for (last = first; *last; last = &(*last)->next) {
+		server = *last;
+
+		if ((!strcmp(server->addr, addr)) && (!strcmp(server->port, port))) {
+			server->retain = 1;
+			return NULL;
+		}
 	}
 
 	/* grab some memory and add the info */
@@ -214,11 +404,40 @@ void listen_add(const char *addr, const char *port)
 	server->addr = xstrdup(addr);
 	server->port = xstrdup(port);
 	server->sock_fd = -1;
-	server->next = firstaddr;
+	server->metrics = metrics;
+	server->retain = 1;
+
+	*last = server;
+
+	return server;
+}
+
+/* add another listening address */
+void listen_add(const char *addr, const char *port)
+{
+	if (server_add(&firstaddr, addr, port, 0)) {
+		upsdebugx(3, "listen_add: added %s:%s", addr, port);
+	}
+}
+
+/* add a listening address for metrics scrapers */
+void metrics_listen_add(const char *addr, const char *port)
+{
+	if (server_add(&firstmetrics, addr, port, 1)) {
+		upsdebugx(3, "metrics_listen_add: added %s:%s", addr, port);
+	}
+}
 
-	firstaddr = server;
+/* default behaviour if no LISTEN address has been specified */
+static void listen_defaults(void)
+{
+	if (opt_af != AF_INET) {
+		listen_add("::1", string_const(PORT));
+	}
 
-	upsdebugx(3, "listen_add: added %s:%s", server->addr, server->port);
+	if (opt_af != AF_INET6) {
+		listen_add("127.0.0.1", string_const(PORT));
+	}
 }
 
 /* create a listening socket for tcp connections */
@@ -236,6 +455,14 @@ static void setuptcp(stype_t *server)
 	hints.ai_protocol	= IPPROTO_TCP;
 
 	if ((v = getaddrinfo(server->addr, server->port, &hints, &res)) != 0) {
+		/* a typo in a LISTEN line is not worth dying over on reload */
+		if (reload_flag) {
+			upslogx(LOG_ERR, "not listening on %s port %s: %s",
+				server->addr, server->port,
+				(v == EAI_SYSTEM) ? strerror(errno) : gai_strerror(v));
+			return;
+		}
+
 		if (v == EAI_SYSTEM) {
 			fatal_with_errno(EXIT_FAILURE, "getaddrinfo");
 		}
@@ -292,6 +519,220 @@ static void setuptcp(stype_t *server)
 	return;
 }
 
+/* the event loop a client is registered with */
+static evloop_t *client_loop(const nut_ctype_t *client)
+{
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		return client->worker->loop;
+	}
+#else
+	NUT_UNUSED_VARIABLE(client);
+#endif	/* HAVE_PTHREAD */
+
+	return evloop_default();
+}
+
+/* the timers of the loop a client is registered with */
+static twheel_t *client_wheel(nut_ctype_t *client)
+{
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		return &client->worker->wheel;
+	}
+#else
+	NUT_UNUSED_VARIABLE(client);
+#endif	/* HAVE_PTHREAD */
+
+	return &timers;
+}
+
+/* serialize access to the output queue of a client which a worker
+ * serves, no-ops for main loop clients */
+void client_lock(nut_ctype_t *client)
+{
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		pthread_mutex_lock(&client->outlock);
+	}
+#else
+	NUT_UNUSED_VARIABLE(client);
+#endif	/* HAVE_PTHREAD */
+}
+
+void client_unlock(nut_ctype_t *client)
+{
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		pthread_mutex_unlock(&client->outlock);
+	}
+#else
+	NUT_UNUSED_VARIABLE(client);
+#endif	/* HAVE_PTHREAD */
+}
+
+/* get state_lock in at least the given mode for a request of a worker
+ * client, *held tracks what this thread holds already; main loop
+ * clients run with it held for writing anyway */
+static void state_lock_take(const nut_ctype_t *client, state_lock_t mode, state_lock_t *held)
+{
+#ifdef HAVE_PTHREAD
+	if ((!client->worker) || (*held >= mode)) {
+		return;
+	}
+
+	if (*held != LOCK_NONE) {
+		pthread_rwlock_unlock(&state_lock);
+	}
+
+	if (mode == LOCK_EXCL) {
+		pthread_rwlock_wrlock(&state_lock);
+	} else {
+		pthread_rwlock_rdlock(&state_lock);
+	}
+
+	*held = mode;
+#else
+	NUT_UNUSED_VARIABLE(client);
+	NUT_UNUSED_VARIABLE(mode);
+	NUT_UNUSED_VARIABLE(held);
+#endif	/* HAVE_PTHREAD */
+}
+
+static void state_lock_drop(state_lock_t *held)
+{
+#ifdef HAVE_PTHREAD
+	if (*held != LOCK_NONE) {
+		pthread_rwlock_unlock(&state_lock);
+		*held = LOCK_NONE;
+	}
+#else
+	NUT_UNUSED_VARIABLE(held);
+#endif	/* HAVE_PTHREAD */
+}
+
+/* the main loop holds state_lock for writing while it works */
+static void state_lock_main(void)
+{
+#ifdef HAVE_PTHREAD
+	if (workers_running) {
+		pthread_rwlock_wrlock(&state_lock);
+	}
+#endif	/* HAVE_PTHREAD */
+}
+
+static void state_unlock_main(void)
+{
+#ifdef HAVE_PTHREAD
+	if (workers_running) {
+		pthread_rwlock_unlock(&state_lock);
+	}
+#endif	/* HAVE_PTHREAD */
+}
+
+/* whether the caller runs the main loop, which alone may touch driver
+ * connections */
+int upsd_is_main_thread(void)
+{
+#ifdef HAVE_PTHREAD
+	if (workers_running) {
+		return pthread_equal(pthread_self(), main_thread);
+	}
+#endif	/* HAVE_PTHREAD */
+
+	return 1;
+}
+
+#ifdef HAVE_PTHREAD
+/* have the worker of a client look at it soon */
+static void worker_poke(nut_ctype_t *client)
+{
+	upsd_worker_t	*w = client->worker;
+	int	wake = 0;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (!client->poked) {
+		if (w->numpokes >= w->pokesalloc) {
+			w->pokesalloc = w->pokesalloc ? w->pokesalloc * 2 : 64;
+			w->pokes = xrealloc(w->pokes, w->pokesalloc * sizeof(*w->pokes));
+		}
+
+		w->pokes[w->numpokes++] = client;
+		client->poked = 1;
+
+		/* one byte in the pipe is enough for all of them */
+		wake = (w->numpokes == 1);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	if (wake) {
+		if (write(w->wakefd[1], "", 1) < 0) {
+			/* full means that it is awake already */
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				upslog_with_errno(LOG_ERR, "%s: can't wake up worker", __func__);
+			}
+		}
+	}
+}
+#endif	/* HAVE_PTHREAD */
+
+/* whether the connection is still good, see client_drop() */
+static int client_alive(nut_ctype_t *client)
+{
+	int	ret;
+
+	client_lock(client);
+	ret = timerisset(&client->last_heard);
+	client_unlock(client);
+
+	return ret;
+}
+
+/* note that the client just sent a request, unless it is being dropped
+ * (returns 0 then) */
+static int client_heard(nut_ctype_t *client)
+{
+	int	ret;
+
+	client_lock(client);
+	ret = timerisset(&client->last_heard);
+	if (ret) {
+		nut_monotime(&client->last_heard);
+	}
+	client_unlock(client);
+
+	return ret;
+}
+
+/* have the connection of a client closed by the loop serving it, once
+ * it is done with the current request if any */
+static void client_dropped(nut_ctype_t *client);
+
+void client_drop(nut_ctype_t *client)
+{
+	client_lock(client);
+	timerclear(&client->last_heard);
+	client_unlock(client);
+
+	client_dropped(client);
+}
+
+/* the rest of client_drop(), once last_heard was cleared */
+static void client_dropped(nut_ctype_t *client)
+{
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		worker_poke(client);
+		return;
+	}
+#endif	/* HAVE_PTHREAD */
+
+	/* the main loop closes it with its next pass */
+	twtimer_set(&timers, &client->idle, 0);
+}
+
 /* decrement the login counter for this ups */
 static void declogins(const char *upsname)
 {
@@ -320,6 +761,16 @@ static void client_disconnect(nut_ctype_t *client)
 
 	upsdebugx(2, "Disconnect from %s", client->addr);
 
+	/* last chance for e.g. "OK Goodbye" to get out */
+	if (client->outlen) {
+		client_flush(client);
+	}
+
+	evloop_loop_del(client_loop(client), client->sock_fd);
+	twtimer_del(&client->idle);
+
+	watch_client_free(client);
+
 	shutdown(client->sock_fd, 2);
 	close(client->sock_fd);
 
@@ -345,112 +796,537 @@ static void client_disconnect(nut_ctype_t *client)
 		/* lastclient = client->prev; */
 	}
 
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		upsd_worker_t	*w = client->worker;
+		size_t	i;
+
+		pthread_mutex_lock(&w->lock);
+
+		for (i = 0; (client->poked) && (i < w->numpokes); i++) {
+			if (w->pokes[i] == client) {
+				w->pokes[i] = w->pokes[--w->numpokes];
+				client->poked = 0;
+			}
+		}
+
+		pthread_mutex_unlock(&w->lock);
+
+		pthread_mutex_destroy(&client->outlock);
+		free(client->deferbuf);
+		worker_clients--;
+	}
+#endif	/* HAVE_PTHREAD */
+
 	free(client->addr);
 	free(client->loginups);
 	free(client->password);
 	free(client->username);
+	free(client->outbuf);
+	free(client->inbuf);
 	free(client);
 
 	return;
 }
 
-/* send the buffer <sendbuf> of length <sendlen> to host <dest>
- * returns effectively a boolean: 0 = failed, 1 = sent ok
- */
-int sendback(nut_ctype_t *client, const char *fmt, ...)
+/* client_disconnect() from the thread serving the client, which may
+ * not hold state_lock yet */
+static void client_close(nut_ctype_t *client)
 {
-	ssize_t	res;
-	size_t	len;
-	char	ans[NUT_NET_ANSWER_MAX+1];
-	va_list	ap;
-
-	if (!client) {
-		return 0;
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		pthread_rwlock_wrlock(&state_lock);
+		client_disconnect(client);
+		pthread_rwlock_unlock(&state_lock);
+		return;
 	}
+#endif	/* HAVE_PTHREAD */
 
-	va_start(ap, fmt);
-	vsnprintf(ans, sizeof(ans), fmt, ap);
-	va_end(ap);
+	client_disconnect(client);
+}
 
-	len = strlen(ans);
+/* shed a client once it has not sent anything for
+ * client_inactivity_delay seconds, or close it after client_drop();
+ * this runs on the loop serving the client, with state_lock held */
+static void client_idle(twtimer_t *timer)
+{
+	nut_ctype_t	*client = (nut_ctype_t *)timer->arg;
+	struct timeval	now, last_heard;
+	double	idle;
 
-	/* System write() and our ssl_write() have a loophole that they write a
-	 * size_t amount of bytes and upon success return that in ssize_t value
-	 */
-	assert(len < SSIZE_MAX);
+	client_lock(client);
+	last_heard = client->last_heard;
+	client_unlock(client);
 
-#ifdef WITH_SSL
-	if (client->ssl) {
-		res = ssl_write(client, ans, len);
-	} else
-#endif /* WITH_SSL */
-	{
-		res = write(client->sock_fd, ans, len);
+	if (!timerisset(&last_heard)) {
+		client_disconnect(client);
+		return;
 	}
 
-	upsdebugx(2, "write: [destfd=%d] [len=%zu] [%s]", client->sock_fd, len, str_rtrim(ans, '\n'));
-
-	if (res < 0 || len != (size_t)res) {
-		upslog_with_errno(LOG_NOTICE, "write() failed for %s", client->addr);
-		client->last_heard = 0;
-		return 0;	/* failed */
+	/* watchers may legitimately just wait for updates */
+	if (client->numwatch > 0) {
+		twtimer_set(client_wheel(client), timer, client_inactivity_delay + 1);
+		return;
 	}
 
-	return 1;	/* OK */
-}
+	nut_monotime(&now);
+	idle = nut_monotime_diff(&now, &last_heard);
 
-/* just a simple wrapper for now */
-int send_err(nut_ctype_t *client, const char *errtype)
-{
-	if (!client) {
-		return -1;
+	if (idle > client_inactivity_delay) {
+		upsdebugx(2, "%s: %s was idle for %g seconds", __func__, client->addr, idle);
+		client_disconnect(client);
+		return;
 	}
 
-	upsdebugx(4, "Sending error [%s] to client %s", errtype, client->addr);
-
-	return sendback(client, "ERR %s\n", errtype);
+	/* heard from since: check again once it could be idle */
+	twtimer_set(client_wheel(client), timer, client_inactivity_delay - (time_t)idle + 1);
 }
 
-/* disconnect anyone logged into this UPS */
-void kick_login_clients(const char *upsname)
+/* append to the output queue of a client, growing it as needed up to
+ * NUT_NET_OUTBUF_LIMIT: past that the client is shed (returns 0 then) */
+static int client_queue(nut_ctype_t *client, const char *buf, size_t len)
 {
-	nut_ctype_t	*client, *cnext;
+	size_t	tail, first;
 
-	for (client = firstclient; client; client = cnext) {
+	if (client->outlen + len > NUT_NET_OUTBUF_LIMIT) {
+		upslogx(LOG_NOTICE, "Client %s has %zu bytes of output pending, dropping it",
+			client->addr, client->outlen);
+		timerclear(&client->last_heard);
+		return 0;
+	}
 
-		cnext = client->next;
+	if (client->outlen + len > client->outsize) {
+		size_t	newsize = client->outsize ? client->outsize : LARGEBUF;
+		char	*newbuf;
 
-		/* if it's not logged in, don't check it */
-		if (!client->loginups) {
-			continue;
+		while (newsize < client->outlen + len) {
+			newsize *= 2;
 		}
 
-		if (!strcmp(client->loginups, upsname)) {
-			upslogx(LOG_INFO, "Kicking client %s (was on UPS [%s])\n", client->addr, upsname);
-			client_disconnect(client);
+		/* unwrap the pending data while moving it over */
+		newbuf = xmalloc(newsize);
+		first = client->outsize - client->outhead;
+		if (first > client->outlen) {
+			first = client->outlen;
+		}
+		if (client->outlen) {
+			memcpy(newbuf, client->outbuf + client->outhead, first);
+			memcpy(newbuf + first, client->outbuf, client->outlen - first);
 		}
-	}
-}
 
-/* make sure a UPS is sane - connected, with fresh data */
-int ups_available(const upstype_t *ups, nut_ctype_t *client)
-{
-	if (ups->sock_fd < 0) {
-		send_err(client, NUT_ERR_DRIVER_NOT_CONNECTED);
-		return 0;
+		free(client->outbuf);
+		client->outbuf = newbuf;
+		client->outsize = newsize;
+		client->outhead = 0;
 	}
 
-	if (ups->stale) {
-		send_err(client, NUT_ERR_DATA_STALE);
-		return 0;
+	tail = (client->outhead + client->outlen) % client->outsize;
+	first = client->outsize - tail;
+	if (first > len) {
+		first = len;
 	}
 
-	/* must be OK */
+	memcpy(client->outbuf + tail, buf, first);
+	memcpy(client->outbuf, buf + first, len - first);
+	client->outlen += len;
+
 	return 1;
 }
 
-/* check flags and access for an incoming command from the network */
-static void check_command(int cmdnum, nut_ctype_t *client, size_t numarg,
+#ifdef HAVE_PTHREAD
+/* queue the changes the main loop left for a worker client, from the
+ * worker serving it: see sendpush() */
+static void client_undefer(nut_ctype_t *client)
+{
+	upsd_worker_t	*w = client->worker;
+	char	*buf;
+	size_t	len;
+	int	drop;
+
+	if (!w) {
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	buf = client->deferbuf;
+	len = client->deferlen;
+	drop = client->deferdrop;
+	client->deferbuf = NULL;
+	client->deferlen = 0;
+	client->defersize = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	if ((!len) && (!drop)) {
+		return;
+	}
+
+	client_lock(client);
+	if (drop) {
+		timerclear(&client->last_heard);
+	} else if (timerisset(&client->last_heard)) {
+		client_queue(client, buf, len);
+	}
+	client_unlock(client);
+
+	free(buf);
+}
+#endif	/* HAVE_PTHREAD */
+
+/* a client sent requests which are not handled yet, and which the loop
+ * serving it would not tell about: kept by client_parse(), or read ahead
+ * by the TLS layer */
+static int client_buffered(nut_ctype_t *client)
+{
+	return (client->inlen > 0) || ssl_pending(client);
+}
+
+/* write out as much of the pending output as the socket takes without
+ * blocking, and only ask for POLLOUT while something remains queued
+ * returns -1 if the connection failed, 0 otherwise
+ */
+static int client_write(nut_ctype_t *client)
+{
+	ssize_t	res;
+	evloop_t	*loop = client_loop(client);
+
+	while (client->outlen > 0) {
+		size_t	first = client->outsize - client->outhead;
+
+		if (first > client->outlen) {
+			first = client->outlen;
+		}
+
+#ifdef WITH_SSL
+		if (client->ssl) {
+			/* what does not fit stays queued as it is, and goes
+			 * out once the TLS layer may go on (client->ssl_want) */
+			res = ssl_write(client, client->outbuf + client->outhead, first);
+		} else
+#endif /* WITH_SSL */
+		{
+			struct iovec	iov[2];
+			struct msghdr	msg;
+
+			iov[0].iov_base = client->outbuf + client->outhead;
+			iov[0].iov_len = first;
+			iov[1].iov_base = client->outbuf;
+			iov[1].iov_len = client->outlen - first;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+
+#ifdef MSG_DONTWAIT
+			res = sendmsg(client->sock_fd, &msg, MSG_DONTWAIT);
+#else
+			res = sendmsg(client->sock_fd, &msg, 0);
+#endif
+		}
+
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+		}
+
+		if (res <= 0) {
+			upslog_with_errno(LOG_NOTICE, "write() failed for %s", client->addr);
+			client->outlen = 0;
+			client->outhead = 0;
+			client->ssl_want = 0;
+			timerclear(&client->last_heard);
+			evloop_loop_mod(loop, client->sock_fd, POLLIN);
+			twtimer_set(client_wheel(client), &client->idle, 0);
+			return -1;
+		}
+
+		upsdebugx(5, "%s: [destfd=%d] wrote %zd of %zu bytes", __func__,
+			client->sock_fd, res, client->outlen);
+
+		STATS_ADD(net_bytes_out, res);
+
+		client->outhead = (client->outhead + (size_t)res) % client->outsize;
+		client->outlen -= (size_t)res;
+
+		/* a client draining a big answer is not idle */
+		if (timerisset(&client->last_heard)) {
+			nut_monotime(&client->last_heard);
+		}
+	}
+
+	if (client->outlen > NUT_NET_OUTBUF_MAX) {
+		/* don't take more requests until it catches up, the idle
+		 * timeout eventually drops it if it never does */
+		upsdebugx(2, "%s: %s has %zu bytes pending, not reading from it",
+			__func__, client->addr, client->outlen);
+		evloop_loop_mod(loop, client->sock_fd,
+			client->ssl_want ? client->ssl_want : POLLOUT);
+		return 0;
+	}
+
+	if (client->outlen) {
+		/* a TLS write waiting to read first goes on after reading */
+		evloop_loop_mod(loop, client->sock_fd,
+			POLLIN | (client->ssl_want ? client->ssl_want : POLLOUT));
+		return 0;
+	}
+
+	client->outhead = 0;
+
+	/* don't keep a big buffer around after a large dump */
+	if (client->outsize > 16 * LARGEBUF) {
+		free(client->outbuf);
+		client->outbuf = NULL;
+		client->outsize = 0;
+	}
+
+	/* e.g. the handshake may have to send before it reads on, and
+	 * requests kept by client_parse() are handled on the next POLLOUT */
+	evloop_loop_mod(loop, client->sock_fd,
+		POLLIN | client->ssl_want | (client_buffered(client) ? POLLOUT : 0));
+
+	return 0;
+}
+
+/* client_write(), from the thread serving the client */
+int client_flush(nut_ctype_t *client)
+{
+	int	ret;
+
+	client_lock(client);
+	ret = client_write(client);
+	client_unlock(client);
+
+	return ret;
+}
+
+/* have the loop serving a client other than the one currently served
+ * flush its output, e.g. after pushing a WATCHed change to it */
+void client_flush_later(nut_ctype_t *client)
+{
+#ifdef HAVE_PTHREAD
+	if (client->worker) {
+		worker_poke(client);
+		return;
+	}
+#endif	/* HAVE_PTHREAD */
+
+	evloop_mod(client->sock_fd,
+		(client->outlen > NUT_NET_OUTBUF_MAX) ? POLLOUT : (POLLIN | POLLOUT));
+}
+
+/* queue the formatted answer for sending to the client, the actual
+ * write happens in client_flush() once the current request is handled
+ * returns effectively a boolean: 0 = failed, 1 = queued ok
+ */
+int sendback(nut_ctype_t *client, const char *fmt, ...)
+{
+	int	res, alive;
+	size_t	len;
+	char	ans[NUT_NET_ANSWER_MAX+1];
+	va_list	ap;
+
+	if (!client) {
+		return 0;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(ans, sizeof(ans), fmt, ap);
+	va_end(ap);
+
+	len = strlen(ans);
+
+	client_lock(client);
+
+	/* the connection failed or was shed, don't bother */
+	alive = timerisset(&client->last_heard);
+	res = alive ? client_queue(client, ans, len) : 0;
+
+	client_unlock(client);
+
+	if (!res) {
+		/* shed just now, have the loop serving it close it */
+		if (alive) {
+			client_drop(client);
+		}
+
+		return 0;
+	}
+
+	upsdebugx(2, "write: [destfd=%d] [len=%zu] [%s]", client->sock_fd, len, str_rtrim(ans, '\n'));
+
+	return res;
+}
+
+#ifdef HAVE_PTHREAD
+/* leave a line for the worker of a client to queue, from the main loop
+ * which found its output queue taken; called with the lock of the worker
+ * held, which it releases, returns 0 once too many of them piled up */
+static int client_defer(nut_ctype_t *client, const char *buf, size_t len)
+{
+	upsd_worker_t	*w = client->worker;
+	int	ret = 0;
+
+	if (client->deferdrop) {
+		/* the worker is told already, nothing more to keep */
+	} else if (client->deferlen > NUT_NET_OUTBUF_MAX) {
+		upslogx(LOG_NOTICE, "Client %s is not reading its updates (%zu bytes deferred), dropping it",
+			client->addr, client->deferlen);
+		client->deferdrop = 1;
+		free(client->deferbuf);
+		client->deferbuf = NULL;
+		client->deferlen = 0;
+		client->defersize = 0;
+	} else {
+		if (client->deferlen + len > client->defersize) {
+			client->defersize = client->defersize ? client->defersize * 2 : LARGEBUF;
+			if (client->defersize < client->deferlen + len) {
+				client->defersize = client->deferlen + len;
+			}
+			client->deferbuf = xrealloc(client->deferbuf, client->defersize);
+		}
+
+		memcpy(client->deferbuf + client->deferlen, buf, len);
+		client->deferlen += len;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	worker_poke(client);
+
+	return ret;
+}
+#endif	/* HAVE_PTHREAD */
+
+/* queue a line the client did not ask for, such as a WATCHed change,
+ * and have it sent soon; unlike answers, these keep coming whether the
+ * client reads them or not, so it is dropped once they pile up.
+ * The main loop never waits for a worker to be done with the output
+ * queue of a client, the line is left for the worker to queue then
+ * returns effectively a boolean: 0 = failed, 1 = queued ok
+ */
+int sendpush(nut_ctype_t *client, const char *fmt, ...)
+{
+	int	res = 0;
+	size_t	len;
+	char	ans[NUT_NET_ANSWER_MAX+1];
+	va_list	ap;
+
+	va_start(ap, fmt);
+	vsnprintf(ans, sizeof(ans), fmt, ap);
+	va_end(ap);
+
+	len = strlen(ans);
+
+#ifdef HAVE_PTHREAD
+	if ((client->worker) && (upsd_is_main_thread())) {
+		upsd_worker_t	*w = client->worker;
+
+		/* those deferred already go first */
+		pthread_mutex_lock(&w->lock);
+		if ((client->deferlen) || (client->deferdrop)
+		 || (pthread_mutex_trylock(&client->outlock) != 0)) {
+			return client_defer(client, ans, len);
+		}
+		pthread_mutex_unlock(&w->lock);
+	} else
+#endif	/* HAVE_PTHREAD */
+	{
+		client_lock(client);
+	}
+
+	/* already being dropped otherwise */
+	if (timerisset(&client->last_heard)) {
+		if (client->outlen > NUT_NET_OUTBUF_MAX) {
+			upslogx(LOG_NOTICE, "Client %s is not reading its updates (%zu bytes pending), dropping it",
+				client->addr, client->outlen);
+			timerclear(&client->last_heard);
+		} else {
+			/* sheds the client past NUT_NET_OUTBUF_LIMIT */
+			res = client_queue(client, ans, len);
+		}
+
+		if (!res) {
+			client_unlock(client);
+			client_dropped(client);
+			return 0;
+		}
+	}
+
+	client_unlock(client);
+
+	if (res) {
+		upsdebugx(2, "push: [destfd=%d] [len=%zu] [%s]", client->sock_fd, len, str_rtrim(ans, '\n'));
+		client_flush_later(client);
+	}
+
+	return res;
+}
+
+/* just a simple wrapper for now */
+int send_err(nut_ctype_t *client, const char *errtype)
+{
+	if (!client) {
+		return -1;
+	}
+
+	upsdebugx(4, "Sending error [%s] to client %s", errtype, client->addr);
+
+	return sendback(client, "ERR %s\n", errtype);
+}
+
+/* disconnect anyone logged into this UPS */
+void kick_login_clients(const char *upsname)
+{
+	nut_ctype_t	*client, *cnext;
+
+	for (client = firstclient; client; client = cnext) {
+
+		cnext = client->next;
+
+		/* if it's not logged in, don't check it */
+		if (!client->loginups) {
+			continue;
+		}
+
+		if (!strcmp(client->loginups, upsname)) {
+			upslogx(LOG_INFO, "Kicking client %s (was on UPS [%s])\n", client->addr, upsname);
+
+			/* only its worker may disconnect it */
+			if (client->worker) {
+				client_drop(client);
+				continue;
+			}
+
+			client_disconnect(client);
+		}
+	}
+}
+
+/* make sure a UPS is sane - connected, with fresh data */
+int ups_available(const upstype_t *ups, nut_ctype_t *client)
+{
+	if (ups->sock_fd < 0) {
+		send_err(client, NUT_ERR_DRIVER_NOT_CONNECTED);
+		return 0;
+	}
+
+	if (ups->stale) {
+		send_err(client, NUT_ERR_DATA_STALE);
+		return 0;
+	}
+
+	/* must be OK */
+	return 1;
+}
+
+/* check flags and access for an incoming command from the network */
+static void check_command(int cmdnum, nut_ctype_t *client, size_t numarg,
 	const char **arg)
 {
 	upsdebugx(6, "Entering %s: %s", __func__, numarg > 0 ? arg[0] : "<>");
@@ -494,27 +1370,61 @@ static void check_command(int cmdnum, nut_ctype_t *client, size_t numarg,
 	netcmds[cmdnum].func(client, (numarg < 2) ? 0 : (numarg - 1), (numarg > 1) ? &arg[1] : NULL);
 }
 
-/* parse requests from the network */
-static void parse_net(nut_ctype_t *client)
+/* find the netcmds entry for the request just parsed, -1 if none */
+static int find_command(const nut_ctype_t *client)
 {
 	int	i;
 
 	/* shouldn't happen */
 	if (client->ctx.numargs < 1) {
-		send_err(client, NUT_ERR_UNKNOWN_COMMAND);
-		return;
+		return -1;
 	}
 
 	for (i = 0; netcmds[i].name; i++) {
 		if (!strcasecmp(netcmds[i].name, client->ctx.arglist[0])) {
-			check_command(i, client, client->ctx.numargs, (const char **) client->ctx.arglist);
-			return;
+			return i;
 		}
 	}
 
-	/* fallthrough = not matched by any entry in netcmds */
+	return -1;
+}
+
+/* what a request needs of state_lock */
+static state_lock_t command_lock(int cmdnum)
+{
+	if ((cmdnum < 0) || (netcmds[cmdnum].flags & FLAG_LOCAL)) {
+		return LOCK_NONE;
+	}
+
+	if (netcmds[cmdnum].flags & FLAG_SHARED) {
+		return LOCK_SHARED;
+	}
+
+	return LOCK_EXCL;
+}
+
+/* parse requests from the network */
+static void parse_net(nut_ctype_t *client, int cmdnum)
+{
+	/* not matched by any entry in netcmds */
+	if (cmdnum < 0) {
+		send_err(client, NUT_ERR_UNKNOWN_COMMAND);
+		return;
+	}
+
+	check_command(cmdnum, client, client->ctx.numargs, (const char **) client->ctx.arglist);
+}
+
+/* connections counting against MAXCONN */
+nfds_t client_count(void)
+{
+	size_t	ret = evloop_count();
+
+#ifdef HAVE_PTHREAD
+	ret += worker_clients;
+#endif	/* HAVE_PTHREAD */
 
-	send_err(client, NUT_ERR_UNKNOWN_COMMAND);
+	return (nfds_t)ret;
 }
 
 /* answer incoming tcp connections */
@@ -536,17 +1446,43 @@ static void client_connect(stype_t *server)
 		return;
 	}
 
+	if (client_count() >= maxconn) {
+		/* refuse clients that we are unable to handle */
+		upslogx(LOG_NOTICE, "Rejecting connection from %s: MAXCONN (%jd) reached",
+			inet_ntopW(&csock), (intmax_t)maxconn);
+		close(fd);
+		return;
+	}
+
+#ifdef TCP_NODELAY
+	{
+		/* answers to a batch go out in one write already, Nagle
+		 * would only hold those of a pipelined burst read in
+		 * several pieces behind the delayed ACK of the client */
+		int	one = 1;
+
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one)) != 0) {
+			upsdebug_with_errno(2, "%s: setsockopt TCP_NODELAY", __func__);
+		}
+	}
+#endif	/* TCP_NODELAY */
+
 	client = xcalloc(1, sizeof(*client));
 
 	client->sock_fd = fd;
 
-	time(&client->last_heard);
+	nut_monotime(&client->last_heard);
 
 	client->addr = xstrdup(inet_ntopW(&csock));
 
 	client->tracking = 0;
+	client->metrics = server->metrics;
 
 	pconf_init(&client->ctx, NULL);
+	/* LIST VAR and its devices, and one more to tell a longer list
+	 * from one cut short by the parser */
+	client->ctx.arg_limit = NUT_NET_LIST_UPS_MAX + 3;
+	twtimer_init(&client->idle, client_idle, client);
 
 	if (firstclient) {
 		firstclient->prev = client;
@@ -555,6 +1491,27 @@ static void client_connect(stype_t *server)
 
 	firstclient = client;
 
+#ifdef HAVE_PTHREAD
+	if (workers_running) {
+		/* the worker registers it with its loop once woken up */
+		client->worker = &workers[worker_next++ % workers_running];
+		pthread_mutex_init(&client->outlock, NULL);
+		worker_clients++;
+		worker_poke(client);
+
+		upsdebugx(2, "Connect from %s (worker %zu)", client->addr,
+			(size_t)(client->worker - workers));
+		return;
+	}
+#endif	/* HAVE_PTHREAD */
+
+	if (evloop_add(fd, POLLIN, EVLOOP_CLIENT, client) < 0) {
+		client_disconnect(client);
+		return;
+	}
+
+	twtimer_set(&timers, &client->idle, client_inactivity_delay + 1);
+
 /*
 	if (lastclient) {
 		client->prev = lastclient;
@@ -566,43 +1523,148 @@ static void client_connect(stype_t *server)
 	upsdebugx(2, "Connect from %s", client->addr);
 }
 
-/* read tcp messages and handle them */
-static void client_readline(nut_ctype_t *client)
+/* how much of our output a client has not taken yet */
+static size_t client_pending(nut_ctype_t *client)
 {
-	char	buf[SMALLBUF];
-	int	i;
-	ssize_t	ret;
+	size_t	ret;
 
-#ifdef WITH_SSL
-	if (client->ssl) {
-		ret = ssl_read(client, buf, sizeof(buf));
-	} else
-#endif /* WITH_SSL */
-	{
-		ret = read(client->sock_fd, buf, sizeof(buf));
-	}
+	client_lock(client);
+	ret = client->outlen;
+	client_unlock(client);
 
-	if (ret < 0) {
-		upsdebug_with_errno(2, "Disconnect %s (read failure)", client->addr);
-		client_disconnect(client);
-		return;
-	}
+	return ret;
+}
 
-	if (ret == 0) {
-		upsdebugx(2, "Disconnect %s (no data available)", client->addr);
-		client_disconnect(client);
+/* a scraper is closed once all of its answer went out, returns 1 if it
+ * was answered already */
+static int client_answered(nut_ctype_t *client)
+{
+	if (client->metrics < 4) {
+		return 0;
+	}
+
+	if (!client_pending(client)) {
+		client_close(client);
+	}
+
+	return 1;
+}
+
+/* a scraper on METRICS_LISTEN gets the metrics, whatever it asked for,
+ * once the header of its HTTP request is over, and the connection ends
+ * once they are sent: the idle timeout takes care of one which stops
+ * reading them */
+static void client_metrics(nut_ctype_t *client, const char *buf, size_t len)
+{
+	size_t	i;
+	state_lock_t	held = LOCK_NONE;
+
+	/* whatever comes after the request does not matter */
+	if (client->metrics > 3) {
 		return;
 	}
 
+	for (i = 0; (i < len) && (client->metrics < 3); i++) {
+		if (buf[i] == '\n') {
+			client->metrics++;
+		} else if (buf[i] != '\r') {
+			client->metrics = 1;
+		}
+	}
+
+	if (client->metrics < 3) {
+		return;
+	}
+
+	if (client_heard(client)) {
+		state_lock_take(client, LOCK_SHARED, &held);
+		stats_metrics(client);
+		state_lock_drop(&held);
+	}
+
+	client->metrics++;
+	client_flush(client);
+	client_answered(client);
+}
+
+/* run the password of a client through crypt() if the request needs it,
+ * without holding state_lock meanwhile (see user.c) */
+static void client_pwcheck(nut_ctype_t *client, int cmdnum, state_lock_t *held)
+{
+	char	*hash;
+
+	if ((cmdnum < 0) || (!(netcmds[cmdnum].flags & FLAG_USER))
+	 || (!client->username) || (!client->password)) {
+		return;
+	}
+
+	state_lock_take(client, LOCK_SHARED, held);
+
+	if ((hash = user_pwhash(client->username, client->password)) == NULL) {
+		return;
+	}
+
+	state_lock_drop(held);
+
+	if (user_pwcrypt(hash, client->password)) {
+		state_lock_take(client, LOCK_EXCL, held);
+		user_pwverified(client->username, client->password, hash);
+	}
+
+	free(hash);
+}
+
+/* handle the requests in what a client sent, as long as it takes our
+ * answers: once it lets too many pile up, the rest waits in
+ * client->inbuf for client_resume()
+ * returns 0 if the client was closed meanwhile, 1 otherwise
+ */
+static int client_parse(nut_ctype_t *client, const char *buf, size_t len)
+{
+	size_t	i, used;
+	int	cmdnum;
+	unsigned long	requests = 0;
+	state_lock_t	held = LOCK_NONE;
+
 	/* fragment handling code */
-	for (i = 0; i < ret; i++) {
+	for (i = 0; i < len; i += used) {
+
+		if (client_pending(client) > NUT_NET_OUTBUF_MAX) {
+			upsdebugx(2, "%s: %s has too much output pending, keeping %zu bytes of requests for later",
+				__func__, client->addr, len - i);
+			client->inbuf = xmalloc(len - i);
+			client->inlen = len - i;
+			memcpy(client->inbuf, buf + i, len - i);
+			break;
+		}
 
-		/* add to the receive queue one by one */
-		switch (pconf_char(&client->ctx, buf[i]))
+		/* add to the receive queue up to the end of a line */
+		switch (pconf_line_buf(&client->ctx, buf + i, len - i, &used))
 		{
 		case 1:
-			time(&client->last_heard);	/* command received */
-			parse_net(client);
+			/* command received */
+#ifdef HAVE_PTHREAD
+			/* changes pushed before come before the answer */
+			client_undefer(client);
+#endif	/* HAVE_PTHREAD */
+
+			if (client_heard(client)) {
+				cmdnum = find_command(client);
+				client_pwcheck(client, cmdnum, &held);
+
+				/* kept over a batch of requests as long as it will do */
+				state_lock_take(client, command_lock(cmdnum), &held);
+				parse_net(client, cmdnum);
+				requests++;
+			}
+
+			/* logged out, or the connection failed */
+			if (!client_alive(client)) {
+				state_lock_drop(&held);
+				STATS_ADD(net_requests, requests);
+				client_close(client);
+				return 0;
+			}
 			continue;
 
 		case 0:
@@ -611,56 +1673,242 @@ static void client_readline(nut_ctype_t *client)
 		default:
 			/* parse error */
 			upslogx(LOG_NOTICE, "Parse error on sock: %s", client->ctx.errmsg);
-			return;
+			state_lock_drop(&held);
+			STATS_ADD(net_requests, requests);
+			STATS_ADD(net_parse_errors, 1);
+			client_flush(client);
+			return 1;
 		}
 	}
 
-	return;
+	state_lock_drop(&held);
+	STATS_ADD(net_requests, requests);
+
+	/* send all answers to this batch of requests in one go */
+	client_flush(client);
+
+	return 1;
+}
+
+/* go on with the requests client_parse() kept for later, once the
+ * client took enough of our output */
+static void client_resume(nut_ctype_t *client)
+{
+	char	*buf = client->inbuf;
+	size_t	len = client->inlen;
+
+	if ((!len) || (client_pending(client) > NUT_NET_OUTBUF_MAX)) {
+		return;
+	}
+
+	client->inbuf = NULL;
+	client->inlen = 0;
+
+	client_parse(client, buf, len);
+	free(buf);
+}
+
+/* read tcp messages and handle them */
+static void client_readline(nut_ctype_t *client)
+{
+	char	buf[SMALLBUF];
+	ssize_t	ret;
+
+	/* what it sent before comes first, reading on waits for the
+	 * next event */
+	if (client->inlen) {
+		client_resume(client);
+		return;
+	}
+
+#ifdef WITH_SSL
+	if (client->ssl) {
+		ret = ssl_read(client, buf, sizeof(buf));
+	} else
+#endif /* WITH_SSL */
+	{
+		ret = read(client->sock_fd, buf, sizeof(buf));
+	}
+
+	if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+		/* the TLS layer waits for more of a record or the handshake,
+		 * see that the loop watches for what it needs */
+		client_flush(client);
+		return;
+	}
+
+	if (ret < 0) {
+		upsdebug_with_errno(2, "Disconnect %s (read failure)", client->addr);
+		client_close(client);
+		return;
+	}
+
+	if (ret == 0) {
+		upsdebugx(2, "Disconnect %s (no data available)", client->addr);
+		client_close(client);
+		return;
+	}
+
+	STATS_ADD(net_bytes_in, ret);
+
+	if (client->metrics) {
+		client_metrics(client, buf, (size_t)ret);
+		return;
+	}
+
+	client_parse(client, buf, (size_t)ret);
+}
+
+static void server_open(stype_t *server)
+{
+	setuptcp(server);
+
+	if (server->sock_fd >= 0) {
+		evloop_add(server->sock_fd, POLLIN, EVLOOP_SERVER, server);
+	}
 }
 
 void server_load(void)
 {
 	stype_t	*server;
 
-	/* default behaviour if no LISTEN addres has been specified */
 	if (!firstaddr) {
-		if (opt_af != AF_INET) {
-			listen_add("::1", string_const(PORT));
-		}
-
-		if (opt_af != AF_INET6) {
-			listen_add("127.0.0.1", string_const(PORT));
-		}
+		listen_defaults();
 	}
 
 	for (server = firstaddr; server; server = server->next) {
-		setuptcp(server);
+		server_open(server);
 	}
 
 	/* check if we have at least 1 valid LISTEN interface */
 	if (firstaddr->sock_fd < 0) {
 		fatalx(EXIT_FAILURE, "no listening interface available");
 	}
+
+	/* metrics are not worth refusing to start over */
+	for (server = firstmetrics; server; server = server->next) {
+		server_open(server);
+	}
 }
 
-void server_free(void)
+static void server_close(stype_t *server)
+{
+	if (server->sock_fd != -1) {
+		evloop_del(server->sock_fd);
+		close(server->sock_fd);
+	}
+
+	free(server->addr);
+	free(server->port);
+	free(server);
+}
+
+static void server_list_free(stype_t *first)
 {
 	stype_t	*server, *snext;
 
-	/* cleanup server fds */
-	for (server = firstaddr; server; server = snext) {
+	for (server = first; server; server = snext) {
 		snext = server->next;
+		server_close(server);
+	}
+}
 
-		if (server->sock_fd != -1) {
-			close(server->sock_fd);
+/* called before upsd.conf is read again: the LISTEN and METRICS_LISTEN
+ * lines found then mark what is to be kept */
+void server_reload_start(void)
+{
+	stype_t	*server;
+
+	for (server = firstaddr; server; server = server->next) {
+		server->retain = 0;
+	}
+
+	for (server = firstmetrics; server; server = server->next) {
+		server->retain = 0;
+	}
+}
+
+/* close what is no longer listed */
+static void server_reload_list(stype_t **first)
+{
+	stype_t	*server, **prev;
+
+	for (prev = first; (server = *prev) != NULL; ) {
+		if (server->retain) {
+			prev = &server->next;
+			continue;
 		}
 
-		free(server->addr);
-		free(server->port);
-		free(server);
+		upslogx(LOG_INFO, "no longer listening on %s port %s",
+			server->addr, server->port);
+
+		*prev = server->next;
+		server_close(server);
 	}
+}
+
+/* called once upsd.conf was read again (if it could be, per loaded):
+ * sockets of addresses still listed stay open, with their clients, and
+ * those which could not be opened before are tried again */
+void server_reload_finish(int loaded)
+{
+	stype_t	*server;
+	int	listed = 0, usable = 0;
 
+	for (server = firstaddr; server; server = server->next) {
+		listed |= server->retain;
+	}
+
+	if ((loaded) && (!listed)) {
+		listen_defaults();
+	}
+
+	for (server = firstaddr; server; server = server->next) {
+		if (!loaded) {
+			server->retain = 1;
+		}
+
+		if ((server->retain) && (server->sock_fd < 0)) {
+			server_open(server);
+		}
+
+		if ((server->retain) && (server->sock_fd >= 0)) {
+			usable = 1;
+		}
+	}
+
+	/* rather than being left unreachable */
+	if (!usable) {
+		upslogx(LOG_ERR, "Reload: no usable LISTEN address, keeping the current ones");
+
+		for (server = firstaddr; server; server = server->next) {
+			server->retain |= (server->sock_fd >= 0);
+		}
+	}
+
+	server_reload_list(&firstaddr);
+
+	for (server = firstmetrics; server; server = server->next) {
+		if (!loaded) {
+			server->retain = 1;
+		}
+
+		if ((server->retain) && (server->sock_fd < 0)) {
+			server_open(server);
+		}
+	}
+
+	server_reload_list(&firstmetrics);
+}
+
+void server_free(void)
+{
+	/* cleanup server fds */
+	server_list_free(firstaddr);
 	firstaddr = NULL;
+
+	server_list_free(firstmetrics);
+	firstmetrics = NULL;
 }
 
 static void client_free(void)
@@ -685,11 +1933,14 @@ static void driver_free(void)
 		unext = ups->next;
 
 		if (ups->sock_fd != -1) {
+			evloop_del(ups->sock_fd);
 			close(ups->sock_fd);
 		}
 
+		twtimer_del(&ups->check);
 		sstate_infofree(ups);
 		sstate_cmdfree(ups);
+		watch_ups_free(ups);
 
 		pconf_finish(&ups->sock_ctx);
 
@@ -698,6 +1949,12 @@ static void driver_free(void)
 		free(ups->desc);
 		free(ups);
 	}
+
+	firstups = NULL;
+	free(ups_hash);
+	ups_hash = NULL;
+	ups_buckets = 0;
+	ups_count = 0;
 }
 
 static void upsd_cleanup(void)
@@ -722,16 +1979,24 @@ static void upsd_cleanup(void)
 	free(certname);
 	free(certpasswd);
 
-	free(fds);
-	free(handler);
+	evloop_free();
 }
 
 static void poll_reload(void)
 {
+	static nfds_t	maxconn_ok = 0;
 	long	ret;
 
 	ret = sysconf(_SC_OPEN_MAX);
 
+	/* a running server keeps the last limit that worked */
+	if ((maxconn_ok) && (((intmax_t)ret < (intmax_t)maxconn) || (1 > maxconn))) {
+		upslogx(LOG_ERR, "Reload: ignoring MAXCONN %jd (system limit %ld), keeping %jd",
+			(intmax_t)maxconn, ret, (intmax_t)maxconn_ok);
+		maxconn = maxconn_ok;
+		return;
+	}
+
 	if ((intmax_t)ret < (intmax_t)maxconn) {
 		fatalx(EXIT_FAILURE,
 			"Your system limits the maximum number of connections to %ld\n"
@@ -739,441 +2004,747 @@ static void poll_reload(void)
 			"problem is resolved.\n", ret, (intmax_t)maxconn);
 	}
 
-	if (1 > maxconn) {
-		fatalx(EXIT_FAILURE,
-			"You requested %jd as maximum number of connections.\n"
-			"The server won't start until this problem is resolved.\n", (intmax_t)maxconn);
-	}
+	if (1 > maxconn) {
+		fatalx(EXIT_FAILURE,
+			"You requested %jd as maximum number of connections.\n"
+			"The server won't start until this problem is resolved.\n", (intmax_t)maxconn);
+	}
+
+	maxconn_ok = maxconn;
+
+	/* nothing to (re)allocate here: the event backend grows its own
+	 * tables as descriptors get registered, and client_connect() refuses
+	 * connections beyond maxconn */
+}
+
+/* instant command and setvar status tracking */
+
+static tracking_t *tracking_find(const char *id)
+{
+	tracking_t	*item;
+	size_t	hash;
+
+	if ((!tracking_hash) || (!id))
+		return NULL;
+
+	/* tracking ids too */
+	hash = nut_strhash(id, 1);
+
+	for (item = tracking_hash[hash & (tracking_buckets - 1)]; item; item = item->hnext) {
+		if ((item->hash == hash) && (!strcasecmp(item->id, id)))
+			return item;
+	}
+
+	return NULL;
+}
+
+static void tracking_grow(void)
+{
+	tracking_t	**newhash;
+	size_t	newbuckets = nut_hashbuckets(tracking_count, 64);
+	size_t	i;
+
+	newhash = xcalloc(newbuckets, sizeof(*newhash));
+
+	for (i = 0; i < tracking_buckets; i++) {
+		while (tracking_hash[i]) {
+			tracking_t	*item = tracking_hash[i];
+
+			tracking_hash[i] = item->hnext;
+			item->hnext = newhash[item->hash & (newbuckets - 1)];
+			newhash[item->hash & (newbuckets - 1)] = item;
+		}
+	}
+
+	free(tracking_hash);
+	tracking_hash = newhash;
+	tracking_buckets = newbuckets;
+}
+
+/* allocate a new status tracking entry */
+int tracking_add(const char *id)
+{
+	tracking_t	*item;
+
+	if ((!tracking_enabled) || (!id))
+		return 0;
+
+	if (tracking_count >= tracking_buckets)
+		tracking_grow();
+
+	item = xcalloc(1, sizeof(*item));
+
+	item->id = xstrdup(id);
+	item->status = STAT_PENDING;
+	nut_monotime(&item->request_time);
+
+	/* the list stays ordered by request_time, for tracking_cleanup() */
+	if (tracking_list) {
+		tracking_list->prev = item;
+		item->next = tracking_list;
+	} else {
+		tracking_last = item;
+	}
+
+	tracking_list = item;
+
+	item->hash = nut_strhash(id, 1);
+	item->hnext = tracking_hash[item->hash & (tracking_buckets - 1)];
+	tracking_hash[item->hash & (tracking_buckets - 1)] = item;
+	tracking_count++;
+
+	return 1;
+}
+
+/* set status of a specific tracking entry */
+int tracking_set(const char *id, const char *value)
+{
+	tracking_t	*item;
+
+	/* sanity checks */
+	if ((!id) || (!value))
+		return 0;
+
+	item = tracking_find(id);
+
+	if (!item)
+		return 0; /* id not found! */
+
+	item->status = atoi(value);
+	return 1;
+}
+
+static void tracking_unlink(tracking_t *item)
+{
+	tracking_t	**iptr;
+
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		/* deleting first entry */
+		tracking_list = item->next;
+
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		tracking_last = item->prev;
+
+	for (iptr = &tracking_hash[item->hash & (tracking_buckets - 1)]; *iptr; iptr = &(*iptr)->hnext) {
+		if (*iptr == item) {
+			*iptr = item->hnext;
+			break;
+		}
+	}
+
+	tracking_count--;
+
+	free(item->id);
+	free(item);
+}
+
+/* free a specific tracking entry */
+int tracking_del(const char *id)
+{
+	tracking_t	*item;
+
+	/* sanity check */
+	if (!id)
+		return 0;
+
+	upsdebugx(3, "%s: deleting id %s", __func__, id);
+
+	item = tracking_find(id);
+
+	if (!item)
+		return 0; /* id not found! */
+
+	tracking_unlink(item);
+
+	return 1;
+}
+
+/* free all status tracking entries */
+void tracking_free(void)
+{
+	/* sanity check */
+	if (!tracking_hash)
+		return;
+
+	upsdebugx(3, "%s", __func__);
+
+	while (tracking_list)
+		tracking_unlink(tracking_list);
+
+	free(tracking_hash);
+	tracking_hash = NULL;
+	tracking_buckets = 0;
+}
+
+/* cleanup status tracking entries according to their age and tracking_delay:
+ * the oldest are at the end of the list, so stop at the first recent one */
+void tracking_cleanup(void)
+{
+	struct timeval	now;
+
+	/* sanity check */
+	if (!tracking_last)
+		return;
+
+	nut_monotime(&now);
+
+	upsdebugx(3, "%s", __func__);
+
+	while ((tracking_last) && (nut_monotime_diff(&now, &tracking_last->request_time) > tracking_delay)) {
+		upsdebugx(3, "%s: deleting id %s", __func__, tracking_last->id);
+		tracking_unlink(tracking_last);
+	}
+}
+
+/* tracking_cleanup() once the oldest entry expires, or tracking_delay
+ * from now if there is none, since newer ones can't expire earlier */
+static void tracking_check(twtimer_t *timer)
+{
+	struct timeval	now;
+	time_t	delay = tracking_delay;
+
+	tracking_cleanup();
+
+	if (tracking_last) {
+		nut_monotime(&now);
+		delay = (time_t)nut_monotime_diff(&tracking_last->request_time, &now) + tracking_delay + 1;
+	}
+
+	twtimer_set(&timers, timer, (delay > 0) ? delay : 1);
+}
+
+/* get status of a specific tracking entry */
+char *tracking_get(const char *id)
+{
+	tracking_t	*item = tracking_find(id);
+
+	if (!item)
+		return "ERR UNKNOWN"; /* id not found! */
+
+	switch (item->status)
+	{
+	case STAT_PENDING:
+		return "PENDING";
+	case STAT_HANDLED:
+		return "SUCCESS";
+	case STAT_UNKNOWN:
+		return "ERR UNKNOWN";
+	case STAT_INVALID:
+		return "ERR INVALID-ARGUMENT";
+	case STAT_FAILED:
+		return "ERR FAILED";
+	}
+
+	return "ERR UNKNOWN";
+}
+
+/* enable general status tracking (tracking_enabled) and return its value (1). */
+int tracking_enable(void)
+{
+	tracking_enabled = 1;
+
+	return tracking_enabled;
+}
+
+/* disable general status tracking only if no client use it anymore.
+ * return the new value for tracking_enabled */
+int tracking_disable(void)
+{
+	nut_ctype_t		*client, *cnext;
+
+	for (client = firstclient; client; client = cnext) {
+		cnext = client->next;
+		if (client->tracking == 1)
+			return 1;
+	}
+	return 0;
+}
+
+/* return current general status of tracking (tracking_enabled). */
+int tracking_is_enabled(void)
+{
+	return tracking_enabled;
+}
+
+/* number of entries kept for GET TRACKING */
+size_t tracking_size(void)
+{
+	return tracking_count;
+}
+
+/* UUID v4 basic implementation
+ * Note: 'dest' must be at least `UUID4_LEN` long */
+int nut_uuid_v4(char *uuid_str)
+{
+	size_t		i;
+	uint8_t nut_uuid[UUID4_BYTESIZE];
+
+	if (!uuid_str)
+		return 0;
+
+	for (i = 0; i < UUID4_BYTESIZE; i++)
+		nut_uuid[i] = (uint8_t)rand() + (uint8_t)rand();
+
+	/* set variant and version */
+	nut_uuid[6] = (nut_uuid[6] & 0x0F) | 0x40;
+	nut_uuid[8] = (nut_uuid[8] & 0x3F) | 0x80;
+
+	return snprintf(uuid_str, UUID4_LEN,
+		"%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+		nut_uuid[0], nut_uuid[1], nut_uuid[2], nut_uuid[3],
+		nut_uuid[4], nut_uuid[5], nut_uuid[6], nut_uuid[7],
+		nut_uuid[8], nut_uuid[9], nut_uuid[10], nut_uuid[11],
+		nut_uuid[12], nut_uuid[13], nut_uuid[14], nut_uuid[15]);
+}
+
+/* handle one descriptor reported by the event backend */
+static void dispatch(handler_type_t type, void *data, int revents)
+{
+	if (revents & (POLLHUP|POLLERR|POLLNVAL)) {
+
+		switch(type)
+		{
+		case EVLOOP_DRIVER:
+			sstate_disconnect((upstype_t *)data);
+			break;
+		case EVLOOP_CLIENT:
+			client_disconnect((nut_ctype_t *)data);
+			break;
+		case EVLOOP_SERVER:
+			upsdebugx(2, "%s: server disconnected", __func__);
+			break;
+
+#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
+# pragma GCC diagnostic push
+#endif
+#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT
+# pragma GCC diagnostic ignored "-Wcovered-switch-default"
+#endif
+#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE
+# pragma GCC diagnostic ignored "-Wunreachable-code"
+#endif
+/* Older CLANG (e.g. clang-3.4) seems to not support the GCC pragmas above */
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcovered-switch-default"
+#pragma clang diagnostic ignored "-Wunreachable-code"
+#endif
+		/* All enum cases defined as of the time of coding
+		 * have been covered above. Handle later definitions,
+		 * memory corruptions and buggy inputs below...
+		 */
+		default:
+			upsdebugx(2, "%s: <unknown> disconnected", __func__);
+			break;
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
+# pragma GCC diagnostic pop
+#endif
+
+		}
+
+		return;
+	}
+
+	/* room again for output queued earlier */
+	if ((revents & POLLOUT) && (type == EVLOOP_CLIENT)) {
+		nut_ctype_t	*client = (nut_ctype_t *)data;
+
+		client_flush(client);
+
+		if (client_answered(client)) {
+			return;
+		}
+
+		/* or for the TLS layer to go on reading, or it caught up
+		 * with the requests it sent meanwhile */
+		if ((client->ssl_want & POLLOUT) || client_buffered(client)) {
+			client_readline(client);
+			return;
+		}
+	}
+
+	if (revents & POLLIN) {
+
+		switch(type)
+		{
+		case EVLOOP_DRIVER:
+			sstate_readline((upstype_t *)data);
+			break;
+		case EVLOOP_CLIENT:
+			client_readline((nut_ctype_t *)data);
+			break;
+		case EVLOOP_SERVER:
+			client_connect((stype_t *)data);
+			break;
+
+#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
+# pragma GCC diagnostic push
+#endif
+#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT
+# pragma GCC diagnostic ignored "-Wcovered-switch-default"
+#endif
+#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE
+# pragma GCC diagnostic ignored "-Wunreachable-code"
+#endif
+/* Older CLANG (e.g. clang-3.4) seems to not support the GCC pragmas above */
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcovered-switch-default"
+#pragma clang diagnostic ignored "-Wunreachable-code"
+#endif
+		/* All enum cases defined as of the time of coding
+		 * have been covered above. Handle later definitions,
+		 * memory corruptions and buggy inputs below...
+		 */
+		default:
+			upsdebugx(2, "%s: <unknown> has data available", __func__);
+			break;
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
+# pragma GCC diagnostic pop
+#endif
+
+		}
 
-	/* How many items can we stuff into the array? */
-	size_t maxalloc = SIZE_MAX / sizeof(void *);
-	if ((uintmax_t)maxalloc < (uintmax_t)maxconn) {
-		fatalx(EXIT_FAILURE,
-			"You requested %jd as maximum number of connections, but we can only allocate %zu.\n"
-			"The server won't start until this problem is resolved.\n", (intmax_t)maxconn, maxalloc);
+		return;
 	}
-
-	/* The checks above effectively limit that maxconn is in size_t range */
-	fds = xrealloc(fds, (size_t)maxconn * sizeof(*fds));
-	handler = xrealloc(handler, (size_t)maxconn * sizeof(*handler));
 }
 
-/* instant command and setvar status tracking */
-
-/* allocate a new status tracking entry */
-int tracking_add(const char *id)
+/* the clock of the timer wheels, which NTP can't set back or forth */
+static time_t timers_now(void)
 {
-	tracking_t	*item;
+	struct timeval	now;
 
-	if ((!tracking_enabled) || (!id))
-		return 0;
+	nut_monotime(&now);
 
-	item = xcalloc(1, sizeof(*item));
+	return now.tv_sec;
+}
 
-	item->id = xstrdup(id);
-	item->status = STAT_PENDING;
-	time(&item->request_time);
+/* how long a loop may wait for events before its next timer is due,
+ * in milliseconds */
+static int timers_timeout(const twheel_t *wheel)
+{
+	time_t	timeout = twheel_timeout(wheel);
 
-	if (tracking_list) {
-		tracking_list->prev = item;
-		item->next = tracking_list;
+	if (timeout < 0) {
+		return -1;
 	}
 
-	tracking_list = item;
+	if (timeout > INT_MAX / 1000) {
+		timeout = INT_MAX / 1000;
+	}
 
-	return 1;
+	return (int)timeout * 1000;
 }
 
-/* set status of a specific tracking entry */
-int tracking_set(const char *id, const char *value)
+/* dispatch() for the main loop */
+static void mainloop_dispatch(handler_type_t type, void *data, int revents)
 {
-	tracking_t	*item, *next_item;
-
-	/* sanity checks */
-	if ((!tracking_list) || (!id) || (!value))
-		return 0;
-
-	for (item = tracking_list; item; item = next_item) {
+	struct timeval	start;
 
-		next_item = item->next;
+	nut_monotime(&start);
 
-		if (!strcasecmp(item->id, id)) {
-			item->status = atoi(value);
-			return 1;
-		}
-	}
+	state_lock_main();
+	dispatch(type, data, revents);
+	state_unlock_main();
 
-	return 0; /* id not found! */
+	stats_loop_time(&start);
 }
 
-/* free a specific tracking entry */
-int tracking_del(const char *id)
+#ifdef HAVE_PTHREAD
+/* see who was poked since the last time, returns 1 when the worker
+ * is to stop */
+static int worker_wakeup(upsd_worker_t *w)
 {
-	tracking_t	*item, *next_item;
+	char	buf[SMALLBUF];
+	size_t	i, numwork;
+	int	stop;
 
-	/* sanity check */
-	if ((!tracking_list) || (!id))
-		return 0;
+	while (read(w->wakefd[0], buf, sizeof(buf)) > 0);
 
-	upsdebugx(3, "%s: deleting id %s", __func__, id);
+	pthread_mutex_lock(&w->lock);
+
+	if (w->workalloc < w->numpokes) {
+		w->workalloc = w->pokesalloc;
+		w->work = xrealloc(w->work, w->workalloc * sizeof(*w->work));
+	}
+
+	numwork = w->numpokes;
 
-	for (item = tracking_list; item; item = next_item) {
+	for (i = 0; i < numwork; i++) {
+		w->work[i] = w->pokes[i];
+		w->work[i]->poked = 0;
+	}
 
-		next_item = item->next;
+	w->numpokes = 0;
+	stop = w->stop;
 
-		if (strcasecmp(item->id, id))
-			continue;
+	pthread_mutex_unlock(&w->lock);
 
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			/* deleting first entry */
-			tracking_list = item->next;
+	/* only this thread disconnects these, so they are all still there */
+	for (i = 0; i < numwork; i++) {
+		nut_ctype_t	*client = w->work[i];
 
-		if (item->next)
-			item->next->prev = item->prev;
+		if (!client->inloop) {
+			if (evloop_loop_add(w->loop, client->sock_fd, POLLIN, EVLOOP_CLIENT, client) < 0) {
+				client_drop(client);
+			}
+			twtimer_set(&w->wheel, &client->idle, client_inactivity_delay + 1);
+			client->inloop = 1;
+		}
 
-		free(item->id);
-		free(item);
+		client_undefer(client);
 
-		return 1;
+		if (!client_alive(client)) {
+			client_close(client);
+			continue;
+		}
 
+		client_flush(client);
 	}
 
-	return 0; /* id not found! */
+	return stop;
 }
 
-/* free all status tracking entries */
-void tracking_free(void)
+/* handle one descriptor of a worker, EVLOOP_SERVER being its wakeup pipe */
+static void worker_dispatch(handler_type_t type, void *data, int revents)
 {
-	tracking_t	*item, *next_item;
+	if (type == EVLOOP_SERVER) {
+		upsd_worker_t	*w = (upsd_worker_t *)data;
 
-	/* sanity check */
-	if (!tracking_list)
+		w->done = worker_wakeup(w);
 		return;
-
-	upsdebugx(3, "%s", __func__);
-
-	for (item = tracking_list; item; item = next_item) {
-		next_item = item->next;
-		tracking_del(item->id);
 	}
-}
-
-/* cleanup status tracking entries according to their age and tracking_delay */
-void tracking_cleanup(void)
-{
-	tracking_t	*item, *next_item;
-	time_t	now;
 
-	/* sanity check */
-	if (!tracking_list)
+	if (revents & (POLLHUP|POLLERR|POLLNVAL)) {
+		client_close((nut_ctype_t *)data);
 		return;
+	}
 
-	time(&now);
-
-	upsdebugx(3, "%s", __func__);
+	if (revents & POLLOUT) {
+		nut_ctype_t	*client = (nut_ctype_t *)data;
 
-	for (item = tracking_list; item; item = next_item) {
+		client_flush(client);
 
-		next_item = item->next;
+		/* see dispatch() */
+		if (client_answered(client)) {
+			return;
+		}
 
-		if (difftime(now, item->request_time) > tracking_delay) {
-			tracking_del(item->id);
+		if ((client->ssl_want & POLLOUT) || client_buffered(client)) {
+			client_readline(client);
+			return;
 		}
 	}
+
+	if (revents & POLLIN) {
+		client_readline((nut_ctype_t *)data);
+	}
 }
 
-/* get status of a specific tracking entry */
-char *tracking_get(const char *id)
+/* run the timers of a worker, only taking state_lock if any expired */
+static void worker_timers(upsd_worker_t *w)
 {
-	tracking_t	*item, *next_item;
-
-	/* sanity checks */
-	if ((!tracking_list) || (!id))
-		return "ERR UNKNOWN";
+	time_t	now = timers_now(), timeout = twheel_timeout(&w->wheel);
+	int	expired;
 
-	for (item = tracking_list; item; item = next_item) {
+	expired = (timeout >= 0) && (now - w->wheel.now >= timeout);
 
-		next_item = item->next;
+	if (expired) {
+		pthread_rwlock_wrlock(&state_lock);
+	}
 
-		if (strcasecmp(item->id, id))
-			continue;
+	twheel_run(&w->wheel, now);
 
-		switch (item->status)
-		{
-		case STAT_PENDING:
-			return "PENDING";
-		case STAT_HANDLED:
-			return "SUCCESS";
-		case STAT_UNKNOWN:
-			return "ERR UNKNOWN";
-		case STAT_INVALID:
-			return "ERR INVALID-ARGUMENT";
-		case STAT_FAILED:
-			return "ERR FAILED";
-		}
+	if (expired) {
+		pthread_rwlock_unlock(&state_lock);
 	}
-
-	return "ERR UNKNOWN"; /* id not found! */
 }
 
-/* enable general status tracking (tracking_enabled) and return its value (1). */
-int tracking_enable(void)
+static void *worker_run(void *arg)
 {
-	tracking_enabled = 1;
+	upsd_worker_t	*w = (upsd_worker_t *)arg;
 
-	return tracking_enabled;
+	while (!w->done) {
+		if ((evloop_loop_wait(w->loop, timers_timeout(&w->wheel), worker_dispatch) < 0) && (errno != EINTR)) {
+			upslog_with_errno(LOG_ERR, "%s", __func__);
+		}
+
+		worker_timers(w);
+	}
+
+	return NULL;
 }
 
-/* disable general status tracking only if no client use it anymore.
- * return the new value for tracking_enabled */
-int tracking_disable(void)
+/* set up the WORKERS threads, after the main loop is all set */
+static void workers_start(void)
 {
-	nut_ctype_t		*client, *cnext;
+	pthread_rwlockattr_t	attr;
+	sigset_t	set, oldset;
+	size_t	i;
+	int	ret;
 
-	for (client = firstclient; client; client = cnext) {
-		cnext = client->next;
-		if (client->tracking == 1)
-			return 1;
+	if (num_workers < 1) {
+		return;
 	}
-	return 0;
-}
 
-/* return current general status of tracking (tracking_enabled). */
-int tracking_is_enabled(void)
-{
-	return tracking_enabled;
-}
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	/* GET and LIST keep coming: let the main loop in between them */
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&state_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
 
-/* UUID v4 basic implementation
- * Note: 'dest' must be at least `UUID4_LEN` long */
-int nut_uuid_v4(char *uuid_str)
-{
-	size_t		i;
-	uint8_t nut_uuid[UUID4_BYTESIZE];
+	main_thread = pthread_self();
+	workers = xcalloc((size_t)num_workers, sizeof(*workers));
 
-	if (!uuid_str)
-		return 0;
+	/* signals are for the main loop */
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGQUIT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
 
-	for (i = 0; i < UUID4_BYTESIZE; i++)
-		nut_uuid[i] = (uint8_t)rand() + (uint8_t)rand();
+	for (i = 0; i < (size_t)num_workers; i++) {
+		upsd_worker_t	*w = &workers[i];
 
-	/* set variant and version */
-	nut_uuid[6] = (nut_uuid[6] & 0x0F) | 0x40;
-	nut_uuid[8] = (nut_uuid[8] & 0x3F) | 0x80;
+		w->loop = evloop_new(event_backend);
+		twheel_init(&w->wheel, timers_now());
 
-	return snprintf(uuid_str, UUID4_LEN,
-		"%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
-		nut_uuid[0], nut_uuid[1], nut_uuid[2], nut_uuid[3],
-		nut_uuid[4], nut_uuid[5], nut_uuid[6], nut_uuid[7],
-		nut_uuid[8], nut_uuid[9], nut_uuid[10], nut_uuid[11],
-		nut_uuid[12], nut_uuid[13], nut_uuid[14], nut_uuid[15]);
-}
+		if (pipe(w->wakefd) < 0) {
+			fatal_with_errno(EXIT_FAILURE, "%s: pipe", __func__);
+		}
 
-/* service requests and check on new data */
-static void mainloop(void)
-{
-	int	ret;
-	nfds_t	i, nfds = 0;
+		fcntl(w->wakefd[0], F_SETFL, fcntl(w->wakefd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(w->wakefd[1], F_SETFL, fcntl(w->wakefd[1], F_GETFL) | O_NONBLOCK);
 
-	upstype_t	*ups;
-	nut_ctype_t		*client, *cnext;
-	stype_t		*server;
-	time_t	now;
+		evloop_loop_add(w->loop, w->wakefd[0], POLLIN, EVLOOP_SERVER, w);
+		pthread_mutex_init(&w->lock, NULL);
 
-	time(&now);
+		if ((ret = pthread_create(&w->thread, NULL, worker_run, w)) != 0) {
+			errno = ret;
+			fatal_with_errno(EXIT_FAILURE, "%s: pthread_create", __func__);
+		}
 
-	if (reload_flag) {
-		conf_reload();
-		poll_reload();
-		reload_flag = 0;
+		/* clients only go to workers once they all run */
+		workers_running++;
 	}
 
-	/* cleanup instcmd/setvar status tracking entries if needed */
-	tracking_cleanup();
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 
-	/* scan through driver sockets */
-	for (ups = firstups; ups && (nfds < maxconn); ups = ups->next) {
+	upslogx(LOG_INFO, "Serving clients from %zu worker threads", workers_running);
+}
 
-		/* see if we need to (re)connect to the socket */
-		if (ups->sock_fd < 0) {
-			upsdebugx(1, "%s: UPS [%s] is not currently connected",
-				__func__, ups->name);
-			ups->sock_fd = sstate_connect(ups);
-			upsdebugx(1, "%s: UPS [%s] is now connected as FD %d",
-				__func__, ups->name, ups->sock_fd);
-			continue;
-		}
+/* stop the WORKERS threads and close the connections they served */
+static void workers_stop(void)
+{
+	nut_ctype_t	*client, *cnext;
+	size_t	i, numworkers = workers_running;
 
-		/* throw some warnings if it's not feeding us data any more */
-		if (sstate_dead(ups, maxage)) {
-			ups_data_stale(ups);
-		} else {
-			ups_data_ok(ups);
-		}
+	if (!numworkers) {
+		return;
+	}
 
-		fds[nfds].fd = ups->sock_fd;
-		fds[nfds].events = POLLIN;
+	for (i = 0; i < numworkers; i++) {
+		pthread_mutex_lock(&workers[i].lock);
+		workers[i].stop = 1;
+		pthread_mutex_unlock(&workers[i].lock);
 
-		handler[nfds].type = DRIVER;
-		handler[nfds].data = ups;
+		if (write(workers[i].wakefd[1], "", 1) < 0) {
+			upsdebug_with_errno(1, "%s: write", __func__);
+		}
+	}
 
-		nfds++;
+	for (i = 0; i < numworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
 	}
 
-	/* scan through client sockets */
+	/* all alone again */
 	for (client = firstclient; client; client = cnext) {
-
 		cnext = client->next;
 
-		if (difftime(now, client->last_heard) > 60) {
-			/* shed clients after 1 minute of inactivity */
-			/* FIXME: create an upsd.conf parameter (CLIENT_INACTIVITY_DELAY) */
+		if (client->worker) {
 			client_disconnect(client);
-			continue;
-		}
-
-		if (nfds >= maxconn) {
-			/* ignore clients that we are unable to handle */
-			continue;
 		}
+	}
 
-		fds[nfds].fd = client->sock_fd;
-		fds[nfds].events = POLLIN;
+	workers_running = 0;
 
-		handler[nfds].type = CLIENT;
-		handler[nfds].data = client;
+	for (i = 0; i < numworkers; i++) {
+		upsd_worker_t	*w = &workers[i];
 
-		nfds++;
+		evloop_delete(w->loop);
+		close(w->wakefd[0]);
+		close(w->wakefd[1]);
+		pthread_mutex_destroy(&w->lock);
+		free(w->pokes);
+		free(w->work);
 	}
 
-	/* scan through server sockets */
-	for (server = firstaddr; server && (nfds < maxconn); server = server->next) {
-
-		if (server->sock_fd < 0) {
-			continue;
-		}
+	free(workers);
+	workers = NULL;
 
-		fds[nfds].fd = server->sock_fd;
-		fds[nfds].events = POLLIN;
+	pthread_rwlock_destroy(&state_lock);
+}
+#endif	/* HAVE_PTHREAD */
 
-		handler[nfds].type = SERVER;
-		handler[nfds].data = server;
+/* service requests and check on new data */
+static void mainloop(void)
+{
+	int	ret, timeout;
 
-		nfds++;
-	}
+	state_lock_main();
 
-	upsdebugx(2, "%s: polling %jd filedescriptors", __func__, (intmax_t)nfds);
+	if (reload_flag) {
+		struct timeval	start, now;
 
-	ret = poll(fds, nfds, 2000);
+		nut_monotime(&start);
 
-	if (ret == 0) {
-		upsdebugx(2, "%s: no data available", __func__);
-		return;
-	}
+		conf_reload();
+		poll_reload();
+		reload_flag = 0;
 
-	if (ret < 0) {
-		upslog_with_errno(LOG_ERR, "%s", __func__);
-		return;
+		nut_monotime(&now);
+		STATS_ADD(reloads, 1);
+		STATS_SET(reload_usec, nut_monotime_diff(&now, &start) * 1e6);
 	}
 
-	for (i = 0; i < nfds; i++) {
-
-		if (fds[i].revents & (POLLHUP|POLLERR|POLLNVAL)) {
-
-			switch(handler[i].type)
-			{
-			case DRIVER:
-				sstate_disconnect((upstype_t *)handler[i].data);
-				break;
-			case CLIENT:
-				client_disconnect((nut_ctype_t *)handler[i].data);
-				break;
-			case SERVER:
-				upsdebugx(2, "%s: server disconnected", __func__);
-				break;
-
-#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
-# pragma GCC diagnostic push
-#endif
-#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT
-# pragma GCC diagnostic ignored "-Wcovered-switch-default"
-#endif
-#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE
-# pragma GCC diagnostic ignored "-Wunreachable-code"
-#endif
-/* Older CLANG (e.g. clang-3.4) seems to not support the GCC pragmas above */
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcovered-switch-default"
-#pragma clang diagnostic ignored "-Wunreachable-code"
-#endif
-			/* All enum cases defined as of the time of coding
-			 * have been covered above. Handle later definitions,
-			 * memory corruptions and buggy inputs below...
-			 */
-			default:
-				upsdebugx(2, "%s: <unknown> disconnected", __func__);
-				break;
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
-#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
-# pragma GCC diagnostic pop
-#endif
+	/* driver (re)connections and staleness checks, idle clients and
+	 * the cleanup of tracking entries, each when its time comes
+	 * (drivers register themselves with the event backend in
+	 * sstate_connect() once they are connected) */
+	twheel_run(&timers, timers_now());
 
-			}
+	state_unlock_main();
 
-			continue;
-		}
+	timeout = timers_timeout(&timers);
 
-		if (fds[i].revents & POLLIN) {
+	upsdebugx(2, "%s: polling %zu filedescriptors for %d ms", __func__, evloop_count(), timeout);
 
-			switch(handler[i].type)
-			{
-			case DRIVER:
-				sstate_readline((upstype_t *)handler[i].data);
-				break;
-			case CLIENT:
-				client_readline((nut_ctype_t *)handler[i].data);
-				break;
-			case SERVER:
-				client_connect((stype_t *)handler[i].data);
-				break;
+	ret = evloop_wait(timeout, mainloop_dispatch);
 
-#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
-# pragma GCC diagnostic push
-#endif
-#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT
-# pragma GCC diagnostic ignored "-Wcovered-switch-default"
-#endif
-#ifdef HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE
-# pragma GCC diagnostic ignored "-Wunreachable-code"
-#endif
-/* Older CLANG (e.g. clang-3.4) seems to not support the GCC pragmas above */
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcovered-switch-default"
-#pragma clang diagnostic ignored "-Wunreachable-code"
-#endif
-			/* All enum cases defined as of the time of coding
-			 * have been covered above. Handle later definitions,
-			 * memory corruptions and buggy inputs below...
-			 */
-			default:
-				upsdebugx(2, "%s: <unknown> has data available", __func__);
-				break;
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
-#if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && ( (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_COVERED_SWITCH_DEFAULT) || (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_UNREACHABLE_CODE) )
-# pragma GCC diagnostic pop
-#endif
-			}
+	if (ret == 0) {
+		upsdebugx(2, "%s: no data available", __func__);
+		return;
+	}
 
-			continue;
+	if (ret < 0) {
+		/* a signal (e.g. reload) is not worth complaining about */
+		if (errno != EINTR) {
+			upslog_with_errno(LOG_ERR, "%s", __func__);
 		}
+		return;
 	}
 }
 
@@ -1420,6 +2991,9 @@ int main(int argc, char **argv)
 	/* do this here, since getpwnam() might not work in the chroot */
 	new_uid = get_user_pwent(user);
 
+	/* and /dev/urandom might not be there either */
+	user_keyinit();
+
 	if (chroot_path) {
 		chroot_start(chroot_path);
 	}
@@ -1461,6 +3035,15 @@ int main(int argc, char **argv)
 	}
 	} /* scope */
 
+	/* set up the event backend before any descriptors get registered */
+	event_backend = evloop_init(event_backend);
+	upslogx(LOG_INFO, "Using %s event backend", evloop_backend_name(event_backend));
+
+	/* before ups.conf, which sets up the timers of the drivers */
+	twheel_init(&timers, timers_now());
+	twtimer_init(&tracking_timer, tracking_check, NULL);
+	twtimer_set(&timers, &tracking_timer, tracking_delay);
+
 	/* start server */
 	server_load();
 
@@ -1508,10 +3091,22 @@ int main(int argc, char **argv)
 	/* initialize SSL (keyfile must be readable by nut user) */
 	ssl_init();
 
+#ifdef HAVE_PTHREAD
+	workers_start();
+#else
+	if (num_workers > 0) {
+		upslogx(LOG_WARNING, "WORKERS is not supported by this build, serving all clients from the main loop");
+	}
+#endif	/* HAVE_PTHREAD */
+
 	while (!exit_flag) {
 		mainloop();
 	}
 
+#ifdef HAVE_PTHREAD
+	workers_stop();
+#endif	/* HAVE_PTHREAD */
+
 	ssl_cleanup();
 
 	upslogx(LOG_INFO, "Signal %d: exiting", exit_flag);
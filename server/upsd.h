@@ -43,9 +43,21 @@
 #include "parseconf.h"
 #include "nut_ctype.h"
 #include "upstype.h"
+#include "evloop.h"
 
 #define NUT_NET_ANSWER_MAX SMALLBUF
 
+/* stop reading requests from clients that let this much of our output
+ * pile up unread, until they catch up */
+#define NUT_NET_OUTBUF_MAX (1024 * 1024)
+
+/* and drop those which let even this much pile up, e.g. with a single
+ * request, or with updates of what they WATCH */
+#define NUT_NET_OUTBUF_LIMIT (16 * NUT_NET_OUTBUF_MAX)
+
+/* devices in a single LIST VAR request */
+#define NUT_NET_LIST_UPS_MAX 64
+
 #ifdef __cplusplus
 /* *INDENT-OFF* */
 extern "C" {
@@ -55,17 +67,34 @@ extern "C" {
 /* prototypes from upsd.c */
 
 upstype_t *get_ups_ptr(const char *upsname);
+void ups_index_add(upstype_t *ups);
+void ups_index_del(upstype_t *ups);
+void ups_index_rebuild(void);
 int ups_available(const upstype_t *ups, nut_ctype_t *client);
+void ups_check_start(upstype_t *ups);
+void ups_check_soon(upstype_t *ups);
 
 void listen_add(const char *addr, const char *port);
+void metrics_listen_add(const char *addr, const char *port);
+nfds_t client_count(void);
 
 void kick_login_clients(const char *upsname);
 int sendback(nut_ctype_t *client, const char *fmt, ...)
 	__attribute__ ((__format__ (__printf__, 2, 3)));
+int sendpush(nut_ctype_t *client, const char *fmt, ...)
+	__attribute__ ((__format__ (__printf__, 2, 3)));
 int send_err(nut_ctype_t *client, const char *errtype);
+int client_flush(nut_ctype_t *client);
+void client_flush_later(nut_ctype_t *client);
+void client_drop(nut_ctype_t *client);
+void client_lock(nut_ctype_t *client);
+void client_unlock(nut_ctype_t *client);
+int upsd_is_main_thread(void);
 
 void server_load(void);
 void server_free(void);
+void server_reload_start(void);
+void server_reload_finish(int loaded);
 
 void check_perms(const char *fn);
 
@@ -89,10 +118,14 @@ char *tracking_get(const char *id);
 int tracking_enable(void);
 int tracking_disable(void);
 int tracking_is_enabled(void);
+size_t tracking_size(void);
 
 /* declarations from upsd.c */
 extern int		maxage, tracking_delay, allow_no_device;
+extern int		client_inactivity_delay;
 extern nfds_t		maxconn;
+extern evloop_backend_t	event_backend;
+extern int		num_workers;
 extern char		*statepath, *datapath;
 extern upstype_t	*firstups;
 extern nut_ctype_t	*firstclient;
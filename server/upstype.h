@@ -23,6 +23,8 @@
 #define NUT_UPSTYPE_H_SEEN 1
 
 #include "parseconf.h"
+#include "twheel.h"
+#include "nut_stdint.h"
 
 #ifdef __cplusplus
 /* *INDENT-OFF* */
@@ -40,19 +42,40 @@ typedef struct upstype_s {
 	int			stale;
 	int			dumpdone;
 	int			data_ok;
-	time_t			last_heard;
-	time_t			last_ping;
-	time_t			last_connfail;
+	struct timeval		last_heard;	/* nut_monotime() */
+	struct timeval		last_ping;
+	struct timeval		last_connfail;
+	twtimer_t		check;		/* see ups_check() */
 	PCONF_CTX_t		sock_ctx;
 	struct st_tree_s	*inforoot;
 	struct cmdlist_s	*cmdlist;
 
+	uint64_t		seq;		/* of the last change to inforoot */
+	uint64_t		seqbase;	/* changes before this were lost */
+	struct st_tree_s	*delroot;	/* deleted variables, by seq */
+
+	struct watch_s		*watchers;	/* clients to push changes to */
+
+	int			inbatch;	/* driver sent BATCH BEGIN */
+	struct sbatch_s		*batch;		/* its lines, applied on BATCH END */
+	size_t			batchlen;
+	size_t			batchsize;
+
+	int			compact;	/* driver sends compact records */
+	char			*rbuf;		/* incomplete record */
+	size_t			rlen;
+	size_t			rsize;
+	struct svar_s		*vars;		/* indexed by record id */
+	size_t			numvars;
+
 	int	numlogins;
 	int	fsd;		/* forced shutdown in effect? */
 
 	int	retain;
 
 	struct upstype_s	*next;
+	struct upstype_s	*hnext;		/* in the same hash bucket */
+	size_t			hash;		/* of name, see get_ups_ptr() */
 
 } upstype_t;
 
@@ -44,9 +44,22 @@ typedef struct {
 typedef struct {
 	char	*username;
 	char	*password;
+	char	*pwhash;		/* from crypt(3), instead of password */
 	instcmdlist_t *firstcmd;
 	actionlist_t  *firstaction;
 	void	*next;
+
+	/* what the checks look at, made from the above by user_load() */
+	unsigned int	actions;	/* USER_ACTION_* bits */
+	int	allcmds;		/* "instcmds = all" */
+	char	**cmdset;		/* the cmd of each firstcmd, hashed */
+	size_t	cmdbuckets;
+	uint64_t	verified;	/* digest of the last password found
+					 * to match pwhash, if pwknown */
+	int	pwknown;
+
+	size_t	hash;
+	void	*hnext;			/* in the same hash bucket */
 } ulist_t;
 
 #ifdef __cplusplus
@@ -19,10 +19,20 @@
 
 #include "config.h"  /* must be the first header */
 
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_CRYPT_H
+#include <crypt.h>
+#endif
 
 #include "common.h"
 #include "parseconf.h"
@@ -30,44 +40,140 @@
 #include "user.h"
 #include "user-data.h"
 
+/*
+ * Users are hashed by name, and once upsd.users is loaded, each of them
+ * gets its actions as bits and its instcmds hashed, so that checking a
+ * request doesn't walk any list. Passwords are compared in a time which
+ * does not depend on how much of them was right.
+ *
+ * A password may also be given hashed by crypt(3) (password_hash), which
+ * is slow by design. Before handling a request which needs the password,
+ * upsd runs it through crypt() with user_pwhash(), user_pwcrypt() and
+ * user_pwverified(), the slow part without holding state_lock. The checks
+ * only look at what this left: a digest of the last password found to
+ * match, keyed with random bytes of this process, so that neither the
+ * password nor anything to try guesses against is kept. The checks run
+ * on the main loop or with state_lock held for writing, never in parallel.
+ */
+
+#define USER_ACTION_SET		(1U << 0)
+#define USER_ACTION_FSD		(1U << 1)
+#define USER_ACTION_LOGIN	(1U << 2)
+#define USER_ACTION_MASTER	(1U << 3)
+#define USER_ACTION_PRIMARY	(1U << 4)
+
+static const struct {
+	const char	*name;
+	unsigned int	bit;
+} user_actions[] = {
+	{ "SET", USER_ACTION_SET },
+	{ "FSD", USER_ACTION_FSD },
+	{ "LOGIN", USER_ACTION_LOGIN },
+	{ "MASTER", USER_ACTION_MASTER },
+	{ "PRIMARY", USER_ACTION_PRIMARY }
+};
+
 static ulist_t	*users = NULL;
+static ulist_t	*users_last = NULL;
+
+static ulist_t	**user_hash = NULL;
+static size_t	user_buckets = 0;
+static size_t	user_count = 0;
 
 static	ulist_t	*curr_user;
 
+/* of what user_load() read, 0 before that */
+static uint64_t	users_digest = 0;
+
+/* the key of user_pwdigest(), see user_keyinit() */
+static uint64_t	user_key[2];
+static int	user_keyed = 0;
+
+#ifdef HAVE_PTHREAD
+/* crypt() returns a static buffer */
+static pthread_mutex_t	user_crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static ulist_t *user_find(const char *un)
+{
+	ulist_t	*tmp;
+	size_t	hash;
+
+	if (!user_hash) {
+		return NULL;
+	}
+
+	/* user names are case-sensitive, instcmd names are not */
+	hash = nut_strhash(un, 0);
+
+	for (tmp = user_hash[hash & (user_buckets - 1)]; tmp; tmp = tmp->hnext) {
+		if ((tmp->hash == hash) && (!strcmp(tmp->username, un))) {
+			return tmp;
+		}
+	}
+
+	return NULL;
+}
+
+/* index a user just added to the list, growing the index as needed */
+static void user_index_add(ulist_t *user)
+{
+	ulist_t	*tmp;
+
+	user->hash = nut_strhash(user->username, 0);
+	user_count++;
+
+	/* keep the chains short */
+	if ((user_hash) && (user_count <= user_buckets)) {
+		user->hnext = user_hash[user->hash & (user_buckets - 1)];
+		user_hash[user->hash & (user_buckets - 1)] = user;
+		return;
+	}
+
+	free(user_hash);
+
+	user_buckets = nut_hashbuckets(user_count, 16);
+
+	user_hash = xcalloc(user_buckets, sizeof(*user_hash));
+
+	for (tmp = users; tmp; tmp = tmp->next) {
+		tmp->hnext = user_hash[tmp->hash & (user_buckets - 1)];
+		user_hash[tmp->hash & (user_buckets - 1)] = tmp;
+	}
+}
+
 /* create a new user entry */
 static void user_add(const char *un)
 {
-	ulist_t	*tmp, *last = NULL;
+	ulist_t	*tmp;
 
 	if (!un) {
 		return;
 	}
 
-	for (tmp = users; tmp != NULL; tmp = tmp->next) {
-
-		last = tmp;
-
-		if (!strcmp(tmp->username, un)) {
-			fprintf(stderr, "Ignoring duplicate user %s\n", un);
-			return;
-		}
+	if (user_find(un)) {
+		fprintf(stderr, "Ignoring duplicate user %s\n", un);
+		return;
 	}
 
 	tmp = xcalloc(1, sizeof(*tmp));
 	tmp->username = xstrdup(un);
 
-	if (last) {
-		last->next = tmp;
+	if (users_last) {
+		users_last->next = tmp;
 	} else {
 		users = tmp;
 	}
 
+	users_last = tmp;
+	user_index_add(tmp);
+
 	/* remember who we're working on */
 	curr_user = tmp;
 }
 
-/* set password */
-static void user_password(const char *pw)
+/* set password, or its hash */
+static void user_password(const char *pw, int hashed)
 {
 	if (!curr_user) {
 		upslogx(LOG_WARNING, "Ignoring password definition outside "
@@ -79,13 +185,25 @@ static void user_password(const char *pw)
 		return;
 	}
 
-	if (curr_user->password) {
+	if ((curr_user->password) || (curr_user->pwhash)) {
 		fprintf(stderr, "Ignoring duplicate password for %s\n",
 			curr_user->username);
 		return;
 	}
 
-	curr_user->password = xstrdup(pw);
+#ifndef HAVE_CRYPT
+	if (hashed) {
+		upslogx(LOG_WARNING, "Ignoring password_hash for %s: "
+			"upsd was built without crypt(3)", curr_user->username);
+		return;
+	}
+#endif
+
+	if (hashed) {
+		curr_user->pwhash = xstrdup(pw);
+	} else {
+		curr_user->password = xstrdup(pw);
+	}
 }
 
 /* attach allowed instcmds to user */
@@ -166,6 +284,65 @@ static void user_add_action(const char *act)
 	curr_user->firstaction = addaction(curr_user->firstaction, act);
 }
 
+/* the USER_ACTION_* bit of an action, 0 if unknown */
+static unsigned int user_actionbit(const char *action)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(user_actions) / sizeof(user_actions[0]); i++) {
+		if (!strcasecmp(user_actions[i].name, action)) {
+			return user_actions[i].bit;
+		}
+	}
+
+	return 0;
+}
+
+/* turn the lists of a user into what the checks look at */
+static void user_compile(ulist_t *user)
+{
+	instcmdlist_t	*cmd;
+	actionlist_t	*act;
+	size_t	count = 0, i;
+
+	for (act = user->firstaction; act != NULL; act = act->next) {
+		unsigned int	bit = user_actionbit(act->action);
+
+		if (!bit) {
+			upslogx(LOG_WARNING, "Unknown action %s for user %s",
+				act->action, user->username);
+		}
+
+		user->actions |= bit;
+	}
+
+	for (cmd = user->firstcmd; cmd != NULL; cmd = cmd->next) {
+		if (!strcasecmp(cmd->cmd, "all")) {
+			user->allcmds = 1;
+		}
+		count++;
+	}
+
+	if ((user->allcmds) || (!count)) {
+		return;
+	}
+
+	/* open addressing, at most half full */
+	user->cmdbuckets = nut_hashbuckets(count, 8);
+
+	user->cmdset = xcalloc(user->cmdbuckets, sizeof(*user->cmdset));
+
+	for (cmd = user->firstcmd; cmd != NULL; cmd = cmd->next) {
+		i = nut_strhash(cmd->cmd, 1) & (user->cmdbuckets - 1);
+
+		while (user->cmdset[i]) {
+			i = (i + 1) & (user->cmdbuckets - 1);
+		}
+
+		user->cmdset[i] = cmd->cmd;
+	}
+}
+
 static void flushcmd(instcmdlist_t *ptr)
 {
 	if (!ptr) {
@@ -202,6 +379,8 @@ static void flushuser(ulist_t *ptr)
 
 	free(ptr->username);
 	free(ptr->password);
+	free(ptr->pwhash);
+	free(ptr->cmdset);
 	free(ptr);
 }
 
@@ -210,71 +389,207 @@ void user_flush(void)
 {
 	flushuser(users);
 	users = NULL;
+	users_last = NULL;
+
+	free(user_hash);
+	user_hash = NULL;
+	user_buckets = 0;
+	user_count = 0;
 }
 
-static int user_matchinstcmd(ulist_t *user, const char * cmd)
+/* compare without stopping at the first difference, so that the time
+ * taken only depends on the length of what was given */
+static int user_pwmatch(const char *stored, const char *given)
 {
-	instcmdlist_t	*tmp;
+	size_t	slen = strlen(stored), glen = strlen(given), i;
+	unsigned int	diff = (slen != glen);
 
-	for (tmp = user->firstcmd; tmp != NULL; tmp = tmp->next) {
+	for (i = 0; i < glen; i++) {
+		diff |= (unsigned char)given[i] ^ (unsigned char)(slen ? stored[i % slen] : 0);
+	}
 
-		if (!strcasecmp(tmp->cmd, cmd)) {
-			return 1;	/* good */
-		}
+	return (diff == 0);
+}
 
-		if (!strcasecmp(tmp->cmd, "all")) {
-			return 1;	/* good */
+/* the key of the password digests, random for every run of upsd (or at
+ * least hard to guess without /dev/urandom), before user_load() */
+void user_keyinit(void)
+{
+	int	fd;
+	struct timeval	now;
+
+	if (user_keyed) {
+		return;
+	}
+
+	if (((fd = open("/dev/urandom", O_RDONLY)) >= 0)
+	 && (read(fd, user_key, sizeof(user_key)) == (ssize_t)sizeof(user_key))) {
+		user_keyed = 1;
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (!user_keyed) {
+		upsdebugx(1, "%s: can't read /dev/urandom, deriving the key from the time", __func__);
+		gettimeofday(&now, NULL);
+		user_key[0] ^= ((uint64_t)now.tv_sec << 20) ^ (uint64_t)now.tv_usec;
+		user_key[1] ^= ((uint64_t)getpid() << 32) ^ ((uint64_t)now.tv_usec << 12);
+		user_keyed = 1;
+	}
+}
+
+#define USER_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+#define USER_SIPROUND	do { \
+		v0 += v1; v1 = USER_ROTL(v1, 13); v1 ^= v0; v0 = USER_ROTL(v0, 32); \
+		v2 += v3; v3 = USER_ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = USER_ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = USER_ROTL(v1, 17); v1 ^= v2; v2 = USER_ROTL(v2, 32); \
+	} while (0)
+
+/* SipHash-2-4 of a password, keyed with user_key */
+static uint64_t user_pwdigest(const char *pw)
+{
+	const unsigned char	*in = (const unsigned char *)pw;
+	size_t	len = strlen(pw), i, j;
+	uint64_t	v0 = 0x736f6d6570736575ULL ^ user_key[0];
+	uint64_t	v1 = 0x646f72616e646f6dULL ^ user_key[1];
+	uint64_t	v2 = 0x6c7967656e657261ULL ^ user_key[0];
+	uint64_t	v3 = 0x7465646279746573ULL ^ user_key[1];
+	uint64_t	m, last = (uint64_t)len << 56;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		for (m = 0, j = 0; j < 8; j++) {
+			m |= (uint64_t)in[i + j] << (8 * j);
 		}
+
+		v3 ^= m;
+		USER_SIPROUND;
+		USER_SIPROUND;
+		v0 ^= m;
 	}
 
-	return 0;	/* fail */
+	for (j = 0; i + j < len; j++) {
+		last |= (uint64_t)in[i + j] << (8 * j);
+	}
+
+	v3 ^= last;
+	USER_SIPROUND;
+	USER_SIPROUND;
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	USER_SIPROUND;
+	USER_SIPROUND;
+	USER_SIPROUND;
+	USER_SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
 }
 
-int user_checkinstcmd(const char *un, const char *pw, const char *cmd)
+/* whether pw is the one user_pwverified() kept for a user */
+static int user_pwknown(const ulist_t *user, const char *pw)
 {
-	ulist_t	*tmp;
+	return (user->pwknown) && ((user_pwdigest(pw) ^ user->verified) == 0);
+}
 
-	if ((!un) || (!pw) || (!cmd)) {
-		return 0;	/* failed */
+/* the crypt(3) hash to run a password of un through with user_pwcrypt(),
+ * for user_pwverified() to keep the outcome: a copy to free, or NULL if
+ * there is nothing slow to do; with state_lock held, at least for reading */
+char *user_pwhash(const char *un, const char *pw)
+{
+	ulist_t	*user;
+
+	if ((!un) || (!pw) || ((user = user_find(un)) == NULL)) {
+		return NULL;
 	}
 
-	for (tmp = users; tmp != NULL; tmp = tmp->next) {
+	if ((!user->pwhash) || (user_pwknown(user, pw))) {
+		return NULL;
+	}
 
-		/* let's be paranoid before we call strcmp */
+	return xstrdup(user->pwhash);
+}
 
-		if ((!tmp->username) || (!tmp->password)) {
-			continue;
-		}
+/* whether pw matches hash, slow by design: runs without state_lock */
+int user_pwcrypt(const char *hash, const char *pw)
+{
+#ifdef HAVE_CRYPT
+	const char	*res;
+	int	ret;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&user_crypt_lock);
+#endif
+	res = crypt(pw, hash);
+	ret = (res) && (user_pwmatch(hash, res));
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&user_crypt_lock);
+#endif
+
+	return ret;
+#else
+	NUT_UNUSED_VARIABLE(hash);
+	NUT_UNUSED_VARIABLE(pw);
+
+	return 0;
+#endif	/* HAVE_CRYPT */
+}
 
-		if (strcmp(tmp->username, un)) {
-			continue;
-		}
+/* keep that pw is the password of un, as long as its hash is still the
+ * one user_pwcrypt() found it to match; with state_lock held for writing */
+void user_pwverified(const char *un, const char *pw, const char *hash)
+{
+	ulist_t	*user = user_find(un);
 
+	if ((!user) || (!user->pwhash) || (strcmp(user->pwhash, hash))) {
+		return;
+	}
 
-		if (strcmp(tmp->password, pw)) {
-			/* password mismatch */
-			return 0;	/* fail */
-		}
+	user->verified = user_pwdigest(pw);
+	user->pwknown = 1;
+}
 
-		if (!user_matchinstcmd(tmp, cmd)) {
-			return 0;		/* fail */
-		}
+/* the user named un, if pw is its password */
+static ulist_t *user_verify(const char *un, const char *pw)
+{
+	ulist_t	*user = user_find(un);
 
-		/* passed all checks */
-		return 1;	/* good */
+	if (!user) {
+		/* username not found */
+		return NULL;
 	}
 
-	/* username not found */
-	return 0;	/* fail */
+	if (user->password) {
+		return user_pwmatch(user->password, pw) ? user : NULL;
+	}
+
+	/* crypt() already ran, see user_pwverified() */
+	if (user->pwhash) {
+		return user_pwknown(user, pw) ? user : NULL;
+	}
+
+	/* no password, no access */
+	return NULL;
 }
 
-static int user_matchaction(ulist_t *user, const char *action)
+static int user_matchinstcmd(ulist_t *user, const char * cmd)
 {
-	actionlist_t	*tmp;
+	size_t	i;
+
+	if (user->allcmds) {
+		return 1;	/* good */
+	}
 
-	for (tmp = user->firstaction; tmp != NULL; tmp = tmp->next) {
+	if (!user->cmdset) {
+		return 0;	/* fail */
+	}
 
-		if (!strcasecmp(tmp->action, action)) {
+	for (i = nut_strhash(cmd, 1) & (user->cmdbuckets - 1); user->cmdset[i];
+		i = (i + 1) & (user->cmdbuckets - 1)) {
+
+		if (!strcasecmp(user->cmdset[i], cmd)) {
 			return 1;	/* good */
 		}
 	}
@@ -282,41 +597,52 @@ static int user_matchaction(ulist_t *user, const char *action)
 	return 0;	/* fail */
 }
 
-int user_checkaction(const char *un, const char *pw, const char *action)
+int user_checkinstcmd(const char *un, const char *pw, const char *cmd)
 {
-	ulist_t	*tmp;
+	ulist_t	*user;
 
-	if ((!un) || (!pw) || (!action))
+	if ((!un) || (!pw) || (!cmd)) {
 		return 0;	/* failed */
+	}
 
-	for (tmp = users; tmp != NULL; tmp = tmp->next) {
+	user = user_verify(un, pw);
 
-		/* let's be paranoid before we call strcmp */
+	if (!user) {
+		return 0;	/* fail */
+	}
 
-		if ((!tmp->username) || (!tmp->password)) {
-			continue;
-		}
+	if (!user_matchinstcmd(user, cmd)) {
+		return 0;		/* fail */
+	}
 
-		if (strcmp(tmp->username, un)) {
-			continue;
-		}
+	/* passed all checks */
+	return 1;	/* good */
+}
 
-		if (strcmp(tmp->password, pw)) {
-			upsdebugx(2, "user_checkaction: password mismatch");
-			return 0;	/* fail */
-		}
+int user_checkaction(const char *un, const char *pw, const char *action)
+{
+	ulist_t	*user;
+	unsigned int	bit;
 
-		if (!user_matchaction(tmp, action)) {
-			upsdebugx(2, "user_matchaction: failed");
-			return 0;	/* fail */
-		}
+	if ((!un) || (!pw) || (!action))
+		return 0;	/* failed */
 
-		/* passed all checks */
-		return 1;	/* good */
+	user = user_verify(un, pw);
+
+	if (!user) {
+		upsdebugx(2, "user_checkaction: password mismatch");
+		return 0;	/* fail */
 	}
 
-	/* username not found */
-	return 0;	/* fail */
+	bit = user_actionbit(action);
+
+	if ((!bit) || (!(user->actions & bit))) {
+		upsdebugx(2, "user_matchaction: failed");
+		return 0;	/* fail */
+	}
+
+	/* passed all checks */
+	return 1;	/* good */
 }
 
 /* handle "upsmon primary" and "upsmon secondary" for nicer configurations */
@@ -344,7 +670,12 @@ static void set_upsmon_type(char *type)
 static void parse_var(char *var, char *val)
 {
 	if (!strcasecmp(var, "password")) {
-		user_password(val);
+		user_password(val, 0);
+		return;
+	}
+
+	if (!strcasecmp(var, "password_hash")) {
+		user_password(val, 1);
 		return;
 	}
 
@@ -464,6 +795,39 @@ static void upsd_user_err(const char *errmsg)
 	upslogx(LOG_ERR, "Fatal error in parseconf(upsd.users): %s", errmsg);
 }
 
+/* FNV-1a of the whole file, 0 if it can't be read */
+static uint64_t user_file_digest(const char *fn)
+{
+	FILE	*f;
+	char	buf[LARGEBUF];
+	size_t	len, i;
+	uint64_t	hash = 14695981039346656037ULL;
+
+	if ((f = fopen(fn, "r")) == NULL) {
+		return 0;
+	}
+
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		for (i = 0; i < len; i++) {
+			hash ^= (unsigned char)buf[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	fclose(f);
+
+	return hash;
+}
+
+int user_changed(void)
+{
+	char	fn[SMALLBUF];
+
+	snprintf(fn, sizeof(fn), "%s/upsd.users", confpath());
+
+	return ((!users_digest) || (user_file_digest(fn) != users_digest));
+}
+
 void user_load(void)
 {
 	char	fn[SMALLBUF];
@@ -471,10 +835,16 @@ void user_load(void)
 
 	curr_user = NULL;
 
+	/* if upsd did not already */
+	user_keyinit();
+
 	snprintf(fn, sizeof(fn), "%s/upsd.users", confpath());
 
 	check_perms(fn);
 
+	/* before parsing, so that a change meanwhile is seen next time */
+	users_digest = user_file_digest(fn);
+
 	pconf_init(&ctx, upsd_user_err);
 
 	if (!pconf_file_begin(&ctx, fn)) {
@@ -497,4 +867,10 @@ void user_load(void)
 	}
 
 	pconf_finish(&ctx);
+
+	for (curr_user = users; curr_user; curr_user = curr_user->next) {
+		user_compile(curr_user);
+	}
+
+	curr_user = NULL;
 }
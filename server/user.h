@@ -31,13 +31,22 @@ extern "C" {
 /* *INDENT-ON* */
 #endif
 
+void user_keyinit(void);
 void user_load(void);
 
 int user_checkinstcmd(const char *un, const char *pw, const char *cmd);
 int user_checkaction(const char *un, const char *pw, const char *action);
 
+/* checking a password against a crypt(3) hash, in steps (see user.c) */
+char *user_pwhash(const char *un, const char *pw);
+int user_pwcrypt(const char *hash, const char *pw);
+void user_pwverified(const char *un, const char *pw, const char *hash);
+
 void user_flush(void);
 
+/* whether upsd.users is not what user_load() last read */
+int user_changed(void);
+
 /* cheat - we don't want the full upsd.h included here */
 void check_perms(const char *fn);
 
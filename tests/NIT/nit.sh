@@ -779,6 +779,438 @@ testcases_sandbox_cppnit() {
     testcase_sandbox_cppnit_simple_admin
 }
 
+testcase_sandbox_upsd_workers_load() {
+    log_separator
+    log_info "Compare GET and LIST throughput of UPSD with several WORKERS settings"
+
+    NETLOADBENCH="${TOP_BUILDDIR}/tests/netloadbench"
+    if [ x"${TOP_BUILDDIR}" = x ] || [ ! -x "$NETLOADBENCH" ] ; then
+        log_info "netloadbench was not built (make check), skipping"
+        return 0
+    fi
+
+    # Scaling can only show with as many cores, the load generator
+    # gets one thread per core too
+    CPUS="`getconf _NPROCESSORS_ONLN 2>/dev/null`" || CPUS=1
+    [ -n "$CPUS" ] && [ "$CPUS" -gt 0 ] 2>/dev/null || CPUS=1
+    log_info "Found $CPUS CPU core(s)"
+
+    cp -f "$NUT_CONFPATH/upsd.conf" "$NUT_CONFPATH/upsd.conf.orig" \
+    || die "Failed to back up upsd.conf"
+
+    for W in ${NIT_WORKERS-0 1 2 $CPUS} ; do
+        kill -15 $PID_UPSD 2>/dev/null
+        wait $PID_UPSD
+
+        cp -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf" \
+        && echo "WORKERS $W" >> "$NUT_CONFPATH/upsd.conf" \
+        || die "Failed to populate temporary FS structure for the NIT: upsd.conf"
+
+        upsd -F &
+        PID_UPSD="$!"
+
+        COUNTDOWN=30
+        while ! upsc dummy@localhost:$NUT_PORT device.model >/dev/null 2>&1 ; do
+            sleep 1
+            COUNTDOWN="`expr $COUNTDOWN - 1`"
+            [ "$COUNTDOWN" -lt 1 ] && die "upsd with WORKERS $W does not respond"
+        done
+
+        for MODE in "" "-l" ; do
+            if OUT="`"$NETLOADBENCH" -H localhost -p $NUT_PORT -c 16 -j $CPUS -t ${NIT_LOAD_SECONDS-5} $MODE dummy device.model`" ; then
+                log_info "WORKERS $W: $OUT"
+                PASSED="`expr $PASSED + 1`"
+            else
+                log_error "WORKERS $W: $OUT"
+                FAILED="`expr $FAILED + 1`"
+            fi
+        done
+    done
+
+    mv -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf"
+}
+
+testcase_sandbox_upsd_reload() {
+    log_separator
+    log_info "Reload UPSD configuration with clients connected, and with LISTEN changes"
+
+    RELOADBENCH="${TOP_BUILDDIR}/tests/reloadbench"
+    if [ x"${TOP_BUILDDIR}" = x ] || [ ! -x "$RELOADBENCH" ] ; then
+        log_info "reloadbench was not built (make check), skipping"
+        return 0
+    fi
+
+    # Every client must keep its session and get the driver data right
+    # after each SIGHUP
+    if OUT="`"$RELOADBENCH" -H localhost -p $NUT_PORT -c 16 -n ${NIT_RELOADS-10} -P $PID_UPSD dummy device.model`" ; then
+        log_info "$OUT"
+        PASSED="`expr $PASSED + 1`"
+    else
+        log_error "$OUT"
+        FAILED="`expr $FAILED + 1`"
+    fi
+
+    EXTRA_PORT="`expr $NUT_PORT + 1`"
+    cp -f "$NUT_CONFPATH/upsd.conf" "$NUT_CONFPATH/upsd.conf.orig" \
+    && echo "LISTEN 127.0.0.1 $EXTRA_PORT" >> "$NUT_CONFPATH/upsd.conf" \
+    || die "Failed to populate temporary FS structure for the NIT: upsd.conf"
+
+    kill -1 $PID_UPSD
+    sleep 2
+
+    if upsc dummy@127.0.0.1:$EXTRA_PORT device.model >/dev/null \
+    && upsc dummy@localhost:$NUT_PORT device.model >/dev/null ; then
+        log_info "OK, upsd listens on both ports after reload"
+        PASSED="`expr $PASSED + 1`"
+    else
+        log_error "upsd does not listen on both ports after reload"
+        FAILED="`expr $FAILED + 1`"
+    fi
+
+    mv -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf"
+    kill -1 $PID_UPSD
+    sleep 2
+
+    if upsc dummy@127.0.0.1:$EXTRA_PORT device.model >/dev/null 2>&1 ; then
+        log_error "upsd still listens on port $EXTRA_PORT after reload"
+        FAILED="`expr $FAILED + 1`"
+    elif isPidAlive "$PID_UPSD" && upsc dummy@localhost:$NUT_PORT device.model >/dev/null ; then
+        log_info "OK, upsd stopped listening on port $EXTRA_PORT only"
+        PASSED="`expr $PASSED + 1`"
+    else
+        log_error "upsd does not respond after reload"
+        FAILED="`expr $FAILED + 1`"
+    fi
+}
+
+testcase_sandbox_upsd_stall() {
+    log_separator
+    log_info "Query UPSD while another client, in plain text and in TLS, stops reading"
+
+    STALLCLIENT="${TOP_BUILDDIR}/tests/stallclient"
+    if [ x"${TOP_BUILDDIR}" = x ] || [ ! -x "$STALLCLIENT" ] ; then
+        log_info "stallclient was not built (make check), skipping"
+        return 0
+    fi
+
+    for W in 0 1 ; do
+        kill -15 $PID_UPSD 2>/dev/null
+        wait $PID_UPSD
+
+        cp -f "$NUT_CONFPATH/upsd.conf" "$NUT_CONFPATH/upsd.conf.orig" \
+        && echo "WORKERS $W" >> "$NUT_CONFPATH/upsd.conf" \
+        || die "Failed to populate temporary FS structure for the NIT: upsd.conf"
+
+        TLS=""
+        if (command -v openssl) >/dev/null 2>&1 \
+        && openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+            -keyout "$NUT_CONFPATH/upsd.key" -out "$NUT_CONFPATH/upsd.crt" >/dev/null 2>&1 \
+        && cat "$NUT_CONFPATH/upsd.crt" "$NUT_CONFPATH/upsd.key" > "$NUT_CONFPATH/upsd.pem" \
+        ; then
+            echo "CERTFILE $NUT_CONFPATH/upsd.pem" >> "$NUT_CONFPATH/upsd.conf"
+            TLS="-s"
+        else
+            log_info "No openssl program to make a certificate with, only checking in plain text"
+        fi
+
+        upsd -F &
+        PID_UPSD="$!"
+
+        COUNTDOWN=30
+        while ! upsc dummy@localhost:$NUT_PORT device.model >/dev/null 2>&1 ; do
+            sleep 1
+            COUNTDOWN="`expr $COUNTDOWN - 1`"
+            [ "$COUNTDOWN" -lt 1 ] && die "upsd with WORKERS $W does not respond"
+        done
+
+        for MODE in "" $TLS ; do
+            OUT="`"$STALLCLIENT" -H localhost -p $NUT_PORT $MODE dummy device.model`"
+            case "$?" in
+                0)  log_info "WORKERS $W: $OUT"
+                    PASSED="`expr $PASSED + 1`"
+                    ;;
+                77) log_info "WORKERS $W: $OUT" ;;
+                *)  log_error "WORKERS $W: $OUT"
+                    FAILED="`expr $FAILED + 1`"
+                    ;;
+            esac
+        done
+
+        mv -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf"
+    done
+
+    kill -15 $PID_UPSD 2>/dev/null
+    wait $PID_UPSD
+    upsd -F &
+    PID_UPSD="$!"
+    sleep 2
+}
+
+testcase_sandbox_upsd_watch_stall() {
+    log_separator
+    log_info "Push WATCHed changes to clients which stop reading, served by worker threads"
+
+    STALLCLIENT="${TOP_BUILDDIR}/tests/stallclient"
+    if [ x"${TOP_BUILDDIR}" = x ] || [ ! -x "$STALLCLIENT" ] ; then
+        log_info "stallclient was not built (make check), skipping"
+        return 0
+    fi
+
+    for W in 0 1 2 ; do
+        kill -15 $PID_UPSD 2>/dev/null
+        wait $PID_UPSD
+
+        cp -f "$NUT_CONFPATH/upsd.conf" "$NUT_CONFPATH/upsd.conf.orig" \
+        && echo "WORKERS $W" >> "$NUT_CONFPATH/upsd.conf" \
+        || die "Failed to populate temporary FS structure for the NIT: upsd.conf"
+
+        upsd -F > "$NUT_STATEPATH/upsd-watch.log" 2>&1 &
+        PID_UPSD="$!"
+
+        COUNTDOWN=30
+        while ! upsc dummy@localhost:$NUT_PORT device.model >/dev/null 2>&1 ; do
+            sleep 1
+            COUNTDOWN="`expr $COUNTDOWN - 1`"
+            [ "$COUNTDOWN" -lt 1 ] && die "upsd with WORKERS $W does not respond"
+        done
+
+        # More changes than the socket buffers of the watchers and the
+        # output queues of upsd take, for it to drop them
+        OUT="`NUT_USER='admin' NUT_PASS="${TESTPASS_ADMIN}" \
+            "$STALLCLIENT" -w -H localhost -p $NUT_PORT -n 100000 -t 30 dummy ups.mfr`"
+        case "$?" in
+            0)  log_info "WORKERS $W: $OUT (`grep -c 'dropping it' "$NUT_STATEPATH/upsd-watch.log"` watchers dropped)"
+                PASSED="`expr $PASSED + 1`"
+                ;;
+            77) log_info "WORKERS $W: $OUT" ;;
+            *)  log_error "WORKERS $W: $OUT"
+                FAILED="`expr $FAILED + 1`"
+                ;;
+        esac
+
+        mv -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf"
+    done
+
+    kill -15 $PID_UPSD 2>/dev/null
+    wait $PID_UPSD
+    rm -f "$NUT_STATEPATH/upsd-watch.log"
+    upsd -F &
+    PID_UPSD="$!"
+    sleep 2
+}
+
+testcase_sandbox_upsd_metrics() {
+    log_separator
+    log_info "Scrape the metrics of many UPSes with a client which stops reading for a while"
+
+    STALLCLIENT="${TOP_BUILDDIR}/tests/stallclient"
+    if [ x"${TOP_BUILDDIR}" = x ] || [ ! -x "$STALLCLIENT" ] ; then
+        log_info "stallclient was not built (make check), skipping"
+        return 0
+    fi
+
+    kill -15 $PID_UPSD 2>/dev/null
+    wait $PID_UPSD
+
+    # More metrics than the socket buffers take, even grown to their
+    # largest; there are no drivers for these, so upsd complains about
+    # each of them, which only goes to its own log
+    METRICS_PORT="`expr $NUT_PORT + 1`"
+    cp -f "$NUT_CONFPATH/upsd.conf" "$NUT_CONFPATH/upsd.conf.orig" \
+    && cp -f "$NUT_CONFPATH/ups.conf" "$NUT_CONFPATH/ups.conf.orig" \
+    && echo "METRICS_LISTEN localhost $METRICS_PORT" >> "$NUT_CONFPATH/upsd.conf" \
+    && awk 'BEGIN { for (i = 1; i <= 40000; i++) printf("[scrape%d]\n\tdriver = dummy-ups\n\tport = scrape.dev\n", i) }' \
+        >> "$NUT_CONFPATH/ups.conf" \
+    || die "Failed to populate temporary FS structure for the NIT: ups.conf"
+    NUMUPS="`grep -c '^\[' "$NUT_CONFPATH/ups.conf"`"
+
+    for W in 0 1 ; do
+        cp -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf" \
+        && echo "METRICS_LISTEN localhost $METRICS_PORT" >> "$NUT_CONFPATH/upsd.conf" \
+        && echo "WORKERS $W" >> "$NUT_CONFPATH/upsd.conf" \
+        || die "Failed to populate temporary FS structure for the NIT: upsd.conf"
+
+        upsd -F > "$NUT_STATEPATH/upsd-metrics.log" 2>&1 &
+        PID_UPSD="$!"
+
+        COUNTDOWN=60
+        while ! upsc dummy@localhost:$NUT_PORT device.model >/dev/null 2>&1 ; do
+            sleep 1
+            COUNTDOWN="`expr $COUNTDOWN - 1`"
+            [ "$COUNTDOWN" -lt 1 ] && die "upsd with WORKERS $W does not respond"
+        done
+
+        OUT="`"$STALLCLIENT" -m -H localhost -p $METRICS_PORT $NUMUPS`"
+        if [ "$?" = 0 ] ; then
+            log_info "WORKERS $W: $OUT"
+            PASSED="`expr $PASSED + 1`"
+        else
+            log_error "WORKERS $W: $OUT"
+            FAILED="`expr $FAILED + 1`"
+        fi
+
+        kill -15 $PID_UPSD 2>/dev/null
+        wait $PID_UPSD
+    done
+
+    mv -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf"
+    mv -f "$NUT_CONFPATH/ups.conf.orig" "$NUT_CONFPATH/ups.conf"
+    rm -f "$NUT_STATEPATH/upsd-metrics.log"
+    upsd -F &
+    PID_UPSD="$!"
+    sleep 2
+}
+
+# Check that the answers of upsd in $OUT have (or, with "absent", do not
+# have) a line matching the extended regex $2, for the request named $1
+protocol_expect() {
+    if echo "$OUT" | grep -E "$2" >/dev/null ; then
+        [ x"${3-}" != x"absent" ] && return 0
+        log_error "$1: got a line matching '$2' in:"
+    else
+        [ x"${3-}" = x"absent" ] && return 0
+        log_error "$1: no line matching '$2' in:"
+    fi
+    echo "$OUT" >&2
+    PROTOCOL_OK=false
+}
+
+protocol_result() {
+    if $PROTOCOL_OK ; then
+        log_info "OK, $1 answered as expected"
+        PASSED="`expr $PASSED + 1`"
+    else
+        FAILED="`expr $FAILED + 1`"
+    fi
+}
+
+testcase_sandbox_upsd_protocol() {
+    log_separator
+    log_info "Ask UPSD for changes with LIST DELTA, WATCH and PUSH, GET VARAGE and descriptions"
+
+    PROTOCLIENT="${TOP_BUILDDIR}/tests/protoclient"
+    if [ x"${TOP_BUILDDIR}" = x ] || [ ! -x "$PROTOCLIENT" ] ; then
+        log_info "protoclient was not built (make check), skipping"
+        return 0
+    fi
+
+    # Descriptions come from cmdvartab in the sources, not an installed one
+    kill -15 $PID_UPSD 2>/dev/null
+    wait $PID_UPSD
+
+    cp -f "$NUT_CONFPATH/upsd.conf" "$NUT_CONFPATH/upsd.conf.orig" \
+    || die "Failed to back up upsd.conf"
+    if [ x"${TOP_SRCDIR}" != x ]; then
+        echo "DATAPATH ${TOP_SRCDIR}/data" >> "$NUT_CONFPATH/upsd.conf" \
+        || die "Failed to populate temporary FS structure for the NIT: upsd.conf"
+    fi
+
+    upsd -F &
+    PID_UPSD="$!"
+
+    COUNTDOWN=30
+    while ! upsc dummy@localhost:$NUT_PORT device.model >/dev/null 2>&1 ; do
+        sleep 1
+        COUNTDOWN="`expr $COUNTDOWN - 1`"
+        [ "$COUNTDOWN" -lt 1 ] && die "upsd does not respond"
+    done
+
+    # LIST DELTA: everything at first, then only what changed since the
+    # sequence given, or everything again for one upsd can not know
+    # (older than its data, or not given out yet)
+    PROTOCOL_OK=true
+    OUT="`echo 'LIST DELTA dummy 0' | "$PROTOCLIENT" -H localhost -p $NUT_PORT`" \
+    || PROTOCOL_OK=false
+    protocol_expect "LIST DELTA 0" '^RESET dummy$'
+    protocol_expect "LIST DELTA 0" '^VAR dummy device.model "'
+    SEQ="`echo "$OUT" | sed -n 's/^SEQ dummy //p'`"
+    if [ -z "$SEQ" ] ; then
+        log_error "LIST DELTA 0: no SEQ line in: $OUT"
+        PROTOCOL_OK=false
+        SEQ=0
+    fi
+
+    OUT="`echo "LIST DELTA dummy $SEQ" | "$PROTOCLIENT" -H localhost -p $NUT_PORT`" \
+    || PROTOCOL_OK=false
+    protocol_expect "LIST DELTA $SEQ" '^RESET ' absent
+    protocol_expect "LIST DELTA $SEQ" '^VAR dummy device.model ' absent
+
+    for S in 1 "${SEQ}0" ; do
+        OUT="`echo "LIST DELTA dummy $S" | "$PROTOCLIENT" -H localhost -p $NUT_PORT`" \
+        || PROTOCOL_OK=false
+        protocol_expect "LIST DELTA $S" '^RESET dummy$'
+        protocol_expect "LIST DELTA $S" '^VAR dummy device.model "'
+    done
+    protocol_result "LIST DELTA"
+
+    # WATCH: the current value, then each change pushed until UNWATCH,
+    # whatever the case of the pattern; the last change must also be in
+    # the next LIST DELTA
+    PROTOCOL_OK=true
+    OUT="`"$PROTOCLIENT" -H localhost -p $NUT_PORT << EOF
+USERNAME admin
+PASSWORD ${TESTPASS_ADMIN}
+WATCH dummy "UPS.MF?"
+WAIT 5 PUSH VAR dummy ups.mfr
+SET VAR dummy ups.mfr "nit-watch-1"
+WAIT 10 PUSH VAR dummy ups.mfr "nit-watch-1"
+GET VARAGE dummy ups.mfr
+UNWATCH dummy
+SET VAR dummy ups.mfr "nit-watch-2"
+SLEEP 3
+GET VAR dummy ups.mfr
+LIST DELTA dummy $SEQ
+EOF
+`" || PROTOCOL_OK=false
+    protocol_expect "WATCH" '^PUSH VAR dummy ups.mfr "nit-watch-1"$'
+    protocol_expect "UNWATCH" '^PUSH VAR dummy ups.mfr "nit-watch-2"$' absent
+    protocol_expect "UNWATCH" '^VAR dummy ups.mfr "nit-watch-2"$'
+    protocol_expect "LIST DELTA $SEQ" '^VAR dummy ups.mfr "nit-watch-2"$'
+    protocol_result "WATCH, UNWATCH and PUSH"
+
+    # GET VARAGE: recent for the value just set above
+    PROTOCOL_OK=true
+    echo "$OUT" | grep -E '^VARAGE dummy ups.mfr [0-9]+\.[0-9]{3}$' \
+    | awk '{ exit !($4 < 3) }' || {
+        log_error "GET VARAGE: no age under 3 seconds for a value just set in:"
+        echo "$OUT" >&2
+        PROTOCOL_OK=false
+    }
+    OUT="`printf 'GET VARAGE dummy device.model\nGET VARAGE dummy ups.bogus.value\n' \
+        | "$PROTOCLIENT" -H localhost -p $NUT_PORT`" \
+    || PROTOCOL_OK=false
+    protocol_expect "GET VARAGE" '^VARAGE dummy device.model [0-9]+\.[0-9]{3}$'
+    protocol_expect "GET VARAGE" '^ERR VAR-NOT-SUPPORTED$'
+    protocol_result "GET VARAGE"
+
+    # Descriptions of indexed collections: their own entry if any, else
+    # as outlet.n.*, else without their index
+    if [ x"${TOP_SRCDIR}" != x ]; then
+        PROTOCOL_OK=true
+        OUT="`"$PROTOCLIENT" -H localhost -p $NUT_PORT << EOF
+GET DESC dummy outlet.1.desc
+GET DESC dummy OUTLET.17.STATUS
+GET DESC dummy ambient.contacts.3.status
+GET CMDDESC dummy outlet.5.load.off
+GET DESC dummy outlet.3.bogus
+EOF
+`" || PROTOCOL_OK=false
+        protocol_expect "GET DESC" '^DESC dummy outlet.1.desc "Outlet description"$'
+        protocol_expect "GET DESC" '^DESC dummy OUTLET.17.STATUS "Outlet switch status"$'
+        protocol_expect "GET DESC" '^DESC dummy ambient.contacts.3.status "State of this dry contact sensor"$'
+        protocol_expect "GET CMDDESC" '^CMDDESC dummy outlet.5.load.off "Turn off the load on this outlet immediately"$'
+        protocol_expect "GET DESC" '^DESC dummy outlet.3.bogus "Description unavailable"$'
+        protocol_result "GET DESC and GET CMDDESC of indexed names"
+    fi
+
+    kill -15 $PID_UPSD 2>/dev/null
+    wait $PID_UPSD
+    mv -f "$NUT_CONFPATH/upsd.conf.orig" "$NUT_CONFPATH/upsd.conf"
+    upsd -F &
+    PID_UPSD="$!"
+    sleep 2
+}
+
 # TODO: Some upsmon tests?
 
 testgroup_sandbox() {
@@ -788,6 +1220,11 @@ testgroup_sandbox() {
     testcase_sandbox_upsc_query_timer
     testcases_sandbox_python
     testcases_sandbox_cppnit
+    testcase_sandbox_upsd_reload
+    testcase_sandbox_upsd_stall
+    testcase_sandbox_upsd_watch_stall
+    testcase_sandbox_upsd_metrics
+    testcase_sandbox_upsd_protocol
 
     sandbox_forget_configs
 }
@@ -806,6 +1243,21 @@ testgroup_sandbox_cppnit() {
     sandbox_forget_configs
 }
 
+testgroup_sandbox_upsd_protocol() {
+    # Arrange for quick test iterations
+    testcase_sandbox_start_drivers_after_upsd
+    testcase_sandbox_upsd_protocol
+    sandbox_forget_configs
+}
+
+testgroup_sandbox_upsd_workers() {
+    # Not among the defaults: takes a while, and needs several cores
+    # to tell anything
+    testcase_sandbox_start_drivers_after_upsd
+    testcase_sandbox_upsd_workers_load
+    sandbox_forget_configs
+}
+
 testgroup_sandbox_cppnit_simple_admin() {
     # Arrange for quick test iterations
     testcase_sandbox_start_drivers_after_upsd
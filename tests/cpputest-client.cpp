@@ -52,6 +52,9 @@ class NutActiveClientTest : public CppUnit::TestFixture
 	CPPUNIT_TEST_SUITE( NutActiveClientTest );
 		CPPUNIT_TEST( test_query_ver );
 		CPPUNIT_TEST( test_list_ups );
+		CPPUNIT_TEST( test_async_pipeline );
+		CPPUNIT_TEST( test_async_logout );
+		CPPUNIT_TEST( test_client_pool );
 		CPPUNIT_TEST( test_auth_user );
 		CPPUNIT_TEST( test_auth_primary );
 	CPPUNIT_TEST_SUITE_END();
@@ -70,6 +73,9 @@ public:
 
 	void test_query_ver();
 	void test_list_ups();
+	void test_async_pipeline();
+	void test_async_logout();
+	void test_client_pool();
 	void test_auth_user();
 	void test_auth_primary();
 };
@@ -220,6 +226,214 @@ void NutActiveClientTest::test_list_ups() {
 		noException);
 }
 
+void NutActiveClientTest::test_async_pipeline() {
+	nut::AsyncTcpClient c("localhost", NUT_PORT);
+	std::set<std::string> devs;
+	size_t answers = 0, called = 0;
+	bool noException = true;
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"AsyncTcpClient is not connected after constructor",
+		c.isConnected());
+
+	/* All of these go out before the first answer is read */
+	std::future<std::string> ver = c.query("VER");
+	std::future<std::set<std::string> > names = c.getDeviceNames();
+	std::future<std::vector<std::string> > bogus =
+		c.getDeviceVariableValue("no-such-ups", "ups.status");
+	c.query("VER", [&called](std::future<std::string>& f) {
+		f.get();
+		called++;
+	});
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"AsyncTcpClient did not queue the pipelined queries",
+		c.getPendingCount() == 4);
+
+	try {
+		c.wait(ver, 10);
+		std::cerr << "[D] Got Data Server VER asynchronously: " << ver.get() << std::endl;
+		answers++;
+
+		c.wait(names, 10);
+		devs = names.get();
+		std::cerr << "[D] Got device list asynchronously (" << devs.size() << ")" << std::endl;
+		answers++;
+
+		/* Answered in order, so this one is there as well */
+		c.wait(bogus, 10);
+		try {
+			bogus.get();
+			std::cerr << "[D] Got a value for a bogus device" << std::endl;
+			noException = false;
+		}
+		catch(nut::NutException& ex)
+		{
+			std::cerr << "[D] Bogus device failed as expected: " << ex.what() << std::endl;
+			answers++;
+		}
+
+		/* One GET per device, all in flight at once */
+		std::vector<std::future<std::vector<std::string> > > values;
+		for (std::set<std::string>::iterator it = devs.begin();
+			it != devs.end(); it++
+		) {
+			values.push_back(c.getDeviceVariableValue(*it, "ups.status"));
+		}
+		for (size_t i = 0; i < values.size(); i++) {
+			c.wait(values[i], 10);
+			try {
+				values[i].get();
+			}
+			catch(nut::NutException& ex)
+			{
+				/* A device without ups.status is fine here */
+				std::cerr << "[D] No ups.status: " << ex.what() << std::endl;
+			}
+		}
+
+		/* The current values pushed right after WATCH must go to the
+		 * handler, not complete the query sent after it */
+		if (!devs.empty()) {
+			size_t changes = 0;
+			std::future<void> watch = c.watchDevice(*devs.begin(),
+				std::set<std::string>(),
+				[&changes](const nut::VariableChange&) { changes++; });
+			std::future<std::string> after = c.query("VER");
+
+			c.wait(after, 10);
+			watch.get();
+			if (after.get().compare(0, 5, "PUSH ") == 0) {
+				std::cerr << "[D] A pushed change answered a query" << std::endl;
+				noException = false;
+			}
+			else {
+				std::cerr << "[D] Got " << changes << " pushed changes" << std::endl;
+				answers++;
+			}
+
+			std::future<void> unwatch = c.unwatchDevice(*devs.begin());
+			c.wait(unwatch, 10);
+			unwatch.get();
+		}
+		else {
+			answers++;
+		}
+
+		while (c.getPendingCount() > 0 && c.run(10)) {}
+	}
+	catch(nut::NutException& ex)
+	{
+		std::cerr << "[D] Pipelined queries failed: " << ex.what() << std::endl;
+		noException = false;
+	}
+
+	c.disconnect();
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed pipelined queries with AsyncTcpClient: threw NutException",
+		noException);
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"AsyncTcpClient did not answer all pipelined queries",
+		answers == 4 && called == 1);
+}
+
+void NutActiveClientTest::test_async_logout() {
+	nut::AsyncTcpClient c("localhost", NUT_PORT);
+	bool noException = true;
+
+	/* upsd answers, then closes the connection: both may be read at once */
+	std::future<std::string> ver = c.query("VER");
+	std::future<void> bye = c.logout();
+
+	try {
+		c.wait(bye, 10);
+		std::cerr << "[D] Got Data Server VER before LOGOUT: " << ver.get() << std::endl;
+		bye.get();
+	}
+	catch(nut::NutException& ex)
+	{
+		std::cerr << "[D] LOGOUT failed: " << ex.what() << std::endl;
+		noException = false;
+	}
+
+	/* Then the server hangs up */
+	while (c.isConnected() && c.run(1)) {}
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed to log out with AsyncTcpClient: threw NutException",
+		noException);
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"AsyncTcpClient is still connected after LOGOUT",
+		!c.isConnected());
+}
+
+void NutActiveClientTest::test_client_pool() {
+	nut::ClientPool pool;
+	std::string local, down;
+	bool noException = true;
+
+	/* Twice the same server, and one port nobody listens on */
+	local = pool.addHost("localhost", NUT_PORT);
+	pool.addHost("127.0.0.1", NUT_PORT);
+	down = pool.addHost("127.0.0.1", 1, 2);
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"ClientPool does not list its hosts",
+		pool.getHosts().size() == 3);
+
+	try {
+		nut::ClientPool::Results<std::string> vers = pool.check();
+		nut::ClientPool::Results<std::set<std::string> > names = pool.getDeviceNames();
+		nut::ClientPool::Results<std::map<std::string, std::vector<std::string> > > status =
+			pool.getDeviceVariableValue("ups.status");
+
+		CPPUNIT_ASSERT_MESSAGE(
+			"ClientPool did not answer for every host",
+			vers.size() == 3 && names.size() == 3 && status.size() == 3);
+
+		for (nut::ClientPool::Results<std::string>::iterator it = vers.begin();
+			it != vers.end(); it++
+		) {
+			std::cerr << "[D] Got VER of " << it->first << ": "
+				<< (it->second.ok ? it->second.value : "failed: " + it->second.error)
+				<< std::endl;
+			CPPUNIT_ASSERT_MESSAGE(
+				"ClientPool health check did not tell up from down",
+				it->second.ok == (it->first != down));
+		}
+
+		CPPUNIT_ASSERT_MESSAGE(
+			"ClientPool got different devices from the same server",
+			names[local].ok && names[local].value == names["127.0.0.1:" + std::to_string(NUT_PORT)].value);
+
+		CPPUNIT_ASSERT_MESSAGE(
+			"ClientPool got ups.status of more devices than there are",
+			status[local].ok && status[local].value.size() <= names[local].value.size());
+
+		CPPUNIT_ASSERT_MESSAGE(
+			"ClientPool kept no connection to a host which is up",
+			pool.isConnected(local) && !pool.isConnected(down));
+	}
+	catch(nut::NutException& ex)
+	{
+		std::cerr << "[D] ClientPool queries failed: " << ex.what() << std::endl;
+		noException = false;
+	}
+
+	pool.removeHost(down);
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed ClientPool queries: threw NutException",
+		noException);
+
+	CPPUNIT_ASSERT_MESSAGE(
+		"ClientPool did not forget a removed host",
+		pool.getHosts().size() == 2);
+}
+
 void NutActiveClientTest::test_auth_user() {
 	if (NUT_USER.empty()) {
 		std::cerr << "[D] SKIPPING test_auth_user()" << std::endl;
@@ -0,0 +1,154 @@
+/* dsprotobench - compare upsd parsing driver updates as text and as
+   compact records
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * A recorded answer of a driver to DUMPALL is replayed the way upsd
+ * receives it: once as the text protocol (fed to pconf_char() one byte
+ * at a time) and once converted to compact records (see dsproto.h).
+ * Two things are timed: loading the whole dump into an empty tree, and
+ * a steady stream of updates where every variable changes each time.
+ *
+ * That both parsers end up with the same tree is checked by dsprototest,
+ * in "make check".
+ *
+ * Usage: dsprotobench [dump file]
+ *
+ * The default is dsprotobench.dump in $srcdir, as set by make.
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "timehead.h"
+#include "dsprotoreplay.h"
+
+#define BENCH_MINBYTES	(64 * 1024 * 1024)
+
+static double now_usec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1e6 + (double)tv.tv_usec;
+}
+
+static double bench_dump(const stream_t *st, int compact, size_t rounds)
+{
+	parser_t	p;
+	double	start;
+	size_t	round;
+
+	start = now_usec();
+
+	for (round = 0; round < rounds; round++) {
+		parser_init(&p);
+
+		if (compact) {
+			parse_records(&p, st->buf, st->len);
+		} else {
+			parse_text(&p, st->buf, st->len);
+		}
+
+		parser_free(&p);
+	}
+
+	return now_usec() - start;
+}
+
+static double bench_update(const stream_t *dump, const stream_t upd[2], int compact, size_t rounds)
+{
+	parser_t	p;
+	double	start;
+	size_t	round;
+
+	parser_init(&p);
+
+	if (compact) {
+		parse_records(&p, dump->buf, dump->len);
+	} else {
+		parse_text(&p, dump->buf, dump->len);
+	}
+
+	start = now_usec();
+
+	for (round = 0; round < rounds; round++) {
+		if (compact) {
+			parse_records(&p, upd[round % 2].buf, upd[round % 2].len);
+		} else {
+			parse_text(&p, upd[round % 2].buf, upd[round % 2].len);
+		}
+	}
+
+	start = now_usec() - start;
+	parser_free(&p);
+
+	return start;
+}
+
+int main(int argc, char **argv)
+{
+	const char	*fn = (argc > 1) ? argv[1] : NULL;
+	stream_t	dump, cdump, upd[2], cupd[2];
+	size_t	numvars, rounds;
+	double	text, compact;
+
+	memset(&dump, 0, sizeof(dump));
+	memset(&cdump, 0, sizeof(cdump));
+	memset(upd, 0, sizeof(upd));
+	memset(cupd, 0, sizeof(cupd));
+
+	stream_load(&dump, fn);
+
+	numvars = streams_make(&dump, &cdump, upd, cupd);
+
+	if (numvars < 1) {
+		fatalx(EXIT_FAILURE, "no SETINFO in the dump");
+	}
+
+	printf("%zu variables, dump %zu bytes as text, %zu as records\n",
+		numvars, dump.len, cdump.len);
+	printf("%-8s %12s %12s %12s %12s\n", "", "text", "records", "text", "records");
+	printf("%-8s %12s %12s %12s %12s\n", "", "nsec/var", "nsec/var", "MB/s", "MB/s");
+
+	rounds = BENCH_MINBYTES / dump.len + 1;
+	text = bench_dump(&dump, 0, rounds);
+	compact = bench_dump(&cdump, 1, rounds);
+
+	printf("%-8s %12.1f %12.1f %12.1f %12.1f\n", "dump",
+		text * 1000 / ((double)rounds * numvars),
+		compact * 1000 / ((double)rounds * numvars),
+		(double)dump.len * rounds / text, (double)cdump.len * rounds / compact);
+
+	rounds = BENCH_MINBYTES / upd[0].len + 1;
+	text = bench_update(&dump, upd, 0, rounds);
+	compact = bench_update(&cdump, cupd, 1, rounds);
+
+	printf("%-8s %12.1f %12.1f %12.1f %12.1f\n", "update",
+		text * 1000 / ((double)rounds * numvars),
+		compact * 1000 / ((double)rounds * numvars),
+		(double)upd[0].len * rounds / text, (double)cupd[0].len * rounds / compact);
+
+	free(dump.buf);
+	free(cdump.buf);
+	free(upd[0].buf);
+	free(upd[1].buf);
+	free(cupd[0].buf);
+	free(cupd[1].buf);
+
+	return EXIT_SUCCESS;
+}
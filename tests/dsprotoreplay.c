@@ -0,0 +1,321 @@
+/* dsprotoreplay.c - replay a recorded driver dump to the upsd parsers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "config.h"
+
+#include "common.h"
+#include "dsproto.h"
+#include "dsprotoreplay.h"
+
+void stream_add(stream_t *st, const char *data, size_t len)
+{
+	if (st->len + len > st->size) {
+		st->size = (st->len + len) * 2;
+		st->buf = xrealloc(st->buf, st->size);
+	}
+
+	memcpy(st->buf + st->len, data, len);
+	st->len += len;
+}
+
+void stream_load(stream_t *st, const char *fn)
+{
+	const char	*srcdir = getenv("srcdir");
+	char	path[SMALLBUF], buf[LARGEBUF];
+	size_t	ret;
+	FILE	*f;
+
+	if (!fn) {
+		snprintf(path, sizeof(path), "%s/dsprotobench.dump", srcdir ? srcdir : ".");
+		fn = path;
+	}
+
+	f = fopen(fn, "rb");
+
+	if (!f) {
+		fatal_with_errno(EXIT_FAILURE, "can't open %s", fn);
+	}
+
+	while ((ret = fread(buf, 1, sizeof(buf), f)) > 0) {
+		stream_add(st, buf, ret);
+	}
+
+	fclose(f);
+}
+
+static void stream_rec(stream_t *st, int type, unsigned int id, const char *data, size_t len)
+{
+	char	buf[DSP_HDR_LEN + ST_SOCK_BUF_LEN];
+	size_t	buflen = dsp_encode(buf, sizeof(buf), type, id, data, len);
+
+	if (!buflen) {
+		fatalx(EXIT_FAILURE, "record too large");
+	}
+
+	stream_add(st, buf, buflen);
+}
+
+void parser_init(parser_t *p)
+{
+	memset(p, 0, sizeof(*p));
+	pconf_init(&p->ctx, NULL);
+}
+
+void parser_free(parser_t *p)
+{
+	size_t	i;
+
+	pconf_finish(&p->ctx);
+	state_infofree(p->root);
+	state_cmdfree(p->cmds);
+
+	for (i = 0; i < p->numids; i++) {
+		free(p->names[i]);
+	}
+
+	free(p->names);
+	free(p->nodes);
+}
+
+/* the subset of parse_args() in upsd that a dump needs */
+static void parse_args(parser_t *p, size_t numargs, char **arg)
+{
+	if (numargs < 2) {
+		return;
+	}
+
+	if (!strcasecmp(arg[0], "ADDCMD")) {
+		state_addcmd(&p->cmds, arg[1]);
+		return;
+	}
+
+	if (numargs < 3) {
+		return;
+	}
+
+	if (!strcasecmp(arg[0], "SETINFO")) {
+		if (state_setinfo_seq(&p->root, arg[1], arg[2], p->seq + 1)) {
+			p->seq++;
+		}
+		return;
+	}
+
+	if (!strcasecmp(arg[0], "SETFLAGS")) {
+		state_setflags(p->root, arg[1], numargs - 2, &arg[2]);
+		return;
+	}
+
+	if (!strcasecmp(arg[0], "SETAUX")) {
+		state_setaux(p->root, arg[1], arg[2]);
+		return;
+	}
+
+	if (!strcasecmp(arg[0], "ADDENUM")) {
+		state_addenum(p->root, arg[1], arg[2]);
+		return;
+	}
+
+	if ((numargs > 3) && (!strcasecmp(arg[0], "ADDRANGE"))) {
+		state_addrange(p->root, arg[1], atoi(arg[2]), atoi(arg[3]));
+	}
+}
+
+void parse_text(parser_t *p, const char *buf, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) {
+		switch (pconf_char(&p->ctx, buf[i]))
+		{
+		case 1:
+			parse_args(p, p->ctx.numargs, p->ctx.arglist);
+			continue;
+
+		case 0:
+			continue;
+
+		default:
+			fatalx(EXIT_FAILURE, "parse error: %s", p->ctx.errmsg);
+		}
+	}
+}
+
+void parse_records(parser_t *p, const char *buf, size_t len)
+{
+	char	val[ST_MAX_VALUE_LEN];
+	dsp_rec_t	rec;
+	ssize_t	ret;
+	size_t	pos = 0;
+
+	while ((ret = dsp_decode(buf + pos, len - pos, &rec)) > 0) {
+		pos += (size_t)ret;
+
+		switch (rec.type)
+		{
+		case DSP_REC_TEXT:
+			parse_text(p, rec.data, rec.len);
+			continue;
+
+		case DSP_REC_NAME:
+			if (rec.id >= p->numids) {
+				size_t	num = rec.id + 64;
+
+				p->names = xrealloc(p->names, num * sizeof(*p->names));
+				p->nodes = xrealloc(p->nodes, num * sizeof(*p->nodes));
+				memset(p->names + p->numids, 0, (num - p->numids) * sizeof(*p->names));
+				memset(p->nodes + p->numids, 0, (num - p->numids) * sizeof(*p->nodes));
+				p->numids = num;
+			}
+
+			free(p->names[rec.id]);
+			p->names[rec.id] = xcalloc(1, rec.len + 1);
+			memcpy(p->names[rec.id], rec.data, rec.len);
+			p->nodes[rec.id] = NULL;
+			continue;
+
+		case DSP_REC_SET:
+			memcpy(val, rec.data, rec.len);
+			val[rec.len] = '\0';
+
+			/* as svar_setinfo() in upsd */
+			if (!p->nodes[rec.id]) {
+				p->nodes[rec.id] = state_tree_find(p->root, p->names[rec.id]);
+			}
+
+			if (p->nodes[rec.id]) {
+				if (state_setnode_seq(p->nodes[rec.id], val, p->seq + 1)) {
+					p->seq++;
+				}
+			} else {
+				if (state_setinfo_seq(&p->root, p->names[rec.id], val, p->seq + 1)) {
+					p->seq++;
+				}
+				p->nodes[rec.id] = state_tree_find(p->root, p->names[rec.id]);
+			}
+			continue;
+
+		default:
+			break;
+		}
+	}
+
+	if ((ret < 0) || (pos != len)) {
+		fatalx(EXIT_FAILURE, "bad record stream at offset %zu", pos);
+	}
+}
+
+size_t streams_make(const stream_t *dump, stream_t *cdump, stream_t upd[2], stream_t cupd[2])
+{
+	PCONF_CTX_t	ctx;
+	st_tree_t	*ids = NULL;
+	size_t	i, start = 0, numvars = 0;
+	int	k;
+
+	pconf_init(&ctx, NULL);
+
+	for (i = 0; i < dump->len; i++) {
+		const char	*line = dump->buf + start;
+		size_t	linelen = i + 1 - start;
+		int	ret = pconf_char(&ctx, dump->buf[i]);
+
+		if (ret == -1) {
+			fatalx(EXIT_FAILURE, "parse error in dump: %s", ctx.errmsg);
+		}
+
+		if (ret != 1) {
+			continue;
+		}
+
+		start = i + 1;
+
+		if ((ctx.numargs != 3) || (strcasecmp(ctx.arglist[0], "SETINFO"))) {
+			stream_rec(cdump, DSP_REC_TEXT, 0, line, linelen);
+			continue;
+		}
+
+		state_setinfo(&ids, ctx.arglist[1], "");
+		state_tree_find(ids, ctx.arglist[1])->aux = (long)++numvars;
+
+		stream_rec(cdump, DSP_REC_NAME, (unsigned int)numvars, ctx.arglist[1], strlen(ctx.arglist[1]));
+		stream_rec(cdump, DSP_REC_SET, (unsigned int)numvars, ctx.arglist[2], strlen(ctx.arglist[2]));
+
+		for (k = 0; k < 2; k++) {
+			char	val[ST_MAX_VALUE_LEN], enc[ST_MAX_VALUE_LEN], buf[ST_SOCK_BUF_LEN];
+
+			snprintf(val, sizeof(val), "%s%d", ctx.arglist[2], k);
+			pconf_encode(val, enc, sizeof(enc));
+			snprintf(buf, sizeof(buf), "SETINFO %s \"%s\"\n", ctx.arglist[1], enc);
+
+			stream_add(&upd[k], buf, strlen(buf));
+			stream_rec(&cupd[k], DSP_REC_SET, (unsigned int)numvars, val, strlen(val));
+		}
+	}
+
+	pconf_finish(&ctx);
+	state_infofree(ids);
+
+	return numvars;
+}
+
+static void tree_compare(const st_tree_t *node, st_tree_t *other)
+{
+	const st_tree_t	*onode;
+
+	if (!node) {
+		return;
+	}
+
+	tree_compare(node->left, other);
+
+	onode = state_tree_find(other, node->var);
+
+	if ((!onode) || (strcmp(node->raw, onode->raw)) || (node->flags != onode->flags)
+	 || (node->aux != onode->aux)) {
+		fatalx(EXIT_FAILURE, "parsers disagree on [%s]", node->var);
+	}
+
+	tree_compare(node->right, other);
+}
+
+void replay_verify(const stream_t *dump, const stream_t *cdump, const stream_t upd[2], const stream_t cupd[2])
+{
+	parser_t	text, compact;
+	int	k;
+
+	parser_init(&text);
+	parser_init(&compact);
+
+	parse_text(&text, dump->buf, dump->len);
+	parse_records(&compact, cdump->buf, cdump->len);
+
+	tree_compare(text.root, compact.root);
+	tree_compare(compact.root, text.root);
+
+	for (k = 0; k < 2; k++) {
+		parse_text(&text, upd[k].buf, upd[k].len);
+		parse_records(&compact, cupd[k].buf, cupd[k].len);
+
+		tree_compare(text.root, compact.root);
+
+		if (text.seq != compact.seq) {
+			fatalx(EXIT_FAILURE, "parsers saw a different number of changes");
+		}
+	}
+
+	parser_free(&text);
+	parser_free(&compact);
+}
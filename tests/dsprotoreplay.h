@@ -0,0 +1,60 @@
+/* dsprotoreplay.h - replay a recorded driver dump to the upsd parsers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef NUT_DSPROTOREPLAY_H_SEEN
+#define NUT_DSPROTOREPLAY_H_SEEN 1
+
+#include "parseconf.h"
+#include "state.h"
+
+typedef struct {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+} stream_t;
+
+/* what upsd keeps per connection */
+typedef struct {
+	PCONF_CTX_t	ctx;
+	st_tree_t	*root;
+	cmdlist_t	*cmds;
+	uint64_t	seq;
+	char	**names;	/* compact: by id */
+	st_tree_t	**nodes;
+	size_t	numids;
+} parser_t;
+
+void stream_add(stream_t *st, const char *data, size_t len);
+
+/* read a whole dump file, fn or dsprotobench.dump in $srcdir if NULL */
+void stream_load(stream_t *st, const char *fn);
+
+void parser_init(parser_t *p);
+void parser_free(parser_t *p);
+
+/* as upsd does with the text protocol and with compact records */
+void parse_text(parser_t *p, const char *buf, size_t len);
+void parse_records(parser_t *p, const char *buf, size_t len);
+
+/* convert the text dump to records, the way a driver sends them, and
+ * make two streams of updates changing every variable in turn */
+size_t streams_make(const stream_t *dump, stream_t *cdump, stream_t upd[2], stream_t cupd[2]);
+
+/* replay all streams to both parsers, fatal if their trees differ */
+void replay_verify(const stream_t *dump, const stream_t *cdump, const stream_t upd[2], const stream_t cupd[2]);
+
+#endif	/* NUT_DSPROTOREPLAY_H_SEEN */
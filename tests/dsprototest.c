@@ -0,0 +1,65 @@
+/* dsprototest - check that upsd gets the same data from a driver as text
+   and as compact records
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * The recorded answer of a driver to DUMPALL is replayed to both upsd
+ * parsers, as text and converted to compact records (see dsproto.h),
+ * followed by two rounds of updates to every variable. Both must end
+ * up with the same variables, values, flags and change counts.
+ *
+ * Usage: dsprototest [dump file]
+ *
+ * The default is dsprotobench.dump in $srcdir, as set by make.
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "dsprotoreplay.h"
+
+int main(int argc, char **argv)
+{
+	stream_t	dump, cdump, upd[2], cupd[2];
+	size_t	numvars;
+
+	memset(&dump, 0, sizeof(dump));
+	memset(&cdump, 0, sizeof(cdump));
+	memset(upd, 0, sizeof(upd));
+	memset(cupd, 0, sizeof(cupd));
+
+	stream_load(&dump, (argc > 1) ? argv[1] : NULL);
+
+	numvars = streams_make(&dump, &cdump, upd, cupd);
+
+	if (numvars < 1) {
+		fatalx(EXIT_FAILURE, "no SETINFO in the dump");
+	}
+
+	replay_verify(&dump, &cdump, upd, cupd);
+
+	printf("dsprototest: %zu variables, both parsers agree\n", numvars);
+
+	free(dump.buf);
+	free(cdump.buf);
+	free(upd[0].buf);
+	free(upd[1].buf);
+	free(cupd[0].buf);
+	free(cupd[1].buf);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,225 @@
+/* evloopbench - measure per-wakeup cost of the upsd event backends
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * For a growing number of idle "clients" (socket pairs), make one of
+ * them readable and measure how long it takes to get it dispatched:
+ *  - legacy: rebuild a pollfd array from a client list, poll() it and
+ *    scan all results, like the upsd mainloop used to do;
+ *  - poll/epoll: the evloop backends, with registration done once.
+ *
+ * Usage: evloopbench [clients...]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "nut_stdint.h"
+#include "timehead.h"
+#include "evloop.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define BENCH_ROUNDS	20000
+
+typedef struct {
+	int	fd[2];
+	int	hits;
+} benchconn_t;
+
+static benchconn_t	*conns = NULL;
+static size_t	numconns = 0;
+
+static double now_usec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1e6 + (double)tv.tv_usec;
+}
+
+static void conn_read(benchconn_t *conn)
+{
+	char	ch;
+
+	if (read(conn->fd[0], &ch, 1) == 1) {
+		conn->hits++;
+	}
+}
+
+static void bench_dispatch(handler_type_t type, void *data, int revents)
+{
+	NUT_UNUSED_VARIABLE(type);
+
+	if (revents & POLLIN) {
+		conn_read((benchconn_t *)data);
+	}
+}
+
+static void poke(size_t round)
+{
+	/* spread wakeups over the whole set, cheap pseudo-random walk */
+	benchconn_t	*conn = &conns[(round * 7919) % numconns];
+
+	if (write(conn->fd[1], "x", 1) != 1) {
+		fatal_with_errno(EXIT_FAILURE, "write");
+	}
+}
+
+static double bench_legacy(void)
+{
+	struct pollfd	*fds = xcalloc(numconns, sizeof(*fds));
+	size_t	round, i;
+	double	start;
+
+	start = now_usec();
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		poke(round);
+
+		for (i = 0; i < numconns; i++) {
+			fds[i].fd = conns[i].fd[0];
+			fds[i].events = POLLIN;
+		}
+
+		if (poll(fds, (nfds_t)numconns, -1) < 1) {
+			fatal_with_errno(EXIT_FAILURE, "poll");
+		}
+
+		for (i = 0; i < numconns; i++) {
+			if (fds[i].revents & POLLIN) {
+				conn_read(&conns[i]);
+			}
+		}
+	}
+
+	free(fds);
+
+	return (now_usec() - start) / BENCH_ROUNDS;
+}
+
+static double bench_evloop(evloop_backend_t backend)
+{
+	size_t	round, i;
+	double	start;
+
+	if (evloop_init(backend) != backend) {
+		evloop_free();
+		return -1;
+	}
+
+	for (i = 0; i < numconns; i++) {
+		if (evloop_add(conns[i].fd[0], POLLIN, EVLOOP_CLIENT, &conns[i]) < 0) {
+			fatalx(EXIT_FAILURE, "can't register FD %d", conns[i].fd[0]);
+		}
+	}
+
+	start = now_usec();
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		poke(round);
+
+		if (evloop_wait(-1, bench_dispatch) < 1) {
+			fatal_with_errno(EXIT_FAILURE, "evloop_wait");
+		}
+	}
+
+	start = (now_usec() - start) / BENCH_ROUNDS;
+
+	evloop_free();
+
+	return start;
+}
+
+static void bench(size_t clients)
+{
+	size_t	i;
+	double	legacy, epoll_us, poll_us;
+
+	conns = xcalloc(clients, sizeof(*conns));
+
+	for (numconns = 0; numconns < clients; numconns++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, conns[numconns].fd) < 0) {
+			fatal_with_errno(EXIT_FAILURE, "socketpair");
+		}
+	}
+
+	legacy = bench_legacy();
+	poll_us = bench_evloop(EVLOOP_POLL);
+	epoll_us = bench_evloop(EVLOOP_EPOLL);
+
+	printf("%8zu %12.2f %12.2f ", clients, legacy, poll_us);
+	if (epoll_us < 0) {
+		printf("%12s\n", "n/a");
+	} else {
+		printf("%12.2f\n", epoll_us);
+	}
+
+	for (i = 0; i < numconns; i++) {
+		close(conns[i].fd[0]);
+		close(conns[i].fd[1]);
+	}
+
+	free(conns);
+	conns = NULL;
+	numconns = 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t	dflt[] = { 10, 100, 1000, 4000 };
+	struct rlimit	rl;
+	size_t	maxclients = 0;
+	int	i;
+
+	/* each client needs two descriptors, plus some slack */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+		maxclients = (size_t)(rl.rlim_cur - 16) / 2;
+	}
+
+	printf("usec per wakeup, %d rounds\n", BENCH_ROUNDS);
+	printf("%8s %12s %12s %12s\n", "clients", "legacy", "poll", "epoll");
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			size_t	clients = (size_t)strtoul(argv[i], NULL, 10);
+
+			if ((clients < 1) || (maxclients && (clients > maxclients))) {
+				upslogx(LOG_WARNING, "skipping %s clients (limit is %zu)", argv[i], maxclients);
+				continue;
+			}
+
+			bench(clients);
+		}
+	} else {
+		size_t	j;
+
+		for (j = 0; j < sizeof(dflt) / sizeof(dflt[0]); j++) {
+			if (maxclients && (dflt[j] > maxclients)) {
+				continue;
+			}
+
+			bench(dflt[j]);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
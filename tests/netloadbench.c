@@ -0,0 +1,329 @@
+/* netloadbench - measure how many GET or LIST requests a running upsd
+   answers per second
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Each connection keeps a few requests in flight, so that the server
+ * rather than the round trips sets the pace; the connections are spread
+ * over threads, so that the load generator does not run out of CPU
+ * before a server with WORKERS does. Every answer is checked to be what
+ * was asked for.
+ *
+ * This needs a server with a UPS to query, see testcase_sandbox_upsd_workers
+ * in NIT/nit.sh which compares several WORKERS settings.
+ *
+ * Usage: netloadbench [-H host] [-p port] [-c connections] [-j threads]
+ *	[-d depth] [-t seconds] [-l] ups [var]
+ *
+ * -l asks for LIST VAR ups instead of GET VAR ups var (ups.status).
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "timehead.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+typedef struct {
+	int	fd;
+	size_t	inflight;	/* requests sent but not answered yet */
+	char	buf[LARGEBUF];
+	size_t	len;
+} conn_t;
+
+typedef struct {
+#ifdef HAVE_PTHREAD
+	pthread_t	thread;
+#endif
+	conn_t	*conns;
+	size_t	numconns;
+	unsigned long	answers;
+	unsigned long	errors;
+} loader_t;
+
+static const char	*host = "127.0.0.1", *port = NULL, *upsname, *varname = "ups.status";
+static size_t	depth = 8;
+static int	list = 0;
+static double	deadline;
+
+	/* the request and how its answer ends */
+static char	request[SMALLBUF], answer_end[SMALLBUF];
+static size_t	requestlen, answer_endlen;
+
+static double now_sec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+static int conn_open(void)
+{
+	struct addrinfo	hints, *res, *ai;
+	int	fd = -1, ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fatalx(EXIT_FAILURE, "getaddrinfo %s: %s", host, gai_strerror(ret));
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			continue;
+		}
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		fatal_with_errno(EXIT_FAILURE, "can't connect to %s port %s", host, port);
+	}
+
+	return fd;
+}
+
+/* top up the requests in flight */
+static void conn_send(conn_t *conn)
+{
+	char	buf[LARGEBUF];
+	size_t	len = 0;
+
+	while ((conn->inflight < depth) && (len + requestlen <= sizeof(buf))) {
+		memcpy(buf + len, request, requestlen);
+		len += requestlen;
+		conn->inflight++;
+	}
+
+	if ((len) && (write(conn->fd, buf, len) != (ssize_t)len)) {
+		fatal_with_errno(EXIT_FAILURE, "write");
+	}
+}
+
+/* read and account for the answers which came in */
+static void conn_recv(loader_t *ld, conn_t *conn)
+{
+	ssize_t	ret;
+	char	*line, *eol;
+
+	ret = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+
+	if (ret <= 0) {
+		fatal_with_errno(EXIT_FAILURE, "read (server gone?)");
+	}
+
+	conn->len += (size_t)ret;
+
+	for (line = conn->buf; (eol = memchr(line, '\n', conn->len - (size_t)(line - conn->buf))); line = eol + 1) {
+
+		if (!strncmp(line, "ERR ", 4)) {
+			ld->errors++;
+		} else if ((size_t)(eol - line) < answer_endlen || strncmp(line, answer_end, answer_endlen)) {
+			/* VAR lines of a LIST */
+			continue;
+		}
+
+		ld->answers++;
+		conn->inflight--;
+	}
+
+	conn->len -= (size_t)(line - conn->buf);
+	memmove(conn->buf, line, conn->len);
+
+	if (conn->len == sizeof(conn->buf)) {
+		fatalx(EXIT_FAILURE, "answer line too long");
+	}
+}
+
+static void *loader_run(void *arg)
+{
+	loader_t	*ld = (loader_t *)arg;
+	struct pollfd	*fds = xcalloc(ld->numconns, sizeof(*fds));
+	size_t	i;
+
+	while (now_sec() < deadline) {
+		for (i = 0; i < ld->numconns; i++) {
+			conn_send(&ld->conns[i]);
+			fds[i].fd = ld->conns[i].fd;
+			fds[i].events = POLLIN;
+		}
+
+		if (poll(fds, (nfds_t)ld->numconns, 100) < 0) {
+			fatal_with_errno(EXIT_FAILURE, "poll");
+		}
+
+		for (i = 0; i < ld->numconns; i++) {
+			if (fds[i].revents) {
+				conn_recv(ld, &ld->conns[i]);
+			}
+		}
+	}
+
+	free(fds);
+
+	return NULL;
+}
+
+static void help(const char *prog)
+	__attribute__((noreturn));
+
+static void help(const char *prog)
+{
+	printf("usage: %s [-H host] [-p port] [-c connections] [-j threads] [-d depth] [-t seconds] [-l] ups [var]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	loader_t	*loaders;
+	size_t	numconns = 8, numthreads = 1, i;
+	unsigned long	answers = 0, errors = 0;
+	double	seconds = 5, start;
+	int	c;
+
+	port = getenv("NUT_PORT");
+
+	while ((c = getopt(argc, argv, "H:p:c:j:d:t:l")) != -1) {
+		switch (c)
+		{
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'c':
+			numconns = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			numthreads = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			seconds = strtod(optarg, NULL);
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			help(argv[0]);
+		}
+	}
+
+	if ((optind >= argc) || (numconns < 1) || (numthreads < 1) || (depth < 1)) {
+		help(argv[0]);
+	}
+
+	upsname = argv[optind];
+
+	if (optind + 1 < argc) {
+		varname = argv[optind + 1];
+	}
+
+	if ((!port) || (!*port)) {
+		port = "3493";
+	}
+
+#ifndef HAVE_PTHREAD
+	numthreads = 1;
+#endif
+
+	if (numthreads > numconns) {
+		numthreads = numconns;
+	}
+
+	if (list) {
+		snprintf(request, sizeof(request), "LIST VAR %s\n", upsname);
+		snprintf(answer_end, sizeof(answer_end), "END LIST VAR %s", upsname);
+	} else {
+		snprintf(request, sizeof(request), "GET VAR %s %s\n", upsname, varname);
+		snprintf(answer_end, sizeof(answer_end), "VAR %s %s ", upsname, varname);
+	}
+
+	requestlen = strlen(request);
+	answer_endlen = strlen(answer_end);
+
+	loaders = xcalloc(numthreads, sizeof(*loaders));
+
+	for (i = 0; i < numconns; i++) {
+		loader_t	*ld = &loaders[i % numthreads];
+
+		ld->conns = xrealloc(ld->conns, (ld->numconns + 1) * sizeof(*ld->conns));
+		memset(&ld->conns[ld->numconns], 0, sizeof(*ld->conns));
+		ld->conns[ld->numconns].fd = conn_open();
+		ld->numconns++;
+	}
+
+	start = now_sec();
+	deadline = start + seconds;
+
+#ifdef HAVE_PTHREAD
+	for (i = 0; i < numthreads; i++) {
+		if (pthread_create(&loaders[i].thread, NULL, loader_run, &loaders[i]) != 0) {
+			fatalx(EXIT_FAILURE, "pthread_create");
+		}
+	}
+
+	for (i = 0; i < numthreads; i++) {
+		pthread_join(loaders[i].thread, NULL);
+	}
+#else
+	loader_run(&loaders[0]);
+#endif
+
+	start = now_sec() - start;
+
+	for (i = 0; i < numthreads; i++) {
+		size_t	j;
+
+		answers += loaders[i].answers;
+		errors += loaders[i].errors;
+
+		for (j = 0; j < loaders[i].numconns; j++) {
+			close(loaders[i].conns[j].fd);
+		}
+
+		free(loaders[i].conns);
+	}
+
+	free(loaders);
+
+	printf("%s %s: %zu connections, %zu threads, depth %zu: %.0f answers/s, %lu errors\n",
+		list ? "LIST VAR" : "GET VAR", upsname, numconns, numthreads, depth,
+		(double)answers / start, errors);
+
+	return ((answers > 0) && (errors == 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
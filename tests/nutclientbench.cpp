@@ -0,0 +1,323 @@
+/* nutclientbench - count what libnutclient allocates, and the time it
+   takes, to parse a large LIST VAR answer
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * A child process plays upsd, with one device which has many variables
+ * (long names, and long quoted values next to short ones, as those of a
+ * big PDU). The parent lists them again and again with:
+ *
+ *   map	TcpClient::getDeviceVariableValues()
+ *   visit	TcpClient::forEachVariable()
+ *   names	TcpClient::getDeviceVariableNames()
+ *   copy	each row exploded into a vector of its own, then copied
+ *   		into the map, as getDeviceVariableValues() used to
+ *
+ * and counts the calls to the global operator new made meanwhile.
+ * Visiting must allocate the same few times whatever the number of
+ * variables, and the map must cost less than the copy. All must find
+ * the same variables.
+ *
+ * Usage: nutclientbench [variables [rounds]]
+ */
+
+#include "config.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <new>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "../clients/nutclient.h"
+
+#define BENCH_UPS	"bench"
+#define BENCH_VARS	2000
+#define BENCH_ROUNDS	20
+
+/* allocations the visitor may make per list, whatever its length: the
+ * request, the strings it is checked against and the growth of the
+ * receive buffer */
+#define VISIT_ALLOCS_MAX	16
+
+static unsigned long	allocs = 0;
+
+void *operator new(size_t size)
+{
+	void	*p = malloc(size ? size : 1);
+
+	if (!p) {
+		throw std::bad_alloc();
+	}
+
+	allocs++;
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace {
+
+/* to get at the protected list(), as the old code did */
+class BenchClient : public nut::TcpClient
+{
+public:
+	BenchClient(const std::string& host, uint16_t port):
+		nut::TcpClient(host, port) {}
+
+	std::map<std::string,std::vector<std::string> > copyValues(const std::string& dev)
+	{
+		std::map<std::string,std::vector<std::string> > map;
+
+		std::vector<std::vector<std::string> > res = list("VAR", dev);
+		for (size_t n = 0; n < res.size(); ++n)
+		{
+			std::vector<std::string>& vals = res[n];
+			std::string var = vals[0];
+			vals.erase(vals.begin());
+			map[var] = vals;
+		}
+
+		return map;
+	}
+};
+
+std::string list_answer(size_t vars)
+{
+	std::string	ans = "BEGIN LIST VAR " BENCH_UPS "\n";
+	char	line[256];
+
+	for (size_t i = 0; i < vars; i++) {
+		if (i % 2) {
+			snprintf(line, sizeof(line), "VAR " BENCH_UPS " outlet.%zu.realpower.nominal %zu\n",
+				i, i * 10);
+		} else {
+			snprintf(line, sizeof(line), "VAR " BENCH_UPS " outlet.%zu.desc \"Rack %zu, \\\"power strip\\\" %zu\"\n",
+				i, i / 24, i % 24);
+		}
+		ans += line;
+	}
+
+	return ans + "END LIST VAR " BENCH_UPS "\n";
+}
+
+bool write_all(int fd, const std::string& str)
+{
+	size_t	done = 0;
+
+	while (done < str.size()) {
+		ssize_t	ret = write(fd, str.data() + done, str.size() - done);
+
+		if (ret <= 0) {
+			return false;
+		}
+		done += static_cast<size_t>(ret);
+	}
+
+	return true;
+}
+
+/* answer the one client until it logs out */
+void serve(int lsock, const std::string& list)
+{
+	int	fd = accept(lsock, nullptr, nullptr);
+	std::string	in;
+	char	buf[512];
+	ssize_t	ret;
+
+	while ((fd >= 0) && ((ret = read(fd, buf, sizeof(buf))) > 0)) {
+		size_t	idx;
+
+		in.append(buf, static_cast<size_t>(ret));
+
+		while ((idx = in.find('\n')) != std::string::npos) {
+			std::string	req = in.substr(0, idx);
+
+			in.erase(0, idx + 1);
+
+			if (req == "LIST VAR " BENCH_UPS) {
+				write_all(fd, list);
+			} else if (req == "LOGOUT") {
+				write_all(fd, "OK Goodbye\n");
+				_exit(EXIT_SUCCESS);
+			} else {
+				write_all(fd, "ERR UNKNOWN-COMMAND\n");
+			}
+		}
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+typedef struct {
+	const char	*name;
+	unsigned long	allocs;		/* in all but the first round */
+	double	usec;
+	size_t	found;			/* variables of the last round */
+} bench_t;
+
+template<typename F> void bench_run(bench_t& b, size_t rounds, F fn)
+{
+	/* the first one sizes the buffers */
+	b.found = fn();
+
+	for (size_t r = 0; r < rounds; r++) {
+		unsigned long	before = allocs;
+		std::chrono::steady_clock::time_point	start = std::chrono::steady_clock::now();
+
+		b.found = fn();
+
+		b.usec += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+		b.allocs += allocs - before;
+	}
+}
+
+} /* namespace */
+
+int main(int argc, char **argv)
+{
+	size_t	vars = BENCH_VARS, rounds = BENCH_ROUNDS, i;
+	struct sockaddr_in	sa;
+	socklen_t	salen = sizeof(sa);
+	int	lsock, status, ret = EXIT_SUCCESS;
+	pid_t	pid;
+
+	if (argc > 1) {
+		vars = strtoul(argv[1], nullptr, 10);
+	}
+
+	if (argc > 2) {
+		rounds = strtoul(argv[2], nullptr, 10);
+	}
+
+	if ((vars < 1) || (rounds < 1)) {
+		fprintf(stderr, "usage: %s [variables [rounds]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	if ((lsock < 0)
+	 || (bind(lsock, reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) != 0)
+	 || (listen(lsock, 1) != 0)
+	 || (getsockname(lsock, reinterpret_cast<struct sockaddr *>(&sa), &salen) != 0)) {
+		perror("nutclientbench: listen");
+		return EXIT_FAILURE;
+	}
+
+	if ((pid = fork()) < 0) {
+		perror("nutclientbench: fork");
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0) {
+		serve(lsock, list_answer(vars));
+	}
+
+	close(lsock);
+
+	BenchClient	c("127.0.0.1", ntohs(sa.sin_port));
+	std::map<std::string,std::vector<std::string> >	map, copy;
+	bench_t	benches[4];
+
+	memset(benches, 0, sizeof(benches));
+	benches[0].name = "map";
+	benches[1].name = "visit";
+	benches[2].name = "names";
+	benches[3].name = "copy";
+
+	bench_run(benches[0], rounds, [&]() {
+		map = c.getDeviceVariableValues(BENCH_UPS);
+		return map.size();
+	});
+
+	bench_run(benches[1], rounds, [&]() {
+		size_t	found = 0;
+
+		c.forEachVariable(BENCH_UPS, [&](const std::string& name, const std::vector<std::string>& values) {
+			std::map<std::string,std::vector<std::string> >::const_iterator	it = map.find(name);
+
+			if ((it != map.end()) && (it->second == values)) {
+				found++;
+			}
+		});
+		return found;
+	});
+
+	bench_run(benches[2], rounds, [&]() {
+		return c.getDeviceVariableNames(BENCH_UPS).size();
+	});
+
+	bench_run(benches[3], rounds, [&]() {
+		copy = c.copyValues(BENCH_UPS);
+		return copy.size();
+	});
+
+	c.logout();
+	waitpid(pid, &status, 0);
+
+	for (i = 0; i < 4; i++) {
+		printf("%-6s %zu variables: %8.1f usec, %8.2f allocations per list, %.3f per variable\n",
+			benches[i].name, benches[i].found, benches[i].usec / static_cast<double>(rounds),
+			static_cast<double>(benches[i].allocs) / static_cast<double>(rounds),
+			static_cast<double>(benches[i].allocs) / static_cast<double>(rounds * vars));
+
+		if (benches[i].found != vars) {
+			printf("nutclientbench: %s found %zu variables, expected %zu\n",
+				benches[i].name, benches[i].found, vars);
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	if (map != copy) {
+		printf("nutclientbench: map and copy differ\n");
+		ret = EXIT_FAILURE;
+	}
+
+	if (benches[1].allocs > VISIT_ALLOCS_MAX * rounds) {
+		printf("nutclientbench: visiting allocated %lu times in %zu rounds, expected at most %d per round\n",
+			benches[1].allocs, rounds, VISIT_ALLOCS_MAX);
+		ret = EXIT_FAILURE;
+	}
+
+	if (benches[0].allocs >= benches[3].allocs) {
+		printf("nutclientbench: the map allocated %lu times, the copy %lu\n",
+			benches[0].allocs, benches[3].allocs);
+		ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
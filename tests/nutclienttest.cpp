@@ -52,6 +52,8 @@ class NutClientTest : public CppUnit::TestFixture
 		CPPUNIT_TEST( test_copy_assignment_var );
 
 		CPPUNIT_TEST( test_nutclientstub_dev );
+
+		CPPUNIT_TEST( test_caching_client );
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -72,6 +74,8 @@ public:
 	void test_copy_assignment_var();
 
 	void test_nutclientstub_dev();
+
+	void test_caching_client();
 };
 
 // Registers the fixture into the 'registry'
@@ -518,6 +522,101 @@ void NutClientTest::test_nutclientstub_dev() {
 		!noException);
 }
 
+/* Counts what reaches it, and knows when a variable does not exist */
+class CountingClientStub : public MemClientStub
+{
+public:
+	CountingClientStub() : gets(0), lists(0) {}
+
+	ListValue getDeviceVariableValue(const std::string& dev, const std::string& name) override {
+		gets++;
+		ListValue values = MemClientStub::getDeviceVariableValue(dev, name);
+		if (values.empty()) {
+			throw NutException("VAR-NOT-SUPPORTED");
+		}
+		return values;
+	}
+
+	ListObject getDeviceVariableValues(const std::string& dev) override {
+		lists++;
+		return MemClientStub::getDeviceVariableValues(dev);
+	}
+
+	int gets, lists;
+};
+
+void NutClientTest::test_caching_client() {
+	CountingClientStub stub;
+	nut::CachingClient c(&stub, 60);
+	bool missing = false;
+
+	stub.setDeviceVariable("ups_1", "ups.status", "OL");
+	stub.setDeviceVariable("ups_1", "device.model", "Model 1");
+
+	/* Asked once, then kept */
+	c.getDeviceVariableValue("ups_1", "ups.status");
+	ListValue values = c.getDeviceVariableValue("ups_1", "ups.status");
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed caching client: value asked again",
+		stub.gets == 1 && values.size() == 1 && values[0] == "OL");
+
+	/* Negative caching */
+	for (int i = 0; i < 2; i++) {
+		try {
+			c.getDeviceVariableValue("ups_1", "no.such.var");
+		}
+		catch(nut::NutException& ex)
+		{
+			missing = (ex.str() == "VAR-NOT-SUPPORTED");
+		}
+	}
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed caching client: missing variable asked again",
+		missing && stub.gets == 2);
+
+	/* One listing fills the cache for the single values */
+	ListObject objects = c.getDeviceVariableValues("ups_1");
+	objects = c.getDeviceVariableValues("ups_1");
+	c.getDeviceVariableValue("ups_1", "device.model");
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed caching client: values listed again",
+		stub.lists == 1 && stub.gets == 2 && objects.size() == 2);
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed caching client: variable names not kept",
+		c.hasDeviceVariable("ups_1", "ups.status") && !c.hasDeviceVariable("ups_1", "no.such.var"));
+
+	/* Setting a variable forgets its value */
+	c.setDeviceVariable("ups_1", "ups.status", "OB");
+	values = c.getDeviceVariableValue("ups_1", "ups.status");
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed caching client: value kept after SET",
+		stub.gets == 3 && values[0] == "OB");
+
+	/* A command forgets all but the static values */
+	try {
+		c.executeDeviceCommand("ups_1", "test.battery.start");
+	}
+	catch(nut::NutException& ex)
+	{
+		NUT_UNUSED_VARIABLE(ex);
+	}
+	c.getDeviceVariableValue("ups_1", "device.model");
+	c.getDeviceVariableValue("ups_1", "ups.status");
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed caching client: values kept after INSTCMD",
+		stub.gets == 4);
+
+	/* Nothing kept without a TTL */
+	c.setTTL(0);
+	c.setStaticTTL(0);
+	c.invalidate();
+	c.getDeviceVariableValue("ups_1", "device.model");
+	c.getDeviceVariableValue("ups_1", "device.model");
+	CPPUNIT_ASSERT_MESSAGE(
+		"Failed caching client: value kept without TTL",
+		stub.gets == 6);
+}
+
 } // namespace nut {}
 
 #if (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_PUSH_POP) && (defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_EXIT_TIME_DESTRUCTORS || defined HAVE_PRAGMA_GCC_DIAGNOSTIC_IGNORED_GLOBAL_CONSTRUCTORS)
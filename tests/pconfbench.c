@@ -0,0 +1,160 @@
+/* pconfbench - measure the throughput of the parseconf entry points
+   used on sockets
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Streams of typical lines are cut in SMALLBUF chunks, as upsd and the
+ * drivers read them, and fed to pconf_char() one byte at a time and to
+ * pconf_line_buf() a chunk at a time:
+ *
+ *   net	requests of network clients (GET VAR, LIST VAR)
+ *   sock	SETINFO lines from a driver, short quoted values
+ *   long	SETINFO lines with values close to the default word limit
+ *
+ * Both must see the same number of lines and arguments.
+ *
+ * Usage: pconfbench
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "timehead.h"
+#include "parseconf.h"
+
+#define BENCH_MINBYTES	(32 * 1024 * 1024)
+#define BENCH_LINES	1000
+
+typedef struct {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+} stream_t;
+
+static double now_usec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1e6 + (double)tv.tv_usec;
+}
+
+static void stream_add(stream_t *st, const char *data)
+{
+	size_t	len = strlen(data);
+
+	if (st->len + len > st->size) {
+		st->size = (st->len + len) * 2;
+		st->buf = xrealloc(st->buf, st->size);
+	}
+
+	memcpy(st->buf + st->len, data, len);
+	st->len += len;
+}
+
+static void stream_make(stream_t *st, const char *kind)
+{
+	char	buf[LARGEBUF], val[PCONF_DEFAULT_WORDLEN_LIMIT];
+	size_t	i;
+
+	memset(st, 0, sizeof(*st));
+
+	for (i = 0; i < BENCH_LINES; i++) {
+		if (!strcmp(kind, "net")) {
+			snprintf(buf, sizeof(buf), (i % 2) ? "GET VAR ups%zu outlet.%zu.status\n" : "LIST VAR ups%zu\n",
+				i % 8, i % 48);
+		} else if (!strcmp(kind, "sock")) {
+			snprintf(buf, sizeof(buf), "SETINFO outlet.%zu.desc \"Outlet %zu \\\"rack %zu\\\"\"\n",
+				i % 48, i % 48, i);
+		} else {
+			memset(val, 'a' + (int)(i % 26), sizeof(val) - 16);
+			val[sizeof(val) - 16] = '\0';
+			snprintf(buf, sizeof(buf), "SETINFO ups.id \"%s %zu\"\n", val, i);
+		}
+
+		stream_add(st, buf);
+	}
+}
+
+static double bench(const stream_t *st, int bybuf, size_t rounds, size_t *lines)
+{
+	PCONF_CTX_t	ctx;
+	size_t	round, i, j, end, used;
+	double	start;
+
+	pconf_init(&ctx, NULL);
+	*lines = 0;
+
+	start = now_usec();
+
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < st->len; i = end) {
+			end = (i + SMALLBUF < st->len) ? i + SMALLBUF : st->len;
+
+			if (!bybuf) {
+				for (j = i; j < end; j++) {
+					if (pconf_char(&ctx, st->buf[j]) == 1) {
+						*lines += ctx.numargs;
+					}
+				}
+				continue;
+			}
+
+			for (j = i; j < end; j += used) {
+				if (pconf_line_buf(&ctx, st->buf + j, end - j, &used) == 1) {
+					*lines += ctx.numargs;
+				}
+			}
+		}
+	}
+
+	start = now_usec() - start;
+	pconf_finish(&ctx);
+
+	return start;
+}
+
+int main(void)
+{
+	static const char	*kinds[] = { "net", "sock", "long" };
+	stream_t	st;
+	size_t	k, rounds, args1, args2;
+	double	bychar, bybuf;
+
+	printf("%-8s %12s %12s %14s %14s\n", "", "bytes/line", "args/line", "pconf_char", "pconf_line_buf");
+	printf("%-8s %12s %12s %14s %14s\n", "", "", "", "MB/s", "MB/s");
+
+	for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+		stream_make(&st, kinds[k]);
+		rounds = BENCH_MINBYTES / st.len + 1;
+
+		bychar = bench(&st, 0, rounds, &args1);
+		bybuf = bench(&st, 1, rounds, &args2);
+
+		if (args1 != args2) {
+			fatalx(EXIT_FAILURE, "%s: parsers disagree", kinds[k]);
+		}
+
+		printf("%-8s %12zu %12zu %14.1f %14.1f\n", kinds[k],
+			st.len / BENCH_LINES, args1 / (rounds * BENCH_LINES),
+			(double)st.len * rounds / bychar, (double)st.len * rounds / bybuf);
+
+		free(st.buf);
+	}
+
+	return EXIT_SUCCESS;
+}
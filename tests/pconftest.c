@@ -0,0 +1,261 @@
+/* pconftest - check that pconf_line_buf() parses exactly like pconf_char()
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * A few known lines are checked for their arguments first. Then random
+ * input, made mostly of the characters the parser cares about, is fed
+ * to one context a character at a time and to another in chunks of
+ * random size, with random word and argument limits; both must report
+ * the same lines, arguments and errors in the same order.
+ *
+ * Usage: pconftest [seed [rounds]]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "parseconf.h"
+
+#define TEST_ROUNDS	20000
+#define TEST_MAXLEN	600
+
+/* what both parsers saw, one entry per line or error */
+typedef struct {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+} trace_t;
+
+static unsigned long	seed = 1;
+
+static unsigned int rnd(unsigned int range)
+{
+	seed = seed * 1103515245UL + 12345UL;
+	return (unsigned int)((seed >> 16) & 0x7fff) % range;
+}
+
+static void trace_add(trace_t *t, const char *data, size_t len)
+{
+	if (t->len + len + 1 > t->size) {
+		t->size = (t->len + len + 1) * 2;
+		t->buf = xrealloc(t->buf, t->size);
+	}
+
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+	t->buf[t->len] = '\0';
+}
+
+static void trace_ret(trace_t *t, PCONF_CTX_t *ctx, int ret)
+{
+	size_t	i;
+
+	if (ret == 0) {
+		return;
+	}
+
+	if (ret < 0) {
+		trace_add(t, "ERR ", 4);
+		trace_add(t, ctx->errmsg, strlen(ctx->errmsg));
+		trace_add(t, "\n", 1);
+		return;
+	}
+
+	trace_add(t, "LINE", 4);
+
+	for (i = 0; i < ctx->numargs; i++) {
+		trace_add(t, " [", 2);
+		trace_add(t, ctx->arglist[i], strlen(ctx->arglist[i]));
+		trace_add(t, "]", 1);
+	}
+
+	trace_add(t, "\n", 1);
+}
+
+static void ctx_init(PCONF_CTX_t *ctx, size_t arg_limit, size_t wordlen_limit)
+{
+	pconf_init(ctx, NULL);
+	ctx->arg_limit = arg_limit;
+	ctx->wordlen_limit = wordlen_limit;
+}
+
+static void parse_bychar(trace_t *t, PCONF_CTX_t *ctx, const char *buf, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) {
+		trace_ret(t, ctx, pconf_char(ctx, buf[i]));
+	}
+}
+
+static void parse_bybuf(trace_t *t, PCONF_CTX_t *ctx, const char *buf, size_t len, size_t chunk)
+{
+	size_t	i, end, used;
+
+	for (i = 0; i < len; i = end) {
+		end = (i + chunk < len) ? i + chunk : len;
+
+		for (; i < end; i += used) {
+			trace_ret(t, ctx, pconf_line_buf(ctx, buf + i, end - i, &used));
+
+			if (used == 0) {
+				fatalx(EXIT_FAILURE, "pconf_line_buf used nothing");
+			}
+		}
+	}
+}
+
+static void check_line(const char *line, const char *expect)
+{
+	PCONF_CTX_t	ctx;
+	trace_t	bychar, bybuf;
+
+	memset(&bychar, 0, sizeof(bychar));
+	memset(&bybuf, 0, sizeof(bybuf));
+
+	ctx_init(&ctx, PCONF_DEFAULT_ARG_LIMIT, PCONF_DEFAULT_WORDLEN_LIMIT);
+	parse_bychar(&bychar, &ctx, line, strlen(line));
+	pconf_finish(&ctx);
+
+	ctx_init(&ctx, PCONF_DEFAULT_ARG_LIMIT, PCONF_DEFAULT_WORDLEN_LIMIT);
+	parse_bybuf(&bybuf, &ctx, line, strlen(line), strlen(line));
+	pconf_finish(&ctx);
+
+	if ((!bychar.buf) || (strcmp(bychar.buf, expect)) || (!bybuf.buf) || (strcmp(bybuf.buf, expect))) {
+		printf("input:    %s", line);
+		printf("expected: %s", expect);
+		printf("bychar:   %s", bychar.buf ? bychar.buf : "(nothing)\n");
+		printf("bybuf:    %s", bybuf.buf ? bybuf.buf : "(nothing)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	free(bychar.buf);
+	free(bybuf.buf);
+}
+
+static void make_input(char *buf, size_t len)
+{
+	static const char	special[] = " \t\r\n\"\\#=";
+	size_t	i;
+
+	for (i = 0; i < len; i++) {
+		switch (rnd(16))
+		{
+		case 0: case 1: case 2: case 3: case 4: case 5:
+			buf[i] = special[rnd(sizeof(special) - 1)];
+			break;
+
+		case 6:
+			/* things addchar() refuses */
+			buf[i] = (char)(rnd(2) ? rnd(0x20) : 0x80 + rnd(0x80));
+			break;
+
+		case 7:
+			buf[i] = 0x7f;
+			break;
+
+		default:
+			buf[i] = (char)('a' + rnd(26));
+		}
+	}
+}
+
+static void fuzz(unsigned int rounds)
+{
+	static const size_t	arg_limits[] = { 0, 1, 3, PCONF_DEFAULT_ARG_LIMIT };
+	static const size_t	word_limits[] = { 0, 1, 5, PCONF_DEFAULT_WORDLEN_LIMIT };
+	char	buf[TEST_MAXLEN];
+	unsigned int	round;
+
+	for (round = 0; round < rounds; round++) {
+		PCONF_CTX_t	ctx1, ctx2;
+		trace_t	bychar, bybuf;
+		size_t	len = 1 + rnd(TEST_MAXLEN - 1), chunk = 1 + rnd(len);
+		size_t	arg_limit = arg_limits[rnd(4)];
+		size_t	word_limit = word_limits[rnd(4)];
+
+		/* now and then, a long word in a long line */
+		if (rnd(4) == 0) {
+			memset(buf, 'x', len);
+			make_input(buf, len / 8);
+		} else {
+			make_input(buf, len);
+		}
+
+		memset(&bychar, 0, sizeof(bychar));
+		memset(&bybuf, 0, sizeof(bybuf));
+
+		ctx_init(&ctx1, arg_limit, word_limit);
+		ctx_init(&ctx2, arg_limit, word_limit);
+
+		parse_bychar(&bychar, &ctx1, buf, len);
+		parse_bybuf(&bybuf, &ctx2, buf, len, chunk);
+
+		/* and whatever was left over must end the same way too */
+		parse_bychar(&bychar, &ctx1, "\n", 1);
+		parse_bybuf(&bybuf, &ctx2, "\n", 1, 1);
+
+		if ((bychar.len != bybuf.len) || ((bychar.len) && (memcmp(bychar.buf, bybuf.buf, bychar.len)))) {
+			printf("round %u: parsers disagree (chunks of %zu, limits %zu/%zu)\n",
+				round, chunk, arg_limit, word_limit);
+			printf("--- pconf_char:\n%s--- pconf_line_buf:\n%s",
+				bychar.buf ? bychar.buf : "", bybuf.buf ? bybuf.buf : "");
+			exit(EXIT_FAILURE);
+		}
+
+		pconf_finish(&ctx1);
+		pconf_finish(&ctx2);
+		free(bychar.buf);
+		free(bybuf.buf);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int	rounds = TEST_ROUNDS;
+	unsigned long	start;
+
+	if (argc > 1) {
+		seed = strtoul(argv[1], NULL, 0);
+	}
+
+	start = seed;
+
+	if (argc > 2) {
+		rounds = (unsigned int)strtoul(argv[2], NULL, 0);
+	}
+
+	check_line("this is a line\n", "LINE [this] [is] [a] [line]\n");
+	check_line("this \"is also\" a line\n", "LINE [this] [is also] [a] [line]\n");
+	check_line("embedded\\ space embedded\\\\backslash\n", "LINE [embedded space] [embedded\\backslash]\n");
+	check_line("SETINFO ups.alarm \"Replace \\\"battery\\\"!\"\n", "LINE [SETINFO] [ups.alarm] [Replace \"battery\"!]\n");
+	check_line("a=b # comment \" \\\n", "LINE [a] [=] [b]\n");
+	check_line("joined\\\nline \"\"\n", "LINE [joinedline] []\n");
+	/* after an error, parsing goes on right after the offending # */
+	check_line("bad \"# quote\nnext\n", "ERR Unbalanced word due to unescaped # in quotes\nLINE [quote]\nLINE [next]\n");
+
+	/* addchar() complains about every character it drops */
+	if (!freopen("/dev/null", "w", stderr)) {
+		fatal_with_errno(EXIT_FAILURE, "can't redirect stderr");
+	}
+
+	fuzz(rounds);
+
+	printf("pconftest: %u random inputs parsed alike (seed %lu)\n", rounds, start);
+
+	return EXIT_SUCCESS;
+}
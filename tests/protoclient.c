@@ -0,0 +1,286 @@
+/* protoclient - talk the network protocol to upsd, one request at a time
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Each line read from the standard input is sent to the server, and its
+ * answer printed: one line, or all of a BEGIN LIST ... END LIST. Lines
+ * pushed by the server in between (PUSH ...) are printed as they come.
+ * Two input lines are not sent but tell what to wait for:
+ *
+ *	WAIT <seconds> <text>	print what comes until a line starting
+ *				with text, fail if none does in time
+ *	SLEEP <seconds>		print what comes for that long
+ *
+ * This exits with 1 if an answer does not come within the timeout, or
+ * the server hangs up. See testcase_sandbox_upsd_protocol in NIT/nit.sh.
+ *
+ * Usage: protoclient [-H host] [-p port] [-t seconds]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "timehead.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+
+static int	fd = -1;
+static char	inbuf[LARGEBUF];
+static size_t	inlen = 0;
+
+static void conn_open(const char *host, const char *port)
+{
+	struct addrinfo	hints, *res, *ai;
+	int	ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fatalx(EXIT_FAILURE, "getaddrinfo %s: %s", host, gai_strerror(ret));
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			continue;
+		}
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		fatal_with_errno(EXIT_FAILURE, "can't connect to %s port %s", host, port);
+	}
+}
+
+/* the next line from the server, printed; 0 if none came before the
+ * deadline, -1 if the server hung up */
+static int conn_readline(const struct timeval *deadline, char *line, size_t linelen)
+{
+	struct timeval	now;
+	struct pollfd	pfd;
+	char	*nl;
+	ssize_t	ret;
+	double	left;
+
+	for (;;) {
+		if ((nl = memchr(inbuf, '\n', inlen)) != NULL) {
+			size_t	len = (size_t)(nl - inbuf);
+
+			snprintf(line, linelen, "%.*s", (int)len, inbuf);
+			memmove(inbuf, nl + 1, inlen - len - 1);
+			inlen -= len + 1;
+
+			printf("%s\n", line);
+			fflush(stdout);
+			return 1;
+		}
+
+		if (inlen >= sizeof(inbuf)) {
+			fatalx(EXIT_FAILURE, "line too long from the server");
+		}
+
+		nut_monotime(&now);
+		left = nut_monotime_diff(deadline, &now);
+
+		if (left <= 0) {
+			return 0;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		ret = poll(&pfd, 1, (int)(left * 1000) + 1);
+
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fatal_with_errno(EXIT_FAILURE, "poll");
+		}
+
+		if (ret == 0) {
+			continue;
+		}
+
+		ret = read(fd, inbuf + inlen, sizeof(inbuf) - inlen);
+
+		if (ret <= 0) {
+			return -1;
+		}
+
+		inlen += (size_t)ret;
+	}
+}
+
+static void deadline_in(struct timeval *deadline, double seconds)
+{
+	nut_monotime(deadline);
+	deadline->tv_sec += (time_t)seconds;
+	deadline->tv_usec += (suseconds_t)((seconds - (double)(time_t)seconds) * 1e6);
+
+	if (deadline->tv_usec >= 1000000) {
+		deadline->tv_sec++;
+		deadline->tv_usec -= 1000000;
+	}
+}
+
+/* send a request and print its answer */
+static int conn_query(const char *request, size_t timeout)
+{
+	struct timeval	deadline;
+	char	line[LARGEBUF];
+	size_t	len = strlen(request);
+	int	list = 0, ret;
+
+	if ((write(fd, request, len) != (ssize_t)len) || (write(fd, "\n", 1) != 1)) {
+		printf("can't send %s: %s\n", request, strerror(errno));
+		return 0;
+	}
+
+	deadline_in(&deadline, (double)timeout);
+
+	while ((ret = conn_readline(&deadline, line, sizeof(line))) == 1) {
+		if (!strncmp(line, "PUSH ", 5)) {
+			continue;
+		}
+
+		if (!strncmp(line, "BEGIN LIST ", 11)) {
+			list = 1;
+			continue;
+		}
+
+		if ((!list) || (!strncmp(line, "END LIST ", 9))) {
+			return 1;
+		}
+	}
+
+	printf("%s to %s\n", (ret < 0) ? "server hung up answering" : "no answer in time", request);
+	return 0;
+}
+
+/* WAIT <seconds> <text> or SLEEP <seconds> */
+static int conn_wait(const char *args, int sleeping)
+{
+	struct timeval	deadline;
+	char	line[LARGEBUF], *end;
+	double	seconds;
+	int	ret;
+
+	seconds = strtod(args, &end);
+
+	if ((end == args) || (seconds < 0) || ((!sleeping) && (*end != ' '))) {
+		fatalx(EXIT_FAILURE, "bad %s %s", sleeping ? "SLEEP" : "WAIT", args);
+	}
+
+	deadline_in(&deadline, seconds);
+
+	while ((ret = conn_readline(&deadline, line, sizeof(line))) == 1) {
+		if ((!sleeping) && (!strncmp(line, end + 1, strlen(end + 1)))) {
+			return 1;
+		}
+	}
+
+	if (ret < 0) {
+		printf("server hung up\n");
+		return 0;
+	}
+
+	if (!sleeping) {
+		printf("no %s within %s seconds\n", end + 1, args);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void help(const char *prog)
+	__attribute__((noreturn));
+
+static void help(const char *prog)
+{
+	printf("usage: %s [-H host] [-p port] [-t seconds] < requests\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char	*host = "127.0.0.1", *port;
+	char	request[LARGEBUF];
+	size_t	timeout = 5, len;
+	int	c, ret = 1;
+
+	port = getenv("NUT_PORT");
+
+	while ((c = getopt(argc, argv, "H:p:t:")) != -1) {
+		switch (c)
+		{
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 't':
+			timeout = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			help(argv[0]);
+		}
+	}
+
+	if ((optind < argc) || (timeout < 1)) {
+		help(argv[0]);
+	}
+
+	if ((!port) || (!*port)) {
+		port = "3493";
+	}
+
+	conn_open(host, port);
+
+	while ((ret) && (fgets(request, sizeof(request), stdin))) {
+		len = strcspn(request, "\r\n");
+		request[len] = '\0';
+
+		if (!len) {
+			continue;
+		}
+
+		if (!strncmp(request, "WAIT ", 5)) {
+			ret = conn_wait(request + 5, 0);
+		} else if (!strncmp(request, "SLEEP ", 6)) {
+			ret = conn_wait(request + 6, 1);
+		} else {
+			ret = conn_query(request, timeout);
+		}
+	}
+
+	close(fd);
+
+	return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
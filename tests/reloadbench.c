@@ -0,0 +1,265 @@
+/* reloadbench - measure how long a running upsd takes to reload its
+   configuration, and check that its clients live through it
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * The server is sent SIGHUP over and over, and each time asked for
+ * GET STATS reload.count until that goes up: the time this took, and the
+ * reload.usec upsd measured itself, are what is reported. After each
+ * reload, every one of the connections opened at the start must still
+ * answer GET VAR with the value of the variable, that is the clients and
+ * the data of the driver must have been kept.
+ *
+ * This needs a server with a UPS to query, see testcase_sandbox_upsd_reload
+ * in NIT/nit.sh which also edits the configuration between reloads.
+ *
+ * Usage: reloadbench [-H host] [-p port] [-c connections] [-n reloads]
+ *	-P pid ups [var]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "timehead.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <signal.h>
+
+static const char	*host = "127.0.0.1", *port = NULL;
+
+static int conn_open(void)
+{
+	struct addrinfo	hints, *res, *ai;
+	int	fd = -1, ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fatalx(EXIT_FAILURE, "getaddrinfo %s: %s", host, gai_strerror(ret));
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			continue;
+		}
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		fatal_with_errno(EXIT_FAILURE, "can't connect to %s port %s", host, port);
+	}
+
+	return fd;
+}
+
+/* send a request and read the one line answering it, 0 if the server
+ * hung up */
+static int conn_query(int fd, const char *request, char *buf, size_t buflen)
+{
+	size_t	len = 0, reqlen = strlen(request);
+	ssize_t	ret;
+
+	if (write(fd, request, reqlen) != (ssize_t)reqlen) {
+		return 0;
+	}
+
+	while (len < buflen - 1) {
+		if ((ret = read(fd, buf + len, buflen - 1 - len)) <= 0) {
+			return 0;
+		}
+
+		len += (size_t)ret;
+
+		if (buf[len - 1] == '\n') {
+			buf[len - 1] = '\0';
+			return 1;
+		}
+	}
+
+	fatalx(EXIT_FAILURE, "answer line too long");
+}
+
+static unsigned long get_stat(int fd, const char *name)
+{
+	char	request[SMALLBUF], buf[LARGEBUF], prefix[SMALLBUF];
+
+	snprintf(request, sizeof(request), "GET STATS %s\n", name);
+	snprintf(prefix, sizeof(prefix), "STATS %s ", name);
+
+	if (!conn_query(fd, request, buf, sizeof(buf))) {
+		fatalx(EXIT_FAILURE, "server gone while asked for %s", name);
+	}
+
+	if (strncmp(buf, prefix, strlen(prefix))) {
+		fatalx(EXIT_FAILURE, "unexpected answer to GET STATS %s: %s", name, buf);
+	}
+
+	return strtoul(buf + strlen(prefix), NULL, 10);
+}
+
+static double elapsed_ms(const struct timeval *start)
+{
+	struct timeval	now;
+
+	nut_monotime(&now);
+	return nut_monotime_diff(&now, start) * 1e3;
+}
+
+static void help(const char *prog)
+	__attribute__((noreturn));
+
+static void help(const char *prog)
+{
+	printf("usage: %s [-H host] [-p port] [-c connections] [-n reloads] -P pid ups [var]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char	*upsname, *varname = "ups.status";
+	int	*fds, ctl, c;
+	size_t	numconns = 16, reloads = 10, i, r, lost = 0, wrong = 0;
+	pid_t	pid = 0;
+	char	request[SMALLBUF], expect[SMALLBUF], buf[LARGEBUF];
+	double	ms, min = 0, max = 0, sum = 0, usec_sum = 0;
+
+	port = getenv("NUT_PORT");
+
+	while ((c = getopt(argc, argv, "H:p:c:n:P:")) != -1) {
+		switch (c)
+		{
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'c':
+			numconns = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			reloads = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			pid = (pid_t)strtol(optarg, NULL, 10);
+			break;
+		default:
+			help(argv[0]);
+		}
+	}
+
+	if ((optind >= argc) || (pid < 1) || (reloads < 1)) {
+		help(argv[0]);
+	}
+
+	upsname = argv[optind];
+
+	if (optind + 1 < argc) {
+		varname = argv[optind + 1];
+	}
+
+	if ((!port) || (!*port)) {
+		port = "3493";
+	}
+
+	snprintf(request, sizeof(request), "GET VAR %s %s\n", upsname, varname);
+	snprintf(expect, sizeof(expect), "VAR %s %s ", upsname, varname);
+
+	ctl = conn_open();
+	fds = xcalloc(numconns ? numconns : 1, sizeof(*fds));
+
+	for (i = 0; i < numconns; i++) {
+		fds[i] = conn_open();
+	}
+
+	for (r = 0; r < reloads; r++) {
+		struct timeval	start;
+		unsigned long	count = get_stat(ctl, "reload.count");
+
+		nut_monotime(&start);
+
+		if (kill(pid, SIGHUP) != 0) {
+			fatal_with_errno(EXIT_FAILURE, "kill %ld", (long)pid);
+		}
+
+		/* it is done with the next pass of its main loop */
+		while (get_stat(ctl, "reload.count") == count) {
+			if (elapsed_ms(&start) > 10000) {
+				fatalx(EXIT_FAILURE, "no reload after 10 seconds");
+			}
+
+			usleep(200);
+		}
+
+		ms = elapsed_ms(&start);
+		usec_sum += (double)get_stat(ctl, "reload.usec");
+
+		sum += ms;
+		if ((r == 0) || (ms < min)) {
+			min = ms;
+		}
+		if (ms > max) {
+			max = ms;
+		}
+
+		for (i = 0; i < numconns; i++) {
+			if (fds[i] < 0) {
+				continue;
+			}
+
+			if (!conn_query(fds[i], request, buf, sizeof(buf))) {
+				upslogx(LOG_ERR, "connection %zu lost with reload %zu", i, r + 1);
+				close(fds[i]);
+				fds[i] = -1;
+				lost++;
+				continue;
+			}
+
+			if (strncmp(buf, expect, strlen(expect))) {
+				upslogx(LOG_ERR, "connection %zu after reload %zu: %s", i, r + 1, buf);
+				wrong++;
+			}
+		}
+	}
+
+	for (i = 0; i < numconns; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+
+	free(fds);
+	close(ctl);
+
+	printf("%zu reloads with %zu connections: %.2f/%.2f/%.2f ms min/avg/max until seen, "
+		"%.2f ms avg in upsd, %zu connections lost, %zu wrong answers\n",
+		reloads, numconns, min, sum / (double)reloads, max,
+		usec_sum / (double)reloads / 1e3, lost, wrong);
+
+	return ((lost == 0) && (wrong == 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
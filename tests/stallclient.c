@@ -0,0 +1,500 @@
+/* stallclient - check that upsd keeps serving everyone else while one
+   of its clients stops reading the answers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * One connection (in TLS with -s) sends a burst of LIST VAR requests and
+ * never reads the answers, which are many more than the socket buffers
+ * hold. Another connection must then still have its GET VAR answered
+ * within the timeout, that is neither the thread serving the first one
+ * nor the main loop of upsd may wait for it to read. Once the first one
+ * reads again, it must get the answers to all of its requests.
+ *
+ * With -m, the one which stalls is a scraper of METRICS_LISTEN at port
+ * instead, and it must get all of the metrics of the given number of
+ * UPSes once it reads again.
+ *
+ * With -w, several connections WATCH the UPS and stop reading, while
+ * another one sets var (ups.mfr by default) as many times as requests,
+ * as the user and password in NUT_USER and NUT_PASS. upsd drops the
+ * watchers once the changes pushed to them pile up, and must answer
+ * every SET VAR, then a GET VAR, within the timeout all along.
+ *
+ * This needs a server with a UPS to query, see testcase_sandbox_upsd_stall
+ * in NIT/nit.sh. It exits with 77 if -s was asked for, but the server or
+ * this build do not talk TLS.
+ *
+ * Usage: stallclient [-H host] [-p port] [-s] [-n requests] [-t seconds]
+ *	ups [var]
+ *        stallclient -m [-H host] [-p port] [-t seconds] numups
+ *        stallclient -w [-H host] [-p port] [-n requests] [-t seconds]
+ *	ups [var]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "timehead.h"
+#include "../clients/upsclient.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+static void help(const char *prog)
+	__attribute__((noreturn));
+
+static void help(const char *prog)
+{
+	printf("usage: %s [-H host] [-p port] [-s] [-n requests] [-t seconds] ups [var]\n", prog);
+	printf("       %s -m [-H host] [-p port] [-t seconds] numups\n", prog);
+	printf("       %s -w [-H host] [-p port] [-n requests] [-t seconds] ups [var]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/* answer to a request sent by stall_watch(), which must be OK */
+static int expect_ok(UPSCONN_t *ups, const char *what, size_t timeout)
+{
+	char	line[LARGEBUF];
+
+	if (upscli_readline_timeout(ups, line, sizeof(line), (time_t)timeout) < 0) {
+		printf("no answer to %s within %zu seconds while watchers stall: %s\n",
+			what, timeout, upscli_strerror(ups));
+		return 0;
+	}
+
+	if (strncmp(line, "OK", 2)) {
+		printf("%s failed while watchers stall: %s\n", what, line);
+		return 0;
+	}
+
+	return 1;
+}
+
+#define STALL_WATCHERS	8
+#define STALL_BURST	1000
+
+/* have several clients WATCH a UPS without reading the changes upsd
+ * pushes to them, while another one keeps changing a variable */
+static int stall_watch(const char *host, uint16_t port, const char *upsname,
+	const char *varname, size_t requests, size_t timeout)
+{
+	UPSCONN_t	watch[STALL_WATCHERS], set, probe, *probes[1];
+	const char	*user = getenv("NUT_USER"), *pass = getenv("NUT_PASS");
+	const char	*query[3];
+	char	request[SMALLBUF], expect[SMALLBUF], *burst;
+	struct timeval	start, now;
+	size_t	i, j, len, chunk = 100, numa;
+	int	rcvbuf = 4096, ret;
+	char	**answer;
+
+	if ((!user) || (!pass)) {
+		printf("NUT_USER and NUT_PASS are needed to SET VAR, nothing to check\n");
+		return 77;
+	}
+
+	if (upscli_init(0, NULL, NULL, NULL) < 0) {
+		fatalx(EXIT_FAILURE, "upscli_init failed");
+	}
+
+	/* with a burst of LIST VAR after it, for the thread serving them
+	 * to be busy with their output while changes are pushed to them */
+	snprintf(request, sizeof(request), "LIST VAR %s\n", upsname);
+	len = strlen(request);
+	burst = xmalloc(STALL_BURST * len + sizeof(request));
+	snprintf(burst, sizeof(request), "WATCH %s\n", upsname);
+	numa = strlen(burst);
+	for (i = 0; i < STALL_BURST; i++) {
+		memcpy(burst + numa + i * len, request, len);
+	}
+	len = numa + STALL_BURST * len;
+
+	for (i = 0; i < STALL_WATCHERS; i++) {
+		if (upscli_connect(&watch[i], host, port, 0) < 0) {
+			fatalx(EXIT_FAILURE, "watching connection: %s", upscli_strerror(&watch[i]));
+		}
+
+		if (setsockopt(upscli_fd(&watch[i]), SOL_SOCKET, SO_RCVBUF, (void *)&rcvbuf, sizeof(rcvbuf)) != 0) {
+			upslog_with_errno(LOG_WARNING, "setsockopt SO_RCVBUF");
+		}
+
+		/* and never read anything */
+		if (upscli_sendline(&watch[i], burst, len) < 0) {
+			fatalx(EXIT_FAILURE, "watching connection: %s", upscli_strerror(&watch[i]));
+		}
+	}
+
+	free(burst);
+
+	if (upscli_connect(&set, host, port, 0) < 0) {
+		fatalx(EXIT_FAILURE, "setting connection: %s", upscli_strerror(&set));
+	}
+
+	snprintf(request, sizeof(request), "USERNAME %s\n", user);
+	if ((upscli_sendline(&set, request, strlen(request)) < 0)
+	 || (!expect_ok(&set, "USERNAME", timeout))) {
+		return EXIT_FAILURE;
+	}
+
+	snprintf(request, sizeof(request), "PASSWORD %s\n", pass);
+	if ((upscli_sendline(&set, request, strlen(request)) < 0)
+	 || (!expect_ok(&set, "PASSWORD", timeout))) {
+		return EXIT_FAILURE;
+	}
+
+	query[0] = "VAR";
+	query[1] = upsname;
+	query[2] = varname;
+
+	burst = xmalloc(chunk * sizeof(request));
+
+	/* a chunk at a time, for upsd to push the changes meanwhile */
+	for (i = 0; i < requests; i += chunk) {
+		for (j = 0, len = 0; (j < chunk) && (i + j < requests); j++) {
+			/* as long as dummy-ups takes, for more to push */
+			snprintf(burst + len, sizeof(request), "SET VAR %s %s \"stall-%026zu\"\n",
+				upsname, varname, i + j);
+			len += strlen(burst + len);
+		}
+
+		if (upscli_sendline(&set, burst, len) < 0) {
+			fatalx(EXIT_FAILURE, "setting connection: %s", upscli_strerror(&set));
+		}
+
+		for (j = 0; (j < chunk) && (i + j < requests); j++) {
+			if (!expect_ok(&set, "SET VAR", timeout)) {
+				printf("(after %zu of %zu)\n", i + j, requests);
+				return EXIT_FAILURE;
+			}
+		}
+
+		/* upsd only forwards them: wait for the driver to catch up,
+		 * not to have its socket overflow */
+		snprintf(expect, sizeof(expect), "stall-%026zu", i + j - 1);
+		nut_monotime(&start);
+		do {
+			if (upscli_get(&set, 3, query, &numa, &answer) < 0) {
+				printf("GET VAR failed while watchers stall: %s\n", upscli_strerror(&set));
+				return EXIT_FAILURE;
+			}
+
+			nut_monotime(&now);
+			if (nut_monotime_diff(&now, &start) > (double)timeout) {
+				printf("%s not set to %s within %zu seconds while watchers stall\n",
+					varname, expect, timeout);
+				return EXIT_FAILURE;
+			}
+		} while ((numa < 4) || (strcmp(answer[3], expect)));
+	}
+
+	free(burst);
+
+	if (upscli_connect(&probe, host, port, 0) < 0) {
+		fatalx(EXIT_FAILURE, "probing connection: %s", upscli_strerror(&probe));
+	}
+
+	if (upscli_submit_get(&probe, 3, query) < 0) {
+		fatalx(EXIT_FAILURE, "probing connection: %s", upscli_strerror(&probe));
+	}
+
+	probes[0] = &probe;
+	ret = upscli_poll(probes, 1, (int)timeout * 1000);
+
+	if ((ret < 1) || (upscli_collect(&probe, &numa, &answer) != UPSCLI_ANSWER_GET)) {
+		printf("no answer to GET VAR %s %s after %zu SET VAR while %d watchers stall\n",
+			upsname, varname, requests, STALL_WATCHERS);
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu SET VAR %s %s answered while %d watchers stall\n",
+		requests, upsname, varname, STALL_WATCHERS);
+
+	upscli_disconnect(&probe);
+	upscli_disconnect(&set);
+	for (i = 0; i < STALL_WATCHERS; i++) {
+		upscli_disconnect(&watch[i]);
+	}
+	upscli_cleanup();
+
+	return EXIT_SUCCESS;
+}
+
+/* scrape the metrics, but only read them after a while: upsd must keep
+ * on sending them for as long as it takes, and only then close */
+static int stall_metrics(const char *host, const char *port, size_t numups, size_t timeout)
+{
+	struct addrinfo	hints, *res, *ai;
+	struct timeval	tv;
+	const char	*request = "GET /metrics HTTP/1.0\r\n\r\n", *line;
+	char	*body = NULL;
+	size_t	len = 0, size = 0, found = 0;
+	ssize_t	ret;
+	int	fd = -1, rcvbuf = 4096;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fatalx(EXIT_FAILURE, "getaddrinfo %s: %s", host, gai_strerror((int)ret));
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			continue;
+		}
+
+		/* before connecting, for the window to stay small */
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&rcvbuf, sizeof(rcvbuf)) != 0) {
+			upslog_with_errno(LOG_WARNING, "setsockopt SO_RCVBUF");
+		}
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		fatal_with_errno(EXIT_FAILURE, "can't connect to %s port %s", host, port);
+	}
+
+	if (write(fd, request, strlen(request)) < 0) {
+		fatal_with_errno(EXIT_FAILURE, "write");
+	}
+
+	/* let the server fill up the socket buffers */
+	sleep(1);
+
+	tv.tv_sec = (time_t)timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv)) != 0) {
+		upslog_with_errno(LOG_WARNING, "setsockopt SO_RCVTIMEO");
+	}
+
+	do {
+		if (size - len < LARGEBUF) {
+			size = size ? size * 2 : 16 * LARGEBUF;
+			body = xrealloc(body, size + 1);
+		}
+
+		ret = read(fd, body + len, size - len);
+		if (ret > 0) {
+			len += (size_t)ret;
+		}
+	} while (ret > 0);
+
+	if (ret < 0) {
+		upslog_with_errno(LOG_WARNING, "read");
+	}
+
+	close(fd);
+	body[len] = '\0';
+
+	for (line = strstr(body, "\nupsd_ups_stale{"); line; line = strstr(line + 1, "\nupsd_ups_stale{")) {
+		found++;
+	}
+
+	if ((strncmp(body, "HTTP/1.0 200 ", 13)) || (found != numups) || (body[len - 1] != '\n')) {
+		printf("only %zu of %zu UPSes in the %zu bytes of metrics sent to a scraper which stalled\n",
+			found, numups, len);
+		free(body);
+		return EXIT_FAILURE;
+	}
+
+	printf("all metrics of %zu UPSes (%zu bytes) sent to a scraper which stalled\n",
+		numups, len);
+	free(body);
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	const char	*host = "127.0.0.1", *port, *upsname, *varname = "ups.status";
+	const char	*query[3];
+	UPSCONN_t	stall, probe, *probes[1];
+	int	c, tls = 0, metrics = 0, watch = 0, ret, rcvbuf = 65536;
+	size_t	requests = 10000, timeout = 5, i, len, numa;
+	char	request[SMALLBUF], expect[SMALLBUF], line[LARGEBUF], *burst, **answer;
+	struct timeval	start, now, tv;
+	double	ms;
+
+	port = getenv("NUT_PORT");
+
+	while ((c = getopt(argc, argv, "H:p:smwn:t:")) != -1) {
+		switch (c)
+		{
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 's':
+			tls = 1;
+			break;
+		case 'm':
+			metrics = 1;
+			break;
+		case 'w':
+			watch = 1;
+			break;
+		case 'n':
+			requests = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			timeout = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			help(argv[0]);
+		}
+	}
+
+	if ((optind >= argc) || (requests < 1) || (timeout < 1)) {
+		help(argv[0]);
+	}
+
+	if (metrics) {
+		if ((!port) || (!*port)) {
+			help(argv[0]);
+		}
+
+		return stall_metrics(host, port, strtoul(argv[optind], NULL, 10), timeout);
+	}
+
+	upsname = argv[optind];
+
+	if (optind + 1 < argc) {
+		varname = argv[optind + 1];
+	}
+
+	if ((!port) || (!*port)) {
+		port = "3493";
+	}
+
+	if (watch) {
+		return stall_watch(host, (uint16_t)atoi(port), upsname,
+			(optind + 1 < argc) ? varname : "ups.mfr", requests, timeout);
+	}
+
+	if (upscli_init(0, NULL, NULL, NULL) < 0) {
+		fatalx(EXIT_FAILURE, "upscli_init failed");
+	}
+
+	if (upscli_connect(&stall, host, (uint16_t)atoi(port), tls ? UPSCLI_CONN_TRYSSL : 0) < 0) {
+		fatalx(EXIT_FAILURE, "stalling connection: %s", upscli_strerror(&stall));
+	}
+
+	if (tls && (upscli_ssl(&stall) != 1)) {
+		printf("TLS is not available, nothing to check\n");
+		upscli_disconnect(&stall);
+		upscli_cleanup();
+		return 77;
+	}
+
+	/* keep the kernel from taking in much of what upsd sends, but
+	 * with a window large enough not to slow down reading it later */
+	if (setsockopt(upscli_fd(&stall), SOL_SOCKET, SO_RCVBUF, (void *)&rcvbuf, sizeof(rcvbuf)) != 0) {
+		upslog_with_errno(LOG_WARNING, "setsockopt SO_RCVBUF");
+	}
+
+	snprintf(request, sizeof(request), "LIST VAR %s\n", upsname);
+	len = strlen(request);
+	burst = xmalloc(requests * len);
+
+	for (i = 0; i < requests; i++) {
+		memcpy(burst + i * len, request, len);
+	}
+
+	/* all in one go: the server stops reading long before it is over,
+	 * but the socket buffers on both ends take it in */
+	if (upscli_sendline(&stall, burst, requests * len) < 0) {
+		fatalx(EXIT_FAILURE, "stalling connection: %s", upscli_strerror(&stall));
+	}
+
+	free(burst);
+
+	/* let the server fill up the socket buffers */
+	sleep(1);
+
+	if (upscli_connect(&probe, host, (uint16_t)atoi(port), 0) < 0) {
+		fatalx(EXIT_FAILURE, "probing connection: %s", upscli_strerror(&probe));
+	}
+
+	query[0] = "VAR";
+	query[1] = upsname;
+	query[2] = varname;
+
+	nut_monotime(&start);
+
+	if (upscli_submit_get(&probe, 3, query) < 0) {
+		fatalx(EXIT_FAILURE, "probing connection: %s", upscli_strerror(&probe));
+	}
+
+	probes[0] = &probe;
+	ret = upscli_poll(probes, 1, (int)timeout * 1000);
+
+	nut_monotime(&now);
+	ms = nut_monotime_diff(&now, &start) * 1e3;
+
+	if (ret < 1) {
+		printf("no answer to GET VAR %s %s within %zu seconds while a%s client stalls\n",
+			upsname, varname, timeout, tls ? " TLS" : "");
+		return EXIT_FAILURE;
+	}
+
+	if (upscli_collect(&probe, &numa, &answer) != UPSCLI_ANSWER_GET) {
+		printf("GET VAR %s %s failed while a%s client stalls: %s\n",
+			upsname, varname, tls ? " TLS" : "", upscli_strerror(&probe));
+		return EXIT_FAILURE;
+	}
+
+	printf("GET VAR %s %s answered in %.2f ms while a%s client stalls with %zu LIST VAR requests\n",
+		upsname, varname, ms, tls ? " TLS" : "", requests);
+
+	upscli_disconnect(&probe);
+
+	/* none of its requests may have been lost meanwhile; the TLS reads
+	 * of libupsclient wait for as long as it takes otherwise */
+	tv.tv_sec = (time_t)timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(upscli_fd(&stall), SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv)) != 0) {
+		upslog_with_errno(LOG_WARNING, "setsockopt SO_RCVTIMEO");
+	}
+
+	snprintf(expect, sizeof(expect), "END LIST VAR %s", upsname);
+
+	for (i = 0; i < requests; ) {
+		if (upscli_readline_timeout(&stall, line, sizeof(line), (time_t)timeout) < 0) {
+			printf("only %zu of %zu LIST VAR answered to the%s client which stalled: %s\n",
+				i, requests, tls ? " TLS" : "", upscli_strerror(&stall));
+			return EXIT_FAILURE;
+		}
+
+		if (!strcmp(line, expect)) {
+			i++;
+		}
+	}
+	upscli_disconnect(&stall);
+	upscli_cleanup();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+/* statebench - measure the cost of the common state tree operations
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Variables are named and added the way snmp-ups templates do it
+ * (outlet.1.*, outlet.2.*, ...), i.e. in nearly sorted order, which
+ * is the worst case for a plain binary search tree. For each size,
+ * time insertion, lookup of every variable and an in-order dump, with
+ * both the current (balanced) state tree and the former unbalanced one.
+ * The tree itself is checked by statetest, in "make check".
+ *
+ * Usage: statebench [variables...]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "timehead.h"
+#include "state.h"
+
+#define BENCH_MINOPS	200000
+
+static const char	*fields[] = {
+	"current", "delay.reboot", "delay.shutdown", "desc", "id",
+	"power", "realpower", "status", "switchable", "voltage"
+};
+
+#define NUMFIELDS	(sizeof(fields) / sizeof(fields[0]))
+
+static char	**names = NULL;
+static size_t	numnames = 0;
+
+static double now_usec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1e6 + (double)tv.tv_usec;
+}
+
+static void names_make(size_t count)
+{
+	char	buf[SMALLBUF];
+	size_t	i;
+
+	names = xcalloc(count, sizeof(*names));
+
+	for (numnames = 0; numnames < count; numnames++) {
+		i = numnames;
+		snprintf(buf, sizeof(buf), "outlet.%zu.%s", i / NUMFIELDS + 1, fields[i % NUMFIELDS]);
+		names[numnames] = xstrdup(buf);
+	}
+}
+
+static void names_free(void)
+{
+	size_t	i;
+
+	for (i = 0; i < numnames; i++) {
+		free(names[i]);
+	}
+
+	free(names);
+	names = NULL;
+	numnames = 0;
+}
+
+/* the former unbalanced tree, for comparison */
+static void legacy_setinfo(st_tree_t **nptr, const char *var, const char *val)
+{
+	while (*nptr) {
+		st_tree_t	*node = *nptr;
+
+		if (strcasecmp(node->var, var) > 0) {
+			nptr = &node->left;
+			continue;
+		}
+
+		if (strcasecmp(node->var, var) < 0) {
+			nptr = &node->right;
+			continue;
+		}
+
+		return;
+	}
+
+	*nptr = xcalloc(1, sizeof(**nptr));
+	(*nptr)->var = xstrdup(var);
+	(*nptr)->raw = xstrdup(val);
+	(*nptr)->val = (*nptr)->raw;
+}
+
+static st_tree_t *legacy_find(st_tree_t *node, const char *var)
+{
+	while (node) {
+		if (strcasecmp(node->var, var) > 0) {
+			node = node->left;
+			continue;
+		}
+
+		if (strcasecmp(node->var, var) < 0) {
+			node = node->right;
+			continue;
+		}
+
+		break;
+	}
+
+	return node;
+}
+
+static void legacy_free(st_tree_t *node)
+{
+	/* iterative on the right, the degenerate tree is a long list */
+	while (node) {
+		st_tree_t	*next = node->right;
+
+		legacy_free(node->left);
+		free(node->var);
+		free(node->raw);
+		free(node);
+		node = next;
+	}
+}
+
+/* what tree_dump() in upsd does, minus the formatting */
+static size_t tree_walk(const st_tree_t *node, const char **last)
+{
+	size_t	count = 0;
+
+	while (node) {
+		if (node->left) {
+			count += tree_walk(node->left, last);
+		}
+
+		*last = node->var;
+		count++;
+		node = node->right;
+	}
+
+	return count;
+}
+
+static size_t tree_depth(const st_tree_t *node)
+{
+	size_t	ld, rd;
+
+	if (!node) {
+		return 0;
+	}
+
+	ld = tree_depth(node->left);
+	rd = tree_depth(node->right);
+
+	return 1 + ((ld > rd) ? ld : rd);
+}
+
+static void bench(size_t count)
+{
+	st_tree_t	*root = NULL, *lroot = NULL;
+	double	start, ins, find, dump, lins, lfind, ldump;
+	size_t	i, round, rounds;
+	const char	*last;
+
+	names_make(count);
+
+	/* enough rounds for the small sizes to be measurable */
+	rounds = (BENCH_MINOPS + count - 1) / count;
+
+	start = now_usec();
+	for (round = 0; round < rounds; round++) {
+		state_infofree(root);
+		root = NULL;
+		for (i = 0; i < numnames; i++) {
+			state_setinfo(&root, names[i], "0");
+		}
+	}
+	ins = (now_usec() - start) * 1000 / ((double)rounds * count);
+
+	start = now_usec();
+	for (round = 0; round < rounds; round++) {
+		legacy_free(lroot);
+		lroot = NULL;
+		for (i = 0; i < numnames; i++) {
+			legacy_setinfo(&lroot, names[i], "0");
+		}
+	}
+	lins = (now_usec() - start) * 1000 / ((double)rounds * count);
+
+	start = now_usec();
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < numnames; i++) {
+			if (!state_tree_find(root, names[i])) {
+				fatalx(EXIT_FAILURE, "lost [%s]", names[i]);
+			}
+		}
+	}
+	find = (now_usec() - start) * 1000 / ((double)rounds * count);
+
+	start = now_usec();
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < numnames; i++) {
+			if (!legacy_find(lroot, names[i])) {
+				fatalx(EXIT_FAILURE, "lost [%s]", names[i]);
+			}
+		}
+	}
+	lfind = (now_usec() - start) * 1000 / ((double)rounds * count);
+
+	start = now_usec();
+	for (round = 0; round < rounds; round++) {
+		last = NULL;
+		if (tree_walk(root, &last) != count) {
+			fatalx(EXIT_FAILURE, "wrong number of variables in dump");
+		}
+	}
+	dump = (now_usec() - start) * 1000 / ((double)rounds * count);
+
+	start = now_usec();
+	for (round = 0; round < rounds; round++) {
+		last = NULL;
+		tree_walk(lroot, &last);
+	}
+	ldump = (now_usec() - start) * 1000 / ((double)rounds * count);
+
+	printf("%6zu %6zu %6zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+		count, tree_depth(root), tree_depth(lroot),
+		ins, lins, find, lfind, dump, ldump);
+
+	state_infofree(root);
+	legacy_free(lroot);
+	names_free();
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t	dflt[] = { 50, 500, 5000 };
+	int	i;
+
+	printf("nsec per variable, balanced tree vs. former unbalanced one\n");
+	printf("%6s %6s %6s %9s %9s %9s %9s %9s %9s\n", "vars", "depth", "(old)",
+		"insert", "(old)", "lookup", "(old)", "dump", "(old)");
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			size_t	count = (size_t)strtoul(argv[i], NULL, 10);
+
+			if (count < 1) {
+				upslogx(LOG_WARNING, "skipping invalid size %s", argv[i]);
+				continue;
+			}
+
+			bench(count);
+		}
+	} else {
+		size_t	j;
+
+		for (j = 0; j < sizeof(dflt) / sizeof(dflt[0]); j++) {
+			bench(dflt[j]);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
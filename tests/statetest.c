@@ -0,0 +1,256 @@
+/* statetest - check that the state tree stays ordered and balanced
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Variables are named the way snmp-ups templates do it (outlet.1.*,
+ * outlet.2.*, ...) and added in that nearly sorted order, then in random
+ * orders. After every batch of additions and deletions, the tree must be
+ * in order with the heights of an AVL tree, hold exactly the variables
+ * that are left, and find them whatever their case. It must end up empty
+ * once they are all deleted.
+ *
+ * Usage: statetest [seed [rounds]]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "state.h"
+
+#include <ctype.h>
+
+#define TEST_NAMES	1000
+#define TEST_ROUNDS	20
+
+static const char	*fields[] = {
+	"current", "delay.reboot", "delay.shutdown", "desc", "id",
+	"power", "realpower", "status", "switchable", "voltage"
+};
+
+#define NUMFIELDS	(sizeof(fields) / sizeof(fields[0]))
+
+static char	*names[TEST_NAMES];
+static int	present[TEST_NAMES];
+static size_t	order[TEST_NAMES];
+
+static unsigned long	seed = 1;
+
+static unsigned long rnd(unsigned long range)
+{
+	seed = seed * 1103515245UL + 12345UL;
+	return ((seed >> 16) & 0x7fffffffUL) % range;
+}
+
+static void shuffle(void)
+{
+	size_t	i, j, tmp;
+
+	for (i = TEST_NAMES - 1; i > 0; i--) {
+		j = rnd(i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static size_t tree_walk(const st_tree_t *node, const char **last)
+{
+	size_t	count = 0;
+
+	while (node) {
+		if (node->left) {
+			count += tree_walk(node->left, last);
+		}
+
+		if (*last && (strcasecmp(*last, node->var) >= 0)) {
+			fatalx(EXIT_FAILURE, "tree out of order at [%s] after [%s]",
+				node->var, *last);
+		}
+
+		*last = node->var;
+		count++;
+		node = node->right;
+	}
+
+	return count;
+}
+
+static int tree_check(const st_tree_t *node)
+{
+	int	lh, rh;
+
+	if (!node) {
+		return 0;
+	}
+
+	lh = tree_check(node->left);
+	rh = tree_check(node->right);
+
+	if (node->height != 1 + ((lh > rh) ? lh : rh)) {
+		fatalx(EXIT_FAILURE, "wrong height %d at [%s] (%d/%d)",
+			node->height, node->var, lh, rh);
+	}
+
+	if ((lh - rh > 1) || (rh - lh > 1)) {
+		fatalx(EXIT_FAILURE, "tree unbalanced at [%s] (%d/%d)",
+			node->var, lh, rh);
+	}
+
+	return node->height;
+}
+
+static void check(st_tree_t *root, const char *when)
+{
+	const char	*last = NULL;
+	char	upper[SMALLBUF];
+	size_t	i, j, count = 0;
+
+	tree_check(root);
+
+	for (i = 0; i < TEST_NAMES; i++) {
+		const char	*val;
+
+		count += present[i];
+
+		/* lookups ignore the case, as in "GET VAR ups OUTLET.1.STATUS" */
+		for (j = 0; names[i][j]; j++) {
+			upper[j] = (char)toupper((unsigned char)names[i][j]);
+		}
+		upper[j] = '\0';
+
+		val = state_getinfo(root, (i % 2) ? upper : names[i]);
+
+		if (!present[i]) {
+			if (val) {
+				fatalx(EXIT_FAILURE, "%s: deleted [%s] still found", when, names[i]);
+			}
+			continue;
+		}
+
+		if (!val) {
+			fatalx(EXIT_FAILURE, "%s: lost [%s]", when, names[i]);
+		}
+
+		if (strtoul(val, NULL, 10) != i) {
+			fatalx(EXIT_FAILURE, "%s: [%s] is %s, expected %zu", when, names[i], val, i);
+		}
+	}
+
+	if (tree_walk(root, &last) != count) {
+		fatalx(EXIT_FAILURE, "%s: %zu variables expected in the tree", when, count);
+	}
+}
+
+static void add(st_tree_t **root, size_t i)
+{
+	char	val[SMALLBUF];
+
+	snprintf(val, sizeof(val), "%zu", i);
+
+	if (!state_setinfo(root, names[i], val) && !present[i]) {
+		fatalx(EXIT_FAILURE, "failed to add [%s]", names[i]);
+	}
+
+	present[i] = 1;
+}
+
+static void del(st_tree_t **root, size_t i)
+{
+	if (state_delinfo(root, names[i]) != present[i]) {
+		fatalx(EXIT_FAILURE, "deleting [%s] did not return %d", names[i], present[i]);
+	}
+
+	present[i] = 0;
+}
+
+int main(int argc, char **argv)
+{
+	st_tree_t	*root = NULL;
+	unsigned long	rounds = TEST_ROUNDS, r;
+	char	buf[SMALLBUF];
+	size_t	i;
+
+	if (argc > 1) {
+		seed = strtoul(argv[1], NULL, 10);
+	}
+
+	if (argc > 2) {
+		rounds = strtoul(argv[2], NULL, 10);
+	}
+
+	for (i = 0; i < TEST_NAMES; i++) {
+		snprintf(buf, sizeof(buf), "outlet.%zu.%s", i / NUMFIELDS + 1, fields[i % NUMFIELDS]);
+		names[i] = xstrdup(buf);
+		order[i] = i;
+	}
+
+	/* the driver order first: the worst case for a plain binary tree */
+	for (i = 0; i < TEST_NAMES; i++) {
+		add(&root, i);
+	}
+	check(root, "sorted additions");
+
+	for (i = 0; i < TEST_NAMES; i += 2) {
+		del(&root, i);
+	}
+	check(root, "every other deletion");
+
+	for (i = 0; i < TEST_NAMES; i++) {
+		del(&root, i);
+	}
+	check(root, "sorted deletions");
+
+	if (root) {
+		fatalx(EXIT_FAILURE, "tree not empty after deleting everything");
+	}
+
+	/* then random additions and deletions, with repeats and misses */
+	for (r = 0; r < rounds; r++) {
+		shuffle();
+		for (i = 0; i < TEST_NAMES; i++) {
+			if (rnd(4)) {
+				add(&root, order[i]);
+			}
+		}
+		check(root, "random additions");
+
+		shuffle();
+		for (i = 0; i < TEST_NAMES; i++) {
+			if (rnd(2)) {
+				del(&root, order[i]);
+			}
+		}
+		check(root, "random deletions");
+	}
+
+	for (i = 0; i < TEST_NAMES; i++) {
+		del(&root, order[i]);
+	}
+	check(root, "final deletions");
+
+	if (root) {
+		fatalx(EXIT_FAILURE, "tree not empty after deleting everything");
+	}
+
+	for (i = 0; i < TEST_NAMES; i++) {
+		free(names[i]);
+	}
+
+	printf("statetest: %lu rounds passed\n", rounds);
+
+	return EXIT_SUCCESS;
+}
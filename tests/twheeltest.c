@@ -0,0 +1,271 @@
+/* twheeltest - check that the timer wheel runs timers when they expire
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * Timers are set, reset and deleted at random, with delays of all
+ * levels of the wheel, while the clock moves on by random steps (now and
+ * then a long one, or back). Each run must fire exactly the timers whose
+ * time has come, and twheel_timeout() must never sleep past one of them.
+ * Some timers set themselves again or delete another one when they
+ * fire, as the upsd ones do.
+ *
+ * Usage: twheeltest [seed [rounds]]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "twheel.h"
+
+#define TEST_TIMERS	200
+#define TEST_ROUNDS	20000
+
+#define SPAN	((time_t)1 << (TWHEEL_BITS * TWHEEL_LEVELS))
+
+typedef struct {
+	twtimer_t	timer;
+	time_t	expected;	/* when it should fire, if pending */
+	int	pending;
+	int	fired;
+} test_timer_t;
+
+static test_timer_t	timers[TEST_TIMERS];
+static twheel_t	wheel;
+
+static unsigned long	seed = 1;
+
+static unsigned long rnd(unsigned long range)
+{
+	seed = seed * 1103515245UL + 12345UL;
+	return ((seed >> 16) & 0x7fffffffUL) % range;
+}
+
+static time_t rnd_delay(void)
+{
+	switch (rnd(8))
+	{
+	case 0:
+		return 0;
+	case 1:
+		return (time_t)rnd(SPAN + 1000);
+	case 2:
+		return (time_t)rnd(300000);
+	case 3:
+		return (time_t)rnd(5000);
+	default:
+		return (time_t)rnd(100);
+	}
+}
+
+static void timer_set(test_timer_t *t, time_t delay)
+{
+	twtimer_set(&wheel, &t->timer, delay);
+
+	if (delay >= SPAN) {
+		delay = SPAN - 1;
+	}
+
+	t->expected = wheel.now + delay;
+	t->pending = 1;
+}
+
+static void timer_fired(twtimer_t *timer)
+{
+	test_timer_t	*t = (test_timer_t *)timer->arg;
+
+	if (!t->pending) {
+		fatalx(EXIT_FAILURE, "timer %d fired while not pending",
+			(int)(t - timers));
+	}
+
+	if (twtimer_pending(timer)) {
+		fatalx(EXIT_FAILURE, "timer %d still pending in its callback",
+			(int)(t - timers));
+	}
+
+	if (t->expected > wheel.now) {
+		fatalx(EXIT_FAILURE, "timer %d fired at %ld, expected at %ld",
+			(int)(t - timers), (long)wheel.now, (long)t->expected);
+	}
+
+	t->pending = 0;
+	t->fired = 1;
+
+	switch (rnd(4))
+	{
+	case 0:
+		timer_set(t, rnd_delay());
+		break;
+	case 1:
+		/* another one, which may be due in this same run too */
+		t = &timers[rnd(TEST_TIMERS)];
+		twtimer_del(&t->timer);
+		t->pending = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+static void check_run(time_t now)
+{
+	size_t	i;
+
+	/* keep the delays across a step back */
+	if (now < wheel.now) {
+		for (i = 0; i < TEST_TIMERS; i++) {
+			timers[i].expected -= wheel.now - now;
+		}
+	}
+
+	for (i = 0; i < TEST_TIMERS; i++) {
+		timers[i].fired = 0;
+	}
+
+	twheel_run(&wheel, now);
+
+	for (i = 0; i < TEST_TIMERS; i++) {
+		test_timer_t	*t = &timers[i];
+
+		/* fired, or set again for later, or deleted by another one */
+		if ((t->pending) && (t->expected <= now) && (!t->fired)) {
+			fatalx(EXIT_FAILURE, "timer %zu expected at %ld not fired at %ld",
+				i, (long)t->expected, (long)now);
+		}
+
+		if (t->pending != twtimer_pending(&t->timer)) {
+			fatalx(EXIT_FAILURE, "timer %zu pending is %d, expected %d",
+				i, twtimer_pending(&t->timer), t->pending);
+		}
+	}
+}
+
+static void check_timeout(void)
+{
+	time_t	timeout = twheel_timeout(&wheel), first = -1;
+	size_t	i, count = 0;
+
+	for (i = 0; i < TEST_TIMERS; i++) {
+		if (!timers[i].pending) {
+			continue;
+		}
+
+		count++;
+
+		if ((first < 0) || (timers[i].expected - wheel.now < first)) {
+			first = timers[i].expected - wheel.now;
+		}
+	}
+
+	if (first < 0) {
+		first = -1;
+	}
+
+	if (count != wheel.count) {
+		fatalx(EXIT_FAILURE, "%zu timers pending, the wheel counts %zu",
+			count, wheel.count);
+	}
+
+	if ((timeout < 0) != (first < 0)) {
+		fatalx(EXIT_FAILURE, "timeout %ld with the first timer in %ld",
+			(long)timeout, (long)first);
+	}
+
+	if ((timeout > first) || ((first > 0) && (timeout == 0))) {
+		fatalx(EXIT_FAILURE, "timeout %ld with the first timer in %ld",
+			(long)timeout, (long)first);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long	rounds = TEST_ROUNDS, r;
+	time_t	now = 1600000000;
+	size_t	i;
+
+	if (argc > 1) {
+		seed = strtoul(argv[1], NULL, 10);
+	}
+
+	if (argc > 2) {
+		rounds = strtoul(argv[2], NULL, 10);
+	}
+
+	twheel_init(&wheel, now);
+
+	for (i = 0; i < TEST_TIMERS; i++) {
+		twtimer_init(&timers[i].timer, timer_fired, &timers[i]);
+	}
+
+	/* a few that are easy to follow first */
+	timer_set(&timers[0], 1);
+	timer_set(&timers[1], 64);
+	timer_set(&timers[2], 4097);
+	check_timeout();
+
+	if (twheel_timeout(&wheel) != 1) {
+		fatalx(EXIT_FAILURE, "timeout %ld, expected 1", (long)twheel_timeout(&wheel));
+	}
+
+	for (r = 0; r < 5000; r++) {
+		check_run(++now);
+		check_timeout();
+	}
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < 5; i++) {
+			test_timer_t	*t = &timers[rnd(TEST_TIMERS)];
+
+			if (rnd(5) == 0) {
+				twtimer_del(&t->timer);
+				t->pending = 0;
+			} else {
+				timer_set(t, rnd_delay());
+			}
+		}
+
+		check_timeout();
+
+		switch (rnd(50))
+		{
+		case 0:
+			now -= (time_t)rnd(10000);
+			break;
+		case 1:
+			now += (time_t)rnd(2 * SPAN);
+			break;
+		case 2:
+			now += (time_t)rnd(100000);
+			break;
+		default:
+			/* mostly wake up when the wheel says so */
+			if (twheel_timeout(&wheel) >= 0 && rnd(2)) {
+				now = wheel.now + twheel_timeout(&wheel);
+			} else {
+				now += (time_t)rnd(3);
+			}
+			break;
+		}
+
+		check_run(now);
+		check_timeout();
+	}
+
+	printf("twheeltest: %lu rounds passed\n", rounds);
+
+	return EXIT_SUCCESS;
+}
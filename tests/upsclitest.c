@@ -0,0 +1,415 @@
+/* upsclitest - check the non-blocking queries of libupsclient, on many
+   connections at once
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/*
+ * A child process plays upsd, with one device whose variables are all
+ * worth their own name, and a connection of its own for each client.
+ * Some answers are written a byte at a time, the LIST ones are long,
+ * asking for a variable called "missing" gets an ERR, and GET HANGUP
+ * makes it hang up.
+ *
+ * Each connection is sent many queries before any answer is read, GET
+ * and LIST mixed, and all are polled together: every answer must come,
+ * in the order of the queries of its connection, with the right values.
+ * The one connection which is hung up on must fail, and that alone.
+ *
+ * Usage: upsclitest [connections [queries]]
+ */
+
+#include "config.h"
+
+#include "common.h"
+#include "../clients/upsclient.h"
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+
+#define TEST_UPS	"stub"
+#define TEST_CONNS	16
+#define TEST_QUERIES	200
+#define TEST_ROWS	300
+
+/* a query, and the answer expected */
+typedef struct {
+	int	list;
+	char	name[SMALLBUF];
+	size_t	rows;		/* rows collected, for a LIST */
+} test_query_t;
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t	ret;
+
+	while (len > 0) {
+		if ((ret = write(fd, buf, len)) <= 0) {
+			return 0;
+		}
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	return 1;
+}
+
+static int answer(int fd, const char *req)
+{
+	char	buf[LARGEBUF], name[128];
+	size_t	i, len;
+
+	if (!strcmp(req, "GET HANGUP")) {
+		return 0;
+	}
+
+	if (!strcmp(req, "LIST VAR " TEST_UPS)) {
+		if (!write_all(fd, "BEGIN LIST VAR " TEST_UPS "\n", strlen("BEGIN LIST VAR " TEST_UPS "\n"))) {
+			return 0;
+		}
+
+		for (i = 0; i < TEST_ROWS; i++) {
+			snprintf(buf, sizeof(buf), "VAR " TEST_UPS " row.%zu \"row %zu of " TEST_UPS "\"\n", i, i);
+
+			if (!write_all(fd, buf, strlen(buf))) {
+				return 0;
+			}
+		}
+
+		snprintf(buf, sizeof(buf), "END LIST VAR " TEST_UPS "\n");
+		return write_all(fd, buf, strlen(buf));
+	}
+
+	if (sscanf(req, "GET VAR " TEST_UPS " %127s", name) != 1) {
+		snprintf(buf, sizeof(buf), "ERR UNKNOWN-COMMAND\n");
+		return write_all(fd, buf, strlen(buf));
+	}
+
+	if (!strcmp(name, "missing")) {
+		snprintf(buf, sizeof(buf), "ERR VAR-NOT-SUPPORTED\n");
+		return write_all(fd, buf, strlen(buf));
+	}
+
+	snprintf(buf, sizeof(buf), "VAR " TEST_UPS " %s \"%s\"\n", name, name);
+	len = strlen(buf);
+
+	/* now and then, one byte at a time */
+	if (strstr(name, ".7")) {
+		for (i = 0; i < len; i++) {
+			if (!write_all(fd, buf + i, 1)) {
+				return 0;
+			}
+		}
+
+		return 1;
+	}
+
+	return write_all(fd, buf, len);
+}
+
+/* answer one client until it hangs up, or asks us to */
+static void serve(int fd)
+{
+	char	in[LARGEBUF];
+	size_t	len = 0;
+	ssize_t	ret;
+	char	*eol;
+
+	while ((ret = read(fd, in + len, sizeof(in) - 1 - len)) > 0) {
+		len += (size_t)ret;
+
+		while ((eol = memchr(in, '\n', len)) != NULL) {
+			*eol = '\0';
+
+			if (!answer(fd, in)) {
+				/* what was answered must get there: no reset
+				 * for the queries left unread */
+				shutdown(fd, SHUT_WR);
+
+				while (read(fd, in, sizeof(in)) > 0);
+
+				_exit(EXIT_SUCCESS);
+			}
+
+			len -= (size_t)(eol + 1 - in);
+			memmove(in, eol + 1, len);
+		}
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+static void stub_upsd(int lsock)
+{
+	int	fd;
+
+	signal(SIGCHLD, SIG_IGN);
+
+	while ((fd = accept(lsock, NULL, NULL)) >= 0) {
+		if (fork() == 0) {
+			close(lsock);
+			serve(fd);
+		}
+
+		close(fd);
+	}
+
+	_exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	size_t	numconns = TEST_CONNS, numq = TEST_QUERIES, i, q, numa;
+	size_t	answered = 0, failed = 0, polls = 0;
+	struct sockaddr_in	sa;
+	socklen_t	salen = sizeof(sa);
+	UPSCONN_t	*conns, **ups;
+	test_query_t	**queries;
+	size_t	*next;
+	char	**a;
+	const char	*query[3];
+	int	lsock, ret, hangup;
+	pid_t	pid;
+
+	if (argc > 1) {
+		numconns = strtoul(argv[1], NULL, 10);
+	}
+
+	if (argc > 2) {
+		numq = strtoul(argv[2], NULL, 10);
+	}
+
+	if ((numconns < 2) || (numq < 20)) {
+		fatalx(EXIT_FAILURE, "usage: %s [connections [queries]]", argv[0]);
+	}
+
+	/* the connection hung up on must not take us along */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	if ((lsock < 0)
+	 || (bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+	 || (listen(lsock, (int)numconns) != 0)
+	 || (getsockname(lsock, (struct sockaddr *)&sa, &salen) != 0)) {
+		fatal_with_errno(EXIT_FAILURE, "listen");
+	}
+
+	if ((pid = fork()) < 0) {
+		fatal_with_errno(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		stub_upsd(lsock);
+	}
+
+	close(lsock);
+
+	conns = xcalloc(numconns, sizeof(*conns));
+	ups = xcalloc(numconns, sizeof(*ups));
+	queries = xcalloc(numconns, sizeof(*queries));
+	next = xcalloc(numconns, sizeof(*next));
+
+	/* the last one is hung up on half way */
+	hangup = (int)(numconns - 1);
+
+	for (i = 0; i < numconns; i++) {
+		ups[i] = &conns[i];
+
+		if (upscli_connect(ups[i], "127.0.0.1", ntohs(sa.sin_port), 0) != 0) {
+			fatalx(EXIT_FAILURE, "connection %zu: %s", i, upscli_strerror(ups[i]));
+		}
+
+		queries[i] = xcalloc(numq, sizeof(**queries));
+
+		for (q = 0; q < numq; q++) {
+			test_query_t	*t = &queries[i][q];
+
+			if (((int)i == hangup) && (q == numq / 2)) {
+				query[0] = "HANGUP";
+				ret = upscli_submit_get(ups[i], 1, query);
+			} else if (q % 10 == 5) {
+				t->list = 1;
+				query[0] = "VAR";
+				query[1] = TEST_UPS;
+				ret = upscli_submit_list(ups[i], 2, query);
+			} else {
+				if (q % 10 == 3) {
+					snprintf(t->name, sizeof(t->name), "missing");
+				} else {
+					snprintf(t->name, sizeof(t->name), "var.%zu.%zu", i, q);
+				}
+
+				query[0] = "VAR";
+				query[1] = TEST_UPS;
+				query[2] = t->name;
+				ret = upscli_submit_get(ups[i], 3, query);
+			}
+
+			if (ret != 0) {
+				fatalx(EXIT_FAILURE, "connection %zu, query %zu: %s", i, q, upscli_strerror(ups[i]));
+			}
+		}
+
+		if (upscli_pending(ups[i]) != numq) {
+			fatalx(EXIT_FAILURE, "connection %zu: %zu queries pending, expected %zu",
+				i, upscli_pending(ups[i]), numq);
+		}
+	}
+
+	for (;;) {
+		size_t	pending = 0;
+
+		for (i = 0; i < numconns; i++) {
+			pending += upscli_pending(ups[i]);
+		}
+
+		if (pending == 0) {
+			break;
+		}
+
+		if (upscli_poll(ups, numconns, 10000) < 1) {
+			fatalx(EXIT_FAILURE, "no answer in 10 seconds, %zu queries pending", pending);
+		}
+
+		polls++;
+
+		for (i = 0; i < numconns; i++) {
+			if ((upscli_fd(ups[i]) < 0) && (next[i] == numq)) {
+				continue;
+			}
+
+			while (next[i] < numq) {
+				test_query_t	*t = &queries[i][next[i]];
+
+				ret = upscli_collect(ups[i], &numa, &a);
+
+				if (ret == UPSCLI_ANSWER_NONE) {
+					break;
+				}
+
+				if ((int)i == hangup) {
+					/* all of those before are answered */
+					if ((ret < 0) && (strcmp(t->name, "missing"))) {
+						if ((next[i] != numq / 2) || (upscli_upserror(ups[i]) != UPSCLI_ERR_SRVDISC)) {
+							fatalx(EXIT_FAILURE, "connection %zu failed at query %zu: %s",
+								i, next[i], upscli_strerror(ups[i]));
+						}
+
+						if (upscli_pending(ups[i]) != 0) {
+							fatalx(EXIT_FAILURE, "connection %zu still has queries after it failed", i);
+						}
+
+						failed++;
+						next[i] = numq;
+						break;
+					}
+				}
+
+				if (!strcmp(t->name, "missing")) {
+					if ((ret != -1) || (upscli_upserror(ups[i]) != UPSCLI_ERR_VARNOTSUPP)) {
+						fatalx(EXIT_FAILURE, "connection %zu, query %zu: got %d (%s), expected VAR-NOT-SUPPORTED",
+							i, next[i], ret, upscli_strerror(ups[i]));
+					}
+
+					next[i]++;
+					answered++;
+					continue;
+				}
+
+				if (ret < 0) {
+					fatalx(EXIT_FAILURE, "connection %zu, query %zu: %s",
+						i, next[i], upscli_strerror(ups[i]));
+				}
+
+				if (t->list) {
+					if (ret == UPSCLI_ANSWER_END) {
+						if (t->rows != TEST_ROWS) {
+							fatalx(EXIT_FAILURE, "connection %zu, query %zu: %zu rows, expected %d",
+								i, next[i], t->rows, TEST_ROWS);
+						}
+
+						next[i]++;
+						answered++;
+						continue;
+					}
+
+					if ((ret != UPSCLI_ANSWER_ROW) || (numa < 4)
+					 || (strncmp(a[2], "row.", 4)) || (strtoul(a[2] + 4, NULL, 10) != t->rows)) {
+						fatalx(EXIT_FAILURE, "connection %zu, query %zu: unexpected row %zu",
+							i, next[i], t->rows);
+					}
+
+					t->rows++;
+					continue;
+				}
+
+				if ((ret != UPSCLI_ANSWER_GET) || (numa < 4)
+				 || (strcmp(a[2], t->name)) || (strcmp(a[3], t->name))) {
+					fatalx(EXIT_FAILURE, "connection %zu, query %zu: got %d, expected %s",
+						i, next[i], ret, t->name);
+				}
+
+				next[i]++;
+				answered++;
+			}
+		}
+	}
+
+	for (i = 0; i < numconns; i++) {
+		if (next[i] != numq) {
+			fatalx(EXIT_FAILURE, "connection %zu: %zu of %zu queries collected", i, next[i], numq);
+		}
+
+		/* and the connection can still be waited on as before */
+		if ((int)i != hangup) {
+			query[0] = "VAR";
+			query[1] = TEST_UPS;
+			query[2] = "var.last";
+
+			if ((upscli_get(ups[i], 3, query, &numa, &a) != 0) || (numa < 4) || (strcmp(a[3], "var.last"))) {
+				fatalx(EXIT_FAILURE, "connection %zu: blocking GET after the others: %s",
+					i, upscli_strerror(ups[i]));
+			}
+		}
+
+		upscli_disconnect(ups[i]);
+		free(queries[i]);
+	}
+
+	if (failed != 1) {
+		fatalx(EXIT_FAILURE, "%zu connections failed, expected 1", failed);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	free(next);
+	free(queries);
+	free(ups);
+	free(conns);
+
+	printf("upsclitest: %zu connections, %zu answers collected in %zu polls\n",
+		numconns, answered, polls);
+
+	return EXIT_SUCCESS;
+}